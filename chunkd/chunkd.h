@@ -41,6 +41,10 @@ enum {
 	CHD_TRASH_MAX		= 1000,
 
 	CLI_MAX_SENDFILE_SZ	= 512 * 1024,
+
+	CHD_SSL_SESS_CACHE_SZ	= 20000,	/* server-side sessions */
+	CHD_SSL_SESS_TIMEOUT	= 4 * 3600,	/* secs a session is good */
+	CHD_SSL_TICKET_ROTATE	= 2 * 3600,	/* secs per ticket key */
 };
 
 struct client;
@@ -172,6 +176,8 @@ struct server_stats {
 	unsigned long		event;		/* events dispatched */
 	unsigned long		tcp_accept;	/* TCP accepted cxns */
 	unsigned long		opt_write;	/* optimistic writes */
+	unsigned long		ssl_accept;	/* full TLS handshakes */
+	unsigned long		ssl_resume;	/* resumed TLS sessions */
 };
 
 struct server_socket {
@@ -46,6 +46,10 @@
 #include <openssl/hmac.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #include <elist.h>
 #include <chunksrv.h>
 #include <cldc.h>
@@ -175,6 +179,137 @@ void applog(int prio, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Session tickets.  We make our own keys rather than let OpenSSL pick
+ * one per process, so that we can roll them: a ticket is sealed with
+ * the current key, and one sealed with the previous key still opens
+ * (and is replaced) until the next roll.
+ */
+struct ssl_ticket_key {
+	unsigned char		name[16];
+	unsigned char		aes[16];
+	unsigned char		hmac[32];	/* HMAC-SHA256 */
+};
+
+static struct ssl_ticket_key ssl_ticket_keys[2];	/* current, previous */
+static struct event ssl_ticket_ev;
+
+static bool ssl_ticket_key_new(struct ssl_ticket_key *key)
+{
+	return RAND_bytes(key->name, sizeof(key->name)) > 0 &&
+	       RAND_bytes(key->aes, sizeof(key->aes)) > 0 &&
+	       RAND_bytes(key->hmac, sizeof(key->hmac)) > 0;
+}
+
+/*
+ * OpenSSL 3 hands the ticket callback an EVP_MAC context; the HMAC_CTX
+ * callback before it is deprecated there.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ssl_ticket_mac_ctx;
+
+static bool ssl_ticket_mac_init(EVP_MAC_CTX *mctx,
+				struct ssl_ticket_key *key)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+						      key->hmac,
+						      sizeof(key->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						     "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mctx, params) == 1;
+}
+#else
+typedef HMAC_CTX ssl_ticket_mac_ctx;
+
+static bool ssl_ticket_mac_init(HMAC_CTX *hctx, struct ssl_ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(),
+			    NULL) == 1;
+}
+#endif
+
+static int ssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			 EVP_CIPHER_CTX *ectx, ssl_ticket_mac_ctx *mctx,
+			 int enc)
+{
+	struct ssl_ticket_key *key;
+	int i;
+
+	if (enc) {
+		key = &ssl_ticket_keys[0];
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) <= 0)
+			return -1;
+		memcpy(name, key->name, sizeof(key->name));
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes,
+				       iv) != 1 ||
+		    !ssl_ticket_mac_init(mctx, key))
+			return -1;
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++)
+		if (!memcmp(name, ssl_ticket_keys[i].name, sizeof(key->name)))
+			break;
+	if (i == 2)
+		return 0;		/* unknown key: full handshake */
+
+	key = &ssl_ticket_keys[i];
+	if (!ssl_ticket_mac_init(mctx, key) ||
+	    EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes,
+			       iv) != 1)
+		return -1;
+
+	return i == 0 ? 1 : 2;	/* 2: good, but issue a fresh ticket */
+}
+
+static void ssl_ticket_rotate(int fd, short events, void *userdata)
+{
+	struct timeval tv = { CHD_SSL_TICKET_ROTATE, 0 };
+	struct ssl_ticket_key key;
+
+	if (ssl_ticket_key_new(&key)) {
+		ssl_ticket_keys[1] = ssl_ticket_keys[0];
+		ssl_ticket_keys[0] = key;
+		if (debugging)
+			applog(LOG_DEBUG, "SSL ticket key rotated");
+	} else
+		applog(LOG_WARNING, "SSL ticket key not rotated");
+
+	evtimer_add(&ssl_ticket_ev, &tv);
+}
+
+/*
+ * Sessions are kept both in the server cache, for clients resuming by
+ * session ID, and in tickets, for clients that keep their own state.
+ */
+static bool ssl_sessions_init(void)
+{
+	struct timeval tv = { CHD_SSL_TICKET_ROTATE, 0 };
+
+	if (!ssl_ticket_key_new(&ssl_ticket_keys[0]) ||
+	    !ssl_ticket_key_new(&ssl_ticket_keys[1]))
+		return false;
+
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ssl_ctx,
+				       (unsigned char *) PROGRAM_NAME,
+				       strlen(PROGRAM_NAME));
+	SSL_CTX_sess_set_cache_size(ssl_ctx, CHD_SSL_SESS_CACHE_SZ);
+	SSL_CTX_set_timeout(ssl_ctx, CHD_SSL_SESS_TIMEOUT);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, ssl_ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, ssl_ticket_cb);
+#endif
+
+	evtimer_set(&ssl_ticket_ev, ssl_ticket_rotate, NULL);
+	evtimer_add(&ssl_ticket_ev, &tv);
+	return true;
+}
+
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
 	int v;
@@ -268,6 +403,8 @@ static void stats_dump(void)
 	X(event);
 	X(tcp_accept);
 	X(opt_write);
+	X(ssl_accept);
+	X(ssl_resume);
 }
 
 #undef X
@@ -1295,6 +1432,10 @@ static bool cli_evt_ssl_accept(struct client *cli, unsigned int events)
 
 	rc = SSL_accept(cli->ssl);
 	if (rc > 0) {
+		if (SSL_session_reused(cli->ssl))
+			chunkd_srv.stats.ssl_resume++;
+		else
+			chunkd_srv.stats.ssl_accept++;
 		cli->state = evt_recycle;
 		return true;
 	}
@@ -1760,6 +1901,10 @@ int main (int argc, char *argv[])
 	 * early as possible, so that tunables are available.
 	 */
 	read_config();
+	if (ssl_ctx && !ssl_sessions_init()) {
+		applog(LOG_ERR, "SSL session setup failed");
+		exit(1);
+	}
 	if (!chunkd_srv.ourhost)
 		chunkd_srv.ourhost = get_hostname();
 	else if (debugging)
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Inode cache: committed inodes, and their data when small, by inode
+ * number and by name, in front of db4.
+ *
+ * Coherence rides on the transaction: every write of an inode or its
+ * data drops its entry and marks the inum touched, and nothing touched
+ * is cached again until the txn commits or aborts.  Whatever is read
+ * in a txn for an untouched inum is committed state, so survives an
+ * abort.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <cld-private.h>
+#include "cld.h"
+
+struct icache_ent {
+	cldino_t		inum;
+	struct raw_inode	*ino;		/* NULL until read */
+	size_t			name_len;
+
+	void			*data;
+	size_t			data_len;
+	bool			has_data;
+
+	struct list_head	lru;		/* most recent first */
+};
+
+static struct htab *icache_inums;	/* inum -> entry */
+static struct htab *icache_names;	/* inode name -> entry */
+static struct list_head icache_lru = { &icache_lru, &icache_lru };
+static unsigned int icache_count;
+static GArray *icache_touched;		/* inums written by current txn */
+
+static const char *ent_name(const struct icache_ent *ent)
+{
+	return (const char *) (ent->ino + 1);
+}
+
+/* names are keyed by their entry, length and bytes */
+static unsigned long icache_name_hash(const void *v)
+{
+	const struct icache_ent *ent = v;
+
+	return htab_djb_hash(5381, ent_name(ent), ent->name_len);
+}
+
+static int icache_name_equal(const void *_a, const void *_b)
+{
+	const struct icache_ent *a = _a;
+	const struct icache_ent *b = _b;
+
+	if (a->name_len != b->name_len)
+		return 1;
+	return memcmp(ent_name(a), ent_name(b), a->name_len);
+}
+
+static bool icache_init(void)
+{
+	if (icache_inums)
+		return true;
+
+	icache_inums = htab_new(lock_hash, lock_equal, NULL, NULL);
+	icache_names = htab_new(icache_name_hash, icache_name_equal,
+				NULL, NULL);
+	if (!icache_inums || !icache_names) {
+		icache_free();
+		return false;
+	}
+
+	return true;
+}
+
+static void ent_free(struct icache_ent *ent)
+{
+	htab_del(icache_inums, &ent->inum);
+	if (ent->ino)
+		htab_del(icache_names, ent);
+	list_del(&ent->lru);
+	icache_count--;
+
+	free(ent->ino);
+	free(ent->data);
+	free(ent);
+}
+
+static bool touched(cldino_t inum)
+{
+	unsigned int i;
+
+	if (!icache_touched)
+		return false;
+
+	for (i = 0; i < icache_touched->len; i++)
+		if (g_array_index(icache_touched, cldino_t, i) == inum)
+			return true;
+	return false;
+}
+
+static struct icache_ent *ent_get(cldino_t inum, bool create)
+{
+	struct icache_ent *ent;
+
+	if (!icache_init())
+		return NULL;
+
+	ent = htab_get(icache_inums, &inum);
+	if (ent) {
+		list_move(&ent->lru, &icache_lru);
+		return ent;
+	}
+
+	if (!create || touched(inum))
+		return NULL;
+
+	if (icache_count >= CLD_CACHE_MAX)
+		ent_free(list_entry(icache_lru.prev, struct icache_ent, lru));
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		return NULL;
+
+	ent->inum = inum;
+	htab_put(icache_inums, &ent->inum, ent);
+	list_add(&ent->lru, &icache_lru);
+	icache_count++;
+
+	return ent;
+}
+
+static struct raw_inode *ino_dup(const struct icache_ent *ent)
+{
+	struct raw_inode *ino;
+	size_t sz = raw_ino_size(ent->ino);
+
+	ino = malloc(sz);
+	if (ino)
+		memcpy(ino, ent->ino, sz);
+	return ino;
+}
+
+bool icache_inode_get(cldino_t inum, struct raw_inode **inode_out)
+{
+	struct icache_ent *ent;
+
+	ent = ent_get(inum, false);
+	if (!ent || !ent->ino) {
+		cld_srv.stats.cache_inode_miss++;
+		return false;
+	}
+
+	if (inode_out) {
+		*inode_out = ino_dup(ent);
+		if (!*inode_out)
+			return false;
+	}
+
+	cld_srv.stats.cache_inode_hit++;
+	return true;
+}
+
+bool icache_name_get(const char *name, size_t name_len,
+		     struct raw_inode **inode_out)
+{
+	struct icache_ent *ent;
+	struct {
+		struct icache_ent	ent;
+		struct raw_inode	ino;
+	} *key;
+
+	if (!icache_init())
+		return false;
+
+	/* a throwaway entry, shaped so the name hashes like a real one */
+	key = alloca(sizeof(*key) + name_len);
+	memset(key, 0, sizeof(*key));
+	key->ent.ino = &key->ino;
+	key->ent.name_len = name_len;
+	memcpy(&key->ino + 1, name, name_len);
+
+	ent = htab_get(icache_names, &key->ent);
+	if (!ent) {
+		cld_srv.stats.cache_name_miss++;
+		return false;
+	}
+
+	if (inode_out) {
+		*inode_out = ino_dup(ent);
+		if (!*inode_out)
+			return false;
+	}
+
+	list_move(&ent->lru, &icache_lru);
+	cld_srv.stats.cache_name_hit++;
+	return true;
+}
+
+bool icache_data_get(cldino_t inum, void **data_out, size_t *data_len)
+{
+	struct icache_ent *ent;
+	void *data;
+
+	ent = ent_get(inum, false);
+	if (!ent || !ent->has_data) {
+		cld_srv.stats.cache_data_miss++;
+		return false;
+	}
+
+	/* callers own, and may free, what they are handed */
+	data = malloc(ent->data_len ? ent->data_len : 1);
+	if (!data)
+		return false;
+	memcpy(data, ent->data, ent->data_len);
+
+	*data_out = data;
+	*data_len = ent->data_len;
+	cld_srv.stats.cache_data_hit++;
+	return true;
+}
+
+void icache_inode_fill(const struct raw_inode *inode)
+{
+	struct icache_ent *ent;
+	size_t sz = raw_ino_size(inode);
+
+	ent = ent_get(cldino_from_le(inode->inum), true);
+	if (!ent || ent->ino)
+		return;
+
+	ent->ino = malloc(sz);
+	if (!ent->ino)
+		return;
+	memcpy(ent->ino, inode, sz);
+	ent->name_len = le32_to_cpu(inode->ino_len);
+
+	htab_put(icache_names, ent, ent);
+}
+
+void icache_data_fill(cldino_t inum, const void *data, size_t data_len)
+{
+	struct icache_ent *ent;
+
+	if (data_len > CLD_CACHE_DATA_MAX)
+		return;
+
+	ent = ent_get(inum, true);
+	if (!ent || ent->has_data)
+		return;
+
+	if (data_len) {
+		ent->data = malloc(data_len);
+		if (!ent->data)
+			return;
+		memcpy(ent->data, data, data_len);
+	}
+	ent->data_len = data_len;
+	ent->has_data = true;
+}
+
+void icache_touch(cldino_t inum)
+{
+	struct icache_ent *ent;
+
+	if (!icache_inums)
+		return;
+
+	ent = htab_get(icache_inums, &inum);
+	if (ent)
+		ent_free(ent);
+
+	if (touched(inum))
+		return;
+
+	if (!icache_touched)
+		icache_touched = g_array_new(FALSE, FALSE, sizeof(cldino_t));
+	g_array_append_val(icache_touched, inum);
+}
+
+void icache_txn_end(void)
+{
+	if (icache_touched)
+		g_array_set_size(icache_touched, 0);
+}
+
+void icache_flush(void)
+{
+	while (!list_empty(&icache_lru))
+		ent_free(list_entry(icache_lru.next, struct icache_ent, lru));
+}
+
+unsigned int icache_size(void)
+{
+	return icache_count;
+}
+
+void icache_free(void)
+{
+	icache_flush();
+
+	if (icache_inums)
+		htab_free(icache_inums);
+	if (icache_names)
+		htab_free(icache_names);
+	icache_inums = icache_names = NULL;
+
+	if (icache_touched) {
+		g_array_free(icache_touched, TRUE);
+		icache_touched = NULL;
+	}
+}
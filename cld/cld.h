@@ -32,6 +32,7 @@
 #include <hail_private.h>
 #include <ubbp.h>
 #include <htab.h>
+#include <anet.h>
 
 struct client;
 struct session_outpkt;
@@ -41,8 +42,17 @@ enum {
 	CLD_SESS_TIMEOUT	= 60,
 	CLD_MSGID_EXPIRE	= CLD_SESS_TIMEOUT * 2,
 	CLD_RETRY_START		= 2,		/* initial retry after 2sec */
+	CLD_GET_WAIT_MAX	= CLD_SESS_TIMEOUT,	/* longest GET-WAIT */
 	CLD_CHKPT_SEC		= 60 * 5,	/* secs between db4 chkpt */
 	SFL_FOREGROUND		= (1 << 0),	/* run in foreground */
+	SFL_WARM_CACHE		= (1 << 1),	/* read the db in at startup */
+	CLD_WARM_BATCH		= 256,		/* records per warm-up step */
+	CLD_WARM_TICK_MS	= 10,		/* between warm-up steps */
+	CLD_CACHE_MAX		= 4096,		/* inode cache entries */
+	CLD_CACHE_DATA_MAX	= 4096,		/* largest data value cached */
+	CLD_TX_BUF_SZ		= 64 * 1024,	/* output coalescing chunk */
+	CLD_REPLICA_POLL_MS	= 200,		/* replica looks for new log */
+	CLD_TX_MAX_QUEUED	= 16 * CLD_MAX_FRAME_SZ, /* unread output cap */
 };
 
 struct atcp_read {
@@ -63,6 +73,8 @@ struct atcp_read_state {
 
 struct client {
 	int			fd;
+	uint64_t		gen;		/* tells reused fds apart */
+	bool			dead;		/* freed on next read event */
 
 	struct event		ev;
 	short			ev_mask;	/* EV_READ and/or EV_WRITE */
@@ -76,14 +88,30 @@ struct client {
 
 	struct ubbp_header	ubbp;
 
+	/* output: frames are coalesced into tx_buf, which is handed to
+	 * the write queue when full or at the end of the loop iteration
+	 */
+	struct atcp_wr_state	wst;
+	struct event		wr_ev;		/* EV_WRITE, while draining */
+	char			*tx_buf;
+	size_t			tx_len;
+	size_t			tx_cap;
+	struct list_head	tx_node;	/* on cld_srv.tx_dirty */
+
+	char			*pkt;		/* raw_pkt or large_pkt */
+	char			*large_pkt;	/* CSF_LARGE_FRAMES frames */
 	char			raw_pkt[CLD_RAW_MSG_SZ];
 	unsigned int		raw_size;
+
+	time_t			last_rx;	/* last authentic packet */
+	bool			ping_open;	/* a session on us is pinged */
 };
 
 struct session {
 	uint8_t			sid[CLD_SID_SZ];
 
 	int			sock_fd;
+	uint64_t		conn_gen;	/* client gen of sock_fd */
 
 	struct sockaddr_in6	addr;		/* inet address */
 	socklen_t		addr_len;	/* inet address len */
@@ -91,34 +119,68 @@ struct session {
 
 	uint64_t		last_contact;
 	uint64_t		next_fh;
-	struct event		timer;
+	struct cld_timer	timer;		/* expiry and pings */
 
 	uint64_t		next_seqid_in;
 	uint64_t		next_seqid_out;
 
-	GList			*out_q;		/* outgoing pkts (to client) */
-	struct event		retry_timer;
+	/* outgoing pkts awaiting ACK, in a power-of-two ring by seqid */
+	struct session_outpkt	**out_ring;
+	unsigned int		out_size;
+	unsigned int		out_count;
+	uint64_t		out_base;	/* lowest seqid held */
+	uint64_t		out_end;	/* highest seqid held, plus one */
+	struct cld_timer	retry_timer;	/* retransmits */
+
+	GList			*ev_q;		/* events waiting for a flush */
 
 	char			user[CLD_MAX_USERNAME];
+	struct cld_auth_key	auth_key;	/* user's key, set up on use */
+
+	uint32_t		flags;		/* CSF_xxx negotiated */
 
 	bool			ping_open;	/* sent PING, waiting for ack */
 	bool			dead;		/* session has ended */
 
-	/* huge buffer should always come last */
 	enum cld_msg_op		msg_op;
 	uint64_t		msg_xid;
+
+	/* fragment reassembly; pooled, only while a message is in flight */
+	char			*msg_buf;
+	size_t			msg_buf_cap;
 	unsigned int		msg_buf_len;
-	char			msg_buf[CLD_MAX_MSG_SZ];
 };
 
 struct server_stats {
 	unsigned long		poll;		/* num. polls */
 	unsigned long		event;		/* events dispatched */
 	unsigned long		garbage;	/* num. garbage pkts dropped */
+	unsigned long		commit;		/* txns group-committed */
+	unsigned long		flush;		/* group commit log flushes */
+	unsigned long		notify;		/* events sent to watchers */
+	unsigned long		notify_merged;	/* events merged into queued */
+	unsigned long		get_wait;	/* GET-WAITs parked */
+	unsigned long		ack;		/* ACK packets received */
+	unsigned long		ack_piggy;	/* ACKs riding on requests */
+	unsigned long		tx_frames;	/* frames queued for output */
+	unsigned long		tx_flush;	/* per-connection output flushes */
+	unsigned long		ping;		/* liveness probes sent */
+	unsigned long		sess_woken;	/* recovered sessions brought in */
+	unsigned long		sess_reaped;	/* recovered sessions expired */
+	unsigned long		warm_records;	/* db records read to warm up */
+	unsigned long		cache_inode_hit; /* inode cache, by inum */
+	unsigned long		cache_inode_miss;
+	unsigned long		cache_name_hit;	/* inode cache, by name */
+	unsigned long		cache_name_miss;
+	unsigned long		cache_data_hit;	/* inode data cache */
+	unsigned long		cache_data_miss;
+	unsigned long		replica_sync;	/* replica polls finding log */
+	unsigned long		replica_refused; /* writes sent to a replica */
 };
 
 struct server_socket {
 	int			fd;
+	bool			local;		/* AF_UNIX */
 	struct event		ev;
 	struct list_head	sockets_node;
 };
@@ -132,6 +194,8 @@ struct server {
 
 	char			*port;		/* bind port, NULL means auto */
 	char			*port_file;	/* Port file to write */
+	char			*unix_dir;	/* local socket dir, or NULL */
+	char			*unix_path;	/* local socket, once bound */
 
 	struct cldb		cldb;		/* database info */
 
@@ -139,10 +203,33 @@ struct server {
 
 	struct list_head	sockets;
 
+	struct htab		*clients;	/* fd -> client */
+	uint64_t		cli_gen;	/* last client gen handed out */
+	struct list_head	tx_dirty;	/* clients with output to flush */
+
 	struct htab		*sessions;
 
+	struct htab		*locks;		/* inum -> lock holders/waiters */
+
+	struct cld_timer_list	timers;		/* session timer wheel */
+	struct event		timers_ev;	/* wakes us to run it */
+	uint64_t		timers_armed;	/* msec timers_ev fires; 0 if
+						   not armed */
+
 	struct event		chkpt_timer;	/* db4 checkpoint timer */
 
+	struct event		commit_timer;	/* group commit flush timer */
+	unsigned int		commit_usec;	/* group commit window */
+	bool			commit_pending;	/* NOSYNC commits unflushed */
+	GList			*commit_q;	/* output held for flush */
+
+	struct cld_buf_pool	msg_pool;	/* reassembly, packet buffers */
+
+	struct cldb_warm	warm;		/* inode names, and inodes */
+	struct cld_timer	warm_timer;
+
+	struct cld_timer	replica_timer;	/* replica: watch the log */
+
 	struct server_stats	stats;		/* global statistics */
 };
 
@@ -153,6 +240,8 @@ struct pkt_info {
 	uint64_t		xid;
 	enum cld_msg_op		op;
 	size_t			hdr_len;
+	bool			has_ack;	/* cumulative ACK rode along */
+	uint64_t		ack;
 };
 
 #define ___constant_swab32(x) ((uint32_t)(                       \
@@ -166,26 +255,139 @@ static inline uint32_t swab32(uint32_t v)
 	return ___constant_swab32(v);
 }
 
+/* cache.c */
+extern bool icache_inode_get(cldino_t inum, struct raw_inode **inode_out);
+extern bool icache_name_get(const char *name, size_t name_len,
+			    struct raw_inode **inode_out);
+extern bool icache_data_get(cldino_t inum, void **data_out, size_t *data_len);
+extern void icache_inode_fill(const struct raw_inode *inode);
+extern void icache_data_fill(cldino_t inum, const void *data, size_t data_len);
+
+/** Drop an inode's cache entry, and keep it out of the cache until the
+ * current transaction ends.  Called before every write of an inode or
+ * its data.
+ *
+ * @param inum		The inode number
+ */
+extern void icache_touch(cldino_t inum);
+extern void icache_txn_end(void);
+
+/** Drop every entry.  A replica calls this when the master's writes
+ * arrive, as they do not pass through icache_touch.
+ */
+extern void icache_flush(void);
+extern unsigned int icache_size(void);
+extern void icache_free(void);
+
+/* replica.c */
+
+/** May a read-only replica serve this message op?
+ *
+ * @param op		The message op
+ *
+ * @return		true if the op changes nothing replicated
+ */
+extern bool replica_op_ok(enum cld_msg_op op);
+extern void replica_start(void);
+extern void replica_free(void);
+
+/* lock.c */
+extern unsigned long lock_hash(const void *v);
+extern int lock_equal(const void *_a, const void *_b);
+
+/** Add a lock, granting it at once if no holder or earlier waiter
+ * conflicts with it.
+ *
+ * @param txn		The transaction to journal the lock in
+ * @param sid		The session-id of the lock owner
+ * @param fh		The file handle the lock is taken through
+ * @param inum		The inode to lock
+ * @param shared	true for a shared lock, false for exclusive
+ * @param wait		true to queue behind a conflict, false to fail
+ * @param acquired	Set to true if the lock was granted
+ *
+ * @return		0 on success; DB_KEYEXIST on trylock conflict;
+ *			db4 or negative errno code otherwise
+ */
+extern int lock_add(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum,
+		    bool shared, bool wait, bool *acquired);
+
+/** Remove held and waiting locks, granting waiters they were blocking.
+ *
+ * @param txn		The transaction to journal the change in
+ * @param sid		The session-id of the lock owner
+ * @param fh		The file handle, or 0 for all of the session's locks
+ * @param inum		The locked inode
+ *
+ * @return		0 on success; DB_NOTFOUND if nothing matched;
+ *			db4 or negative errno code otherwise
+ */
+extern int lock_remove(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum);
+extern void lock_txn_commit(void);
+extern void lock_txn_abort(void);
+extern int lock_load(DB_TXN *txn);
+extern void locks_free(void);
+
 /* msg.c */
-extern int inode_lock_rescan(DB_TXN *txn, cldino_t inum);
 extern void msg_get(struct session *sess, const void *v);
+
+/** Queue events for the handles open on an inode, and have GET-WAITs
+ * parked on it look again, once txn commits.
+ *
+ * @param txn		The transaction
+ * @param inum		The inode number
+ * @param events	CE_xxx; CE_DELETED goes to every handle
+ *
+ * @return		0, or a db4 error
+ */
+extern int inode_notify(DB_TXN *txn, cldino_t inum, uint32_t events);
+
+/** Handle GET-WAIT: answer as GET once the inode version exceeds the
+ * one given, or when the request's timeout runs out.
+ *
+ * @param sess		The session
+ * @param v		The decoded cld_msg_get_wait
+ */
+extern void msg_get_wait(struct session *sess, const void *v);
+
+/** Re-examine GET-WAITs on inodes changed by the committed txn. */
+extern void get_wait_txn_commit(void);
+
+/** Forget inodes changed by an aborted txn. */
+extern void get_wait_txn_abort(void);
+extern void get_waiters_free(void);
+extern void msg_readdir(struct session *sess, const void *v);
 extern void msg_open(struct session *sess, const void *v);
 extern void msg_put(struct session *sess, const void *v);
+extern void msg_put_if(struct session *sess, const void *v);
+extern void msg_open_get(struct session *sess, const void *v);
+extern void msg_open_put(struct session *sess, const void *v);
 extern void msg_close(struct session *sess, const void *v);
 extern void msg_del(struct session *sess, const void *v);
 extern void msg_unlock(struct session *sess, const void *v);
 extern void msg_lock(struct session *sess, const void *v);
-extern void msg_ack(struct session *sess, uint64_t seqid);
+extern void msg_ack(struct session *sess, uint64_t seqid, bool cumulative);
 
 /* session.c */
 extern uint64_t next_seqid_le(uint64_t *seq);
 extern unsigned long sess_hash(const void *v);
 extern int sess_equal(const void *_a, const void *_b);
 extern void msg_new_sess(int sock_fd, const struct client *cli,
-			const struct pkt_info *info);
+			const struct pkt_info *info,
+			const void *msg, size_t msg_len);
 extern void msg_end_sess(struct session *sess, uint64_t xid);
 extern struct raw_session *session_new_raw(const struct session *sess);
 extern void sessions_free(void);
+extern const struct cld_auth_key *sess_auth_key(struct session *sess);
+
+/** Find a session, bringing it into memory if it was recovered at
+ * startup and not yet needed.
+ *
+ * @param sid		The session id
+ *
+ * @return		The session, or NULL if there is none
+ */
+extern struct session *sess_lookup(const void *sid);
 
 /** Send a message as part of a session.
  *
@@ -211,19 +413,60 @@ extern bool sess_sendmsg(struct session *sess, xdrproc_t xdrproc,
 extern void sess_sendresp_generic(struct session *sess,
 				  enum cle_err_codes code);
 
+/** Commit a transaction as part of the current group commit.
+ *
+ * The log is flushed once for all transactions committed in this
+ * event loop pass; session output is held until then.
+ *
+ * @param txn		The transaction
+ *
+ * @return		0 on success; db4 error code otherwise
+ */
+extern int sess_txn_commit(DB_TXN *txn);
+
+/** Abort a transaction, and drop what was queued for its commit.
+ *
+ * @param txn		The transaction
+ *
+ * @return		0 on success; db4 error code otherwise
+ */
+extern int sess_txn_abort(DB_TXN *txn);
+
+/** Queue an event for a session's handle.
+ *
+ * Nothing is sent unless the current transaction commits; the event
+ * then waits on the session's queue, merged with others for the same
+ * handle, until the group commit flush.
+ *
+ * @param sid		The session-id of the handle's owner
+ * @param fh		The file handle
+ * @param events	CE_xxx bits to deliver
+ */
+extern void sess_event_queue(const uint8_t *sid, uint64_t fh,
+			     uint32_t events);
+extern void sess_event_flush(void);
+extern void sess_commit_flush(void);
+extern void sess_commit_event(int fd, short events, void *userdata);
+
 extern int session_dispose(DB_TXN *txn, struct session *sess);
-extern int session_remove_locks(DB_TXN *txn, uint8_t *sid, uint64_t fh,
-				cldino_t inum, bool *waiter);
-extern int sess_load(struct htab *ss);
+extern int sess_load(void);
 
 /* server.c */
 extern struct server cld_srv;
 extern struct hail_log srv_log;
 extern struct timeval current_time;
-extern int tcp_tx(int sock_fd, struct sockaddr *, socklen_t,
-		  const void *, size_t);
+extern int tcp_tx(int sock_fd, uint64_t conn_gen, const void *, size_t);
 extern const char *user_key(const char *user);
 
+/** Arm a timer on the server's timer wheel, replacing any earlier
+ * expiry it had.
+ *
+ * @param timer		The timer, set up with cld_timer_init
+ * @param msec		Milliseconds from now
+ */
+extern void srv_timer_add(struct cld_timer *timer, unsigned long msec);
+extern void srv_timer_del(struct cld_timer *timer);
+
 /** Transmit a single packet.
  *
  * This function doesn't provide error-retransmission logic.
@@ -31,6 +31,17 @@
 
 static int cldb_up(struct cldb *cldb, unsigned int flags);
 
+/*
+ * A replica that fell behind the master's log removal is brought back
+ * by db4 internal init, which leaves our replicated handles dead.  Note
+ * it; replica_poll reopens them.
+ */
+static void cldb_rep_check(int rc)
+{
+	if (rc == DB_REP_HANDLE_DEAD)
+		cld_srv.cldb.rep_dead = true;
+}
+
 /*
  * db4 page sizes for our various databases.  Filesystem block size
  * is recommended, so 4096 was chosen (default ext3 block size).
@@ -43,6 +54,13 @@ enum {
 	CLDB_PGSZ_HANDLES		= 4096,
 	CLDB_PGSZ_HANDLE_IDX		= 4096,
 	CLDB_PGSZ_LOCKS			= 4096,
+	CLDB_PGSZ_DIRENTS		= 4096,
+};
+
+enum {
+	CLDB_REP_THREADS		= 3,	/* repmgr message threads */
+	CLDB_REP_SYNC_WAIT		= 30,	/* secs a replica waits for
+						   its first sync */
 };
 
 static void db4syslog(const DB_ENV *dbenv, const char *errpfx, const char *msg)
@@ -91,8 +109,8 @@ static int lock_compare(DB *db, const DBT *a_dbt, const DBT *b_dbt)
 	const struct raw_lock *b = b_dbt->data;
 	cldino_t ai = cldino_from_le(a->inum);
 	cldino_t bi = cldino_from_le(b->inum);
-	uint64_t at = le64_to_cpu(a->ctime);
-	uint64_t bt = le64_to_cpu(b->ctime);
+	uint64_t aseq = le64_to_cpu(a->seq);
+	uint64_t bseq = le64_to_cpu(b->seq);
 	uint64_t afh = le64_to_cpu(a->fh);
 	uint64_t bfh = le64_to_cpu(b->fh);
 	int64_t v;
@@ -102,10 +120,9 @@ static int lock_compare(DB *db, const DBT *a_dbt, const DBT *b_dbt)
 	if (v)
 		return v;
 
-	/* compare creation times */
-	v = at - bt;
-	if (v)
-		return v;
+	/* compare queue order */
+	if (aseq != bseq)
+		return aseq < bseq ? -1 : 1;
 
 	/* compare SIDs */
 	v = memcmp(a->sid, b->sid, CLD_SID_SZ);
@@ -116,6 +133,28 @@ static int lock_compare(DB *db, const DBT *a_dbt, const DBT *b_dbt)
 	return afh - bfh;
 }
 
+static int dirent_compare(DB *db, const DBT *a_dbt, const DBT *b_dbt)
+{
+	const struct raw_dirent_key *a = a_dbt->data;
+	const struct raw_dirent_key *b = b_dbt->data;
+	cldino_t ai = cldino_from_le(a->parent);
+	cldino_t bi = cldino_from_le(b->parent);
+	size_t alen = a_dbt->size - sizeof(*a);
+	size_t blen = b_dbt->size - sizeof(*b);
+	int v;
+
+	/* compare parent inode numbers */
+	if (ai != bi)
+		return (ai < bi) ? -1 : 1;
+
+	/* compare names, shorter first on a common prefix */
+	v = memcmp(a->name, b->name, MIN(alen, blen));
+	if (v)
+		return v;
+
+	return (alen > blen) - (alen < blen);
+}
+
 static int open_db(DB_ENV *env, DB **db_out, const char *name,
 		   unsigned int page_size, DBTYPE dbtype, unsigned int flags,
 		   int (*bt_compare)(DB *db, const DBT *dbt1, const DBT *dbt2),
@@ -225,12 +264,123 @@ static void db4_event(DB_ENV *dbenv, u_int32_t event, void *event_info)
 		if (cldb->state_cb)
 			(*cldb->state_cb)(CLDB_EV_ELECTED);
 		break;
+	case DB_EVENT_REP_STARTUPDONE:
+		cldb->rep_synced = true;
+		break;
+#ifdef DB_EVENT_REP_INIT_DONE
+	case DB_EVENT_REP_INIT_DONE:
+		cldb->rep_dead = true;
+		break;
+#endif
 	default:
 		/* do nothing */
 		break;
 	}
 }
 
+/*
+ * Split a "host:port" replication site.  The caller frees *host_out.
+ */
+static int rep_site(const char *site, char **host_out, unsigned int *port)
+{
+	const char *colon;
+	char *end;
+	unsigned long p;
+
+	colon = strrchr(site, ':');
+	if (!colon || colon == site)
+		return -EINVAL;
+
+	p = strtoul(colon + 1, &end, 10);
+	if (*end || p == 0 || p >= 65536)
+		return -EINVAL;
+
+	*host_out = g_strndup(site, colon - site);
+	*port = p;
+	return 0;
+}
+
+/*
+ * Tell repmgr where we listen and where the other sites are.  Replicas
+ * serve reads only: they never stand for election, and the master does
+ * not wait for them to acknowledge its commits.
+ */
+static int cldb_rep_config(struct cldb *cldb)
+{
+	DB_ENV *dbenv = cldb->env;
+	unsigned int port;
+	char *host;
+	GList *tmp;
+	int rc;
+
+	if (rep_site(cldb->rep_local, &host, &port)) {
+		HAIL_ERR(&srv_log, "bad replication site '%s'",
+			 cldb->rep_local);
+		return -EINVAL;
+	}
+	rc = dbenv->repmgr_set_local_site(dbenv, host, port, 0);
+	g_free(host);
+	if (rc) {
+		dbenv->err(dbenv, rc, "dbenv->repmgr_set_local_site");
+		return rc;
+	}
+
+	for (tmp = cldb->rep_remotes; tmp; tmp = tmp->next) {
+		if (rep_site(tmp->data, &host, &port)) {
+			HAIL_ERR(&srv_log, "bad replication site '%s'",
+				 (char *) tmp->data);
+			return -EINVAL;
+		}
+		rc = dbenv->repmgr_add_remote_site(dbenv, host, port,
+						   NULL, 0);
+		g_free(host);
+		if (rc) {
+			dbenv->err(dbenv, rc, "dbenv->repmgr_add_remote_site");
+			return rc;
+		}
+	}
+
+	rc = dbenv->repmgr_set_ack_policy(dbenv, DB_REPMGR_ACKS_NONE);
+	if (rc) {
+		dbenv->err(dbenv, rc, "dbenv->repmgr_set_ack_policy");
+		return rc;
+	}
+
+	rc = dbenv->rep_set_priority(dbenv, cldb->replica ? 0 : 100);
+	if (rc) {
+		dbenv->err(dbenv, rc, "dbenv->rep_set_priority");
+		return rc;
+	}
+
+	return 0;
+}
+
+static int cldb_rep_start(struct cldb *cldb)
+{
+	DB_ENV *dbenv = cldb->env;
+	int i, rc;
+
+	rc = dbenv->repmgr_start(dbenv, CLDB_REP_THREADS,
+				 cldb->replica ? DB_REP_CLIENT : DB_REP_MASTER);
+	if (rc) {
+		dbenv->err(dbenv, rc, "dbenv->repmgr_start");
+		return rc;
+	}
+
+	if (!cldb->replica)
+		return 0;
+
+	/* with the master away, start on what we have; a new replica has
+	 * nothing, and fails to open its databases below
+	 */
+	for (i = 0; i < CLDB_REP_SYNC_WAIT && !cldb->rep_synced; i++)
+		sleep(1);
+	if (!cldb->rep_synced)
+		HAIL_WARN(&srv_log, "replica not yet in sync with master");
+
+	return 0;
+}
+
 int cldb_init(struct cldb *cldb, const char *db_home, const char *db_password,
 	      unsigned int env_flags, const char *errpfx, bool do_syslog,
 	      unsigned int flags, void (*cb)(enum db_event))
@@ -238,7 +388,7 @@ int cldb_init(struct cldb *cldb, const char *db_home, const char *db_password,
 	int rc;
 	DB_ENV *dbenv;
 
-	cldb->is_master = true;
+	cldb->is_master = !cldb->replica;
 	cldb->home = db_home;
 	cldb->state_cb = cb;
 
@@ -291,6 +441,13 @@ int cldb_init(struct cldb *cldb, const char *db_home, const char *db_password,
 		goto err_out;
 	}
 
+	if (cldb->rep_local) {
+		rc = cldb_rep_config(cldb);
+		if (rc)
+			goto err_out;
+		env_flags |= DB_INIT_REP;
+	}
+
 	/* init DB transactional environment, stored in directory db_home */
 	env_flags |= DB_INIT_LOG | DB_INIT_LOCK | DB_INIT_MPOOL;
 	env_flags |= DB_INIT_TXN;
@@ -300,6 +457,12 @@ int cldb_init(struct cldb *cldb, const char *db_home, const char *db_password,
 		goto err_out;
 	}
 
+	if (cldb->rep_local) {
+		rc = cldb_rep_start(cldb);
+		if (rc)
+			goto err_out;
+	}
+
 	rc = cldb_up(cldb, flags);
 	if (rc)
 		goto err_out;
@@ -310,62 +473,118 @@ err_out:
 	dbenv->close(dbenv, 0);
 	return rc;
 }
-
 /*
- * open databases
+ * open the databases the master replicates to us: the namespace
  */
-static int cldb_up(struct cldb *cldb, unsigned int flags)
+static int cldb_ns_open(struct cldb *cldb, unsigned int flags, DB **inodes,
+			DB **inode_names, DB **data, DB **dirents)
 {
 	DB_ENV *dbenv = cldb->env;
 	int rc;
 
-	if (!cldb->is_master)
-		flags &= ~DB_CREATE;
-	if (cldb->keyed)
-		flags |= DB_ENCRYPT;
-
-	/* active sessions; idx: session id */
-	rc = open_db(dbenv, &cldb->sessions, "sessions", CLDB_PGSZ_SESSIONS,
-		     DB_HASH, flags, NULL, NULL, 0);
-	if (rc)
-		goto err_out;
-
 	/* all inodes; idx: inode number */
-	rc = open_db(dbenv, &cldb->inodes, "inodes", CLDB_PGSZ_INODES,
+	rc = open_db(dbenv, inodes, "inodes", CLDB_PGSZ_INODES,
 		     DB_HASH, flags, NULL, NULL, 0);
 	if (rc)
-		goto err_out_sess;
+		goto err_out;
 
 	/* secondary index: inode name (ie. path) to inode number */
-	rc = open_db(dbenv, &cldb->inode_names, "inode_names",
+	rc = open_db(dbenv, inode_names, "inode_names",
 		     CLDB_PGSZ_INODE_NAMES, DB_BTREE, flags, NULL, NULL, 0);
 	if (rc)
 		goto err_out_ino;
 
-	rc = cldb->inodes->associate(cldb->inodes, NULL,
-				     cldb->inode_names, inode_name_key,
-				     DB_CREATE);
+	rc = (*inodes)->associate(*inodes, NULL, *inode_names, inode_name_key,
+				  cldb->replica ? 0 : DB_CREATE);
 	if (rc) {
-		cldb->inodes->err(cldb->inodes, rc, "inodes->associate");
-		goto err_out_ino;
+		(*inodes)->err(*inodes, rc, "inodes->associate");
+		goto err_out_ino_name;
 	}
 
 	/* data (if any) associated with each inode; idx: inode number */
-	rc = open_db(dbenv, &cldb->data, "data", CLDB_PGSZ_DATA,
+	rc = open_db(dbenv, data, "data", CLDB_PGSZ_DATA,
 		     DB_HASH, flags, NULL, NULL, 0);
 	if (rc)
 		goto err_out_ino_name;
 
-	/* open file handles; idx: file handle number */
-	rc = open_db(dbenv, &cldb->handles, "handles", CLDB_PGSZ_HANDLES,
-		     DB_BTREE, flags, NULL, NULL, 0);
+	/* directory entries; idx: parent inode number, name */
+	rc = open_db(dbenv, dirents, "dirents", CLDB_PGSZ_DIRENTS,
+		     DB_BTREE, flags, dirent_compare, NULL, 0);
 	if (rc)
 		goto err_out_data;
 
+	return 0;
+
+err_out_data:
+	(*data)->close(*data, 0);
+err_out_ino_name:
+	(*inode_names)->close(*inode_names, 0);
+err_out_ino:
+	(*inodes)->close(*inodes, 0);
+err_out:
+	return rc;
+}
+
+static void cldb_ns_close(DB *inodes, DB *inode_names, DB *data,
+			  DB *dirents)
+{
+	dirents->close(dirents, 0);
+	data->close(data, 0);
+	inode_names->close(inode_names, 0);
+	inodes->close(inodes, 0);
+}
+
+/*
+ * open databases
+ */
+static int cldb_up(struct cldb *cldb, unsigned int flags)
+{
+	DB_ENV *dbenv = cldb->env;
+	unsigned int lflags, lfset;
+	int rc;
+
+	if (!cldb->is_master)
+		flags &= ~DB_CREATE;
+	if (cldb->keyed)
+		flags |= DB_ENCRYPT;
+	cldb->open_flags = flags;
+
+	/*
+	 * Sessions, handles and locks are a server's own.  A replica
+	 * keeps them in memory and unlogged, which db4 lets a client
+	 * write, and which the master's copies do not replicate into.
+	 */
+	lflags = flags;
+	lfset = 0;
+	if (cldb->replica) {
+		lflags |= DB_CREATE;
+		lfset = DB_TXN_NOT_DURABLE;
+	}
+
+	/* active sessions; idx: session id */
+	rc = open_db(dbenv, &cldb->sessions,
+		     cldb->replica ? NULL : "sessions", CLDB_PGSZ_SESSIONS,
+		     DB_HASH, lflags, NULL, NULL, lfset);
+	if (rc)
+		goto err_out;
+
+	rc = cldb_ns_open(cldb, flags, &cldb->inodes, &cldb->inode_names,
+			  &cldb->data, &cldb->dirents);
+	if (rc)
+		goto err_out_sess;
+
+	/* open file handles; idx: file handle number */
+	rc = open_db(dbenv, &cldb->handles,
+		     cldb->replica ? NULL : "handles", CLDB_PGSZ_HANDLES,
+		     DB_BTREE, lflags, NULL, NULL, lfset);
+	if (rc)
+		goto err_out_ns;
+
 	/* secondary index: inode number to file handle number */
-	rc = open_db(dbenv, &cldb->handle_idx, "handle_idx",
-		     CLDB_PGSZ_HANDLE_IDX, DB_BTREE, flags, NULL,
-		     NULL, DB_DUPSORT);
+	rc = open_db(dbenv, &cldb->handle_idx,
+		     cldb->replica ? NULL : "handle_idx",
+		     CLDB_PGSZ_HANDLE_IDX, DB_BTREE, lflags, NULL,
+		     NULL, DB_DUPSORT | lfset);
 	if (rc)
 		goto err_out_handles;
 
@@ -378,8 +597,9 @@ static int cldb_up(struct cldb *cldb, unsigned int flags)
 	}
 
 	/* active locks; idx: inode number */
-	rc = open_db(dbenv, &cldb->locks, "locks", CLDB_PGSZ_LOCKS,
-		     DB_HASH, flags, NULL, lock_compare, DB_DUPSORT);
+	rc = open_db(dbenv, &cldb->locks,
+		     cldb->replica ? NULL : "locks", CLDB_PGSZ_LOCKS,
+		     DB_HASH, lflags, NULL, lock_compare, DB_DUPSORT | lfset);
 	if (rc)
 		goto err_out_handle_idx;
 
@@ -392,18 +612,44 @@ err_out_handle_idx:
 	cldb->handle_idx->close(cldb->handle_idx, 0);
 err_out_handles:
 	cldb->handles->close(cldb->handles, 0);
-err_out_data:
-	cldb->data->close(cldb->data, 0);
-err_out_ino_name:
-	cldb->inode_names->close(cldb->inode_names, 0);
-err_out_ino:
-	cldb->inodes->close(cldb->inodes, 0);
+err_out_ns:
+	cldb_ns_close(cldb->inodes, cldb->inode_names, cldb->data,
+		      cldb->dirents);
 err_out_sess:
 	cldb->sessions->close(cldb->sessions, 0);
 err_out:
 	return rc;
 }
 
+/*
+ * After internal init our namespace handles are dead.  Open fresh ones
+ * first, so a failure leaves the old set in place (its lookups fail
+ * with DB_REP_HANDLE_DEAD until we get it right), then swap them in.
+ * Sessions, handles and locks are our own and survive untouched.
+ */
+int cldb_rep_reopen(struct cldb *cldb)
+{
+	DB *inodes, *inode_names, *data, *dirents;
+	int rc;
+
+	rc = cldb_ns_open(cldb, cldb->open_flags, &inodes, &inode_names,
+			  &data, &dirents);
+	if (rc)
+		return rc;
+
+	cldb_ns_close(cldb->inodes, cldb->inode_names, cldb->data,
+		      cldb->dirents);
+
+	cldb->inodes = inodes;
+	cldb->inode_names = inode_names;
+	cldb->data = data;
+	cldb->dirents = dirents;
+	cldb->rep_dead = false;
+
+	HAIL_INFO(&srv_log, "replicated databases reopened");
+	return 0;
+}
+
 /*
  * close databases
  */
@@ -411,6 +657,7 @@ void cldb_down(struct cldb *cldb)
 {
 	cldb->up = false;
 
+	cldb->dirents->close(cldb->dirents, 0);
 	cldb->locks->close(cldb->locks, 0);
 	cldb->handle_idx->close(cldb->handle_idx, 0);
 	cldb->handles->close(cldb->handles, 0);
@@ -419,6 +666,7 @@ void cldb_down(struct cldb *cldb)
 	cldb->inodes->close(cldb->inodes, 0);
 	cldb->sessions->close(cldb->sessions, 0);
 
+	cldb->dirents = NULL;
 	cldb->locks = NULL;
 	cldb->handle_idx = NULL;
 	cldb->handles = NULL;
@@ -525,6 +773,9 @@ int cldb_inode_get(DB_TXN *txn, cldino_t inum,
 	if (inode_out)
 		*inode_out = NULL;
 
+	if (icache_inode_get(inum, inode_out))
+		return 0;
+
 	memset(&key, 0, sizeof(key));
 	memset(&val, 0, sizeof(val));
 
@@ -537,9 +788,11 @@ int cldb_inode_get(DB_TXN *txn, cldino_t inum,
 	rc = db_inode->get(db_inode, txn, &key, &val, flags);
 	if (rc && ((rc != DB_NOTFOUND) || notfound_err)) {
 		dbenv->err(dbenv, rc, "db_inode->get");
+		cldb_rep_check(rc);
 	}
 
 	if (rc == 0) {
+		icache_inode_fill(val.data);
 		if (inode_out)
 			*inode_out = val.data;
 		else
@@ -560,6 +813,9 @@ int cldb_inode_get_byname(DB_TXN *txn, const char *name, size_t name_len,
 	if (inode_out)
 		*inode_out = NULL;
 
+	if (icache_name_get(name, name_len, inode_out))
+		return 0;
+
 	memset(&key, 0, sizeof(key));
 	memset(&val, 0, sizeof(val));
 
@@ -572,9 +828,11 @@ int cldb_inode_get_byname(DB_TXN *txn, const char *name, size_t name_len,
 	rc = db_inode_names->get(db_inode_names, txn, &key, &val, flags);
 	if (rc && ((rc != DB_NOTFOUND) || notfound_err)) {
 		dbenv->err(dbenv, rc, "db_inode_names->get");
+		cldb_rep_check(rc);
 	}
 
 	if (rc == 0) {
+		icache_inode_fill(val.data);
 		if (inode_out)
 			*inode_out = val.data;
 		else
@@ -611,6 +869,8 @@ int cldb_inode_put(DB_TXN *txn, struct raw_inode *inode, int put_flags)
 	val.data = inode;
 	val.size = raw_ino_size(inode);
 
+	icache_touch(cldino_from_le(inode->inum));
+
 	rc = db_inode->put(db_inode, txn, &key, &val, put_flags);
 	if (rc)
 		dbenv->err(dbenv, rc, "db_inode->put");
@@ -685,6 +945,9 @@ int cldb_data_get(DB_TXN *txn, cldino_t inum,
 	*data_out = NULL;
 	*data_len = 0;
 
+	if (icache_data_get(inum, data_out, data_len))
+		return 0;
+
 	memset(&key, 0, sizeof(key));
 	memset(&val, 0, sizeof(val));
 
@@ -697,9 +960,11 @@ int cldb_data_get(DB_TXN *txn, cldino_t inum,
 	rc = db_data->get(db_data, txn, &key, &val, rmw ? DB_RMW : 0);
 	if (rc && ((rc != DB_NOTFOUND) || notfound_err)) {
 		dbenv->err(dbenv, rc, "db_data->get");
+		cldb_rep_check(rc);
 	}
 
 	if (!rc) {
+		icache_data_fill(inum, val.data, val.size);
 		*data_out = val.data;
 		*data_len = val.size;
 	}
@@ -726,6 +991,8 @@ int cldb_data_put(DB_TXN *txn, cldino_t inum,
 	val.data = (void *) data;
 	val.size = data_len;
 
+	icache_touch(inum);
+
 	rc = db_data->put(db_data, txn, &key, &val, flags);
 	if (rc)
 		dbenv->err(dbenv, rc, "db_data->put");
@@ -843,15 +1110,17 @@ int cldb_handle_del(DB_TXN *txn, uint8_t *sid, uint64_t fh)
 	return rc;
 }
 
-int cldb_lock_del(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum)
+/*
+ * The locks database is a journal of the in-memory lock table (lock.c);
+ * records are addressed exactly, by (inum, seq, sid, fh), so none of
+ * these need to walk the duplicates of an inode.
+ */
+static int cldb_lock_cursor(DB_TXN *txn, DBC **cur_out, DBT *key, DBT *val,
+			    struct raw_lock *lock, int flags)
 {
-	DBC *cur;
 	DB *db_locks = cld_srv.cldb.locks;
+	DBC *cur;
 	int rc;
-	DBT key, val;
-	cldino_t inum_le = cldino_to_le(inum);
-	struct raw_lock lock;
-	int gflags;
 
 	rc = db_locks->cursor(db_locks, txn, &cur, 0);
 	if (rc) {
@@ -859,167 +1128,561 @@ int cldb_lock_del(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum)
 		return rc;
 	}
 
+	memset(key, 0, sizeof(*key));
+	memset(val, 0, sizeof(*val));
+
+	/* key: inode number */
+	key->data = &lock->inum;
+	key->size = sizeof(lock->inum);
+
+	val->data = lock;
+	val->size = sizeof(*lock);
+	val->ulen = sizeof(*lock);
+	val->flags = DB_DBT_USERMEM;
+
+	rc = cur->get(cur, key, val, DB_GET_BOTH | flags);
+	if (rc) {
+		if (rc != DB_NOTFOUND)
+			db_locks->err(db_locks, rc, "db_locks->cursor get");
+		cur->close(cur);
+		return rc;
+	}
+
+	*cur_out = cur;
+	return 0;
+}
+
+int cldb_lock_put(DB_TXN *txn, const struct raw_lock *lock)
+{
+	DB *db_locks = cld_srv.cldb.locks;
+	DBT key, val;
+	int rc;
+
 	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
 
 	/* key: inode number */
-	key.data = &inum_le;
-	key.size = sizeof(inum_le);
+	key.data = (void *) &lock->inum;
+	key.size = sizeof(lock->inum);
 
-	val.flags = DB_DBT_USERMEM;
-	val.data = &lock;
-	val.ulen = sizeof(lock);
+	val.data = (void *) lock;
+	val.size = sizeof(*lock);
 
-	/* loop through all locks attached to this inum, searching
-	 * for matching lock
-	 */
-	gflags = DB_SET;
-	while (1) {
-		rc = cur->get(cur, &key, &val, gflags);
-		if (rc) {
-			if (rc == DB_NOTFOUND)
-				break;
+	rc = db_locks->put(db_locks, txn, &key, &val, 0);
+	if (rc)
+		db_locks->err(db_locks, rc, "lock_put db4 put");
 
-			db_locks->err(db_locks, rc, "db_locks->cursor get");
-			goto out;
-		}
+	return rc;
+}
 
-		gflags = DB_NEXT_DUP;
+int cldb_lock_del(DB_TXN *txn, const struct raw_lock *lock)
+{
+	struct raw_lock tmp = *lock;
+	DBC *cur;
+	DBT key, val;
+	int rc;
 
-		/* if we have a matching (sid,fh), delete rec and end loop */
-		if (!memcmp(lock.sid, sid, CLD_SID_SZ) &&
-		    (fh == le64_to_cpu(lock.fh))) {
-			rc = cur->del(cur, 0);
-			if (rc) {
-				db_locks->err(db_locks, rc, "cursor del");
-				goto out;
-			}
+	rc = cldb_lock_cursor(txn, &cur, &key, &val, &tmp, DB_RMW);
+	if (rc)
+		return rc;
 
-			break;
-		}
-	}
+	rc = cur->del(cur, 0);
+	if (rc)
+		cld_srv.cldb.locks->err(cld_srv.cldb.locks, rc, "lock_del");
 
-out:
 	cur->close(cur);
 	return rc;
 }
 
-static int cldb_lock_find(DB_TXN *txn, cldino_t inum, bool want_shared)
+int cldb_lock_update(DB_TXN *txn, const struct raw_lock *lock)
 {
+	struct raw_lock tmp = *lock;
 	DBC *cur;
-	DB *db_locks = cld_srv.cldb.locks;
-	int rc, gflags;
 	DBT key, val;
+	int rc;
+
+	rc = cldb_lock_cursor(txn, &cur, &key, &val, &tmp, DB_RMW);
+	if (rc)
+		return rc;
+
+	/* flags are not part of the sort order; overwrite in place */
+	tmp.flags = lock->flags;
+	val.size = sizeof(tmp);
+
+	rc = cur->put(cur, NULL, &val, DB_CURRENT);
+	if (rc)
+		cld_srv.cldb.locks->err(cld_srv.cldb.locks, rc, "lock_update");
+
+	cur->close(cur);
+	return rc;
+}
+
+static size_t dirent_key_fill(struct raw_dirent_key *dk, cldino_t parent,
+			      const char *name, size_t name_len)
+{
+	dk->parent = cldino_to_le(parent);
+	if (name_len)
+		memcpy(dk->name, name, name_len);
+
+	return sizeof(*dk) + name_len;
+}
+
+int cldb_dirent_put(DB_TXN *txn, cldino_t parent,
+		    const char *name, size_t name_len, cldino_t inum)
+{
+	DB *db_dirents = cld_srv.cldb.dirents;
+	char buf[sizeof(struct raw_dirent_key) + CLD_INODE_NAME_MAX];
 	cldino_t inum_le = cldino_to_le(inum);
-	struct raw_lock lock;
-	uint32_t lflags;
+	DBT key, val;
+	int rc;
 
-	rc = db_locks->cursor(db_locks, txn, &cur, 0);
+	if (name_len > CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+
+	/* key: (parent inode number, name) */
+	key.data = buf;
+	key.size = dirent_key_fill((void *) buf, parent, name, name_len);
+
+	val.data = &inum_le;
+	val.size = sizeof(inum_le);
+
+	rc = db_dirents->put(db_dirents, txn, &key, &val, DB_NOOVERWRITE);
+	if (rc)
+		db_dirents->err(db_dirents, rc, "db_dirents->put");
+
+	return rc;
+}
+
+int cldb_dirent_del(DB_TXN *txn, cldino_t parent,
+		    const char *name, size_t name_len)
+{
+	DB *db_dirents = cld_srv.cldb.dirents;
+	char buf[sizeof(struct raw_dirent_key) + CLD_INODE_NAME_MAX];
+	DBT key;
+	int rc;
+
+	if (name_len > CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	memset(&key, 0, sizeof(key));
+
+	/* key: (parent inode number, name) */
+	key.data = buf;
+	key.size = dirent_key_fill((void *) buf, parent, name, name_len);
+
+	rc = db_dirents->del(db_dirents, txn, &key, 0);
+	if (rc && rc != DB_NOTFOUND)
+		db_dirents->err(db_dirents, rc, "db_dirents->del");
+
+	return rc;
+}
+
+/*
+ * Walk the entries of directory 'parent' that sort after the name
+ * 'after' (from the first entry, if after_len is zero), packing them
+ * in the format GET has always returned for directories: a 16-bit
+ * little endian name length, the name, and zero padding to 8 bytes.
+ *
+ * Stops after max_ents entries or max_len bytes; zero means no limit.
+ * Sets *eof if the directory has no entries beyond those returned.
+ */
+int cldb_dirent_list(DB_TXN *txn, cldino_t parent,
+		     const char *after, size_t after_len,
+		     unsigned int max_ents, size_t max_len,
+		     void **data_out, size_t *len_out, bool *eof)
+{
+	DB *db_dirents = cld_srv.cldb.dirents;
+	char buf[sizeof(struct raw_dirent_key) + CLD_INODE_NAME_MAX];
+	struct raw_dirent_key *dk = (void *) buf;
+	cldino_t inum_le;
+	DBC *cur;
+	DBT key, val;
+	void *data = NULL;
+	size_t data_len = 0, data_alloc = 0;
+	unsigned int n_ents = 0;
+	bool at_end = false;
+	int rc, gflags;
+
+	*data_out = NULL;
+	*len_out = 0;
+
+	if (after_len > CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	rc = db_dirents->cursor(db_dirents, txn, &cur, 0);
 	if (rc) {
-		db_locks->err(db_locks, rc, "db_locks->cursor");
+		db_dirents->err(db_dirents, rc, "db_dirents->cursor");
+		cldb_rep_check(rc);
 		return rc;
 	}
 
 	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
 
-	/* key: inode number */
-	key.data = &inum_le;
-	key.size = sizeof(inum_le);
+	/* key: (parent inode number, name); first entry not before 'after' */
+	key.data = buf;
+	key.size = dirent_key_fill(dk, parent, after, after_len);
+	key.ulen = sizeof(buf);
+	key.flags = DB_DBT_USERMEM;
 
+	val.data = &inum_le;
+	val.ulen = sizeof(inum_le);
 	val.flags = DB_DBT_USERMEM;
-	val.data = &lock;
-	val.ulen = sizeof(lock);
 
-	/* loop through locks associated with this inode, searching
-	 * for a conflicting acquired lock
-	 */
-	gflags = DB_SET;
+	gflags = DB_SET_RANGE;
 	while (1) {
+		size_t name_len, ent_len;
+		uint16_t len_le;
+
 		rc = cur->get(cur, &key, &val, gflags);
 		if (rc) {
-			/* no locks, or no next-dup (rc == DB_NOTFOUND) */
-			if (rc == DB_NOTFOUND)
-				break;
-
-			db_locks->err(db_locks, rc, "db_locks->cursor get");
+			if (rc == DB_NOTFOUND) {
+				at_end = true;
+				rc = 0;
+			} else {
+				db_dirents->err(db_dirents, rc, "dirent list get");
+				cldb_rep_check(rc);
+			}
 			break;
 		}
 
-		gflags = DB_NEXT_DUP;
+		gflags = DB_NEXT;
+
+		if (cldino_from_le(dk->parent) != parent) {
+			at_end = true;
+			break;
+		}
 
-		lflags = le32_to_cpu(lock.flags);
+		name_len = key.size - sizeof(*dk);
 
-		/* pending locks do not conflict */
-		if (lflags & CLFL_PENDING)
+		/* resume strictly after the previous page */
+		if (after_len && name_len == after_len &&
+		    !memcmp(dk->name, after, after_len))
 			continue;
 
-		/* if conflicting lock found, end loop (rc == 0) */
-		if (!want_shared ||
-		    (want_shared && (!(lflags & CLFL_SHARED))))
+		ent_len = cldb_dirent_size(name_len);
+		if ((max_ents && n_ents >= max_ents) ||
+		    (max_len && data_len + ent_len > max_len))
 			break;
+
+		if (data_len + ent_len > data_alloc) {
+			size_t new_alloc = MAX(data_alloc * 2, 512);
+			void *mem;
+
+			while (new_alloc < data_len + ent_len)
+				new_alloc *= 2;
+
+			mem = realloc(data, new_alloc);
+			if (!mem) {
+				rc = -ENOMEM;
+				break;
+			}
+
+			data = mem;
+			data_alloc = new_alloc;
+		}
+
+		/* 16-bit name length, name, zero pad */
+		len_le = cpu_to_le16(name_len);
+		memcpy(data + data_len, &len_le, sizeof(len_le));
+		memcpy(data + data_len + 2, dk->name, name_len);
+		memset(data + data_len + 2 + name_len, 0,
+		       ent_len - 2 - name_len);
+
+		data_len += ent_len;
+		n_ents++;
 	}
 
 	cur->close(cur);
-	return rc;
+
+	if (rc) {
+		free(data);
+		return rc;
+	}
+
+	*data_out = data;
+	*len_out = data_len;
+	if (eof)
+		*eof = at_end;
+	return 0;
 }
 
-int cldb_lock_add(DB_TXN *txn, uint8_t *sid, uint64_t fh,
-		  cldino_t inum, bool shared, bool wait, bool *acquired)
+int cldb_dirent_empty(DB_TXN *txn, cldino_t parent, bool *empty)
 {
+	void *data;
+	size_t len;
 	int rc;
-	struct raw_lock lock;
-	cldino_t inum_le = cldino_to_le(inum);
+
+	rc = cldb_dirent_list(txn, parent, NULL, 0, 1, 0, &data, &len, NULL);
+	if (rc)
+		return rc;
+
+	free(data);
+	*empty = (len == 0);
+	return 0;
+}
+
+/*
+ * Move directories from the packed blob in the data db, which every
+ * create and delete rewrote whole, into the dirents db.  Runs once, the
+ * first time a server with the dirents db opens an older database.
+ */
+int cldb_dirent_upgrade(DB_TXN *txn)
+{
+	DB *db_inodes = cld_srv.cldb.inodes;
+	DB *db_dirents = cld_srv.cldb.dirents;
+	DB *db_data = cld_srv.cldb.data;
+	GArray *dirs;
+	DBC *cur;
 	DBT key, val;
-	DB *db_locks = cld_srv.cldb.locks;
-	bool have_conflict = false;
-	uint32_t lock_flags = 0;
+	unsigned int i;
+	int rc;
 
-	if (acquired)
-		*acquired = false;
+	/* nothing to do once any entry, or the mark, has been written */
+	rc = db_dirents->cursor(db_dirents, txn, &cur, 0);
+	if (rc) {
+		db_dirents->err(db_dirents, rc, "db_dirents->cursor");
+		return rc;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.flags = DB_DBT_MALLOC;
+	val.flags = DB_DBT_MALLOC;
 
-	/* search for conflicting lock */
-	rc = cldb_lock_find(txn, inum, shared);
-	if (rc && (rc != DB_NOTFOUND))
+	rc = cur->get(cur, &key, &val, DB_FIRST);
+	cur->close(cur);
+	if (rc == 0) {
+		free(key.data);
+		free(val.data);
+		return 0;
+	}
+	if (rc != DB_NOTFOUND) {
+		db_dirents->err(db_dirents, rc, "dirent upgrade get");
 		return rc;
-	if (rc == 0)
-		have_conflict = true;
+	}
 
-	/* if trylock failed, exit immediately */
-	if (!wait && have_conflict)
-		return DB_KEYEXIST;
+	/* collect directory inodes */
+	dirs = g_array_new(FALSE, FALSE, sizeof(cldino_t));
 
-	/*
-	 * build and store new lock record, marked with CLFL_PENDING
-	 * if lock was not acquired
-	 */
+	rc = db_inodes->cursor(db_inodes, txn, &cur, 0);
+	if (rc) {
+		db_inodes->err(db_inodes, rc, "db_inodes->cursor");
+		goto out;
+	}
 
-	if (shared)
-		lock_flags |= CLFL_SHARED;
-	if (wait && have_conflict)
-		lock_flags |= CLFL_PENDING;
+	while (1) {
+		struct raw_inode *ino;
 
-	lock.inum = cldino_to_le(inum);
-	memcpy(lock.sid, sid, sizeof(lock.sid));
-	lock.fh = cpu_to_le64(fh);
-	lock.ctime = cpu_to_le64(current_time.tv_sec);
-	lock.flags = cpu_to_le32(lock_flags);
+		memset(&key, 0, sizeof(key));
+		memset(&val, 0, sizeof(val));
+		key.flags = DB_DBT_MALLOC;
+		val.flags = DB_DBT_MALLOC;
 
-	memset(&key, 0, sizeof(key));
-	memset(&val, 0, sizeof(val));
+		rc = cur->get(cur, &key, &val, DB_NEXT);
+		if (rc) {
+			if (rc == DB_NOTFOUND)
+				rc = 0;
+			else
+				db_inodes->err(db_inodes, rc, "upgrade inode get");
+			break;
+		}
 
-	/* key: inode number */
-	key.data = &inum_le;
-	key.size = sizeof(inum_le);
+		ino = val.data;
+		if (le32_to_cpu(ino->flags) & CIFL_DIR) {
+			cldino_t inum = cldino_from_le(ino->inum);
 
-	val.data = &lock;
-	val.size = sizeof(lock);
+			g_array_append_val(dirs, inum);
+		}
 
-	rc = db_locks->put(db_locks, txn, &key, &val, 0);
+		free(key.data);
+		free(val.data);
+	}
+
+	cur->close(cur);
 	if (rc)
-		db_locks->err(db_locks, rc, "lock_add db4 put");
+		goto out;
+
+	for (i = 0; i < dirs->len; i++) {
+		cldino_t dir_inum = g_array_index(dirs, cldino_t, i);
+		struct raw_inode *dir, *child;
+		void *blob, *p;
+		size_t blob_len, tmp_len, dir_name_len, dir_size = 0;
+		char path[CLD_INODE_NAME_MAX * 2 + 2];
+
+		rc = cldb_data_get(txn, dir_inum, &blob, &blob_len,
+				   false, true);
+		if (rc == DB_NOTFOUND) {
+			rc = 0;
+			continue;
+		}
+		if (rc)
+			goto out;
+
+		rc = cldb_inode_get(txn, dir_inum, &dir, true, DB_RMW);
+		if (rc) {
+			free(blob);
+			goto out;
+		}
+
+		/* "/" has no name of its own to prefix its children with */
+		dir_name_len = le32_to_cpu(dir->ino_len);
+		if (dir_name_len == 1)
+			dir_name_len = 0;
+		memcpy(path, dir + 1, dir_name_len);
+		path[dir_name_len] = '/';
+
+		p = blob;
+		tmp_len = blob_len;
+		while (tmp_len >= 2) {
+			uint16_t len_le;
+			size_t name_len, ent_len;
+
+			memcpy(&len_le, p, sizeof(len_le));
+			name_len = le16_to_cpu(len_le);
+			ent_len = cldb_dirent_size(name_len);
+			if (ent_len > tmp_len || name_len > CLD_INODE_NAME_MAX)
+				break;
+
+			memcpy(path + dir_name_len + 1, p + 2, name_len);
+			rc = cldb_inode_get_byname(txn, path,
+						   dir_name_len + 1 + name_len,
+						   &child, false, 0);
+			if (rc == 0) {
+				rc = cldb_dirent_put(txn, dir_inum, p + 2,
+						     name_len,
+						     cldino_from_le(child->inum));
+				free(child);
+				if (rc == 0)
+					dir_size += ent_len;
+				else if (rc != DB_KEYEXIST)
+					break;
+			} else if (rc == DB_NOTFOUND)
+				HAIL_WARN(&srv_log, "dropping dangling dirent "
+					  "%.*s", (int) (dir_name_len + 1 +
+							 name_len), path);
+			else
+				break;
+
+			rc = 0;
+			p += ent_len;
+			tmp_len -= ent_len;
+		}
+
+		/* key: inode number */
+		memset(&key, 0, sizeof(key));
+		key.data = &dir->inum;
+		key.size = sizeof(dir->inum);
+
+		icache_touch(cldino_from_le(dir->inum));
+		if (rc == 0)
+			rc = db_data->del(db_data, txn, &key, 0);
+		if (rc == 0) {
+			dir->size = cpu_to_le32(dir_size);
+			rc = cldb_inode_put(txn, dir, 0);
+		}
+
+		free(blob);
+		free(dir);
+		if (rc)
+			goto out;
+	}
 
-	if (acquired && !have_conflict && !rc)
-		*acquired = true;
+	if (dirs->len)
+		HAIL_INFO(&srv_log, "indexed %u directories", dirs->len);
 
+	/* a cell with only empty directories indexes nothing; mark the
+	 * upgrade done so later starts need not scan the inodes again
+	 */
+	rc = cldb_dirent_put(txn, CLD_INO_DIRENT_MARK, NULL, 0, 0);
+
+out:
+	g_array_free(dirs, TRUE);
 	return rc;
 }
 
+/*
+ * Read up to 'max' more records of w->db, values left in place, so its
+ * pages are cached before clients ask for them.  w->db is a secondary
+ * btree index, and the primary record of each entry is read as well.
+ * Each step opens a new cursor and resumes after the last key read,
+ * which needs the key order of a btree.
+ *
+ * Returns the number of records read, 0 once the walk is done, or a
+ * negative error.
+ */
+int cldb_warm_step(struct cldb_warm *w, unsigned int max)
+{
+	DB *db = w->db;
+	DBC *cur;
+	DBT key, pkey, val;
+	cldino_t inum;
+	char last[sizeof(w->key)];
+	size_t last_len = w->key_len;
+	unsigned int n = 0;
+	int rc, gflags;
+
+	if (w->done)
+		return 0;
+
+	rc = db->cursor(db, NULL, &cur, 0);
+	if (rc) {
+		db->err(db, rc, "warm cursor");
+		return -EIO;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+
+	memcpy(last, w->key, last_len);
+	key.data = w->key;
+	key.size = w->key_len;
+	key.ulen = sizeof(w->key);
+	key.flags = DB_DBT_USERMEM;
+
+	memset(&pkey, 0, sizeof(pkey));
+	pkey.data = &inum;
+	pkey.ulen = sizeof(inum);
+	pkey.flags = DB_DBT_USERMEM;
+
+	/* touch the page, copy nothing */
+	val.flags = DB_DBT_PARTIAL;
+	val.doff = 0;
+	val.dlen = 0;
+
+	gflags = w->key_len ? DB_SET_RANGE : DB_FIRST;
+	while (n < max) {
+		rc = cur->pget(cur, &key, &pkey, &val, gflags);
+		if (rc) {
+			if (rc != DB_NOTFOUND) {
+				db->err(db, rc, "warm get");
+				rc = -EIO;
+			} else
+				rc = 0;
+			w->done = true;
+			break;
+		}
+
+		/* the first get of a later step lands on the last key
+		 * of the step before, or on the one after it if that
+		 * was deleted since; only the former was read already
+		 */
+		if (gflags == DB_SET_RANGE && key.size == last_len &&
+		    !memcmp(w->key, last, last_len)) {
+			gflags = DB_NEXT;
+			continue;
+		}
+
+		gflags = DB_NEXT;
+		w->key_len = key.size;
+		n++;
+	}
+
+	cur->close(cur);
+
+	w->records += n;
+	return rc < 0 ? rc : n;
+}
@@ -22,8 +22,10 @@
 
 #include <stdbool.h>
 #include <db.h>
+#include <glib.h>
 #include <cld-private.h>
 #include <cld_msg_rpc.h>
+#include <cld_common.h>
 
 typedef uint64_t cldino_t;
 
@@ -42,6 +44,7 @@ struct raw_session {
 	uint64_t		next_fh;	/* next fh */
 	uint64_t		next_seqid_in;
 	uint64_t		next_seqid_out;
+	uint32_t		flags;		/* CSF_xxx */
 };
 
 struct raw_handle_key {
@@ -63,6 +66,8 @@ struct raw_handle {
 };
 
 enum {
+	CLD_INO_DIRENT_MARK	= 1,		/* parent of the "dirents
+						   index built" record */
 	CLD_INO_ROOT		= 10,
 	CLD_INO_RESERVED_LAST	= 50,
 };
@@ -83,6 +88,19 @@ struct raw_inode {
 	/* inode name */
 };
 
+/*
+ * dirent record key:		struct raw_dirent_key
+ * dirent record value:		cldino_t inum (of the entry)
+ *
+ * Keys sort by parent inode, then by name; a directory's entries are
+ * a contiguous run of the btree.
+ */
+
+struct raw_dirent_key {
+	cldino_t		parent;		/* directory inode number */
+	char			name[0];	/* entry name; no nul */
+};
+
 enum lock_flags {
 	CLFL_SHARED		= (1 << 0),	/* a shared (read) lock */
 	CLFL_PENDING		= (1 << 1),	/* lock waiting to be acq. */
@@ -96,7 +114,8 @@ struct raw_lock {
 	cldino_t		inum;
 	uint8_t			sid[CLD_SID_SZ]; /* session id */
 	uint64_t		fh;		/* handle id */
-	uint64_t		ctime;
+	uint64_t		seq;		/* queue order; older
+						   databases hold a ctime */
 	uint32_t		flags;		/* lock flags: CLFL_xxxx */
 };
 
@@ -112,6 +131,16 @@ struct cldb {
 	const char	*home;			/* database home dir */
 	void		(*state_cb)(enum db_event);
 
+	/* db4 replication; set before cldb_init.  rep_local NULL: none */
+	const char	*rep_local;		/* host:port we listen on */
+	GList		*rep_remotes;		/* host:port of other sites */
+	bool		replica;		/* read-only client, never
+						   master */
+	bool		rep_synced;		/* replica caught up once */
+	bool		rep_dead;		/* internal init killed our
+						   replicated handles */
+	unsigned int	open_flags;		/* db->open flags, to reopen */
+
 	DB_ENV		*env;			/* db4 env ptr */
 
 	DB		*sessions;		/* client sessions */
@@ -125,14 +154,29 @@ struct cldb {
 	DB		*handle_idx;		/* handles (by inode) */
 
 	DB		*locks;			/* held locks */
+
+	DB		*dirents;		/* directory entries */
 };
 
+/* a walk over one database, a step at a time, to pull its pages into
+ * the db4 cache
+ */
+struct cldb_warm {
+	DB		*db;			/* secondary btree index;
+						   primaries read too */
+	bool		done;
+	unsigned long	records;		/* read so far */
+	size_t		key_len;		/* 0: not started */
+	char		key[CLD_INODE_NAME_MAX + 16];	/* last key read */
+};
 
 extern int cldb_init(struct cldb *cldb, const char *db_home, const char *db_password,
 	      unsigned int env_flags, const char *errpfx, bool do_syslog,
 	      unsigned int flags, void (*cb)(enum db_event));
 extern void cldb_down(struct cldb *cldb);
+extern int cldb_rep_reopen(struct cldb *cldb);
 extern void cldb_fini(struct cldb *cldb);
+extern int cldb_warm_step(struct cldb_warm *w, unsigned int max);
 
 extern int cldb_session_get(DB_TXN *txn, uint8_t *sid, struct raw_session **sess,
 		     bool notfound_err, bool rmw);
@@ -165,9 +209,26 @@ extern int cldb_handle_del(DB_TXN *txn, uint8_t *sid, uint64_t fh);
 extern int cldb_handle_get(DB_TXN *txn, uint8_t *sid, uint64_t fh,
 		    struct raw_handle **h_out, int flags);
 
-extern int cldb_lock_del(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum);
-extern int cldb_lock_add(DB_TXN *txn, uint8_t *sid, uint64_t fh,
-			cldino_t inum, bool shared, bool wait, bool *acq);
+extern int cldb_lock_put(DB_TXN *txn, const struct raw_lock *lock);
+extern int cldb_lock_del(DB_TXN *txn, const struct raw_lock *lock);
+extern int cldb_lock_update(DB_TXN *txn, const struct raw_lock *lock);
+
+extern int cldb_dirent_put(DB_TXN *txn, cldino_t parent,
+			   const char *name, size_t name_len, cldino_t inum);
+extern int cldb_dirent_del(DB_TXN *txn, cldino_t parent,
+			   const char *name, size_t name_len);
+extern int cldb_dirent_empty(DB_TXN *txn, cldino_t parent, bool *empty);
+extern int cldb_dirent_list(DB_TXN *txn, cldino_t parent,
+			    const char *after, size_t after_len,
+			    unsigned int max_ents, size_t max_len,
+			    void **data_out, size_t *len_out, bool *eof);
+extern int cldb_dirent_upgrade(DB_TXN *txn);
+
+/* bytes an entry takes in the packed GET/READDIR directory format */
+static inline size_t cldb_dirent_size(size_t name_len)
+{
+	return name_len + 2 + CLD_ALIGN8(name_len + 2);
+}
 
 static inline cldino_t cldino_to_le(cldino_t inum)
 {
@@ -0,0 +1,573 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <cld-private.h>
+#include "cld.h"
+
+/*
+ * In-memory lock table.
+ *
+ * Each locked inode has a set of holders and a FIFO of waiters.  The
+ * table is authoritative while the server runs; every change is also
+ * written to the locks database inside the caller's transaction, and
+ * the table is rebuilt from that database by sess_load at startup.
+ *
+ * Changes are applied to the table as they are journaled.  If the
+ * transaction aborts, the inodes it touched are reloaded from the
+ * database; CE_LOCKED notifications are only sent once it commits.
+ */
+
+struct lock_inode {
+	cldino_t		inum;		/* hash key */
+
+	unsigned int		n_shared;	/* shared holders */
+	unsigned int		n_excl;		/* exclusive holders, 0 or 1 */
+
+	struct list_head	holders;
+	struct list_head	waiters;	/* oldest first */
+};
+
+struct cld_lock {
+	struct list_head	node;		/* on holders or waiters */
+
+	uint8_t			sid[CLD_SID_SZ];
+	uint64_t		fh;
+	uint64_t		seq;		/* queue order */
+	uint32_t		flags;		/* CLFL_xxx */
+};
+
+struct lock_notify {
+	uint8_t			sid[CLD_SID_SZ];
+	uint64_t		fh;
+	cldino_t		inum;
+};
+
+static uint64_t lock_seq;		/* last seq handed out */
+static GArray *lock_touched;		/* inums changed by current txn */
+static GList *lock_notify_q;		/* grants to announce on commit */
+
+unsigned long lock_hash(const void *v)
+{
+	const cldino_t *inum = v;
+
+	return (unsigned long) *inum;
+}
+
+int lock_equal(const void *_a, const void *_b)
+{
+	const cldino_t *a = _a;
+	const cldino_t *b = _b;
+
+	return *a != *b;
+}
+
+static void lock_encode(struct raw_lock *raw, cldino_t inum,
+			const struct cld_lock *lock)
+{
+	memset(raw, 0, sizeof(*raw));
+	raw->inum = cldino_to_le(inum);
+	memcpy(raw->sid, lock->sid, sizeof(raw->sid));
+	raw->fh = cpu_to_le64(lock->fh);
+	raw->seq = cpu_to_le64(lock->seq);
+	raw->flags = cpu_to_le32(lock->flags);
+}
+
+static bool lock_compatible(const struct lock_inode *li, bool shared)
+{
+	if (li->n_excl)
+		return false;
+	return shared || !li->n_shared;
+}
+
+static void lock_hold(struct lock_inode *li, struct cld_lock *lock)
+{
+	lock->flags &= ~CLFL_PENDING;
+	if (lock->flags & CLFL_SHARED)
+		li->n_shared++;
+	else
+		li->n_excl++;
+	list_add_tail(&lock->node, &li->holders);
+}
+
+static void lock_unhold(struct lock_inode *li, struct cld_lock *lock)
+{
+	if (lock->flags & CLFL_SHARED)
+		li->n_shared--;
+	else
+		li->n_excl--;
+	list_del(&lock->node);
+}
+
+static struct lock_inode *lock_inode_get(cldino_t inum, bool create)
+{
+	struct lock_inode *li;
+
+	li = htab_get(cld_srv.locks, &inum);
+	if (li || !create)
+		return li;
+
+	li = calloc(1, sizeof(*li));
+	if (!li)
+		return NULL;
+
+	li->inum = inum;
+	INIT_LIST_HEAD(&li->holders);
+	INIT_LIST_HEAD(&li->waiters);
+
+	if (!htab_put(cld_srv.locks, &li->inum, li)) {
+		free(li);
+		return NULL;
+	}
+
+	return li;
+}
+
+static void lock_inode_free(struct lock_inode *li)
+{
+	struct cld_lock *lock, *tmp;
+
+	list_for_each_entry_safe(lock, tmp, &li->holders, node) {
+		list_del(&lock->node);
+		free(lock);
+	}
+	list_for_each_entry_safe(lock, tmp, &li->waiters, node) {
+		list_del(&lock->node);
+		free(lock);
+	}
+	free(li);
+}
+
+static void lock_inode_put(struct lock_inode *li)
+{
+	if (!list_empty(&li->holders) || !list_empty(&li->waiters))
+		return;
+
+	htab_del(cld_srv.locks, &li->inum);
+	free(li);
+}
+
+static void lock_touch(cldino_t inum)
+{
+	unsigned int i;
+
+	if (!lock_touched)
+		lock_touched = g_array_new(FALSE, FALSE, sizeof(cldino_t));
+
+	for (i = 0; i < lock_touched->len; i++)
+		if (g_array_index(lock_touched, cldino_t, i) == inum)
+			return;
+
+	g_array_append_val(lock_touched, inum);
+}
+
+/*
+ * Attach a lock read from the database.  Records come back in
+ * (seq, sid, fh) order, which is the order the waiters queued in.
+ * Later locks must sort after every one loaded, so seq resumes above
+ * the highest seen.
+ */
+static int lock_attach_raw(const struct raw_lock *raw)
+{
+	struct lock_inode *li;
+	struct cld_lock *lock;
+
+	li = lock_inode_get(cldino_from_le(raw->inum), true);
+	if (!li)
+		return -ENOMEM;
+
+	lock = calloc(1, sizeof(*lock));
+	if (!lock) {
+		lock_inode_put(li);
+		return -ENOMEM;
+	}
+
+	memcpy(lock->sid, raw->sid, sizeof(lock->sid));
+	lock->fh = le64_to_cpu(raw->fh);
+	lock->seq = le64_to_cpu(raw->seq);
+	if (lock->seq > lock_seq)
+		lock_seq = lock->seq;
+	lock->flags = le32_to_cpu(raw->flags);
+
+	if (lock->flags & CLFL_PENDING)
+		list_add_tail(&lock->node, &li->waiters);
+	else
+		lock_hold(li, lock);
+
+	return 0;
+}
+
+/*
+ * Grant waiters from the head of the queue for as long as they are
+ * compatible with the current holders.  A waiter that must wait keeps
+ * everybody behind it waiting too.
+ */
+static int lock_promote(DB_TXN *txn, struct lock_inode *li, bool notify)
+{
+	struct cld_lock *lock, *tmp;
+	struct raw_lock raw;
+	int rc;
+
+	list_for_each_entry_safe(lock, tmp, &li->waiters, node) {
+		struct lock_notify *ln;
+
+		if (!lock_compatible(li, lock->flags & CLFL_SHARED))
+			break;
+
+		list_del(&lock->node);
+		lock_hold(li, lock);
+
+		lock_encode(&raw, li->inum, lock);
+		rc = cldb_lock_update(txn, &raw);
+		if (rc)
+			return rc;
+
+		if (!notify)
+			continue;
+
+		ln = malloc(sizeof(*ln));
+		if (!ln)
+			return -ENOMEM;
+		memcpy(ln->sid, lock->sid, sizeof(ln->sid));
+		ln->fh = lock->fh;
+		ln->inum = li->inum;
+		lock_notify_q = g_list_append(lock_notify_q, ln);
+	}
+
+	return 0;
+}
+
+int lock_add(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum,
+	     bool shared, bool wait, bool *acquired)
+{
+	struct lock_inode *li;
+	struct cld_lock *lock;
+	struct raw_lock raw;
+	bool grant;
+	int rc;
+
+	*acquired = false;
+
+	li = lock_inode_get(inum, false);
+
+	/* queued waiters go first, so later arrivals cannot starve them */
+	grant = !li || (list_empty(&li->waiters) &&
+			lock_compatible(li, shared));
+
+	/* if trylock failed, exit immediately */
+	if (!grant && !wait)
+		return DB_KEYEXIST;
+
+	if (!li) {
+		li = lock_inode_get(inum, true);
+		if (!li)
+			return -ENOMEM;
+	}
+
+	lock = calloc(1, sizeof(*lock));
+	if (!lock) {
+		lock_inode_put(li);
+		return -ENOMEM;
+	}
+
+	memcpy(lock->sid, sid, sizeof(lock->sid));
+	lock->fh = fh;
+	lock->seq = ++lock_seq;
+	if (shared)
+		lock->flags |= CLFL_SHARED;
+
+	if (grant)
+		lock_hold(li, lock);
+	else {
+		lock->flags |= CLFL_PENDING;
+		list_add_tail(&lock->node, &li->waiters);
+	}
+
+	lock_touch(inum);
+
+	lock_encode(&raw, inum, lock);
+	rc = cldb_lock_put(txn, &raw);
+	if (rc)
+		return rc;
+
+	*acquired = grant;
+	return 0;
+}
+
+static bool lock_match(const struct cld_lock *lock, uint8_t *sid, uint64_t fh)
+{
+	if (memcmp(lock->sid, sid, sizeof(lock->sid)))
+		return false;
+	if (fh && (lock->fh != fh))
+		return false;
+
+	return true;
+}
+
+int lock_remove(DB_TXN *txn, uint8_t *sid, uint64_t fh, cldino_t inum)
+{
+	struct lock_inode *li;
+	struct cld_lock *lock, *tmp;
+	struct raw_lock raw;
+	bool found = false;
+	int rc;
+
+	li = lock_inode_get(inum, false);
+	if (!li)
+		return DB_NOTFOUND;
+
+	lock_touch(inum);
+
+	list_for_each_entry_safe(lock, tmp, &li->holders, node) {
+		if (!lock_match(lock, sid, fh))
+			continue;
+
+		lock_encode(&raw, inum, lock);
+		rc = cldb_lock_del(txn, &raw);
+		if (rc)
+			return rc;
+
+		lock_unhold(li, lock);
+		free(lock);
+		found = true;
+	}
+
+	list_for_each_entry_safe(lock, tmp, &li->waiters, node) {
+		if (!lock_match(lock, sid, fh))
+			continue;
+
+		lock_encode(&raw, inum, lock);
+		rc = cldb_lock_del(txn, &raw);
+		if (rc)
+			return rc;
+
+		list_del(&lock->node);
+		free(lock);
+		found = true;
+	}
+
+	if (!found)
+		return DB_NOTFOUND;
+
+	rc = lock_promote(txn, li, true);
+	if (rc)
+		return rc;
+
+	lock_inode_put(li);
+	return 0;
+}
+
+static int lock_inode_reload(cldino_t inum)
+{
+	DB *db_locks = cld_srv.cldb.locks;
+	struct lock_inode *li;
+	DBC *cur;
+	DBT key, val;
+	cldino_t inum_le = cldino_to_le(inum);
+	struct raw_lock raw;
+	int rc, gflags;
+
+	li = lock_inode_get(inum, false);
+	if (li) {
+		htab_del(cld_srv.locks, &li->inum);
+		lock_inode_free(li);
+	}
+
+	rc = db_locks->cursor(db_locks, NULL, &cur, 0);
+	if (rc) {
+		db_locks->err(db_locks, rc, "db_locks->cursor");
+		return rc;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+
+	/* key: inode number */
+	key.data = &inum_le;
+	key.size = sizeof(inum_le);
+
+	val.data = &raw;
+	val.ulen = sizeof(raw);
+	val.flags = DB_DBT_USERMEM;
+
+	gflags = DB_SET;
+	while (1) {
+		rc = cur->get(cur, &key, &val, gflags);
+		if (rc) {
+			if (rc == DB_NOTFOUND)
+				rc = 0;
+			else
+				db_locks->err(db_locks, rc, "lock reload get");
+			break;
+		}
+
+		gflags = DB_NEXT_DUP;
+
+		rc = lock_attach_raw(&raw);
+		if (rc)
+			break;
+	}
+
+	cur->close(cur);
+	return rc;
+}
+
+void lock_txn_commit(void)
+{
+	GList *tmp;
+
+	if (lock_touched)
+		g_array_set_size(lock_touched, 0);
+
+	for (tmp = lock_notify_q; tmp; tmp = tmp->next) {
+		struct lock_notify *ln = tmp->data;
+		struct cld_msg_event me;
+		struct session *sess;
+
+		sess = sess_lookup(ln->sid);
+		if (!sess) {
+			HAIL_WARN(&srv_log, "%s BUG", __func__);
+			goto next;
+		}
+
+		if (!sess->sock_fd) {		/* Freshly recovered session */
+			HAIL_DEBUG(&srv_log, "Lost success sid " SIDFMT
+				   " ino %lld", SIDARG(sess->sid),
+				   (long long) ln->inum);
+			goto next;
+		}
+
+		memset(&me, 0, sizeof(me));
+		me.fh = ln->fh;
+		me.events = CE_LOCKED;
+
+		sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_event,
+			     (void *)&me, CMO_EVENT, NULL, NULL);
+next:
+		free(ln);
+	}
+
+	g_list_free(lock_notify_q);
+	lock_notify_q = NULL;
+}
+
+void lock_txn_abort(void)
+{
+	unsigned int i;
+	GList *tmp;
+
+	for (tmp = lock_notify_q; tmp; tmp = tmp->next)
+		free(tmp->data);
+	g_list_free(lock_notify_q);
+	lock_notify_q = NULL;
+
+	if (!lock_touched)
+		return;
+
+	for (i = 0; i < lock_touched->len; i++) {
+		cldino_t inum = g_array_index(lock_touched, cldino_t, i);
+
+		if (lock_inode_reload(inum))
+			HAIL_ERR(&srv_log, "lock table reload failed, ino %lld",
+				 (long long) inum);
+	}
+
+	g_array_set_size(lock_touched, 0);
+}
+
+static void lock_promote_iter(void *key, void *value, void *userdata)
+{
+	struct lock_inode *li = value;
+	DB_TXN *txn = userdata;
+
+	/* databases written before the lock table could hold waiters
+	 * that were granted without the record being updated
+	 */
+	if (lock_promote(txn, li, false))
+		HAIL_ERR(&srv_log, "lock promote failed, ino %lld",
+			 (long long) li->inum);
+}
+
+int lock_load(DB_TXN *txn)
+{
+	DB *db = cld_srv.cldb.locks;
+	DBC *cur;
+	DBT key, val;
+	struct raw_lock raw;
+	int rc;
+
+	rc = db->cursor(db, txn, &cur, 0);
+	if (rc) {
+		db->err(db, rc, "lock_load cur");
+		return -1;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+
+	val.data = &raw;
+	val.ulen = sizeof(raw);
+	val.flags = DB_DBT_USERMEM;
+
+	while (1) {
+		rc = cur->get(cur, &key, &val, DB_NEXT);
+		if (rc == DB_NOTFOUND)
+			break;
+		if (rc) {
+			db->err(db, rc, "lock_load get");
+			cur->close(cur);
+			return -1;
+		}
+
+		if (lock_attach_raw(&raw)) {
+			HAIL_ERR(&srv_log, "lock_load alloc");
+			cur->close(cur);
+			return -1;
+		}
+	}
+
+	cur->close(cur);
+
+	htab_foreach(cld_srv.locks, lock_promote_iter, txn);
+
+	HAIL_DEBUG(&srv_log, " loaded locks on %u inodes",
+		   htab_size(cld_srv.locks));
+	return 0;
+}
+
+static void lock_free_iter(void *key, void *value, void *userdata)
+{
+	lock_inode_free(value);
+}
+
+void locks_free(void)
+{
+	htab_foreach(cld_srv.locks, lock_free_iter, NULL);
+
+	if (lock_touched) {
+		g_array_free(lock_touched, TRUE);
+		lock_touched = NULL;
+	}
+}
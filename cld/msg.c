@@ -85,109 +85,37 @@ static void pathname_parse(const char *path, size_t path_len,
 	pinfo->base_len = path_len - ofs;
 }
 
-static int dirent_find(const void *data, size_t data_len,
-		       const char *name, size_t name_len,
-		       int *ofs_out, size_t *ent_len_out)
-{
-	const void *p = data;
-	size_t tmp_len = data_len;
-	size_t str_len, rec_len, pad, total_len;
-	const uint16_t *tmp16;
-	long ofs;
-
-	while (tmp_len > 0) {
-		if (tmp_len < 2)
-			return -2;
-
-		tmp16		= p;
-		str_len		= le16_to_cpu(*tmp16);
-		rec_len		= str_len + 2;
-		pad		= CLD_ALIGN8(rec_len);
-		total_len	= rec_len + pad;
-
-		if (total_len > tmp_len)
-			return -2;
-
-		if ((name_len == str_len) &&
-		    !memcmp(p + 2, name, name_len))
-			break;
-
-		p += total_len;
-		tmp_len -= total_len;
-	}
-
-	if (!tmp_len)
-		return -1;
-
-	ofs = (p - data);
+/* a GET-WAIT parked until its inode passes a version */
+struct get_waiter {
+	uint8_t			sid[CLD_SID_SZ];
+	uint64_t		xid;		/* request being answered */
+	uint64_t		fh;
+	cldino_t		inum;
+	uint64_t		vers;		/* answer above this version */
+	struct cld_timer	timer;
+};
 
-	if (ofs_out)
-		*ofs_out = (int) ofs;
-	if (ent_len_out)
-		*ent_len_out = total_len;
+static GList *get_waiters;
+static GArray *get_wait_touched;	/* inums changed by current txn */
 
-	return 0;
-}
-
-static bool dirdata_delete(void *data, size_t *data_len_io,
-			   const char *name, size_t name_len)
+static void get_wait_touch(cldino_t inum)
 {
-	int rc, ofs = -1;
-	size_t ent_len = 0, new_len;
-	size_t data_len = *data_len_io;
-
-	rc = dirent_find(data, data_len, name, name_len, &ofs, &ent_len);
-	if (rc)
-		return false;
-
-	new_len = data_len - ent_len;
-
-	if ((ofs + ent_len) < data_len)
-		memmove(data + ofs,
-			data + ofs + ent_len,
-			data_len - (ofs + ent_len));
+	unsigned int i;
 
-	*data_len_io = new_len;
-	return true;
-}
-
-static bool dirdata_append(void **data, size_t *data_len,
-			   const char *name, size_t name_len)
-{
-	size_t rec_alloc, new_len, pad, orig_len, rec_len;
-	void *mem, *p;
-	uint16_t *raw_len;
-
-	rec_len		= name_len + 2;
-	pad		= CLD_ALIGN8(rec_len);
-	rec_alloc	= rec_len + pad;
-	orig_len	= *data_len;
-	new_len		= orig_len + rec_alloc;
-
-	mem = realloc(*data, new_len);
-	if (!mem) {
-		HAIL_CRIT(&srv_log, "%s: out of memory for data [%zu]",
-			  __func__, new_len);
-		return false;
-	}
+	if (!get_waiters)
+		return;
 
-	/* store 16-bit string length, little endian */
-	p = mem + orig_len;
-	raw_len = p;
-	*raw_len = cpu_to_le16(name_len);
-	p += sizeof(uint16_t);
+	if (!get_wait_touched)
+		get_wait_touched = g_array_new(FALSE, FALSE, sizeof(cldino_t));
 
-	/* store name, zero pad area (if any) */
-	memcpy(p, name, name_len);
-	if (pad)
-		memset(p + name_len, 0, pad);
+	for (i = 0; i < get_wait_touched->len; i++)
+		if (g_array_index(get_wait_touched, cldino_t, i) == inum)
+			return;
 
-	*data = mem;
-	*data_len = new_len;
-	return true;
+	g_array_append_val(get_wait_touched, inum);
 }
 
-static int inode_notify(DB_TXN *txn, cldino_t inum, bool deleted)
+int inode_notify(DB_TXN *txn, cldino_t inum, uint32_t events)
 {
 	int rc;
 	DB *hand_idx = cld_srv.cldb.handle_idx;
@@ -195,7 +123,7 @@ static int inode_notify(DB_TXN *txn, cldino_t inum, bool deleted)
 	DBT key, val;
 	cldino_t inum_le = cldino_to_le(inum);
 	int gflags;
-	struct session *sess;
+	uint32_t hev;
 	struct raw_handle h;
 
 	memset(&key, 0, sizeof(key));
@@ -216,8 +144,6 @@ static int inode_notify(DB_TXN *txn, cldino_t inum, bool deleted)
 
 	gflags = DB_SET;
 	while (1) {
-		struct cld_msg_event me;
-
 		rc = cur->get(cur, &key, &val, gflags);
 		if (rc) {
 			if (rc != DB_NOTFOUND)
@@ -228,39 +154,31 @@ static int inode_notify(DB_TXN *txn, cldino_t inum, bool deleted)
 
 		gflags = DB_NEXT_DUP;
 
-		if (!deleted && !(le32_to_cpu(h.events) & CE_UPDATED))
-			continue;
-
-		sess = htab_get(cld_srv.sessions, h.sid);
-		if (!sess) {
-			HAIL_WARN(&srv_log, "%s BUG", __func__);
-			continue;
-		}
-
-		if (!sess->sock_fd) {		/* Freshly recovered session */
-			HAIL_DEBUG(&srv_log, "Lost notify sid " SIDFMT
-				   " ino %lld", SIDARG(sess->sid),
-				   (long long) inum);
+		/* deletion is news to every handle; the rest, to those
+		 * which asked for it
+		 */
+		if (events & CE_DELETED)
+			hev = CE_DELETED;
+		else
+			hev = events & le32_to_cpu(h.events);
+		if (!hev)
 			continue;
-		}
 
-		memset(&me, 0, sizeof(me));
-		me.fh = le64_to_cpu(h.fh);
-		me.events = deleted ? CE_DELETED : CE_UPDATED;
-
-		if (!sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_event,
-				  (void *)&me, CMO_EVENT, NULL, NULL))
-			break;
+		/* delivered, coalesced, once the txn commits */
+		sess_event_queue(h.sid, le64_to_cpu(h.fh), hev);
 	}
 
 	rc = cur->close(cur);
 	if (rc)
 		hand_idx->err(hand_idx, rc, "inode_notify cursor close");
 
+	/* GET-WAITs parked on this inode look again after commit */
+	get_wait_touch(inum);
+
 	return 0;
 }
 
-static int inode_touch(DB_TXN *txn, struct raw_inode *ino)
+static int inode_touch(DB_TXN *txn, struct raw_inode *ino, uint32_t events)
 {
 	int rc;
 
@@ -274,131 +192,343 @@ static int inode_touch(DB_TXN *txn, struct raw_inode *ino)
 	if (rc)
 		return rc;
 
-	rc = inode_notify(txn, cldino_from_le(ino->inum), false);
+	rc = inode_notify(txn, cldino_from_le(ino->inum), events);
 	if (rc)
 		return rc;
 
 	return 0;
 }
 
-int inode_lock_rescan(DB_TXN *txn, cldino_t inum)
+/*
+ * Fill in a GET response for an inode, reading its data too unless
+ * only metadata is wanted.  The caller frees resp->data.data_val;
+ * name_buf, which resp->inode_name points to, is CLD_INODE_NAME_MAX+1.
+ */
+static enum cle_err_codes inode_get_resp(DB_TXN *txn,
+					 const struct raw_inode *inode,
+					 bool want_data,
+					 struct cld_msg_get_resp *resp,
+					 char *name_buf)
 {
-	DBC *cur;
-	DB *db_locks = cld_srv.cldb.locks;
-	int rc, gflags, acq = 0;
-	DBT key, val;
-	cldino_t inum_le = cldino_to_le(inum);
-	struct raw_lock lock;
-	uint32_t lflags;
-	struct session *sess;
+	cldino_t inum = cldino_from_le(inode->inum);
+	uint32_t name_len, inode_size;
+	void *data_mem = NULL;
+	size_t data_mem_len;
+	int rc;
 
-	rc = db_locks->cursor(db_locks, txn, &cur, 0);
+	inode_size = le32_to_cpu(inode->size);
+	HAIL_DEBUG(&srv_log, "GET-DEBUG: inode->size %u\n", inode_size);
+
+	/* return response containing inode metadata */
+	memset(resp, 0, sizeof(*resp));
+	resp->msg.code = CLE_OK;
+	resp->inum = le64_to_cpu(inode->inum);
+	resp->vers = le64_to_cpu(inode->version);
+	resp->time_create = le64_to_cpu(inode->time_create);
+	resp->time_modify = le64_to_cpu(inode->time_modify);
+	resp->flags = le32_to_cpu(inode->flags);
+
+	name_len = MIN(le32_to_cpu(inode->ino_len), CLD_INODE_NAME_MAX);
+	memcpy(name_buf, inode + 1, name_len);
+	name_buf[name_len] = 0;
+	resp->inode_name = name_buf;
+
+	resp->data.data_len = 0;
+	resp->data.data_val = NULL;
+
+	if (!want_data)
+		return CLE_OK;
+
+	if (resp->flags & CIFL_DIR) {
+		/* rebuild the packed listing from the dirents index */
+		rc = cldb_dirent_list(txn, inum, NULL, 0, 0, 0,
+				      &data_mem, &data_mem_len, NULL);
+		if (rc || (data_mem_len != inode_size)) {
+			free(data_mem);
+			return CLE_DB_ERR;
+		}
+	} else {
+		rc = cldb_data_get(txn, inum, &data_mem, &data_mem_len,
+				   false, false);
+
+		/* treat not-found as zero length file, as we may
+		 * not yet have created the data record
+		 */
+		if (rc == DB_NOTFOUND)
+			return CLE_OK;
+		if (rc || (data_mem_len != inode_size)) {
+			if (!rc)
+				free(data_mem);
+			return CLE_DB_ERR;
+		}
+	}
+
+	resp->data.data_len = data_mem_len;
+	resp->data.data_val = data_mem;
+	return CLE_OK;
+}
+
+/*
+ * Answer a GET of handle fh, made by message xid.  With 'wait' set, an
+ * inode not yet above version 'vers' is left unanswered: *sent stays
+ * false and *inum_out says which inode to wait on.
+ */
+static enum cle_err_codes get_reply(struct session *sess, uint64_t fh,
+				    uint64_t xid, enum cld_msg_op op,
+				    bool wait, uint64_t vers,
+				    cldino_t *inum_out, bool *sent)
+{
+	struct cld_msg_get_resp resp;
+	struct raw_handle *h = NULL;
+	struct raw_inode *inode = NULL;
+	enum cle_err_codes resp_rc = CLE_OK;
+	cldino_t inum;
+	uint32_t omode;
+	int rc;
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+	char name_buf[CLD_INODE_NAME_MAX + 1];
+
+	*sent = false;
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
 	if (rc) {
-		db_locks->err(db_locks, rc, "db_locks->cursor");
-		return rc;
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		return CLE_DB_ERR;
 	}
 
-	memset(&key, 0, sizeof(key));
-	memset(&val, 0, sizeof(val));
+	/* read handle from db */
+	rc = cldb_handle_get(txn, sess->sid, fh, &h, 0);
+	if (rc) {
+		resp_rc = CLE_FH_INVAL;
+		goto err_out;
+	}
 
-	/* key: inode number */
-	key.data = &inum_le;
-	key.size = sizeof(inum_le);
+	inum = cldino_from_le(h->inum);
+	omode = le32_to_cpu(h->mode);
 
-	val.data = &lock;
-	val.ulen = sizeof(lock);
-	val.flags = DB_DBT_USERMEM;
+	if (!(omode & COM_READ)) {
+		resp_rc = CLE_MODE_INVAL;
+		goto err_out;
+	}
 
-	/* loop through locks associated with this inode, searching
-	 * for pending locks that can be converted into acquired
-	 */
-	gflags = DB_SET | DB_RMW;
-	while (1) {
-		struct cld_msg_event me;
+	/* read inode from db */
+	rc = cldb_inode_get(txn, inum, &inode, false, 0);
+	if (rc) {
+		resp_rc = CLE_INODE_INVAL;
+		goto err_out;
+	}
 
-		rc = cur->get(cur, &key, &val, gflags);
-		if (rc) {
-			/* no locks, or no next-dup */
-			if (rc == DB_NOTFOUND) {
-				rc = 0;
-				break;
-			}
+	/* nothing new yet; the caller parks the request */
+	if (wait && le64_to_cpu(inode->version) <= vers) {
+		*inum_out = inum;
+		goto out;
+	}
 
-			db_locks->err(db_locks, rc, "db_locks->cursor get");
-			break;
-		}
+	resp_rc = inode_get_resp(txn, inode, op != CMO_GET_META, &resp,
+				 name_buf);
+	if (resp_rc != CLE_OK)
+		goto err_out;
 
-		gflags = DB_NEXT_DUP | DB_RMW;
+	resp.msg.xid_in = xid;
+	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_get_resp,
+		     (void *)&resp, op == CMO_GET_WAIT ? CMO_GET_WAIT : CMO_GET,
+		     NULL, NULL);
+	*sent = true;
+	free(resp.data.data_val);
 
-		lflags = le32_to_cpu(lock.flags);
+out:
+	rc = txn->commit(txn, 0);
+	if (rc)
+		dbenv->err(dbenv, rc, "msg_get read-only txn commit");
 
-		/* pending locks should be first in the list; if
-		 * no more pending locks are present, end scan
-		 */
-		if (!(lflags & CLFL_PENDING))
-			break;
+	free(h);
+	free(inode);
+	return CLE_OK;
 
-		/* excl lock follows shared lock; do not acquire; end loop */
-		if (acq && (!(lflags & CLFL_SHARED)))
-			break;
+err_out:
+	rc = txn->abort(txn);
+	if (rc)
+		dbenv->err(dbenv, rc, "msg_get txn abort");
+	free(h);
+	free(inode);
+	return resp_rc;
+}
 
-		/* pending lock found; acquire lock */
-		lflags &= ~CLFL_PENDING;
+void msg_get(struct session *sess, const void *v)
+{
+	const struct cld_msg_get *get = v;
+	enum cle_err_codes resp_rc;
+	cldino_t inum;
+	bool sent;
 
-		/* update current lock rec at cursor */
-		rc = cur->put(cur, NULL, &val, DB_CURRENT);
-		if (rc) {
-			db_locks->err(db_locks, rc, "db_locks->cursor get");
-			break;
-		}
+	resp_rc = get_reply(sess, get->fh, sess->msg_xid, sess->msg_op,
+			    false, 0, &inum, &sent);
+	if (resp_rc != CLE_OK)
+		sess_sendresp_generic(sess, resp_rc);
+}
 
-		acq++;
+static void get_wait_free(struct get_waiter *gw)
+{
+	srv_timer_del(&gw->timer);
+	free(gw);
+}
 
-		sess = htab_get(cld_srv.sessions, lock.sid);
-		if (!sess) {
-			HAIL_WARN(&srv_log, "%s BUG", __func__);
-			break;
-		}
+/*
+ * Answer a parked GET-WAIT, unless its inode is still not new enough
+ * and time remains.  Returns true if the waiter is done with.
+ */
+static bool get_wait_retry(struct get_waiter *gw, bool timed_out)
+{
+	struct cld_msg_generic_resp resp;
+	struct session *sess;
+	enum cle_err_codes resp_rc;
+	cldino_t inum;
+	bool sent;
 
-		/*
-		 * send lock acquisition notification to new lock holder
-		 */
+	sess = sess_lookup(gw->sid);
+	if (!sess || sess->dead)
+		return true;
+
+	resp_rc = get_reply(sess, gw->fh, gw->xid, CMO_GET_WAIT,
+			    !timed_out, gw->vers, &inum, &sent);
+	if (resp_rc == CLE_OK)
+		return sent;
+
+	resp.code = resp_rc;
+	resp.xid_in = gw->xid;
+	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_generic_resp,
+		     (void *)&resp, CMO_GET_WAIT, NULL, NULL);
+	return true;
+}
+
+static void get_wait_timeout(struct cld_timer *timer)
+{
+	struct get_waiter *gw = timer->userdata;
+
+	get_wait_retry(gw, true);
+
+	get_waiters = g_list_remove(get_waiters, gw);
+	get_wait_free(gw);
+}
+
+void msg_get_wait(struct session *sess, const void *v)
+{
+	const struct cld_msg_get_wait *gwm = v;
+	struct get_waiter *gw;
+	enum cle_err_codes resp_rc;
+	cldino_t inum;
+	GList *tmp;
+	bool sent;
+
+	/* a retransmission of a request we already hold */
+	for (tmp = get_waiters; tmp; tmp = tmp->next) {
+		gw = tmp->data;
+		if (gw->xid == sess->msg_xid &&
+		    !memcmp(gw->sid, sess->sid, CLD_SID_SZ))
+			return;
+	}
+
+	resp_rc = get_reply(sess, gwm->fh, sess->msg_xid, CMO_GET_WAIT,
+			    gwm->timeout > 0, gwm->vers, &inum, &sent);
+	if (resp_rc != CLE_OK) {
+		sess_sendresp_generic(sess, resp_rc);
+		return;
+	}
+	if (sent)
+		return;
+
+	gw = calloc(1, sizeof(*gw));
+	if (!gw) {
+		sess_sendresp_generic(sess, CLE_OOM);
+		return;
+	}
+
+	memcpy(gw->sid, sess->sid, CLD_SID_SZ);
+	gw->xid = sess->msg_xid;
+	gw->fh = gwm->fh;
+	gw->inum = inum;
+	gw->vers = gwm->vers;
+	cld_timer_init(&gw->timer, "get-wait", get_wait_timeout, gw);
+	srv_timer_add(&gw->timer, MIN(gwm->timeout, CLD_GET_WAIT_MAX) * 1000);
+
+	get_waiters = g_list_prepend(get_waiters, gw);
+	cld_srv.stats.get_wait++;
+}
+
+void get_wait_txn_commit(void)
+{
+	GList *tmp, *tmp1;
+	unsigned int i;
+
+	if (!get_wait_touched || !get_wait_touched->len)
+		return;
+
+	tmp = get_waiters;
+	while (tmp) {
+		struct get_waiter *gw = tmp->data;
 
-		if (!sess->sock_fd) {		/* Freshly recovered session */
-			HAIL_DEBUG(&srv_log, "Lost success sid " SIDFMT
-				   " ino %lld", SIDARG(sess->sid),
-				   (long long) inum);
+		tmp1 = tmp;
+		tmp = tmp->next;
+
+		for (i = 0; i < get_wait_touched->len; i++)
+			if (g_array_index(get_wait_touched, cldino_t, i) ==
+			    gw->inum)
+				break;
+		if (i == get_wait_touched->len)
 			continue;
+
+		if (get_wait_retry(gw, false)) {
+			get_waiters = g_list_delete_link(get_waiters, tmp1);
+			get_wait_free(gw);
 		}
+	}
 
-		memset(&me, 0, sizeof(me));
-		me.fh = le64_to_cpu(lock.fh);
-		me.events = CE_LOCKED;
+	g_array_set_size(get_wait_touched, 0);
+}
 
-		if (!sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_event,
-				(void *)&me, CMO_EVENT, NULL, NULL))
-			break;
-	}
+void get_wait_txn_abort(void)
+{
+	if (get_wait_touched)
+		g_array_set_size(get_wait_touched, 0);
+}
+
+void get_waiters_free(void)
+{
+	GList *tmp;
+
+	for (tmp = get_waiters; tmp; tmp = tmp->next)
+		get_wait_free(tmp->data);
+	g_list_free(get_waiters);
+	get_waiters = NULL;
 
-	cur->close(cur);
-	return rc;
+	if (get_wait_touched) {
+		g_array_free(get_wait_touched, TRUE);
+		get_wait_touched = NULL;
+	}
 }
 
-void msg_get(struct session *sess, const void *v)
+void msg_readdir(struct session *sess, const void *v)
 {
-	const struct cld_msg_get *get = v;
-	struct cld_msg_get_resp resp;
+	const struct cld_msg_readdir *rd = v;
+	struct cld_msg_readdir_resp resp;
 	struct raw_handle *h = NULL;
 	struct raw_inode *inode = NULL;
 	enum cle_err_codes resp_rc = CLE_OK;
 	cldino_t inum;
-	uint32_t name_len, inode_size;
 	uint32_t omode;
+	size_t after_len, data_len;
+	void *data = NULL;
+	bool eof;
 	int rc;
 	DB_ENV *dbenv = cld_srv.cldb.env;
 	DB_TXN *txn;
-	void *data_mem;
-	char *inode_name;
+
+	after_len = rd->after ? strlen(rd->after) : 0;
+	if (rd->max_ents < 0 || after_len > CLD_INODE_NAME_MAX) {
+		resp_rc = CLE_NAME_INVAL;
+		goto err_out_noabort;
+	}
 
 	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
 	if (rc) {
@@ -408,7 +538,7 @@ void msg_get(struct session *sess, const void *v)
 	}
 
 	/* read handle from db */
-	rc = cldb_handle_get(txn, sess->sid, get->fh, &h, 0);
+	rc = cldb_handle_get(txn, sess->sid, rd->fh, &h, 0);
 	if (rc) {
 		resp_rc = CLE_FH_INVAL;
 		goto err_out;
@@ -417,7 +547,7 @@ void msg_get(struct session *sess, const void *v)
 	inum = cldino_from_le(h->inum);
 	omode = le32_to_cpu(h->mode);
 
-	if (!(omode & COM_READ)) {
+	if (!(omode & COM_READ) || !(omode & COM_DIRECTORY)) {
 		resp_rc = CLE_MODE_INVAL;
 		goto err_out;
 	}
@@ -429,60 +559,30 @@ void msg_get(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	inode_size = le32_to_cpu(inode->size);
-	HAIL_DEBUG(&srv_log, "GET-DEBUG: inode->size %u\n", inode_size);
+	/* one page: as many names as asked for, and as fit in a reply */
+	rc = cldb_dirent_list(txn, inum, rd->after, after_len,
+			      rd->max_ents, CLD_MAX_PAYLOAD_SZ,
+			      &data, &data_len, &eof);
+	if (rc) {
+		resp_rc = CLE_DB_ERR;
+		goto err_out;
+	}
 
-	/* return response containing inode metadata */
 	memset(&resp, 0, sizeof(resp));
 	resp.msg.code = CLE_OK;
 	resp.msg.xid_in = sess->msg_xid;
-	resp.inum = le64_to_cpu(inode->inum);
 	resp.vers = le64_to_cpu(inode->version);
-	resp.time_create = le64_to_cpu(inode->time_create);
-	resp.time_modify = le64_to_cpu(inode->time_modify);
-	resp.flags = le32_to_cpu(inode->flags);
+	resp.eof = eof;
+	resp.data.data_len = data_len;
+	resp.data.data_val = data;
 
-	name_len = le32_to_cpu(inode->ino_len);
-	inode_name = alloca(name_len + 1);
-	memcpy (inode_name, inode + 1, name_len);
-	inode_name[name_len] = 0;
-	resp.inode_name = inode_name;
-
-	resp.data.data_len = 0;
-	resp.data.data_val = NULL;
-
-	/* send data, if requested */
-	data_mem = NULL;
-	if (sess->msg_op == CMO_GET) {
-		size_t data_mem_len;
-
-		rc = cldb_data_get(txn, inum, &data_mem, &data_mem_len,
-				   false, false);
-
-		/* treat not-found as zero length file, as we may
-		 * not yet have created the data record
-		 */
-		if (rc != DB_NOTFOUND) {
-			if (rc || (data_mem_len != inode_size)) {
-				if (!rc)
-					free(data_mem);
-				resp_rc = CLE_DB_ERR;
-				goto err_out;
-			} else {
-				resp.data.data_len = data_mem_len;
-				resp.data.data_val = data_mem;
-			}
-		}
-	}
-
-	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_get_resp,
-		     (void *)&resp, CMO_GET, NULL, NULL);
-	if (data_mem)
-		free(data_mem);
+	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_readdir_resp,
+		     (void *)&resp, CMO_READDIR, NULL, NULL);
+	free(data);
 
 	rc = txn->commit(txn, 0);
 	if (rc)
-		dbenv->err(dbenv, rc, "msg_get read-only txn commit");
+		dbenv->err(dbenv, rc, "msg_readdir read-only txn commit");
 
 	free(h);
 	free(inode);
@@ -491,63 +591,52 @@ void msg_get(struct session *sess, const void *v)
 err_out:
 	rc = txn->abort(txn);
 	if (rc)
-		dbenv->err(dbenv, rc, "msg_get txn abort");
+		dbenv->err(dbenv, rc, "msg_readdir txn abort");
 err_out_noabort:
 	sess_sendresp_generic(sess, resp_rc);
 	free(h);
 	free(inode);
 }
 
-void msg_open(struct session *sess, const void *v)
+/*
+ * Find the inode an OPEN names, creating it and linking it into its
+ * parent directory if the mode asks.  A new inode is not yet written;
+ * the caller does that with inode_touch.  The caller frees *inode_out.
+ */
+static enum cle_err_codes inode_open(DB_TXN *txn, const char *name,
+				     uint32_t mode,
+				     struct raw_inode **inode_out,
+				     bool *created)
 {
-	const struct cld_msg_open *open = v;
-	struct cld_msg_open_resp resp;
-	const char *name;
-	struct raw_session *raw_sess = NULL;
 	struct raw_inode *inode = NULL, *parent = NULL;
-	struct raw_handle *h = NULL;
-	int rc, name_len;
-	bool create, excl, do_dir;
 	struct pathname_info pinfo;
-	void *parent_data = NULL;
-	size_t parent_len;
-	uint64_t fh;
-	cldino_t inum;
-	enum cle_err_codes resp_rc = CLE_OK;
-	DB_ENV *dbenv = cld_srv.cldb.env;
-	DB_TXN *txn;
-
-	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
-	if (rc) {
-		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
-		resp_rc = CLE_DB_ERR;
-		goto err_out_noabort;
-	}
+	enum cle_err_codes resp_rc;
+	bool create, excl, do_dir;
+	int rc, name_len;
 
-	name = open->inode_name;
 	name_len = strlen(name);
 
-	create = open->mode & COM_CREATE;
-	excl = open->mode & COM_EXCL;
-	do_dir = open->mode & COM_DIRECTORY;
+	create = mode & COM_CREATE;
+	excl = mode & COM_EXCL;
+	do_dir = mode & COM_DIRECTORY;
 
-	if (!valid_inode_name(name, name_len) || (create && name_len < 2)) {
-		resp_rc = CLE_NAME_INVAL;
-		goto err_out;
-	}
+	if (!valid_inode_name(name, name_len) || (create && name_len < 2))
+		return CLE_NAME_INVAL;
+
+	/* a replica hands out no handle which could change anything */
+	if (cld_srv.cldb.replica &&
+	    (mode & (COM_WRITE | COM_LOCK | COM_ACL | COM_CREATE | COM_EXCL)))
+		return CLE_READ_ONLY;
 
 	pathname_parse(name, name_len, &pinfo);
 
 	/* read inode from db, if it exists */
-	rc = cldb_inode_get_byname(txn, name, name_len, &inode, false, DB_RMW);
-	if (rc && (rc != DB_NOTFOUND)) {
-		resp_rc = CLE_DB_ERR;
-		goto err_out;
-	}
-	if (!create && (rc == DB_NOTFOUND)) {
-		resp_rc = CLE_NAME_INVAL;
-		goto err_out;
-	}
+	rc = cldb_inode_get_byname(txn, name, name_len, &inode, false,
+				   cld_srv.cldb.replica ? 0 : DB_RMW);
+	if (rc && (rc != DB_NOTFOUND))
+		return CLE_DB_ERR;
+	if (!create && (rc == DB_NOTFOUND))
+		return CLE_NAME_INVAL;
 	if (create && rc == 0) {
 		if (excl) {
 			resp_rc = CLE_INODE_EXISTS;
@@ -573,8 +662,7 @@ void msg_open(struct session *sess, const void *v)
 		inode = cldb_inode_new(txn, name, name_len, 0);
 		if (!inode) {
 			HAIL_CRIT(&srv_log, "cannot allocate new inode");
-			resp_rc = CLE_OOM;
-			goto err_out;
+			return CLE_OOM;
 		}
 
 		if (do_dir)
@@ -589,41 +677,112 @@ void msg_open(struct session *sess, const void *v)
 			goto err_out;
 		}
 
-		/* read parent inode data, if any */
-		rc = cldb_data_get(txn, cldino_from_le(parent->inum),
-				   &parent_data, &parent_len, false, true);
-		if (rc == DB_NOTFOUND) {
-			parent_data = NULL;
-			parent_len = 0;
-		} else if (rc) {
+		/* link new child inode into parent directory */
+		rc = cldb_dirent_put(txn, cldino_from_le(parent->inum),
+				     pinfo.base, pinfo.base_len,
+				     cldino_from_le(inode->inum));
+		if (rc) {
 			resp_rc = CLE_DB_ERR;
 			goto err_out;
 		}
 
-		/* append new record to inode's directory data */
-		if (!dirdata_append(&parent_data, &parent_len,
-				    pinfo.base, pinfo.base_len)) {
-			resp_rc = CLE_OOM;
-			goto err_out;
-		}
+		parent->size = cpu_to_le32(le32_to_cpu(parent->size) +
+					   cldb_dirent_size(pinfo.base_len));
 
-		/* write parent inode's updated directory data */
-		rc = cldb_data_put(txn, cldino_from_le(parent->inum),
-				   parent_data, parent_len, 0);
+		rc = inode_touch(txn, parent, CE_UPDATED | CE_CHILD);
 		if (rc) {
 			resp_rc = CLE_DB_ERR;
 			goto err_out;
 		}
 
-		parent->size = cpu_to_le32(parent_len);
+		free(parent);
+	}
 
-		rc = inode_touch(txn, parent);
-		if (rc) {
-			resp_rc = CLE_DB_ERR;
-			goto err_out;
-		}
+	*inode_out = inode;
+	*created = create;
+	return CLE_OK;
+
+err_out:
+	free(parent);
+	free(inode);
+	return resp_rc;
+}
+
+/*
+ * Replace a file's contents, optionally only if it is still at the
+ * version the writer last saw.
+ */
+static enum cle_err_codes inode_write(DB_TXN *txn, struct raw_inode *inode,
+				      bool check_vers, uint64_t vers,
+				      const void *data, size_t data_len)
+{
+	int rc;
+
+	if (check_vers && le64_to_cpu(inode->version) != vers)
+		return CLE_VERS_MISMATCH;
+
+	/* store contig. data area in db */
+	rc = cldb_data_put(txn, cldino_from_le(inode->inum),
+			   data, data_len, 0);
+	if (rc)
+		return CLE_DB_ERR;
+
+	inode->size = cpu_to_le32(data_len);
+
+	/* update inode */
+	rc = inode_touch(txn, inode, CE_UPDATED);
+	if (rc)
+		return CLE_DB_ERR;
+
+	return CLE_OK;
+}
+
+static void put_sendresp(struct session *sess, enum cle_err_codes code,
+			 uint64_t vers)
+{
+	struct cld_msg_put_resp resp;
+
+	/* plain PUT, and errors other than a lost race, are generic */
+	if (sess->msg_op == CMO_PUT ||
+	    (code != CLE_OK && code != CLE_VERS_MISMATCH)) {
+		sess_sendresp_generic(sess, code);
+		return;
+	}
+
+	resp.msg.code = code;
+	resp.msg.xid_in = sess->msg_xid;
+	resp.vers = vers;
+	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_put_resp,
+		     (void *)&resp, sess->msg_op, NULL, NULL);
+}
+
+void msg_open(struct session *sess, const void *v)
+{
+	const struct cld_msg_open *open = v;
+	struct cld_msg_open_resp resp;
+	struct raw_session *raw_sess = NULL;
+	struct raw_inode *inode = NULL;
+	struct raw_handle *h = NULL;
+	int rc;
+	bool create;
+	uint64_t fh;
+	cldino_t inum;
+	enum cle_err_codes resp_rc = CLE_OK;
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		resp_rc = CLE_DB_ERR;
+		goto err_out_noabort;
 	}
 
+	resp_rc = inode_open(txn, open->inode_name, open->mode,
+			     &inode, &create);
+	if (resp_rc != CLE_OK)
+		goto err_out;
+
 	inum = cldino_from_le(inode->inum);
 
 	/* alloc & init new handle; updates session's next_fh */
@@ -645,7 +804,7 @@ void msg_open(struct session *sess, const void *v)
 
 	if (create) {
 		/* write inode */
-		rc = inode_touch(txn, inode);
+		rc = inode_touch(txn, inode, CE_UPDATED);
 
 		if (rc) {
 			resp_rc = CLE_DB_ERR;
@@ -669,15 +828,13 @@ void msg_open(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "msg_open txn commit");
 		resp_rc = CLE_DB_ERR;
 		goto err_out_noabort;
 	}
 
-	free(parent_data);
-	free(parent);
 	free(inode);
 	free(raw_sess);
 	free(h);
@@ -691,24 +848,152 @@ void msg_open(struct session *sess, const void *v)
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_open txn abort");
 err_out_noabort:
 	sess_sendresp_generic(sess, resp_rc);
-	free(parent_data);
-	free(parent);
 	free(inode);
 	free(raw_sess);
 	free(h);
 }
 
-void msg_put(struct session *sess, const void *v)
+/*
+ * OPEN, GET and CLOSE in one transaction.  No handle is made, so the
+ * session record is left alone.
+ */
+void msg_open_get(struct session *sess, const void *v)
+{
+	const struct cld_msg_open_get *og = v;
+	struct cld_msg_get_resp resp;
+	struct raw_inode *inode = NULL;
+	enum cle_err_codes resp_rc = CLE_OK;
+	char name_buf[CLD_INODE_NAME_MAX + 1];
+	bool create;
+	int rc;
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+
+	memset(&resp, 0, sizeof(resp));
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		resp_rc = CLE_DB_ERR;
+		goto err_out_noabort;
+	}
+
+	resp_rc = inode_open(txn, og->inode_name, og->mode, &inode, &create);
+	if (resp_rc != CLE_OK)
+		goto err_out;
+
+	if (create) {
+		rc = inode_touch(txn, inode, CE_UPDATED);
+		if (rc) {
+			resp_rc = CLE_DB_ERR;
+			goto err_out;
+		}
+	}
+
+	resp_rc = inode_get_resp(txn, inode, true, &resp, name_buf);
+	if (resp_rc != CLE_OK)
+		goto err_out;
+
+	/* only a create needs to reach the log */
+	if (create)
+		rc = sess_txn_commit(txn);
+	else
+		rc = txn->commit(txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "msg_open_get txn commit");
+		resp_rc = CLE_DB_ERR;
+		goto err_out_noabort;
+	}
+
+	resp.msg.xid_in = sess->msg_xid;
+	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_get_resp,
+		     (void *)&resp, CMO_OPEN_GET, NULL, NULL);
+
+	free(resp.data.data_val);
+	free(inode);
+	return;
+
+err_out:
+	rc = sess_txn_abort(txn);
+	if (rc)
+		dbenv->err(dbenv, rc, "msg_open_get txn abort");
+err_out_noabort:
+	sess_sendresp_generic(sess, resp_rc);
+	free(resp.data.data_val);
+	free(inode);
+}
+
+/*
+ * OPEN, PUT and CLOSE in one transaction, optionally conditional on
+ * the file's version.
+ */
+void msg_open_put(struct session *sess, const void *v)
+{
+	const struct cld_msg_open_put *op = v;
+	struct raw_inode *inode = NULL;
+	enum cle_err_codes resp_rc = CLE_OK;
+	uint64_t vers = 0;
+	bool create;
+	int rc;
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+
+	if (op->mode & COM_DIRECTORY) {
+		resp_rc = CLE_MODE_INVAL;
+		goto err_out_noabort;
+	}
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		resp_rc = CLE_DB_ERR;
+		goto err_out_noabort;
+	}
+
+	resp_rc = inode_open(txn, op->inode_name, op->mode, &inode, &create);
+	if (resp_rc != CLE_OK)
+		goto err_out;
+
+	/* a writer which lost the race is told the version it lost to */
+	vers = le64_to_cpu(inode->version);
+	resp_rc = inode_write(txn, inode, op->check_vers, op->vers,
+			      op->data.data_val, op->data.data_len);
+	if (resp_rc != CLE_OK)
+		goto err_out;
+	vers = le64_to_cpu(inode->version);
+
+	rc = sess_txn_commit(txn);
+	if (rc) {
+		dbenv->err(dbenv, rc, "msg_open_put txn commit");
+		resp_rc = CLE_DB_ERR;
+		goto err_out_noabort;
+	}
+
+	put_sendresp(sess, CLE_OK, vers);
+	free(inode);
+	return;
+
+err_out:
+	rc = sess_txn_abort(txn);
+	if (rc)
+		dbenv->err(dbenv, rc, "msg_open_put txn abort");
+err_out_noabort:
+	put_sendresp(sess, resp_rc, vers);
+	free(inode);
+}
+
+static void put_common(struct session *sess, uint64_t fh, bool check_vers,
+		       uint64_t vers, const void *data, size_t data_len)
 {
-	const struct cld_msg_put *put = v;
 	struct raw_handle *h = NULL;
 	struct raw_inode *inode = NULL;
 	enum cle_err_codes resp_rc = CLE_OK;
+	uint64_t cur_vers = 0;
 	int rc;
 	cldino_t inum;
 	uint32_t omode;
@@ -723,7 +1008,7 @@ void msg_put(struct session *sess, const void *v)
 	}
 
 	/* read handle from db */
-	rc = cldb_handle_get(txn, sess->sid, put->fh, &h, 0);
+	rc = cldb_handle_get(txn, sess->sid, fh, &h, 0);
 	if (rc) {
 		resp_rc = CLE_FH_INVAL;
 		goto err_out;
@@ -745,47 +1030,52 @@ void msg_put(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	/* store contig. data area in db */
-	rc = cldb_data_put(txn, inum,
-			   put->data.data_val, put->data.data_len, 0);
-	if (rc) {
-		resp_rc = CLE_DB_ERR;
+	cur_vers = le64_to_cpu(inode->version);
+	resp_rc = inode_write(txn, inode, check_vers, vers, data, data_len);
+	if (resp_rc != CLE_OK)
 		goto err_out;
-	}
-
-	inode->size = cpu_to_le32(put->data.data_len);
+	cur_vers = le64_to_cpu(inode->version);
 
-	/* update inode */
-	rc = inode_touch(txn, inode);
-	if (rc) {
-		resp_rc = CLE_DB_ERR;
-		goto err_out;
-	}
-
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "try_commit_data txn commit");
 		resp_rc = CLE_DB_ERR;
 		goto err_out_noabort;
 	}
 
-	sess_sendresp_generic(sess, CLE_OK);
+	put_sendresp(sess, CLE_OK, cur_vers);
 
 	free(h);
 	free(inode);
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_put txn abort");
 err_out_noabort:
-	sess_sendresp_generic(sess, resp_rc);
+	put_sendresp(sess, resp_rc, cur_vers);
 
 	free(h);
 	free(inode);
 }
 
+void msg_put(struct session *sess, const void *v)
+{
+	const struct cld_msg_put *put = v;
+
+	put_common(sess, put->fh, false, 0,
+		   put->data.data_val, put->data.data_len);
+}
+
+void msg_put_if(struct session *sess, const void *v)
+{
+	const struct cld_msg_put_if *put = v;
+
+	put_common(sess, put->fh, true, put->vers,
+		   put->data.data_val, put->data.data_len);
+}
+
 void msg_close(struct session *sess, const void *v)
 {
 	const struct cld_msg_close *close_msg = v;
@@ -793,7 +1083,6 @@ void msg_close(struct session *sess, const void *v)
 	enum cle_err_codes resp_rc = CLE_OK;
 	struct raw_handle *h = NULL;
 	cldino_t lock_inum = 0;
-	bool waiter = false;
 	DB_ENV *dbenv = cld_srv.cldb.env;
 	DB_TXN *txn;
 
@@ -824,24 +1113,16 @@ void msg_close(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	/* remove locks, if any */
-	rc = session_remove_locks(txn, sess->sid,
-				  close_msg->fh, lock_inum, &waiter);
-	if (rc) {
-		resp_rc = CLE_DB_ERR;
-		goto err_out;
-	}
-
-	/* rescan lock_inum if 'waiter', possibly acquiring locks */
-	if (waiter) {
-		rc = inode_lock_rescan(txn, lock_inum);
-		if (rc) {
+	/* remove locks, if any, granting any waiters they blocked */
+	if (lock_inum) {
+		rc = lock_remove(txn, sess->sid, close_msg->fh, lock_inum);
+		if (rc && rc != DB_NOTFOUND) {
 			resp_rc = CLE_DB_ERR;
 			goto err_out;
 		}
 	}
 
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "msg_close txn commit");
 		resp_rc = CLE_DB_ERR;
@@ -853,7 +1134,7 @@ void msg_close(struct session *sess, const void *v)
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_close txn abort");
 err_out_noabort:
@@ -868,8 +1149,6 @@ void msg_del(struct session *sess, const void *v)
 	int rc, name_len;
 	struct pathname_info pinfo;
 	struct raw_inode *parent = NULL, *ino = NULL;
-	void *parent_data = NULL;
-	size_t parent_len;
 	cldino_t del_inum;
 	DB *inodes = cld_srv.cldb.inodes;
 	DB *db_data = cld_srv.cldb.data;
@@ -901,14 +1180,6 @@ void msg_del(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	/* read parent inode data */
-	rc = cldb_data_get(txn, cldino_from_le(parent->inum),
-			   &parent_data, &parent_len, true, true);
-	if (rc) {
-		resp_rc = CLE_DB_ERR;
-		goto err_out;
-	}
-
 	/* read inode to be deleted */
 	rc = cldb_inode_get_byname(txn, del->inode_name, name_len,
 				   &ino, false, 0);
@@ -922,25 +1193,14 @@ void msg_del(struct session *sess, const void *v)
 
 	/* prevent deletion of non-empty dirs */
 	if (le32_to_cpu(ino->flags) & CIFL_DIR) {
-		DBT val;
-
-		memset(&key, 0, sizeof(key));
-		memset(&val, 0, sizeof(val));
+		bool empty;
 
-		/* key: inode number */
-		key.data = &ino->inum;
-		key.size = sizeof(ino->inum);
-
-		val.flags = DB_DBT_MALLOC;
-
-		rc = db_data->get(db_data, txn, &key, &val, 0);
-		free(val.data);
-		if (rc && (rc != DB_NOTFOUND)) {
-			db_data->err(db_data, rc, "db_data->get for rmdir");
+		rc = cldb_dirent_empty(txn, cldino_from_le(ino->inum), &empty);
+		if (rc) {
 			resp_rc = CLE_DB_ERR;
 			goto err_out;
 		}
-		if (rc == 0 && val.size > 0) {
+		if (!empty) {
 			resp_rc = CLE_DIR_NOTEMPTY;
 			goto err_out;
 		}
@@ -949,7 +1209,7 @@ void msg_del(struct session *sess, const void *v)
 	del_inum = cldino_from_le(ino->inum);
 
 	/* notify interested parties of impending deletion */
-	rc = inode_notify(txn, del_inum, true);
+	rc = inode_notify(txn, del_inum, CE_DELETED);
 	if (rc) {
 		resp_rc = CLE_DB_ERR;
 		goto err_out;
@@ -961,6 +1221,7 @@ void msg_del(struct session *sess, const void *v)
 	key.size = sizeof(ino->inum);
 
 	/* delete inode */
+	icache_touch(del_inum);
 	rc = inodes->del(inodes, txn, &key, 0);
 	if (rc) {
 		if (rc == DB_NOTFOUND)
@@ -988,32 +1249,27 @@ void msg_del(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	/* remove record from inode's directory data */
-	if (!dirdata_delete(parent_data, &parent_len,
-			    pinfo.base, pinfo.base_len)) {
-		HAIL_WARN(&srv_log, "dirent del failed");
-		resp_rc = CLE_DB_ERR;
-		goto err_out;
-	}
-
-	/* write parent inode's updated directory data */
-	rc = cldb_data_put(txn, cldino_from_le(parent->inum),
-			   parent_data, parent_len, 0);
+	/* unlink from parent directory */
+	rc = cldb_dirent_del(txn, cldino_from_le(parent->inum),
+			     pinfo.base, pinfo.base_len);
 	if (rc) {
+		if (rc == DB_NOTFOUND)
+			HAIL_WARN(&srv_log, "dirent del failed");
 		resp_rc = CLE_DB_ERR;
 		goto err_out;
 	}
 
-	parent->size = cpu_to_le32(parent_len);
+	parent->size = cpu_to_le32(le32_to_cpu(parent->size) -
+				   cldb_dirent_size(pinfo.base_len));
 
 	/* update parent dir inode */
-	rc = inode_touch(txn, parent);
+	rc = inode_touch(txn, parent, CE_UPDATED | CE_CHILD);
 	if (rc) {
 		resp_rc = CLE_DB_ERR;
 		goto err_out;
 	}
 
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "msg_del txn commit");
 		resp_rc = CLE_DB_ERR;
@@ -1023,18 +1279,16 @@ void msg_del(struct session *sess, const void *v)
 	sess_sendresp_generic(sess, CLE_OK);
 	free(ino);
 	free(parent);
-	free(parent_data);
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_del txn abort");
 err_out_noabort:
 	sess_sendresp_generic(sess, resp_rc);
 	free(ino);
 	free(parent);
-	free(parent_data);
 }
 
 void msg_unlock(struct session *sess, const void *v)
@@ -1070,14 +1324,17 @@ void msg_unlock(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	/* attempt to given lock on filehandle */
-	rc = cldb_lock_del(txn, sess->sid, unlock->fh, inum);
+	/* release lock on filehandle, granting any waiters it blocked */
+	rc = lock_remove(txn, sess->sid, unlock->fh, inum);
 	if (rc) {
-		resp_rc = CLE_LOCK_INVAL;
+		if (rc == DB_NOTFOUND)
+			resp_rc = CLE_LOCK_INVAL;
+		else
+			resp_rc = CLE_DB_ERR;
 		goto err_out;
 	}
 
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "msg_unlock txn commit");
 		resp_rc = CLE_DB_ERR;
@@ -1089,7 +1346,7 @@ void msg_unlock(struct session *sess, const void *v)
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_unlock txn abort");
 err_out_noabort:
@@ -1133,8 +1390,8 @@ void msg_lock(struct session *sess, const void *v)
 	}
 
 	/* attempt to add lock */
-	rc = cldb_lock_add(txn, sess->sid, lock->fh, inum,
-			   lock->flags & CLF_SHARED, wait, &acquired);
+	rc = lock_add(txn, sess->sid, lock->fh, inum,
+		      lock->flags & CLF_SHARED, wait, &acquired);
 	if (rc) {
 		if (rc == DB_KEYEXIST)
 			resp_rc = CLE_LOCK_CONFLICT;
@@ -1143,7 +1400,7 @@ void msg_lock(struct session *sess, const void *v)
 		goto err_out;
 	}
 
-	rc = txn->commit(txn, 0);
+	rc = sess_txn_commit(txn);
 	if (rc) {
 		dbenv->err(dbenv, rc, "msg_lock txn commit");
 		resp_rc = CLE_DB_ERR;
@@ -1162,7 +1419,7 @@ void msg_lock(struct session *sess, const void *v)
 	return;
 
 err_out:
-	rc = txn->abort(txn);
+	rc = sess_txn_abort(txn);
 	if (rc)
 		dbenv->err(dbenv, rc, "msg_lock txn abort");
 err_out_noabort:
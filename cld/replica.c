@@ -0,0 +1,307 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Read-only replica: db4 applies the master's log underneath us, and
+ * we serve GET, GET-META, READDIR and GET-WAIT from it, and watches.
+ *
+ * Replicated writes pass by msg.c, so nobody calls inode_notify for
+ * them.  Instead, whenever the log has moved we look at the inodes our
+ * handles are open on, and any whose version changed since we last
+ * looked is news to its watchers.  The same pass drops the inode cache.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <glib.h>
+#include <cld-private.h>
+#include "cld.h"
+
+struct replica_seen {
+	cldino_t		inum;		/* key; lock_hash reads it */
+	uint64_t		vers;		/* inode version last seen */
+	bool			gone;		/* inode deleted */
+	bool			live;		/* a handle is still open */
+};
+
+static struct htab *replica_seen;	/* inum -> replica_seen */
+static DB_LSN replica_lsn;		/* end of log at last look */
+
+bool replica_op_ok(enum cld_msg_op op)
+{
+	switch (op) {
+	case CMO_NOP:
+	case CMO_RECONNECT:
+	case CMO_NEW_SESS:
+	case CMO_END_SESS:
+	case CMO_ACK:
+	case CMO_ACK_FRAG:
+	case CMO_OPEN:		/* read-only modes; see inode_open */
+	case CMO_OPEN_GET:
+	case CMO_GET_META:
+	case CMO_GET:
+	case CMO_GET_WAIT:
+	case CMO_READDIR:
+	case CMO_CLOSE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool replica_log_moved(void)
+{
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_LOG_STAT *st;
+	bool moved;
+	int rc;
+
+	rc = dbenv->log_stat(dbenv, &st, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "dbenv->log_stat");
+		return true;
+	}
+
+	moved = st->st_cur_file != replica_lsn.file ||
+		st->st_cur_offset != replica_lsn.offset;
+	replica_lsn.file = st->st_cur_file;
+	replica_lsn.offset = st->st_cur_offset;
+
+	free(st);
+	return moved;
+}
+
+static void replica_seen_free(void *key, void *val, void *userdata)
+{
+	free(val);
+}
+
+static void replica_seen_reset(void *key, void *val, void *userdata)
+{
+	struct replica_seen *rs = val;
+	GList **dead = userdata;
+
+	if (!rs->live)
+		*dead = g_list_prepend(*dead, rs);
+	rs->live = false;
+}
+
+/*
+ * Compare one watched inode with what we saw last time, and tell its
+ * handles if it moved on.  A replica sees versions change, not why, so
+ * a directory's watchers hear of a child change too.
+ */
+static int replica_check(DB_TXN *txn, cldino_t inum)
+{
+	struct replica_seen *rs;
+	struct raw_inode *inode;
+	uint64_t vers = 0;
+	uint32_t events;
+	bool gone;
+	int rc;
+
+	rc = cldb_inode_get(txn, inum, &inode, false, 0);
+	if (rc && rc != DB_NOTFOUND)
+		return rc;
+
+	gone = (rc == DB_NOTFOUND);
+	events = CE_UPDATED;
+	if (!gone) {
+		vers = le64_to_cpu(inode->version);
+		if (le32_to_cpu(inode->flags) & CIFL_DIR)
+			events |= CE_CHILD;
+		free(inode);
+	}
+
+	rs = htab_get(replica_seen, &inum);
+	if (!rs) {
+		/* opened since the last look; nothing to compare */
+		rs = calloc(1, sizeof(*rs));
+		if (!rs)
+			return -ENOMEM;
+		rs->inum = inum;
+		rs->vers = vers;
+		rs->gone = gone;
+		rs->live = true;
+		htab_put(replica_seen, &rs->inum, rs);
+		return 0;
+	}
+
+	rs->live = true;
+	if (rs->vers == vers && rs->gone == gone)
+		return 0;
+
+	rs->vers = vers;
+	if (gone && !rs->gone)
+		events = CE_DELETED;
+	rs->gone = gone;
+
+	return inode_notify(txn, inum, events);
+}
+
+static int replica_scan(DB_TXN *txn)
+{
+	DB *hand_idx = cld_srv.cldb.handle_idx;
+	DBC *cur;
+	DBT key, val;
+	cldino_t inum_le;
+	struct raw_handle h;
+	GList *dead = NULL, *tmp;
+	int rc, crc, gflags;
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+
+	key.data = &inum_le;
+	key.ulen = sizeof(inum_le);
+	key.flags = DB_DBT_USERMEM;
+
+	val.data = &h;
+	val.ulen = sizeof(h);
+	val.flags = DB_DBT_USERMEM;
+
+	rc = hand_idx->cursor(hand_idx, txn, &cur, 0);
+	if (rc) {
+		hand_idx->err(hand_idx, rc, "replica_scan cursor");
+		return rc;
+	}
+
+	/* one look per inode, however many handles are open on it */
+	gflags = DB_FIRST;
+	while (1) {
+		rc = cur->get(cur, &key, &val, gflags);
+		if (rc) {
+			if (rc != DB_NOTFOUND)
+				hand_idx->err(hand_idx, rc,
+					      "replica_scan cursor get");
+			break;
+		}
+
+		gflags = DB_NEXT_NODUP;
+
+		rc = replica_check(txn, cldino_from_le(inum_le));
+		if (rc)
+			break;
+	}
+
+	if (rc == DB_NOTFOUND)
+		rc = 0;
+
+	crc = cur->close(cur);
+	if (crc) {
+		hand_idx->err(hand_idx, crc, "replica_scan cursor close");
+		if (!rc)
+			rc = crc;
+	}
+	if (rc)
+		return rc;
+
+	/* forget inodes nobody has open any more */
+	htab_foreach(replica_seen, replica_seen_reset, &dead);
+	for (tmp = dead; tmp; tmp = tmp->next) {
+		struct replica_seen *rs = tmp->data;
+
+		htab_del(replica_seen, &rs->inum);
+		free(rs);
+	}
+	g_list_free(dead);
+
+	return 0;
+}
+
+static void replica_poll(struct cld_timer *timer)
+{
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+	int rc;
+
+	if (!cld_srv.cldb.up)
+		goto out;
+
+	/* after internal init, nothing works until we reopen */
+	if (cld_srv.cldb.rep_dead) {
+		rc = cldb_rep_reopen(&cld_srv.cldb);
+		if (rc) {
+			HAIL_ERR(&srv_log, "replica reopen failed: %d", rc);
+			goto out;
+		}
+		if (cld_srv.warm.db)
+			cld_srv.warm.db = cld_srv.cldb.inode_names;
+		icache_flush();
+		replica_lsn.file = replica_lsn.offset = 0;
+	}
+
+	if (!replica_log_moved())
+		goto out;
+
+	cld_srv.stats.replica_sync++;
+
+	/* the master's writes went round the cache */
+	icache_flush();
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		goto out;
+	}
+
+	rc = replica_scan(txn);
+	if (rc) {
+		rc = sess_txn_abort(txn);
+		if (rc)
+			dbenv->err(dbenv, rc, "replica_poll txn abort");
+		goto out;
+	}
+
+	/* releases the events and GET-WAIT answers queued above */
+	rc = sess_txn_commit(txn);
+	if (rc)
+		dbenv->err(dbenv, rc, "replica_poll txn commit");
+
+out:
+	srv_timer_add(timer, CLD_REPLICA_POLL_MS);
+}
+
+void replica_start(void)
+{
+	replica_seen = htab_new(lock_hash, lock_equal, NULL, NULL);
+	if (!replica_seen) {
+		HAIL_CRIT(&srv_log, "cannot allocate replica table");
+		return;
+	}
+
+	cld_timer_init(&cld_srv.replica_timer, "replica-poll",
+		       replica_poll, NULL);
+	srv_timer_add(&cld_srv.replica_timer, CLD_REPLICA_POLL_MS);
+}
+
+void replica_free(void)
+{
+	if (!replica_seen)
+		return;
+
+	srv_timer_del(&cld_srv.replica_timer);
+	htab_foreach(replica_seen, replica_seen_free, NULL);
+	htab_free(replica_seen);
+	replica_seen = NULL;
+}
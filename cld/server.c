@@ -22,6 +22,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +33,7 @@
 #include <argp.h>
 #include <netdb.h>
 #include <signal.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <openssl/sha.h>
@@ -66,6 +68,25 @@ static struct argp_option options[] = {
 	  "heap, rather than simply exit(2)ing and letting OS clean up." },
 	{ "port-file", 1002, "FILE", 0,
 	  "Write the listen port to FILE." },
+	{ "commit-window", 1003, "USEC", 0,
+	  "Gather transactions for USEC microseconds before flushing the "
+	  "log and releasing their replies.  Default: 0, flush once per "
+	  "event loop pass" },
+	{ "warm-cache", 1004, NULL, 0,
+	  "After startup, read the inode and name databases through, a "
+	  "little at a time, so the first clients find them cached" },
+	{ "unix-socket", 1005, "DIR", OPTION_ARG_OPTIONAL,
+	  "Also listen on a local socket, DIR/cld-PORT.sock, which clients "
+	  "on this host use in preference to TCP.  Default DIR: "
+	  CLD_UNIX_DIR },
+	{ "rep-local", 1006, "HOST:PORT", 0,
+	  "Replicate the database, taking db4 replication traffic on "
+	  "HOST:PORT" },
+	{ "rep-remote", 1007, "HOST:PORT", 0,
+	  "Another replication site; may be given more than once" },
+	{ "replica", 1008, NULL, 0,
+	  "Run as a read-only replica of the master among the --rep-remote "
+	  "sites, serving reads and watches but no writes" },
 	{ }
 };
 
@@ -90,6 +111,7 @@ struct server cld_srv = {
 };
 
 static void ensure_root(void);
+static void upgrade_dirs(void);
 static bool atcp_read(struct atcp_read_state *rst,
 		      void *buf, unsigned int buf_size,
 		      void (*cb)(void *, bool), void *cb_data);
@@ -121,11 +143,133 @@ struct hail_log srv_log = {
 	.func = applog,
 };
 
-int tcp_tx(int sock_fd, struct sockaddr *addr, socklen_t addr_len,
-	   const void *data, size_t data_len)
+static unsigned long cli_hash(const void *v)
+{
+	const int *fd = v;
+
+	return (unsigned long) *fd;
+}
+
+static int cli_equal(const void *_a, const void *_b)
+{
+	const int *a = _a;
+	const int *b = _b;
+
+	return *a != *b;
+}
+
+static int cli_ev_wset(void *ev_info, int fd, atcp_ev_func cb, void *cb_data)
+{
+	event_set(ev_info, fd, EV_WRITE | EV_PERSIST, cb, cb_data);
+	return 0;
+}
+
+static int cli_ev_add(void *ev_info, const struct timeval *tv)
+{
+	return event_add(ev_info, tv);
+}
+
+static int cli_ev_del(void *ev_info)
+{
+	return event_del(ev_info);
+}
+
+static const struct atcp_wr_ops cli_wr_ops = {
+	.ev_wset	= cli_ev_wset,
+	.ev_add		= cli_ev_add,
+	.ev_del		= cli_ev_del,
+};
+
+/* hand the coalesced frames over to the write queue */
+static int cli_tx_push(struct client *cli)
+{
+	int rc;
+
+	if (!cli->tx_buf)
+		return 0;
+
+	rc = atcp_writeq(&cli->wst, cli->tx_buf, cli->tx_len,
+			 atcp_cb_free, cli->tx_buf);
+	if (rc)
+		free(cli->tx_buf);
+
+	cli->tx_buf = NULL;
+	cli->tx_len = 0;
+	cli->tx_cap = 0;
+	return rc;
+}
+
+/** Write out everything queued during this loop iteration.  Each
+ * connection gets one non-blocking writev; what the socket does not
+ * take stays queued and goes out on EV_WRITE.
+ */
+static void tcp_tx_flush(void)
+{
+	struct client *cli, *tmp;
+
+	list_for_each_entry_safe(cli, tmp, &cld_srv.tx_dirty, tx_node) {
+		list_del_init(&cli->tx_node);
+
+		if (cli_tx_push(cli))
+			HAIL_ERR(&srv_log, "%s: fd %d: out of memory",
+				 __func__, cli->fd);
+
+		cld_srv.stats.tx_flush++;
+		atcp_write_start(&cli->wst);
+		atcp_write_run_compl(&cli->wst);
+	}
+}
+
+/** Close a client connection from inside the event loop.  Shutting
+ * the socket down makes the next read event see EOF, and the client
+ * is freed there, once no handler is using it.
+ *
+ * @param cli		The client
+ */
+static void cli_kill(struct client *cli)
+{
+	if (cli->dead)
+		return;
+
+	cli->dead = true;
+	if (cli->fd >= 0)
+		shutdown(cli->fd, SHUT_RDWR);
+}
+
+/** Queue one packet for a client connection, behind a UBBP header.
+ * Nothing is written until tcp_tx_flush.
+ *
+ * @param sock_fd	The client's TCP socket
+ * @param conn_gen	Generation of the connection the packet is for;
+ *			a newer one that reused the fd gets nothing
+ * @param data		Packet
+ * @param data_len	Length of the packet
+ *
+ * @return		0 on success; negative errno otherwise
+ */
+int tcp_tx(int sock_fd, uint64_t conn_gen, const void *data, size_t data_len)
 {
-	ssize_t src;
 	struct ubbp_header ubbp;
+	struct client *cli;
+	size_t need = sizeof(ubbp) + data_len;
+	int rc;
+
+	cli = htab_get(cld_srv.clients, &sock_fd);
+	if (!cli || cli->dead || (cli->gen != conn_gen)) {
+		rc = -ENOTCONN;
+		goto err_out;
+	}
+
+	/* A client that stopped reading does not get to pin our memory.
+	 * Dropping one frame would leave a hole in the stream, so drop
+	 * the connection: the client reconnects and replays instead.
+	 */
+	if ((atcp_wqueued(&cli->wst) + cli->tx_len + need) >
+	    CLD_TX_MAX_QUEUED) {
+		cli_kill(cli);
+		rc = -ECONNRESET;
+		goto err_out;
+	}
 
 	memcpy(ubbp.magic, "CLD1", 4);
 	ubbp.op_size = (data_len << 8) | 2;
@@ -133,25 +277,36 @@ int tcp_tx(int sock_fd, struct sockaddr *addr, socklen_t addr_len,
 	swab32(ubbp.op_size);
 #endif
 
-	src = write(sock_fd, &ubbp, sizeof(ubbp));
-	if (src < 0 && errno != EAGAIN)
-		HAIL_ERR(&srv_log, "%s sendto (fd %d, data_len %u): %s",
-			 __func__, sock_fd, (unsigned int) data_len,
-			 strerror(errno));
+	if (cli->tx_buf && (cli->tx_len + need) > cli->tx_cap) {
+		rc = cli_tx_push(cli);
+		if (rc)
+			goto err_out;
+	}
+	if (!cli->tx_buf) {
+		cli->tx_cap = MAX(need, CLD_TX_BUF_SZ);
+		cli->tx_buf = malloc(cli->tx_cap);
+		if (!cli->tx_buf) {
+			cli->tx_cap = 0;
+			rc = -ENOMEM;
+			goto err_out;
+		}
+	}
 
-	if (src < 0)
-		return -errno;
-	
-	src = write(sock_fd, data, data_len);
-	if (src < 0 && errno != EAGAIN)
-		HAIL_ERR(&srv_log, "%s sendto (fd %d, data_len %u): %s",
-			 __func__, sock_fd, (unsigned int) data_len,
-			 strerror(errno));
-
-	if (src < 0)
-		return -errno;
+	memcpy(cli->tx_buf + cli->tx_len, &ubbp, sizeof(ubbp));
+	memcpy(cli->tx_buf + cli->tx_len + sizeof(ubbp), data, data_len);
+	cli->tx_len += need;
+	cld_srv.stats.tx_frames++;
+
+	if (list_empty(&cli->tx_node))
+		list_add_tail(&cli->tx_node, &cld_srv.tx_dirty);
 
 	return 0;
+
+err_out:
+	HAIL_ERR(&srv_log, "%s sendto (fd %d, data_len %u): %s",
+		 __func__, sock_fd, (unsigned int) data_len,
+		 strerror(-rc));
+	return rc;
 }
 
 const char *user_key(const char *user)
@@ -166,13 +321,14 @@ const char *user_key(const char *user)
 	return user;	/* our secret key */
 }
 
-static int tcp_rx_handle(struct session *sess,
+static int tcp_rx_handle(struct session *sess, const char *msg,
+			 size_t msg_len,
 			 void (*msg_handler)(struct session *, const void *),
 			 xdrproc_t xdrproc, void *xdrdata)
 {
 	XDR xin;
 
-	xdrmem_create(&xin, sess->msg_buf, sess->msg_buf_len, XDR_DECODE);
+	xdrmem_create(&xin, (void *)msg, msg_len, XDR_DECODE);
 	if (!xdrproc(&xin, xdrdata)) {
 		HAIL_DEBUG(&srv_log, "%s: couldn't parse %s message",
 			   __func__, cld_opstr(sess->msg_op));
@@ -185,61 +341,50 @@ static int tcp_rx_handle(struct session *sess,
 	return 0;
 }
 
-/** Recieve a TCP packet
+/** Append a message fragment to the session's reassembly buffer,
+ * which is drawn from the pool when the first fragment arrives.
  *
- * @param sock_fd	The TCP socket we received the packet on
+ * @param sess		The session
+ * @param frag		Fragment data
+ * @param frag_len	Length of the fragment
+ *
+ * @return		CLE_OK, or CLE_BAD_PKT if the message is too long
+ */
+static enum cle_err_codes tcp_rx_frag(struct session *sess, const char *frag,
+				      size_t frag_len)
+{
+	if (cld_buf_reserve(&cld_srv.msg_pool, &sess->msg_buf,
+			    &sess->msg_buf_cap, sess->msg_buf_len,
+			    sess->msg_buf_len + frag_len))
+		return CLE_BAD_PKT;
+
+	memcpy(sess->msg_buf + sess->msg_buf_len, frag, frag_len);
+	sess->msg_buf_len += frag_len;
+	return CLE_OK;
+}
+
+/** Dispatch a complete message to its handler
+ *
+ * @param sock_fd	The TCP socket we received the message on
  * @param cli		Client address data
- * @param info		Packet information
- * @param raw_pkt	The raw packet buffer
- * @param raw_len	Length of the raw packet buffer
+ * @param info		Packet information, from the last packet
+ * @param msg		The whole message
+ * @param msg_len	Length of the message
  *
  * @return		An error code if we should send an error message
  *			response. CLE_OK if we are done.
  */
-static enum cle_err_codes tcp_rx(int sock_fd, const struct client *cli,
-				 struct pkt_info *info, const char *raw_pkt,
-				 size_t raw_len)
+static enum cle_err_codes tcp_rx_msg(int sock_fd, const struct client *cli,
+				     struct pkt_info *info,
+				     const char *msg, size_t msg_len)
 {
-	struct cld_pkt_hdr *pkt = info->pkt;
 	struct session *sess = info->sess;
 
-	if (sess) {
-		size_t msg_len;
-
-		/* advance sequence id's and update last-contact timestamp */
-		sess->last_contact = current_time.tv_sec;
-		sess->sock_fd = sock_fd;
-
-		if (info->op != CMO_ACK) {
-			/* received message - update session */
-			sess->next_seqid_in++;
-		}
-
-		/* copy message fragment into reassembly buffer */
-		if (pkt->mi.order & CLD_PKT_IS_FIRST) {
-			sess->msg_op = info->op;
-			sess->msg_xid = info->xid;
-			sess->msg_buf_len = 0;
-		}
-		msg_len = raw_len - info->hdr_len - CLD_PKT_FTR_LEN;
-		if ((sess->msg_buf_len + msg_len) > CLD_MAX_MSG_SZ)
-			return CLE_BAD_PKT;
-
-		memcpy(sess->msg_buf + sess->msg_buf_len,
-			raw_pkt + info->hdr_len, msg_len);
-		sess->msg_buf_len += msg_len;
-	}
-
-	if (!(pkt->mi.order & CLD_PKT_IS_LAST)) {
-		struct cld_msg_ack_frag ack;
-		ack.seqid = info->seqid;
-
-		/* transmit ack-partial-msg response (once, without retries) */
-		simple_sendmsg(sock_fd, cli, pkt->sid,
-			       pkt->user, 0xdeadbeef,
-			       (xdrproc_t)xdr_cld_msg_ack_frag, (void *)&ack,
-			       CMO_ACK_FRAG);
-		return CLE_OK;
+	/* a replica answers writes in sequence, like any other message */
+	if (cld_srv.cldb.replica && !replica_op_ok(info->op)) {
+		cld_srv.stats.replica_refused++;
+		sess_sendresp_generic(sess, CLE_READ_ONLY);
+		return 0;
 	}
 
 	/* Handle a complete message */
@@ -248,49 +393,76 @@ static enum cle_err_codes tcp_rx(int sock_fd, const struct client *cli,
 		/* fall through */
 	case CMO_GET_META: {
 		struct cld_msg_get get = {0};
-		return tcp_rx_handle(sess, msg_get,
+		return tcp_rx_handle(sess, msg, msg_len, msg_get,
 				     (xdrproc_t)xdr_cld_msg_get, &get);
 	}
+	case CMO_GET_WAIT: {
+		struct cld_msg_get_wait gw = {0};
+		return tcp_rx_handle(sess, msg, msg_len, msg_get_wait,
+				     (xdrproc_t)xdr_cld_msg_get_wait, &gw);
+	}
+	case CMO_READDIR: {
+		struct cld_msg_readdir rd = {0};
+		return tcp_rx_handle(sess, msg, msg_len, msg_readdir,
+				     (xdrproc_t)xdr_cld_msg_readdir, &rd);
+	}
 	case CMO_OPEN: {
 		struct cld_msg_open open_msg = {0};
-		return tcp_rx_handle(sess, msg_open,
+		return tcp_rx_handle(sess, msg, msg_len, msg_open,
 				     (xdrproc_t)xdr_cld_msg_open, &open_msg);
 	}
 	case CMO_PUT: {
 		struct cld_msg_put put = {0};
-		return tcp_rx_handle(sess, msg_put,
+		return tcp_rx_handle(sess, msg, msg_len, msg_put,
 				     (xdrproc_t)xdr_cld_msg_put, &put);
 	}
+	case CMO_PUT_IF: {
+		struct cld_msg_put_if put = {0};
+		return tcp_rx_handle(sess, msg, msg_len, msg_put_if,
+				     (xdrproc_t)xdr_cld_msg_put_if, &put);
+	}
+	case CMO_OPEN_GET: {
+		struct cld_msg_open_get og = {0};
+		return tcp_rx_handle(sess, msg, msg_len, msg_open_get,
+				     (xdrproc_t)xdr_cld_msg_open_get, &og);
+	}
+	case CMO_OPEN_PUT: {
+		struct cld_msg_open_put op = {0};
+		return tcp_rx_handle(sess, msg, msg_len, msg_open_put,
+				     (xdrproc_t)xdr_cld_msg_open_put, &op);
+	}
 	case CMO_CLOSE: {
 		struct cld_msg_close close_msg = {0};
-		return tcp_rx_handle(sess, msg_close,
+		return tcp_rx_handle(sess, msg, msg_len, msg_close,
 				     (xdrproc_t)xdr_cld_msg_close, &close_msg);
 	}
 	case CMO_DEL: {
 		struct cld_msg_del del = {0};
-		return tcp_rx_handle(sess, msg_del,
+		return tcp_rx_handle(sess, msg, msg_len, msg_del,
 				     (xdrproc_t)xdr_cld_msg_del, &del);
 	}
 	case CMO_UNLOCK: {
 		struct cld_msg_unlock unlock = {0};
-		return tcp_rx_handle(sess, msg_unlock,
+		return tcp_rx_handle(sess, msg, msg_len, msg_unlock,
 				     (xdrproc_t)xdr_cld_msg_unlock, &unlock);
 	}
 	case CMO_TRYLOCK:
 		/* fall through */
 	case CMO_LOCK: {
 		struct cld_msg_lock lock = {0};
-		return tcp_rx_handle(sess, msg_lock,
+		return tcp_rx_handle(sess, msg, msg_len, msg_lock,
 				     (xdrproc_t)xdr_cld_msg_lock, &lock);
 	}
 	case CMO_ACK:
-		msg_ack(sess, info->seqid);
+		cld_srv.stats.ack++;
+		msg_ack(sess, info->seqid, sess->flags & CSF_CUM_ACK);
 		return 0;
+	case CMO_RECONNECT:	/* tcp_rx moved the session */
 	case CMO_NOP:
 		sess_sendresp_generic(sess, CLE_OK);
 		return 0;
 	case CMO_NEW_SESS:
-		msg_new_sess(sock_fd, cli, info);
+		msg_new_sess(sock_fd, cli, info, msg, msg_len);
 		return 0;
 	case CMO_END_SESS:
 		msg_end_sess(sess, info->xid);
@@ -303,6 +475,118 @@ static enum cle_err_codes tcp_rx(int sock_fd, const struct client *cli,
 	}
 }
 
+/** Recieve a TCP packet
+ *
+ * @param sock_fd	The TCP socket we received the packet on
+ * @param cli		Client address data
+ * @param info		Packet information
+ * @param raw_pkt	The raw packet buffer
+ * @param raw_len	Length of the raw packet buffer
+ *
+ * @return		An error code if we should send an error message
+ *			response. CLE_OK if we are done.
+ */
+static enum cle_err_codes tcp_rx(int sock_fd, const struct client *cli,
+				 struct pkt_info *info, const char *raw_pkt,
+				 size_t raw_len)
+{
+	struct cld_pkt_hdr *pkt = info->pkt;
+	struct session *sess = info->sess;
+	const char *msg = raw_pkt + info->hdr_len;
+	size_t msg_len = raw_len - info->hdr_len - CLD_PKT_FTR_LEN;
+	char *buf = NULL;
+	size_t buf_cap = 0;
+	enum cle_err_codes rc;
+
+	if (sess) {
+		/* advance sequence id's and update last-contact timestamp */
+		sess->last_contact = current_time.tv_sec;
+
+		/* a stream session follows the client to its new
+		 * connection; validate_pkt_session let only a fresh
+		 * RECONNECT through from there
+		 */
+		if (sess->conn_gen != cli->gen) {
+			memcpy(&sess->addr, &cli->addr, cli->addr_len);
+			sess->addr_len = cli->addr_len;
+			strncpy(sess->ipaddr, cli->addr_host,
+				sizeof(sess->ipaddr));
+			sess->sock_fd = sock_fd;
+			sess->conn_gen = cli->gen;
+		}
+
+		if (info->op != CMO_ACK) {
+			/* received message - update session */
+			if (sess->flags & CSF_STREAM)
+				sess->next_seqid_in = info->seqid + 1;
+			else
+				sess->next_seqid_in++;
+		}
+
+		/* the client acknowledged our output in its request */
+		if (info->has_ack && (sess->flags & CSF_CUM_ACK)) {
+			cld_srv.stats.ack_piggy++;
+			msg_ack(sess, info->ack, true);
+		}
+
+		/* a new message abandons any half-assembled one */
+		if (pkt->mi.order & CLD_PKT_IS_FIRST) {
+			sess->msg_op = info->op;
+			sess->msg_xid = info->xid;
+			cld_buf_put(&cld_srv.msg_pool, sess->msg_buf,
+				    sess->msg_buf_cap);
+			sess->msg_buf = NULL;
+			sess->msg_buf_cap = 0;
+			sess->msg_buf_len = 0;
+		}
+
+		/* a message in one packet is decoded where it lies;
+		 * only fragments are copied into a reassembly buffer
+		 */
+		if ((pkt->mi.order & (CLD_PKT_IS_FIRST | CLD_PKT_IS_LAST)) !=
+		    (CLD_PKT_IS_FIRST | CLD_PKT_IS_LAST)) {
+			rc = tcp_rx_frag(sess, msg, msg_len);
+			if (rc != CLE_OK)
+				return rc;
+		}
+
+		if ((pkt->mi.order & CLD_PKT_IS_LAST) && sess->msg_buf) {
+			/* take the buffer back from the session first;
+			 * the handler may end it
+			 */
+			buf = sess->msg_buf;
+			buf_cap = sess->msg_buf_cap;
+			msg = buf;
+			msg_len = sess->msg_buf_len;
+
+			sess->msg_buf = NULL;
+			sess->msg_buf_cap = 0;
+			sess->msg_buf_len = 0;
+		}
+	}
+
+	if (!(pkt->mi.order & CLD_PKT_IS_LAST)) {
+		struct cld_msg_ack_frag ack;
+
+		if (sess && (sess->flags & CSF_STREAM))
+			return CLE_OK;
+
+		ack.seqid = info->seqid;
+
+		/* transmit ack-partial-msg response (once, without retries) */
+		simple_sendmsg(sock_fd, cli, pkt->sid,
+			       pkt->user, 0xdeadbeef,
+			       (xdrproc_t)xdr_cld_msg_ack_frag, (void *)&ack,
+			       CMO_ACK_FRAG);
+		return CLE_OK;
+	}
+
+	rc = tcp_rx_msg(sock_fd, cli, info, msg, msg_len);
+
+	cld_buf_put(&cld_srv.msg_pool, buf, buf_cap);
+	return rc;
+}
+
 /** Parse a packet's header. Verify that the magic number is correct.
  *
  * @param raw_pkt	Pointer to the packet data
@@ -363,14 +647,20 @@ static bool get_pkt_info(struct cld_pkt_hdr *pkt,
 
 	memset(info, 0, sizeof(*info));
 	info->pkt = pkt;
-	info->sess = s = htab_get(cld_srv.sessions, &pkt->sid);
+	info->sess = s = sess_lookup(&pkt->sid);
 	foot = (struct cld_pkt_ftr *)
 			(raw_pkt + (raw_len - CLD_PKT_FTR_LEN));
 	info->seqid = le64_to_cpu(foot->seqid);
 
 	if (pkt->mi.order & CLD_PKT_IS_FIRST) {
-		info->xid = pkt->mi.cld_pkt_msg_info_u.mi.xid;
-		info->op = pkt->mi.cld_pkt_msg_info_u.mi.op;
+		const struct cld_pkt_msg_infos *infos = cld_pkt_infos(pkt);
+
+		info->xid = infos->xid;
+		info->op = infos->op;
+		if (pkt->mi.order & CLD_PKT_HAS_ACK) {
+			info->has_ack = true;
+			info->ack = pkt->mi.cld_pkt_msg_info_u.mia.ack;
+		}
 	} else {
 		if (!s) {
 			HAIL_DEBUG(&srv_log, "%s: packet is not first, "
@@ -416,11 +706,26 @@ static enum cle_err_codes validate_pkt_session(const struct pkt_info *info,
 		return CLE_SESS_EXISTS;
 	}
 
-	/* verify that client session matches IP */
-	if ((sess->addr_len != cli->addr_len) ||
-	     memcmp(&sess->addr, &cli->addr, sess->addr_len)) {
-		HAIL_DEBUG(&srv_log, "%s: sess->addr doesn't match packet "
-			   "addr", __func__);
+	/* a stream session never retransmits, so a seqid it has used
+	 * already is a replay.  An ACK's seqid is ours, not its own.
+	 */
+	if ((sess->flags & CSF_STREAM) && info->op != CMO_ACK &&
+	    (int64_t) (info->seqid - sess->next_seqid_in) < 0) {
+		HAIL_DEBUG(&srv_log, "%s: stale seqid %llu, want %llu",
+			   __func__, (unsigned long long) info->seqid,
+			   (unsigned long long) sess->next_seqid_in);
+		return CLE_SESS_INVAL;
+	}
+
+	/* a session stays on the connection it last used.  Compare
+	 * connections, not peer addresses: every AF_UNIX peer has the
+	 * same one.  A stream session moves on an explicit RECONNECT,
+	 * which the seqid check above keeps from being replayed.
+	 */
+	if (sess->conn_gen != cli->gen &&
+	    !((sess->flags & CSF_STREAM) && info->op == CMO_RECONNECT)) {
+		HAIL_DEBUG(&srv_log, "%s: session is bound to another "
+			   "connection", __func__);
 		return CLE_SESS_INVAL;
 	}
 
@@ -445,23 +750,33 @@ static enum cle_err_codes validate_pkt_session(const struct pkt_info *info,
  * @param raw_pkt	Pointer to the packet data
  * @param raw_len	Length of the raw data
  * @param pkt		the packet header
+ * @param sess		the packet's session, if it has one yet
  *
  * @return		0 on success; error code otherwise
  */
 static enum cle_err_codes pkt_chk_sig(const char *raw_pkt, int raw_len,
-				      const struct cld_pkt_hdr *pkt)
+				      const struct cld_pkt_hdr *pkt,
+				      struct session *sess)
 {
 	struct cld_pkt_ftr *foot;
-	const char *secret_key;
+	const struct cld_auth_key *auth_key = NULL;
 	int auth_rc;
 
 	foot = (struct cld_pkt_ftr *)
 			(raw_pkt + (raw_len - CLD_PKT_FTR_LEN));
-	secret_key = user_key(pkt->user);
 
-	auth_rc = cld_authcheck(&srv_log, secret_key, raw_pkt,
-				  raw_len - SHA_DIGEST_LENGTH,
-				  foot->sha);
+	/* a session's own user signs with the key cached there */
+	if (sess && !strcmp(sess->user, pkt->user))
+		auth_key = sess_auth_key(sess);
+
+	if (auth_key)
+		auth_rc = cld_auth_key_check(auth_key, raw_pkt,
+					     raw_len - SHA_DIGEST_LENGTH,
+					     foot->sha);
+	else
+		auth_rc = cld_authcheck(&srv_log, user_key(pkt->user),
+					raw_pkt, raw_len - SHA_DIGEST_LENGTH,
+					foot->sha);
 	if (auth_rc) {
 		HAIL_DEBUG(&srv_log, "auth failed, code %d", auth_rc);
 		return CLE_SIG_INVAL;
@@ -470,72 +785,60 @@ static enum cle_err_codes pkt_chk_sig(const char *raw_pkt, int raw_len,
 	return 0;
 }
 
+struct simple_pack {
+	int			fd;
+	const struct client	*cli;
+	const char		*user;
+	uint64_t		seqid;
+};
+
+static int simple_pkt_emit(void *priv, char *buf, size_t cap,
+			   char *pkt, size_t pkt_len)
+{
+	struct simple_pack *sp = priv;
+	struct cld_pkt_ftr *foot;
+	int auth_rc;
+
+	foot = (struct cld_pkt_ftr *) (pkt + (pkt_len - CLD_PKT_FTR_LEN));
+	foot->seqid = cpu_to_le64(sp->seqid);
+
+	auth_rc = cld_authsign(&srv_log, user_key(sp->user), pkt,
+			       pkt_len - SHA_DIGEST_LENGTH, foot->sha);
+	if (auth_rc)
+		HAIL_ERR(&srv_log, "%s: authsign failed: %d",
+			 __func__, auth_rc);
+
+	tcp_tx(sp->fd, sp->cli->gen, pkt, pkt_len);
+
+	cld_buf_put(&cld_srv.msg_pool, buf, cap);
+	return 0;
+}
+
 void simple_sendmsg(int fd, const struct client *cli,
 		    uint64_t sid, const char *user, uint64_t seqid,
 		    xdrproc_t xdrproc, const void *xdrdata, enum cld_msg_op op)
 {
-	XDR xhdr, xmsg;
 	struct cld_pkt_hdr pkt;
 	struct cld_pkt_msg_infos *infos;
-	struct cld_pkt_ftr *foot;
-	const char *secret_key;
-	char *buf;
-	size_t msg_len, hdr_len, buf_len;
-	int auth_rc;
+	struct simple_pack sp = { fd, cli, user, seqid };
+	int rc;
 
 	/* Set up the packet header */
 	memset(&pkt, 0, sizeof(cld_pkt_hdr));
 	memcpy(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic));
 	pkt.sid = sid;
 	pkt.user = (char *)user;
-	pkt.mi.order = CLD_PKT_ORD_FIRST_LAST;
+	pkt.mi.order = CLD_PKT_ORD_FIRST;
 	infos = &pkt.mi.cld_pkt_msg_info_u.mi;
 	cld_rand64(&infos->xid);
 	infos->op = op;
 
-	/* Determine sizes */
-	msg_len = xdr_sizeof(xdrproc, (void *)xdrdata);
-	if (msg_len > CLD_MAX_MSG_SZ) {
-		HAIL_ERR(&srv_log, "%s: tried to put %zu message bytes in a "
-			 "single packet. Maximum message bytes per packet "
-			 "is %d", __func__, msg_len, CLD_MAX_PKT_MSG_SZ);
-		return;
-	}
-	hdr_len = xdr_sizeof((xdrproc_t)xdr_cld_pkt_hdr, &pkt);
-	buf_len = msg_len + hdr_len + CLD_PKT_FTR_LEN;
-	buf = alloca(buf_len);
-
-	/* Serialize data */
-	xdrmem_create(&xhdr, buf, hdr_len, XDR_ENCODE);
-	if (!xdr_cld_pkt_hdr(&xhdr, &pkt)) {
-		xdr_destroy(&xhdr);
-		HAIL_ERR(&srv_log, "%s: xdr_cld_pkt_hdr failed",
-			 __func__);
-		return;
-	}
-	xdr_destroy(&xhdr);
-	xdrmem_create(&xmsg, buf + hdr_len, msg_len, XDR_ENCODE);
-	if (!xdrproc(&xmsg, (void *)xdrdata)) {
-		xdr_destroy(&xmsg);
-		HAIL_ERR(&srv_log, "%s: xdrproc failed", __func__);
-		return;
-	}
-	xdr_destroy(&xmsg);
-
-	foot = (struct cld_pkt_ftr *)
-		(buf + (buf_len - SHA_DIGEST_LENGTH));
-	foot->seqid = cpu_to_le64(seqid);
-	secret_key = user_key(user);
-
-	auth_rc =cld_authsign(&srv_log, secret_key, buf,
-				buf_len - SHA_DIGEST_LENGTH,
-				foot->sha);
-	if (auth_rc)
-		HAIL_ERR(&srv_log, "%s: authsign failed: %d",
-			 __func__, auth_rc);
-
-	tcp_tx(fd, (struct sockaddr *) &cli->addr, cli->addr_len,
-		buf, buf_len);
+	/* always a single packet */
+	rc = cld_msg_pack(&cld_srv.msg_pool, &pkt, xdrproc, xdrdata,
+			  CLD_MAX_MSG_SZ, simple_pkt_emit, &sp);
+	if (rc)
+		HAIL_ERR(&srv_log, "%s: cld_msg_pack failed: %d",
+			 __func__, rc);
 }
 
 static void simple_sendresp(int sock_fd, const struct client *cli,
@@ -566,12 +869,22 @@ static void cli_rd_pkt(void *userdata, bool success)
 	HAIL_DEBUG(&srv_log, "client %s message (%d bytes)",
 		   cli->addr_host, (int) rrc);
 
-	if (!parse_pkt_header(cli->raw_pkt, rrc, &pkt, &hdr_len)) {
+	if (!parse_pkt_header(cli->pkt, rrc, &pkt, &hdr_len)) {
 		cld_srv.stats.garbage++;
 		return;
 	}
 
-	if (!get_pkt_info(&pkt, cli->raw_pkt, rrc, hdr_len, &info)) {
+	if (!get_pkt_info(&pkt, cli->pkt, rrc, hdr_len, &info)) {
+		xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
+		cld_srv.stats.garbage++;
+		return;
+	}
+
+	/* only sessions which negotiated large frames may send them */
+	if ((rrc > CLD_RAW_MSG_SZ) &&
+	    !(info.sess && (info.sess->flags & CSF_LARGE_FRAMES))) {
+		HAIL_DEBUG(&srv_log, "%s: large frame (%d bytes) outside "
+			   "CSF_LARGE_FRAMES session", __func__, (int) rrc);
 		xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
 		cld_srv.stats.garbage++;
 		return;
@@ -584,21 +897,25 @@ static void cli_rd_pkt(void *userdata, bool success)
 		return;
 	}
 
-	err = pkt_chk_sig(cli->raw_pkt, rrc, &pkt);
+	err = pkt_chk_sig(cli->pkt, rrc, &pkt, info.sess);
 	if (err) {
 		simple_sendresp(fd, cli, &info, err);
 		xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
 		return;
 	}
 
-	if (!(cld_srv.cldb.is_master && cld_srv.cldb.up)) {
+	/* renews every stream session on this connection */
+	cli->last_rx = current_time.tv_sec;
+
+	if (!cld_srv.cldb.up ||
+	    !(cld_srv.cldb.is_master || cld_srv.cldb.replica)) {
 		simple_sendmsg(fd, cli, pkt.sid, pkt.user, 0xdeadbeef,
 			       (xdrproc_t)xdr_void, NULL, CMO_NOT_MASTER);
 		xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
 		return;
 	}
 
-	err = tcp_rx(fd, cli, &info, cli->raw_pkt, rrc);
+	err = tcp_rx(fd, cli, &info, cli->pkt, rrc);
 	if (err) {
 		simple_sendresp(fd, cli, &info, err);
 		xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
@@ -623,17 +940,72 @@ static void cli_rd_ubbp(void *userdata, bool success)
 	if (UBBP_OP(cli->ubbp.op_size) != 1)
 		goto err_out;
 	sz = UBBP_SIZE(cli->ubbp.op_size);
-	if (sz > CLD_RAW_MSG_SZ)
+	if (sz > CLD_MAX_FRAME_SZ)
 		goto err_out;
 
+	if (sz <= CLD_RAW_MSG_SZ)
+		cli->pkt = cli->raw_pkt;
+	else {
+		/* kept until the connection goes away; a client which
+		 * sent one large message is likely to send another
+		 */
+		if (!cli->large_pkt) {
+			cli->large_pkt = malloc(CLD_MAX_FRAME_SZ);
+			if (!cli->large_pkt)
+				goto err_out;
+		}
+		cli->pkt = cli->large_pkt;
+	}
+
 	cli->raw_size = sz;
 
-	atcp_read(&cli->rst, cli->raw_pkt, sz, cli_rd_pkt, cli);
+	atcp_read(&cli->rst, cli->pkt, sz, cli_rd_pkt, cli);
 
 	return;
 
 err_out:
-	cli_free(cli);
+	cli_kill(cli);
+}
+
+static void srv_timers_arm(unsigned long msec)
+{
+	struct timeval tv;
+
+	evtimer_del(&cld_srv.timers_ev);
+	cld_srv.timers_armed = 0;
+	if (!msec)
+		return;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	if (evtimer_add(&cld_srv.timers_ev, &tv) < 0) {
+		HAIL_ERR(&srv_log, "timer wheel arm failed");
+		return;
+	}
+	cld_srv.timers_armed = cld_time_ms() + msec;
+}
+
+static void srv_timers_event(int fd, short events, void *userdata)
+{
+	gettimeofday(&current_time, NULL);
+
+	cld_srv.timers_armed = 0;
+	srv_timers_arm(cld_timers_run_ms(&cld_srv.timers));
+}
+
+void srv_timer_add(struct cld_timer *timer, unsigned long msec)
+{
+	cld_timer_add_ms(&cld_srv.timers, timer, msec);
+
+	/* wake sooner, if this is now the first timer due */
+	if (!cld_srv.timers_armed || timer->expires < cld_srv.timers_armed)
+		srv_timers_arm(msec ? msec : 1);
+}
+
+void srv_timer_del(struct cld_timer *timer)
+{
+	/* an early wake-up finds nothing due and re-arms; leave it be */
+	cld_timer_del(&cld_srv.timers, timer);
 }
 
 static void add_chkpt_timer(void)
@@ -710,7 +1082,7 @@ static bool atcp_read_event(struct atcp_read_state *rst, int fd)
 			return false;
 		}
 		if (rrc == 0)
-			break;
+			return false;		/* peer closed */
 
 		tmp->bytes_read += rrc;
 		tmp->bytes_wanted -= rrc;
@@ -734,24 +1106,40 @@ static struct client *cli_alloc(void)
 	if (!cli)
 		return NULL;
 
+	cli->fd = -1;
 	cli->addr_len = sizeof(cli->addr);
 
 	atcp_read_init(&cli->rst);
-	
+	atcp_wr_init(&cli->wst, &cli_wr_ops, &cli->wr_ev, cli);
+	INIT_LIST_HEAD(&cli->tx_node);
+
 	return cli;
 }
 
 static void cli_free(struct client *cli)
 {
+	struct atcp_read *rd, *tmp;
+
 	if (!cli)
 		return;
 
+	list_for_each_entry_safe(rd, tmp, &cli->rst.q, node) {
+		list_del(&rd->node);
+		free(rd);
+	}
+
+	list_del_init(&cli->tx_node);
+	atcp_wr_exit(&cli->wst);
+	free(cli->tx_buf);
+
 	if (cli->fd >= 0) {
+		htab_del(cld_srv.clients, &cli->fd);
 		event_del(&cli->ev);
 		close(cli->fd);
 		cli->fd = -1;
 	}
-	
+
+	free(cli->large_pkt);
 	free(cli);
 }
 
@@ -759,7 +1147,8 @@ static void tcp_cli_event(int fd, short events, void *userdata)
 {
 	struct client *cli = userdata;
 
-	atcp_read_event(&cli->rst, fd);
+	if (!atcp_read_event(&cli->rst, fd) || cli->dead)
+		cli_free(cli);
 }
 
 static void tcp_srv_event(int fd, short events, void *userdata)
@@ -791,17 +1180,30 @@ static void tcp_srv_event(int fd, short events, void *userdata)
 		goto err_out_fd;
 
 	/* disable delay of small output packets */
-	if (setsockopt(cli->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+	if (!sock->local &&
+	    setsockopt(cli->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
 		applog(LOG_WARNING, "TCP_NODELAY failed: %s",
 		       strerror(errno));
 
 	event_set(&cli->ev, cli->fd, EV_READ | EV_PERSIST,
 		  tcp_cli_event, cli);
+	atcp_wr_set_fd(&cli->wst, cli->fd);
+
+	cli->gen = ++cld_srv.cli_gen;
+
+	if (!htab_put(cld_srv.clients, &cli->fd, cli)) {
+		applog(LOG_ERR, "out of memory");
+		goto err_out_fd;
+	}
 
 	/* pretty-print incoming cxn info */
-	getnameinfo((struct sockaddr *) &cli->addr, cli->addr_len,
-		    host, sizeof(host), port, sizeof(port),
-		    NI_NUMERICHOST | NI_NUMERICSERV);
+	if (sock->local) {
+		strcpy(host, "local");
+		snprintf(port, sizeof(port), "fd%d", cli->fd);
+	} else
+		getnameinfo((struct sockaddr *) &cli->addr, cli->addr_len,
+			    host, sizeof(host), port, sizeof(port),
+			    NI_NUMERICHOST | NI_NUMERICSERV);
 	host[sizeof(host) - 1] = 0;
 	port[sizeof(port) - 1] = 0;
 	applog(LOG_INFO, "client host %s port %s connected%s", host, port,
@@ -1045,12 +1447,72 @@ err_addr:
 	return rc;
 }
 
+/*
+ * Listen on a local socket too, named for the TCP port we got, so that
+ * clients on this host can find it.
+ */
+static int net_open_unix(void)
+{
+	struct server_socket *sock;
+	struct sockaddr_storage ss;
+	struct sockaddr_un sun;
+	socklen_t addr_len = sizeof(ss);
+	unsigned int port;
+	int fd;
+
+	if (list_empty(&cld_srv.sockets))
+		return -EINVAL;
+	sock = list_entry(cld_srv.sockets.next, struct server_socket,
+			  sockets_node);
+	if (getsockname(sock->fd, (struct sockaddr *) &ss, &addr_len) < 0)
+		return -errno;
+	if (ss.ss_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *) &ss)->sin6_port);
+	else
+		port = ntohs(((struct sockaddr_in *) &ss)->sin_port);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (cld_unix_path(sun.sun_path, sizeof(sun.sun_path),
+			  cld_srv.unix_dir, port) < 0) {
+		HAIL_ERR(&srv_log, "local socket dir too long: %s",
+			 cld_srv.unix_dir);
+		return -ENAMETOOLONG;
+	}
+
+	/* left behind by a server which did not shut down cleanly; no live
+	 * one owns it, as we hold its TCP port
+	 */
+	unlink(sun.sun_path);
+
+	fd = net_open_socket(AF_UNIX, SOCK_STREAM, 0, sizeof(sun), &sun);
+	if (fd < 0)
+		return fd;
+
+	sock = list_entry(cld_srv.sockets.prev, struct server_socket,
+			  sockets_node);
+	sock->local = true;
+
+	cld_srv.unix_path = strdup(sun.sun_path);
+	if (!cld_srv.unix_path)
+		return -ENOMEM;
+
+	HAIL_INFO(&srv_log, "Listening on %s", sun.sun_path);
+	return 0;
+}
+
 static int net_open(void)
 {
+	int rc;
+
 	if (!cld_srv.port)
-		return net_open_any();
+		rc = net_open_any();
 	else
-		return net_open_known(cld_srv.port);
+		rc = net_open_known(cld_srv.port);
+	if (rc || !cld_srv.unix_dir)
+		return rc;
+
+	return net_open_unix();
 }
 
 static void segv_signal(int signo)
@@ -1065,6 +1527,35 @@ static void term_signal(int signo)
 	event_loopbreak();
 }
 
+/* one step of the --warm-cache walk */
+static void cache_warm(struct cld_timer *timer)
+{
+	int rc;
+
+	rc = cldb_warm_step(&cld_srv.warm, CLD_WARM_BATCH);
+	if (rc > 0) {
+		cld_srv.stats.warm_records += rc;
+		srv_timer_add(timer, CLD_WARM_TICK_MS);
+		return;
+	}
+
+	HAIL_INFO(&srv_log, "cache warm-up done, %lu records",
+		  cld_srv.stats.warm_records);
+}
+
+static void cache_warm_start(void)
+{
+	/* walking the name index reads each inode it points at, too;
+	 * the inodes database itself is a hash, and a walk of it could
+	 * not resume where the last step left off
+	 */
+	memset(&cld_srv.warm, 0, sizeof(cld_srv.warm));
+	cld_srv.warm.db = cld_srv.cldb.inode_names;
+
+	cld_timer_init(&cld_srv.warm_timer, "cache-warm", cache_warm, NULL);
+	srv_timer_add(&cld_srv.warm_timer, CLD_WARM_TICK_MS);
+}
+
 static void stats_signal(int signo)
 {
 	dump_stats = true;
@@ -1079,6 +1570,31 @@ static void stats_dump(void)
 	X(poll);
 	X(event);
 	X(garbage);
+	X(commit);
+	X(flush);
+	X(notify);
+	X(notify_merged);
+	X(get_wait);
+	X(ack);
+	X(ack_piggy);
+	X(tx_frames);
+	X(tx_flush);
+	X(ping);
+	X(sess_woken);
+	X(sess_reaped);
+	X(warm_records);
+	X(cache_inode_hit);
+	X(cache_inode_miss);
+	X(cache_name_hit);
+	X(cache_name_miss);
+	X(cache_data_hit);
+	X(cache_data_miss);
+	X(replica_sync);
+	X(replica_refused);
+	HAIL_INFO(&srv_log, "STAT cache_entries %u", icache_size());
+	HAIL_INFO(&srv_log, "STAT msg_buf_alloc %lu", cld_srv.msg_pool.alloc);
+	HAIL_INFO(&srv_log, "STAT msg_buf_reuse %lu", cld_srv.msg_pool.reuse);
+	HAIL_INFO(&srv_log, "STAT msg_buf_in_use %lu", cld_srv.msg_pool.in_use);
 }
 
 #undef X
@@ -1133,11 +1649,41 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 1002:
 		cld_srv.port_file = arg;
 		break;
+	case 1003:
+		v = atoi(arg);
+		if (v < 0 || v >= 1000000) {
+			fprintf(stderr, "invalid commit window: '%s'\n", arg);
+			argp_usage(state);
+		}
+		cld_srv.commit_usec = v;
+		break;
+	case 1004:
+		cld_srv.flags |= SFL_WARM_CACHE;
+		break;
+	case 1005:
+		cld_srv.unix_dir = arg ? arg : CLD_UNIX_DIR;
+		break;
+	case 1006:
+		cld_srv.cldb.rep_local = arg;
+		break;
+	case 1007:
+		cld_srv.cldb.rep_remotes =
+			g_list_append(cld_srv.cldb.rep_remotes, arg);
+		break;
+	case 1008:
+		cld_srv.cldb.replica = true;
+		break;
 
 	case ARGP_KEY_ARG:
 		argp_usage(state);	/* too many args */
 		break;
 	case ARGP_KEY_END:
+		if (cld_srv.cldb.replica &&
+		    !(cld_srv.cldb.rep_local && cld_srv.cldb.rep_remotes)) {
+			fprintf(stderr, "--replica needs --rep-local and "
+				"--rep-remote\n");
+			argp_usage(state);
+		}
 		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
@@ -1150,7 +1696,10 @@ static int main_loop(void)
 {
 	while (server_running) {
 		cld_srv.stats.poll++;
-		event_dispatch();
+		event_loop(EVLOOP_ONCE);
+
+		/* one writev per connection for all this round's output */
+		tcp_tx_flush();
 
 		gettimeofday(&current_time, NULL);
 
@@ -1169,6 +1718,7 @@ int main (int argc, char *argv[])
 	int rc = 1;
 
 	INIT_LIST_HEAD(&cld_srv.sockets);
+	INIT_LIST_HEAD(&cld_srv.tx_dirty);
 
 	/* isspace() and strcasecmp() consistency requires this */
 	setlocale(LC_ALL, "C");
@@ -1221,10 +1771,20 @@ int main (int argc, char *argv[])
 		      DB_CREATE | DB_THREAD, NULL))
 		exit(1);
 
-	ensure_root();
-
 	evtimer_set(&cld_srv.chkpt_timer, cldb_checkpoint, NULL);
-	add_chkpt_timer();
+
+	/* a replica has the master's root, and its checkpoints, and may
+	 * not write
+	 */
+	if (!cld_srv.cldb.replica) {
+		ensure_root();
+		upgrade_dirs();
+		add_chkpt_timer();
+	}
+
+	evtimer_set(&cld_srv.commit_timer, sess_commit_event, NULL);
+
+	evtimer_set(&cld_srv.timers_ev, srv_timers_event, NULL);
 
 	rc = 1;
 
@@ -1232,9 +1792,23 @@ int main (int argc, char *argv[])
 	if (!cld_srv.sessions)
 		goto err_out_pid;
 
-	if (sess_load(cld_srv.sessions) != 0)
+	cld_srv.locks = htab_new(lock_hash, lock_equal, NULL, NULL);
+	if (!cld_srv.locks)
+		goto err_out_pid;
+
+	cld_srv.clients = htab_new(cli_hash, cli_equal, NULL, NULL);
+	if (!cld_srv.clients)
 		goto err_out_pid;
 
+	if (sess_load() != 0)
+		goto err_out_pid;
+
+	if (cld_srv.flags & SFL_WARM_CACHE)
+		cache_warm_start();
+
+	if (cld_srv.cldb.replica)
+		replica_start();
+
 	/* set up server networking */
 	rc = net_open();
 	if (rc)
@@ -1252,22 +1826,47 @@ int main (int argc, char *argv[])
 
 	HAIL_INFO(&srv_log, "shutting down");
 
-	if (strict_free)
+	/* make the last batch durable */
+	if (cld_srv.commit_pending) {
+		evtimer_del(&cld_srv.commit_timer);
+		sess_commit_flush();
+	}
+	tcp_tx_flush();
+
+	if (strict_free) {
 		if (evtimer_del(&cld_srv.chkpt_timer) < 0)
 			HAIL_WARN(&srv_log, "chkpt timer del failed");
+		evtimer_del(&cld_srv.timers_ev);
+		if (cld_srv.flags & SFL_WARM_CACHE)
+			srv_timer_del(&cld_srv.warm_timer);
+		replica_free();
+	}
 
 	if (cld_srv.cldb.up)
 		cldb_down(&cld_srv.cldb);
 	cldb_fini(&cld_srv.cldb);
 
 err_out_pid:
+	if (cld_srv.unix_path)
+		unlink(cld_srv.unix_path);
 	unlink(cld_srv.pid_file);
 	close(cld_srv.pid_fd);
 err_out:
 	if (strict_free) {
 		net_close();
+		free(cld_srv.unix_path);
+		g_list_free(cld_srv.cldb.rep_remotes);
 		sessions_free();
 		htab_free(cld_srv.sessions);
+		get_waiters_free();
+		icache_free();
+		cld_buf_pool_free(&cld_srv.msg_pool);
+		if (cld_srv.locks) {
+			locks_free();
+			htab_free(cld_srv.locks);
+		}
+		if (cld_srv.clients)
+			htab_free(cld_srv.clients);
 	}
 
 	closelog();
@@ -1336,3 +1935,33 @@ static void ensure_root()
 	exit(1);
 }
 
+/*
+ * Index directories kept in the old packed format, if any.
+ */
+static void upgrade_dirs(void)
+{
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn;
+	int rc;
+
+	rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+		exit(1);
+	}
+
+	rc = cldb_dirent_upgrade(txn);
+	if (rc) {
+		dbenv->err(dbenv, rc, "Directory index upgrade");
+		rc = txn->abort(txn);
+		if (rc)
+			dbenv->err(dbenv, rc, "DB_ENV->txn_abort");
+		exit(1);
+	}
+
+	rc = txn->commit(txn, 0);
+	if (rc) {
+		dbenv->err(dbenv, rc, "DB_ENV->txn_commit");
+		exit(1);
+	}
+}
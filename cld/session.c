@@ -30,12 +30,24 @@
 #include <cld-private.h>
 #include "cld.h"
 
+enum {
+	SESS_OUT_RING_MIN	= 16,		/* initial ACK ring slots */
+	SESS_OUT_RING_MAX	= 1 << 20,	/* unacked seqid span limit */
+
+	SESS_REAP_BATCH		= 64,		/* recovered sessions per txn */
+	SESS_REAP_TICK_MS	= 100,		/* between reaping batches */
+	SESS_JITTER_MS		= CLD_SESS_TIMEOUT / 4 * 1000,
+};
+
 struct session_outpkt {
 	struct session		*sess;
 
-	char			*pkt_data;
+	char			*pkt_data;	/* within buf */
 	size_t			pkt_len;
+	char			*buf;		/* from cld_srv.msg_pool */
+	size_t			buf_cap;
 
+	uint64_t		seqid;
 	uint64_t		next_retry;
 	unsigned int		refs;
 
@@ -43,11 +55,120 @@ struct session_outpkt {
 	void			*done_data;
 };
 
-static void session_retry(int, short, void *);
-static void session_timeout(int, short, void *);
-static int sess_load_db(struct htab *ss, DB_TXN *txn);
+/* an event for one handle, merged with any others not yet sent */
+struct session_event {
+	uint8_t			sid[CLD_SID_SZ];
+	uint64_t		fh;
+	uint32_t		events;		/* CE_xxx */
+};
+
+static GList *sess_ev_staged;		/* events of the current txn */
+static GList *sess_ev_ready;		/* sessions with a non-empty ev_q */
+
+/* a session recovered at startup, not yet needed in memory */
+struct sess_dormant {
+	struct raw_session	raw;		/* sid first: the htab key */
+	bool			woken;
+};
+
+static struct htab *sess_dormant;	/* sid -> struct sess_dormant */
+static GPtrArray *sess_reap_q;		/* dormant, by last contact */
+static unsigned int sess_reap_pos;	/* next entry to look at */
+static time_t sess_reap_grace;		/* nothing reaped before this */
+static struct cld_timer sess_reap_timer;
+
+static void session_retry(struct cld_timer *);
+static void session_timeout(struct cld_timer *);
+static int sess_load_db(DB_TXN *txn);
+static void sess_reap(struct cld_timer *);
+static void sess_dormant_free(void);
 static void op_unref(struct session_outpkt *op);
 
+/*
+ * Output awaiting ACK lives in a ring indexed by seqid, so an ACK finds
+ * its packet directly, and a cumulative ACK walks only what it covers.
+ * Held seqids all lie in [out_base, out_end), which the ring spans.
+ */
+static inline struct session_outpkt **outq_slot(struct session *sess,
+						uint64_t seqid)
+{
+	return &sess->out_ring[seqid & (sess->out_size - 1)];
+}
+
+static bool outq_resize(struct session *sess, uint64_t span)
+{
+	struct session_outpkt **ring;
+	unsigned int size;
+	uint64_t seqid;
+
+	size = sess->out_size ? sess->out_size : SESS_OUT_RING_MIN;
+	while (size < span) {
+		if (size >= SESS_OUT_RING_MAX)
+			return false;
+		size <<= 1;
+	}
+
+	ring = calloc(size, sizeof(*ring));
+	if (!ring)
+		return false;
+
+	for (seqid = sess->out_base; seqid < sess->out_end; seqid++)
+		ring[seqid & (size - 1)] = *outq_slot(sess, seqid);
+
+	free(sess->out_ring);
+	sess->out_ring = ring;
+	sess->out_size = size;
+	return true;
+}
+
+static bool outq_add(struct session *sess, struct session_outpkt *op)
+{
+	uint64_t lo = op->seqid, hi = op->seqid + 1;
+
+	if (sess->out_count) {
+		lo = MIN(lo, sess->out_base);
+		hi = MAX(hi, sess->out_end);
+	}
+
+	if ((hi - lo) > sess->out_size && !outq_resize(sess, hi - lo))
+		return false;
+
+	*outq_slot(sess, op->seqid) = op;
+	sess->out_base = lo;
+	sess->out_end = hi;
+	sess->out_count++;
+	return true;
+}
+
+static struct session_outpkt *outq_remove(struct session *sess,
+					  uint64_t seqid)
+{
+	struct session_outpkt **slot, *op;
+
+	if (seqid < sess->out_base || seqid >= sess->out_end)
+		return NULL;
+
+	slot = outq_slot(sess, seqid);
+	op = *slot;
+	if (!op)
+		return NULL;
+
+	*slot = NULL;
+	sess->out_count--;
+
+	/* keep the held range tight */
+	if (!sess->out_count)
+		sess->out_base = sess->out_end;
+	else {
+		while (!*outq_slot(sess, sess->out_base))
+			sess->out_base++;
+		while (!*outq_slot(sess, sess->out_end - 1))
+			sess->out_end--;
+	}
+
+	return op;
+}
+
 uint64_t next_seqid_le(uint64_t *seq)
 {
 	uint64_t tmp, rc;
@@ -87,8 +208,8 @@ static struct session *session_new(void)
 
 	cld_rand64(&sess->next_seqid_out);
 
-	evtimer_set(&sess->timer, session_timeout, sess);
-	evtimer_set(&sess->retry_timer, session_retry, sess);
+	cld_timer_init(&sess->timer, "sess-timer", session_timeout, sess);
+	cld_timer_init(&sess->retry_timer, "sess-retry", session_retry, sess);
 
 	return sess;
 }
@@ -96,6 +217,7 @@ static struct session *session_new(void)
 static void session_free(struct session *sess, bool hash_remove)
 {
 	GList *tmp;
+	uint64_t seqid;
 
 	if (!sess)
 		return;
@@ -103,23 +225,39 @@ static void session_free(struct session *sess, bool hash_remove)
 	if (hash_remove)
 		htab_del(cld_srv.sessions, sess->sid);
 
-	if (evtimer_del(&sess->timer) < 0)
-		HAIL_ERR(&srv_log, "sess timer del failed");
-	if (evtimer_del(&sess->retry_timer) < 0)
-		HAIL_ERR(&srv_log, "sess retry timer del failed");
+	srv_timer_del(&sess->timer);
+	srv_timer_del(&sess->retry_timer);
 
-	tmp = sess->out_q;
+	/* drop output still waiting for a group commit */
+	tmp = cld_srv.commit_q;
 	while (tmp) {
-		struct session_outpkt *op;
+		GList *tmp1 = tmp;
+		struct session_outpkt *op = tmp->data;
 
-		op = tmp->data;
+		tmp = tmp->next;
+		if (op->sess != sess)
+			continue;
+
+		cld_srv.commit_q = g_list_delete_link(cld_srv.commit_q, tmp1);
 		op_unref(op);
+	}
 
-		tmp->data = NULL;
-		tmp = tmp->next;
+	for (seqid = sess->out_base; seqid < sess->out_end; seqid++)
+		op_unref(*outq_slot(sess, seqid));
+	free(sess->out_ring);
+
+	/* drop events not yet delivered */
+	if (sess->ev_q) {
+		for (tmp = sess->ev_q; tmp; tmp = tmp->next)
+			free(tmp->data);
+		g_list_free(sess->ev_q);
+		sess_ev_ready = g_list_remove(sess_ev_ready, sess);
 	}
 
-	g_list_free(sess->out_q);
+	/* a message that was still arriving */
+	cld_buf_put(&cld_srv.msg_pool, sess->msg_buf, sess->msg_buf_cap);
+
+	cld_auth_key_fini(&sess->auth_key);
 
 	free(sess);
 }
@@ -132,6 +270,11 @@ static void session_free_iter(void *key, void *val, void *dummy)
 void sessions_free(void)
 {
 	htab_foreach(cld_srv.sessions, session_free_iter, NULL);
+
+	if (sess_reap_q) {
+		srv_timer_del(&sess_reap_timer);
+		sess_dormant_free();
+	}
 }
 
 static void session_trash(struct session *sess)
@@ -141,95 +284,6 @@ static void session_trash(struct session *sess)
 	sess->dead = true;
 }
 
-static bool lmatch(const struct raw_lock *lock, uint8_t *sid, uint64_t fh)
-{
-	if (memcmp(lock->sid, sid, sizeof(lock->sid)))
-		return false;
-	if (fh && (le64_to_cpu(lock->fh) != fh))
-		return false;
-
-	return true;
-}
-
-int session_remove_locks(DB_TXN *txn, uint8_t *sid, uint64_t fh,
-			 cldino_t inum, bool *waiter)
-{
-	DB *db_locks = cld_srv.cldb.locks;
-	DBC *cur;
-	*waiter = false;
-	int rc;
-	DBT pkey, pval;
-	cldino_t inum_le = cldino_to_le(inum);
-	int gflags;
-	struct raw_lock l;
-
-	*waiter = false;
-
-	rc = db_locks->cursor(db_locks, txn, &cur, 0);
-	if (rc) {
-		db_locks->err(db_locks, rc, "session_remove_locks cur");
-		goto err_out;
-	}
-
-	memset(&pkey, 0, sizeof(pkey));
-	memset(&pval, 0, sizeof(pval));
-
-	pkey.data = &inum_le;
-	pkey.size = sizeof(inum_le);
-
-	pval.data = &l;
-	pval.ulen = sizeof(l);
-	pval.flags = DB_DBT_USERMEM;
-
-	gflags = DB_SET;
-	while (1) {
-		/* search for first/next matching lock */
-		rc = cur->get(cur, &pkey, &pval, gflags);
-		if (rc) {
-			if (rc != DB_NOTFOUND)
-				db_locks->err(db_locks, rc, "curget2");
-			break;
-		}
-
-		gflags = DB_NEXT_DUP;
-
-		/* if not our sid, check for pending lock acquisitions */
-		if (!lmatch(&l, sid, fh)) {
-			if (le32_to_cpu(l.flags) & CLFL_PENDING)
-				*waiter = true;
-		}
-
-		/* delete lock matching search criteria */
-		else {
-			rc = cur->del(cur, 0);
-			if (rc) {
-				db_locks->err(db_locks, rc, "curdel2");
-				break;
-			}
-		}
-	}
-
-	/* close cursor, being careful to preserve return value
-	 * in most cases, but ignoring it in some others
-	 */
-	if (rc == DB_NOTFOUND)
-		rc = 0;
-	if (rc)
-		cur->close(cur);
-	else {
-		rc = cur->close(cur);
-		if (rc)
-			db_locks->err(db_locks, rc, "curclose2");
-	}
-	if (rc)
-		goto err_out;
-
-	return 0;
-
-err_out:
-	return rc;
-}
-
 static int session_remove(DB_TXN *txn, struct session *sess)
 {
 	DB *db_handles = cld_srv.cldb.handles;
@@ -238,9 +292,8 @@ static int session_remove(DB_TXN *txn, struct session *sess)
 	struct raw_handle h;
 	int rc, i;
 	DBT pkey, pval;
-	cldino_t *locks, *waiters;
+	cldino_t *locks;
 	int n_locks = 0, locks_alloc = 128;
-	int n_waiters = 0, waiters_alloc = 64;
 	int gflags;
 
 	memcpy(hkey.sid, sess->sid, sizeof(sess->sid));
@@ -250,12 +303,6 @@ static int session_remove(DB_TXN *txn, struct session *sess)
 	if (!locks)
 		return -ENOMEM;
 
-	waiters = calloc(waiters_alloc, sizeof(cldino_t));
-	if (!waiters) {
-		rc = -ENOMEM;
-		goto err_out;
-	}
-
 	rc = db_handles->cursor(db_handles, txn, &cur, 0);
 	if (rc) {
 		db_handles->err(db_handles, rc, "session_remove cur1");
@@ -332,38 +379,11 @@ static int session_remove(DB_TXN *txn, struct session *sess)
 		goto err_out;
 
 	/*
-	 * scan locks for waiters; delete our locks
+	 * delete our locks, granting waiters they blocked
 	 */
 	for (i = 0; i < n_locks; i++) {
-		cldino_t inum;
-		bool waiter;
-
-		inum = locks[i];
-		rc = session_remove_locks(txn, sess->sid, 0, inum, &waiter);
-		if (rc)
-			goto err_out;
-
-		if (waiter) {
-			waiters[n_waiters++] = inum;
-			if (n_waiters == waiters_alloc) {
-				void *mem;
-				int new_alloc = waiters_alloc * 2;
-
-				mem = realloc(waiters,
-					new_alloc * sizeof(cldino_t));
-				if (!mem)
-					goto err_out;
-
-				waiters = mem;
-				waiters_alloc = new_alloc;
-			}
-		}
-	}
-
-	/* rescan each inode in 'waiters', possibly acquiring locks */
-	for (i = 0; i < n_waiters; i++) {
-		rc = inode_lock_rescan(txn, waiters[i]);
-		if (rc)
+		rc = lock_remove(txn, sess->sid, 0, locks[i]);
+		if (rc && rc != DB_NOTFOUND)
 			goto err_out;
 	}
 
@@ -375,12 +395,10 @@ static int session_remove(DB_TXN *txn, struct session *sess)
 		goto err_out;
 
 	free(locks);
-	free(waiters);
 	return 0;
 
 err_out:
 	free(locks);
-	free(waiters);
 	return rc;
 }
 
@@ -401,38 +419,70 @@ int session_dispose(DB_TXN *txn, struct session *sess)
 	return rc;
 }
 
+/** The connection a stream session is bound to, while it stays open.
+ * The generation check keeps a reused descriptor from being mistaken
+ * for the session's; peer addresses cannot, as all AF_UNIX peers
+ * share one.
+ *
+ * @param sess		The session
+ * @return		The client connection, or NULL
+ */
+static struct client *sess_conn(const struct session *sess)
+{
+	struct client *cli;
+
+	if (!(sess->flags & CSF_STREAM) || (sess->sock_fd <= 0))
+		return NULL;
+
+	cli = htab_get(cld_srv.clients, &sess->sock_fd);
+	if (!cli || cli->dead || (cli->gen != sess->conn_gen))
+		return NULL;
+
+	return cli;
+}
+
 static void session_ping_done(struct session_outpkt *outpkt)
 {
+	struct client *cli = sess_conn(outpkt->sess);
+
 	outpkt->sess->ping_open = false;
+	if (cli)
+		cli->ping_open = false;
 }
 
-static void session_timeout(int fd, short events, void *userdata)
+static void session_timeout(struct cld_timer *timer)
 {
-	struct session *sess = userdata;
+	struct session *sess = timer->userdata;
+	struct client *cli;
 	uint64_t sess_expire;
 	int rc;
 	DB_ENV *dbenv = cld_srv.cldb.env;
 	DB_TXN *txn;
 	time_t now = time(NULL);
 
+	/* sessions sharing a connection live and die with it: traffic
+	 * for any of them renews all, and one PING probes for all
+	 */
+	cli = sess->dead ? NULL : sess_conn(sess);
+	if (cli && (cli->last_rx > sess->last_contact))
+		sess->last_contact = cli->last_rx;
+
 	sess_expire = sess->last_contact + CLD_SESS_TIMEOUT;
 	if (!sess->dead && (sess_expire > now)) {
-		struct timeval tv;
-
-		if (!sess->ping_open &&
-		    (sess_expire > (sess->last_contact + (CLD_SESS_TIMEOUT / 2) &&
-		    (sess->sock_fd > 0)))) {
+		if (!sess->ping_open && !(cli && cli->ping_open) &&
+		    (now >= sess->last_contact + (CLD_SESS_TIMEOUT / 2)) &&
+		    (sess->sock_fd > 0)) {
 			sess->ping_open = true;
+			if (cli)
+				cli->ping_open = true;
+			cld_srv.stats.ping++;
 			sess_sendmsg(sess,
 				     (xdrproc_t)xdr_void, NULL, CMO_PING,
 				     session_ping_done, NULL);
 		}
 
-		tv.tv_sec = ((sess_expire - now) / 2) + 1;
-		tv.tv_usec = 0;
-		if (evtimer_add(&sess->timer, &tv) < 0)
-			HAIL_ERR(&srv_log, "timer add failed, sid " SIDFMT,
-				 SIDARG(sess->sid));
+		srv_timer_add(&sess->timer,
+			      (((sess_expire - now) / 2) + 1) * 1000);
 		return;		/* timer added; do not time out session */
 	}
 
@@ -452,11 +502,11 @@ static void session_timeout(int fd, short events, void *userdata)
 
 	/* close transaction */
 	if (rc) {
-		rc = txn->abort(txn);
+		rc = sess_txn_abort(txn);
 		if (rc)
 			dbenv->err(dbenv, rc, "session txn_abort");
 	} else {
-		rc = txn->commit(txn, 0);
+		rc = sess_txn_commit(txn);
 		if (rc)
 			dbenv->err(dbenv, rc, "session txn_commit");
 	}
@@ -476,6 +526,7 @@ static void session_encode(struct raw_session *raw, const struct session *sess)
 	raw->next_fh = cpu_to_le64(sess->next_fh);
 	raw->next_seqid_in = cpu_to_le64(sess->next_seqid_in);
 	raw->next_seqid_out = cpu_to_le64(sess->next_seqid_out);
+	raw->flags = cpu_to_le32(sess->flags);
 }
 
 static void session_decode(struct session *sess, const struct raw_session *raw)
@@ -500,39 +551,183 @@ static void session_decode(struct session *sess, const struct raw_session *raw)
 	sess->next_seqid_in = le64_to_cpu(raw->next_seqid_in);
 
 	memcpy(sess->user, raw->user, CLD_MAX_USERNAME);
+
+	sess->flags = le32_to_cpu(raw->flags);
 }
 
-struct raw_session *session_new_raw(const struct session *sess)
+/* Bring a recovered session into memory */
+static struct session *sess_wake(struct sess_dormant *sd)
 {
-	struct raw_session *raw_sess;
+	struct session *sess;
 
-	raw_sess = malloc(sizeof(*raw_sess));
-	if (!raw_sess)
+	sess = session_new();
+	if (!sess)
 		return NULL;
 
-	session_encode(raw_sess, sess);
+	session_decode(sess, &sd->raw);
 
-	return raw_sess;
+	htab_del(sess_dormant, sd->raw.sid);
+	sd->woken = true;		/* freed as the reaper passes it */
+
+	htab_put(cld_srv.sessions, sess->sid, sess);
+
+	return sess;
 }
 
-static struct session_outpkt *op_alloc(size_t pkt_len)
+struct session *sess_lookup(const void *sid)
 {
-	struct session_outpkt *op;
+	struct session *sess;
+	struct sess_dormant *sd;
 
-	op = calloc(1, sizeof(*op));
-	if (!op)
+	sess = htab_get(cld_srv.sessions, sid);
+	if (sess || !sess_dormant)
+		return sess;
+
+	sd = htab_get(sess_dormant, sid);
+	if (!sd)
 		return NULL;
 
-	op->pkt_data = calloc(1, pkt_len);
-	if (!op->pkt_data) {
-		free(op);
+	sess = sess_wake(sd);
+	if (!sess) {
+		HAIL_ERR(&srv_log, "%s: cannot allocate session", __func__);
 		return NULL;
 	}
 
-	op->pkt_len = pkt_len;
-	op->refs = 1;
+	HAIL_DEBUG(&srv_log, "woke sid " SIDFMT, SIDARG(sess->sid));
+	cld_srv.stats.sess_woken++;
 
-	return op;
+	/* spread out the pings of sessions woken together */
+	srv_timer_add(&sess->timer, CLD_SESS_TIMEOUT / 2 * 1000 +
+		      rand() % SESS_JITTER_MS);
+	return sess;
+}
+
+static void sess_dormant_free(void)
+{
+	unsigned int i;
+
+	for (i = sess_reap_pos; i < sess_reap_q->len; i++)
+		free(g_ptr_array_index(sess_reap_q, i));
+	g_ptr_array_free(sess_reap_q, TRUE);
+	sess_reap_q = NULL;
+	sess_reap_pos = 0;
+
+	if (sess_dormant)
+		htab_free(sess_dormant);
+	sess_dormant = NULL;
+}
+
+/*
+ * Dispose of recovered sessions nobody came back for, oldest first and
+ * a batch per transaction, so a restart does not flood the db with
+ * cleanup.  Each gets the grace it had before the restart, and at
+ * least CLD_SESS_TIMEOUT / 2 from startup.  If the transaction fails,
+ * the batch goes back on the queue, dormant, for the next pass.
+ */
+static void sess_reap(struct cld_timer *timer)
+{
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	DB_TXN *txn = NULL;
+	struct sess_dormant *sd, *batch[SESS_REAP_BATCH];
+	struct session *sess;
+	unsigned int i, n = 0;
+	unsigned long next_ms = SESS_REAP_TICK_MS;
+	time_t now = time(NULL), expire;
+	int rc = 0;
+
+	while (sess_reap_pos < sess_reap_q->len) {
+		sd = g_ptr_array_index(sess_reap_q, sess_reap_pos);
+		if (sd->woken) {
+			free(sd);
+			sess_reap_pos++;
+			continue;
+		}
+
+		expire = MAX((time_t) le64_to_cpu(sd->raw.last_contact) +
+			     CLD_SESS_TIMEOUT, sess_reap_grace);
+		if (expire > now) {
+			next_ms = (expire - now) * 1000 +
+				  rand() % SESS_REAP_TICK_MS;
+			break;
+		}
+		if (n == SESS_REAP_BATCH)
+			break;
+
+		if (!txn) {
+			rc = dbenv->txn_begin(dbenv, NULL, &txn, 0);
+			if (rc) {
+				dbenv->err(dbenv, rc, "DB_ENV->txn_begin");
+				txn = NULL;
+				break;
+			}
+		}
+
+		sess = sess_wake(sd);
+		if (!sess)
+			break;
+		batch[n++] = sd;		/* kept until the txn commits */
+		sess_reap_pos++;
+
+		HAIL_INFO(&srv_log, "session timeout, addr %s sid " SIDFMT,
+			  sess->ipaddr, SIDARG(sess->sid));
+
+		rc = session_dispose(txn, sess);
+		if (rc)
+			break;
+	}
+
+	if (txn) {
+		if (rc) {
+			int arc = sess_txn_abort(txn);
+			if (arc)
+				dbenv->err(dbenv, arc, "session txn_abort");
+		} else {
+			rc = sess_txn_commit(txn);
+			if (rc)
+				dbenv->err(dbenv, rc, "session txn_commit");
+			else
+				cld_srv.stats.sess_reaped += n;
+		}
+	}
+
+	if (rc) {
+		/* their records are still in the db: make them dormant
+		 * again, in the queue slots just consumed, in order
+		 */
+		sess_reap_pos -= n;
+		for (i = 0; i < n; i++) {
+			batch[i]->woken = false;
+			htab_put(sess_dormant, batch[i]->raw.sid, batch[i]);
+			g_ptr_array_index(sess_reap_q, sess_reap_pos + i) =
+				batch[i];
+		}
+		srv_timer_add(timer, SESS_REAP_TICK_MS);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		free(batch[i]);
+
+	if (sess_reap_pos >= sess_reap_q->len) {
+		HAIL_DEBUG(&srv_log, "recovered sessions all woken or reaped");
+		sess_dormant_free();
+		return;
+	}
+
+	srv_timer_add(timer, next_ms);
+}
+
+struct raw_session *session_new_raw(const struct session *sess)
+{
+	struct raw_session *raw_sess;
+
+	raw_sess = malloc(sizeof(*raw_sess));
+	if (!raw_sess)
+		return NULL;
+
+	session_encode(raw_sess, sess);
+
+	return raw_sess;
 }
 
 static void op_unref(struct session_outpkt *op)
@@ -546,23 +741,23 @@ static void op_unref(struct session_outpkt *op)
 			return;
 	}
 
-	free(op->pkt_data);
+	cld_buf_put(&cld_srv.msg_pool, op->buf, op->buf_cap);
 	free(op);
 }
 
 static int sess_retry_output(struct session *sess, time_t *next_retry_out)
 {
-	GList *tmp;
+	uint64_t seqid;
 	int rc = 0;
 	time_t next_retry = 0;
 
 	*next_retry_out = 0;
 
-	tmp = sess->out_q;
-	while (tmp) {
-		struct session_outpkt *op;
-		op = tmp->data;
-		tmp = tmp->next;
+	for (seqid = sess->out_base; seqid < sess->out_end; seqid++) {
+		struct session_outpkt *op = *outq_slot(sess, seqid);
+
+		if (!op)
+			continue;
 
 		if (!next_retry || (op->next_retry < next_retry))
 			*next_retry_out = next_retry = op->next_retry;
@@ -578,8 +773,8 @@ static int sess_retry_output(struct session *sess, time_t *next_retry_out)
 				  			op->pkt_len));
 		}
 
-		rc = tcp_tx(sess->sock_fd, (struct sockaddr *) &sess->addr,
-			    sess->addr_len, op->pkt_data, op->pkt_len);
+		rc = tcp_tx(sess->sock_fd, sess->conn_gen,
+			    op->pkt_data, op->pkt_len);
 		if (rc)
 			break;
 
@@ -589,134 +784,411 @@ static int sess_retry_output(struct session *sess, time_t *next_retry_out)
 	return rc;
 }
 
-static void session_retry(int fd, short events, void *userdata)
+static void session_retry(struct cld_timer *timer)
 {
-	struct session *sess = userdata;
+	struct session *sess = timer->userdata;
 	time_t next_retry;
 	time_t now = time(NULL);
-	struct timeval tv;
 
-	if (!sess->out_q)
+	if (!sess->out_count)
 		return;
 
 	sess_retry_output(sess, &next_retry);
 
-	tv.tv_sec = next_retry - now;
-	tv.tv_usec = 0;
-
-	if (evtimer_add(&sess->retry_timer, &tv) < 0)
-		HAIL_ERR(&srv_log, "retry timer re-add failed");
+	srv_timer_add(&sess->retry_timer,
+		      next_retry > now ? (next_retry - now) * 1000 : 0);
 }
 
 static void session_outq(struct session *sess, GList *new_pkts)
 {
-	/* if out_q empty, start retry timer */
-	if (!sess->out_q) {
-		struct timeval tv = { .tv_sec = CLD_RETRY_START };
-		if (evtimer_add(&sess->retry_timer, &tv) < 0)
-			HAIL_ERR(&srv_log, "retry timer start failed");
+	GList *tmp;
+
+	/* if nothing was awaiting ACK, start retry timer */
+	if (!sess->out_count)
+		srv_timer_add(&sess->retry_timer, CLD_RETRY_START * 1000);
+
+	for (tmp = new_pkts; tmp; tmp = tmp->next) {
+		struct session_outpkt *op = tmp->data;
+
+		if (!outq_add(sess, op)) {
+			HAIL_ERR(&srv_log, "%s: out of memory, seqid %llu "
+				 "will not be retried", __func__,
+				 (unsigned long long) op->seqid);
+			op_unref(op);
+		}
 	}
 
-	sess->out_q = g_list_concat(sess->out_q, new_pkts);
+	g_list_free(new_pkts);
 }
 
-bool sess_sendmsg(struct session *sess,
-	xdrproc_t xdrproc, const void *xdrdata, enum cld_msg_op msg_op,
-	void (*done_cb)(struct session_outpkt *), void *done_data)
+static void sess_xmit(struct session *sess, GList *new_pkts)
 {
-	XDR xmsg;
-	size_t msg_rem, msg_len, msg_chunk_len;
-	char *msg_bytes, *msg_cur;
-	GList *tmp_list, *new_pkts = NULL;
-	int first, last;
-	const char *secret_key;
+	GList *tmp_list;
 
-	secret_key = user_key(sess->user);
+	/* send packets */
+	for (tmp_list = g_list_first(new_pkts);
+	     tmp_list;
+	     tmp_list = g_list_next(tmp_list)) {
+		struct session_outpkt *op =
+			(struct session_outpkt *) tmp_list->data;
+		tcp_tx(sess->sock_fd, sess->conn_gen,
+		       op->pkt_data, op->pkt_len);
+	}
 
-	/* Use XDR to serialize the message */
-	msg_len = xdr_sizeof(xdrproc, (void *)xdrdata);
-	if (msg_len > CLD_MAX_MSG_SZ)
-		return false;
-	msg_bytes = alloca(msg_len);
-	xdrmem_create(&xmsg, msg_bytes, msg_len, XDR_ENCODE);
-	if (!xdrproc(&xmsg, (void *)xdrdata)) {
-		xdr_destroy(&xmsg);
-		HAIL_ERR(&srv_log, "%s: xdrproc failed", __func__);
-		return false;
+	/* The stream delivers what we wrote, or the connection dies and
+	 * the client replays its requests on a new one.  Either way there
+	 * is nothing to retransmit, and no ACK is coming.
+	 */
+	if (sess->flags & CSF_STREAM) {
+		for (tmp_list = g_list_first(new_pkts);
+		     tmp_list;
+		     tmp_list = g_list_next(tmp_list)) {
+			struct session_outpkt *op =
+				(struct session_outpkt *) tmp_list->data;
+			if (op->done_cb)
+				op->done_cb(op);
+			op_unref(op);
+		}
+		g_list_free(new_pkts);
+		return;
 	}
-	xdr_destroy(&xmsg);
 
-	/* Break the message into packets */
-	first = 1;
-	msg_rem = msg_len;
-	msg_cur = msg_bytes;
-	do {
-		XDR xout;
-		struct cld_pkt_hdr pkt;
-		size_t hdr_len;
-		struct session_outpkt *op;
+	session_outq(sess, new_pkts);
+}
 
-		if (msg_rem <= CLD_MAX_PKT_MSG_SZ) {
-			msg_chunk_len = msg_rem;
-			last = 1;
-		} else {
-			msg_chunk_len = CLD_MAX_PKT_MSG_SZ;
-			last = 0;
+/*
+ * Forget the in-memory side effects queued by a txn that did not commit.
+ */
+static void sess_txn_rollback(void)
+{
+	GList *tmp;
+
+	lock_txn_abort();
+	get_wait_txn_abort();
+	icache_txn_end();
+
+	for (tmp = sess_ev_staged; tmp; tmp = tmp->next)
+		free(tmp->data);
+	g_list_free(sess_ev_staged);
+	sess_ev_staged = NULL;
+}
+
+int sess_txn_abort(DB_TXN *txn)
+{
+	int rc;
+
+	rc = txn->abort(txn);
+	sess_txn_rollback();
+
+	return rc;
+}
+
+/*
+ * Move the events of a committed txn onto their sessions' queues,
+ * merging with events still queued for the same handle: a watcher
+ * that has not yet been told of one update need not hear of two.
+ */
+static void sess_event_commit(void)
+{
+	GList *tmp;
+
+	for (tmp = sess_ev_staged; tmp; tmp = tmp->next) {
+		struct session_event *ev = tmp->data, *qev;
+		struct session *sess;
+		GList *tmp1;
+
+		sess = sess_lookup(ev->sid);
+		if (!sess) {
+			HAIL_WARN(&srv_log, "%s BUG", __func__);
+			free(ev);
+			continue;
 		}
 
-		/* Set up packet header */
-		memset(&pkt, 0, sizeof(pkt));
-		memcpy(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic));
-		memcpy(&pkt.sid, sess->sid, CLD_SID_SZ);
-		pkt.user = sess->user;
-		if (first) {
-			struct cld_pkt_msg_infos *infos =
-				&pkt.mi.cld_pkt_msg_info_u.mi;
-			if (last)
-				pkt.mi.order = CLD_PKT_ORD_FIRST_LAST;
-			else
-				pkt.mi.order = CLD_PKT_ORD_FIRST;
-			cld_rand64(&infos->xid);
-			infos->op = msg_op;
-		} else {
-			if (last)
-				pkt.mi.order = CLD_PKT_ORD_LAST;
-			else
-				pkt.mi.order = CLD_PKT_ORD_MID;
+		for (tmp1 = sess->ev_q; tmp1; tmp1 = tmp1->next) {
+			qev = tmp1->data;
+			if (qev->fh == ev->fh)
+				break;
 		}
 
-		/* Allocate space and initialize session_outpkt structure */
-		hdr_len = xdr_sizeof((xdrproc_t)xdr_cld_pkt_hdr, (void *)&pkt);
-		op = op_alloc(hdr_len + msg_chunk_len + CLD_PKT_FTR_LEN);
-		if (!op) {
-			HAIL_DEBUG(&srv_log, "%s: op_alloc failed",
-				   __func__);
-			goto err_out;
+		if (tmp1) {
+			qev->events |= ev->events;
+			cld_srv.stats.notify_merged++;
+			free(ev);
+			continue;
 		}
-		op->sess = sess;
-		op->next_retry = current_time.tv_sec + CLD_RETRY_START;
-		op->done_cb = done_cb;
-		op->done_data = done_data;
-		xdrmem_create(&xout, op->pkt_data, hdr_len, XDR_ENCODE);
-		if (!xdr_cld_pkt_hdr(&xout, &pkt)) {
-			xdr_destroy(&xout);
-			HAIL_ERR(&srv_log, "%s: xdr_cld_pkt_hdr failed",
-				  __func__);
-			goto err_out;
+
+		if (!sess->ev_q)
+			sess_ev_ready = g_list_prepend(sess_ev_ready, sess);
+		sess->ev_q = g_list_append(sess->ev_q, ev);
+	}
+
+	g_list_free(sess_ev_staged);
+	sess_ev_staged = NULL;
+
+	/* no flush pending to carry them; send now */
+	if (!cld_srv.commit_pending)
+		sess_event_flush();
+}
+
+void sess_event_queue(const uint8_t *sid, uint64_t fh, uint32_t events)
+{
+	struct session_event *ev;
+
+	ev = malloc(sizeof(*ev));
+	if (!ev) {
+		HAIL_CRIT(&srv_log, "%s: out of memory", __func__);
+		return;
+	}
+
+	memcpy(ev->sid, sid, sizeof(ev->sid));
+	ev->fh = fh;
+	ev->events = events;
+
+	sess_ev_staged = g_list_append(sess_ev_staged, ev);
+}
+
+/*
+ * Send each session its queued events in one go, so a connection sees
+ * one burst per flush rather than one write per writer's txn.
+ */
+void sess_event_flush(void)
+{
+	GList *ready, *tmp, *tmp1;
+
+	ready = sess_ev_ready;
+	sess_ev_ready = NULL;
+
+	for (tmp = ready; tmp; tmp = tmp->next) {
+		struct session *sess = tmp->data;
+		GList *evs = sess->ev_q;
+
+		sess->ev_q = NULL;
+
+		for (tmp1 = evs; tmp1; tmp1 = tmp1->next) {
+			struct session_event *ev = tmp1->data;
+			struct cld_msg_event me;
+
+			if (!sess->sock_fd) {	/* Freshly recovered session */
+				HAIL_DEBUG(&srv_log, "Lost notify sid " SIDFMT
+					   " fh %llu", SIDARG(sess->sid),
+					   (unsigned long long) ev->fh);
+				free(ev);
+				continue;
+			}
+
+			memset(&me, 0, sizeof(me));
+			me.fh = ev->fh;
+			me.events = ev->events;
+
+			sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_event,
+				     (void *)&me, CMO_EVENT, NULL, NULL);
+			cld_srv.stats.notify++;
+			free(ev);
+		}
+
+		g_list_free(evs);
+	}
+
+	g_list_free(ready);
+}
+
+/*
+ * Group commit.  Transactions commit with DB_TXN_NOSYNC, and anything
+ * sessions send afterwards is held on cld_srv.commit_q.  At the end of
+ * this pass through the event loop (or after --commit-window usecs),
+ * a single log flush makes the whole batch durable, and only then is
+ * the held output released, in order.
+ */
+int sess_txn_commit(DB_TXN *txn)
+{
+	int rc;
+
+	rc = txn->commit(txn, DB_TXN_NOSYNC);
+	if (rc) {
+		sess_txn_rollback();
+		return rc;
+	}
+
+	cld_srv.stats.commit++;
+
+	if (!cld_srv.commit_pending) {
+		struct timeval tv = { .tv_usec = cld_srv.commit_usec };
+
+		cld_srv.commit_pending = true;
+		if (evtimer_add(&cld_srv.commit_timer, &tv) < 0) {
+			HAIL_ERR(&srv_log, "commit timer add failed");
+			sess_commit_flush();
+		}
+	}
+
+	/* lock grants and events of this txn go out behind the flush */
+	lock_txn_commit();
+	sess_event_commit();
+	get_wait_txn_commit();
+	icache_txn_end();
+
+	return 0;
+}
+
+void sess_commit_flush(void)
+{
+	DB_ENV *dbenv = cld_srv.cldb.env;
+	GList *tmp, *held;
+	int rc;
+
+	if (!cld_srv.commit_pending)
+		return;
+
+	rc = dbenv->log_flush(dbenv, NULL);
+	if (rc)
+		dbenv->err(dbenv, rc, "group commit log_flush");
+
+	cld_srv.stats.flush++;
+	cld_srv.commit_pending = false;
+
+	held = cld_srv.commit_q;
+	cld_srv.commit_q = NULL;
+
+	for (tmp = held; tmp; tmp = tmp->next) {
+		struct session_outpkt *op = tmp->data;
+
+		if (!rc) {
+			sess_xmit(op->sess, g_list_append(NULL, op));
+			continue;
 		}
-		xdr_destroy(&xout);
 
-		/* Fill in data */
-		memcpy(op->pkt_data + hdr_len, msg_cur, msg_chunk_len);
-		msg_cur += msg_chunk_len;
-		msg_rem -= msg_chunk_len;
-		first = 0;
+		/* The batch is not durable, so its replies must not claim
+		 * success.  Drop them and end their sessions; the clients
+		 * see the session go away and cannot trust the outcome.
+		 */
+		if (!op->sess->dead) {
+			session_trash(op->sess);
+			srv_timer_del(&op->sess->timer);
+			srv_timer_add(&op->sess->timer, 0);
+		}
+		op_unref(op);
+	}
+
+	g_list_free(held);
+
+	/* events only say "look again", so a spurious one is harmless,
+	 * while a lost one leaves a watcher stale: send them regardless
+	 */
+	sess_event_flush();
+}
+
+void sess_commit_event(int fd, short events, void *userdata)
+{
+	gettimeofday(&current_time, NULL);
+
+	sess_commit_flush();
+}
+
+struct sess_pack {
+	struct session		*sess;
+	GList			*pkts;		/* in reverse order */
+	void			(*done_cb)(struct session_outpkt *);
+	void			*done_data;
+};
+
+static int sess_pkt_emit(void *priv, char *buf, size_t cap,
+			 char *pkt, size_t pkt_len)
+{
+	struct sess_pack *sp = priv;
+	struct session_outpkt *op;
+	char *small;
+	size_t small_cap;
+
+	op = calloc(1, sizeof(*op));
+	if (!op) {
+		cld_buf_put(&cld_srv.msg_pool, buf, cap);
+		return -ENOMEM;
+	}
+
+	/* Without CSF_STREAM the packet is held until ACK'd, so move a
+	 * small one out of the large buffer it was encoded in
+	 */
+	if (!(sp->sess->flags & CSF_STREAM) && pkt_len <= cap / 4) {
+		small = cld_buf_get(&cld_srv.msg_pool, pkt_len, &small_cap);
+		if (small) {
+			memcpy(small, pkt, pkt_len);
+			cld_buf_put(&cld_srv.msg_pool, buf, cap);
+			buf = pkt = small;
+			cap = small_cap;
+		}
+	}
+
+	op->buf = buf;
+	op->buf_cap = cap;
+	op->pkt_data = pkt;
+	op->pkt_len = pkt_len;
+	op->refs = 1;
+	op->sess = sp->sess;
+	op->next_retry = current_time.tv_sec + CLD_RETRY_START;
+	op->done_cb = sp->done_cb;
+	op->done_data = sp->done_data;
+
+	sp->pkts = g_list_prepend(sp->pkts, op);
+	return 0;
+}
+
+/* the session user's HMAC key, scheduled on first use */
+const struct cld_auth_key *sess_auth_key(struct session *sess)
+{
+	if (!sess->auth_key.valid &&
+	    cld_auth_key_init(&sess->auth_key, user_key(sess->user)))
+		return NULL;
+
+	return &sess->auth_key;
+}
+
+bool sess_sendmsg(struct session *sess,
+	xdrproc_t xdrproc, const void *xdrdata, enum cld_msg_op msg_op,
+	void (*done_cb)(struct session_outpkt *), void *done_data)
+{
+	struct cld_pkt_hdr pkt;
+	struct cld_pkt_msg_infos *infos;
+	struct sess_pack sp = { sess, NULL, done_cb, done_data };
+	size_t max_chunk_len;
+	GList *tmp_list, *new_pkts;
+	const struct cld_auth_key *auth_key;
+	int rc;
+
+	auth_key = sess_auth_key(sess);
+	if (!auth_key) {
+		HAIL_ERR(&srv_log, "%s: no key for user %s",
+			 __func__, sess->user);
+		return false;
+	}
 
-		new_pkts = g_list_prepend(new_pkts, op);
-	} while (!last);
+	/* Set up the first packet header */
+	memset(&pkt, 0, sizeof(pkt));
+	memcpy(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic));
+	memcpy(&pkt.sid, sess->sid, CLD_SID_SZ);
+	pkt.user = sess->user;
+	pkt.mi.order = CLD_PKT_ORD_FIRST;
+	infos = &pkt.mi.cld_pkt_msg_info_u.mi;
+	cld_rand64(&infos->xid);
+	infos->op = msg_op;
+
+	/* Break the message into packets, unless the client
+	 * accepts each message whole, in a single frame
+	 */
+	if (sess->flags & CSF_LARGE_FRAMES)
+		max_chunk_len = CLD_MAX_MSG_SZ;
+	else
+		max_chunk_len = CLD_MAX_PKT_MSG_SZ;
+
+	rc = cld_msg_pack(&cld_srv.msg_pool, &pkt, xdrproc, xdrdata,
+			  max_chunk_len, sess_pkt_emit, &sp);
+	new_pkts = g_list_reverse(sp.pkts);
+	if (rc) {
+		HAIL_ERR(&srv_log, "%s: cld_msg_pack failed: %d",
+			 __func__, rc);
+		goto err_out;
+	}
 
 	/* add sequence IDs and SHAs */
-	new_pkts = g_list_reverse(new_pkts);
 	for (tmp_list = g_list_first(new_pkts);
 	     tmp_list;
 	     tmp_list = g_list_next(tmp_list)) {
@@ -726,10 +1198,11 @@ bool sess_sendmsg(struct session *sess,
 			(op->pkt_data + (op->pkt_len - CLD_PKT_FTR_LEN));
 		int ret;
 
+		op->seqid = sess->next_seqid_out;
 		foot->seqid = next_seqid_le(&sess->next_seqid_out);
-		ret = cld_authsign(&srv_log, secret_key,
-				op->pkt_data, op->pkt_len - SHA_DIGEST_LENGTH,
-				foot->sha);
+		ret = cld_auth_key_sign(auth_key, op->pkt_data,
+					op->pkt_len - SHA_DIGEST_LENGTH,
+					foot->sha);
 		if (ret) {
 			HAIL_ERR(&srv_log, "%s: authsign failed: %d",
 				 __func__, ret);
@@ -737,17 +1210,13 @@ bool sess_sendmsg(struct session *sess,
 		}
 	}
 
-	/* send packets */
-	for (tmp_list = g_list_first(new_pkts);
-	     tmp_list;
-	     tmp_list = g_list_next(tmp_list)) {
-		struct session_outpkt *op =
-			(struct session_outpkt *) tmp_list->data;
-		tcp_tx(sess->sock_fd, (struct sockaddr *) &sess->addr,
-			sess->addr_len, op->pkt_data, op->pkt_len);
+	/* nothing leaves before the log covering it is on disk */
+	if (cld_srv.commit_pending) {
+		cld_srv.commit_q = g_list_concat(cld_srv.commit_q, new_pkts);
+		return true;
 	}
 
-	session_outq(sess, new_pkts);
+	sess_xmit(sess, new_pkts);
 
 	return true;
 
@@ -772,49 +1241,33 @@ void sess_sendresp_generic(struct session *sess, enum cle_err_codes code)
 		     (void *)&resp, sess->msg_op, NULL, NULL);
 }
 
-void msg_ack(struct session *sess, uint64_t seqid)
+void msg_ack(struct session *sess, uint64_t seqid, bool cumulative)
 {
-	GList *tmp, *tmp1;
 	struct session_outpkt *op;
+	uint64_t first;
 
-	if (!sess->out_q)
-		return;
-
-	/* look through output queue */
-	tmp = sess->out_q;
-	while (tmp) {
-		uint64_t op_seqid;
-		struct cld_pkt_ftr *foot;
-		tmp1 = tmp;
-		tmp = tmp->next;
-
-		op = tmp1->data;
-		foot = (struct cld_pkt_ftr *)
-			(op->pkt_data + (op->pkt_len - CLD_PKT_FTR_LEN));
-		op_seqid = le64_to_cpu(foot->seqid);
-
-		/* if matching seqid found, we ack'd a message in out_q */
-		if (seqid != op_seqid)
+	first = cumulative ? sess->out_base : seqid;
+	for (; first <= seqid && first < sess->out_end; first++) {
+		op = outq_remove(sess, first);
+		if (!op)
 			continue;
 
 		HAIL_DEBUG(&srv_log, "    expiring seqid %llu",
-			   (unsigned long long) op_seqid);
-
-		/* remove and delete the ack'd msg; call ack'd callback */
-		sess->out_q = g_list_delete_link(sess->out_q, tmp1);
+			   (unsigned long long) op->seqid);
 
+		/* delete the ack'd msg; call ack'd callback */
 		if (op->done_cb)
 			op->done_cb(op);
 		op_unref(op);
 	}
 
-	if (!sess->out_q)
-		if (evtimer_del(&sess->retry_timer) < 0)
-			HAIL_ERR(&srv_log, "sess retry timer del 2 failed");
+	if (!sess->out_count)
+		srv_timer_del(&sess->retry_timer);
 }
 
 void msg_new_sess(int sock_fd, const struct client *cli,
-		  const struct pkt_info *info)
+		  const struct pkt_info *info,
+		  const void *msg, size_t msg_len)
 {
 	const struct cld_pkt_hdr *pkt = info->pkt;
 	DB *db = cld_srv.cldb.sessions;
@@ -824,7 +1277,20 @@ void msg_new_sess(int sock_fd, const struct client *cli,
 	int rc;
 	enum cle_err_codes resp_rc = CLE_OK;
 	struct cld_msg_generic_resp resp;
-	struct timeval tv;
+	struct cld_msg_new_sess new_sess = {0};
+
+	/* older clients send NEW-SESS without a body */
+	if (msg_len) {
+		XDR xin;
+
+		xdrmem_create(&xin, (void *)msg, msg_len, XDR_DECODE);
+		if (!xdr_cld_msg_new_sess(&xin, &new_sess)) {
+			xdr_destroy(&xin);
+			resp_rc = CLE_BAD_PKT;
+			goto err_out;
+		}
+		xdr_destroy(&xin);
+	}
 
 	sess = session_new();
 	if (!sess) {
@@ -840,10 +1306,14 @@ void msg_new_sess(int sock_fd, const struct client *cli,
 		pkt->user);
 
 	sess->sock_fd = sock_fd;
+	sess->conn_gen = cli->gen;
 	sess->addr_len = cli->addr_len;
 	strncpy(sess->ipaddr, cli->addr_host, sizeof(sess->ipaddr));
 	sess->last_contact = current_time.tv_sec;
 	sess->next_seqid_in = info->seqid + 1;
+	sess->flags = new_sess.flags &
+		      (CSF_LARGE_FRAMES | CSF_STREAM | CSF_READDIR |
+		       CSF_WATCH | CSF_COMPOUND | CSF_CUM_ACK);
 
 	session_encode(&raw_sess, sess);
 
@@ -877,16 +1347,23 @@ void msg_new_sess(int sock_fd, const struct client *cli,
 	htab_put(cld_srv.sessions, sess->sid, sess);
 
 	/* begin session timer */
-	tv.tv_sec = CLD_SESS_TIMEOUT / 2;
-	tv.tv_usec = 0;
-	if (evtimer_add(&sess->timer, &tv) < 0)
-		HAIL_ERR(&srv_log, "sess timer start failed");
+	srv_timer_add(&sess->timer, CLD_SESS_TIMEOUT / 2 * 1000);
 
-	/* send new-sess reply */
+	/* send new-sess reply; only clients which asked for features
+	 * know how to parse the extended response
+	 */
 	resp.code = CLE_OK;
 	resp.xid_in = info->xid;
-	sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_generic_resp,
-		     (void *)&resp, CMO_NEW_SESS, NULL, NULL);
+	if (msg_len) {
+		struct cld_msg_new_sess_resp ns_resp;
+
+		ns_resp.msg = resp;
+		ns_resp.flags = sess->flags;
+		sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_new_sess_resp,
+			     (void *)&ns_resp, CMO_NEW_SESS, NULL, NULL);
+	} else
+		sess_sendmsg(sess, (xdrproc_t)xdr_cld_msg_generic_resp,
+			     (void *)&resp, CMO_NEW_SESS, NULL, NULL);
 
 	return;
 
@@ -929,7 +1406,7 @@ void msg_end_sess(struct session *sess, uint64_t xid)
  * Fill ss with contents of the database.
  * Returns -1 on error because it prints the diagnostic to the log.
  */
-int sess_load(struct htab *ss)
+int sess_load(void)
 {
 	DB_ENV *dbenv = cld_srv.cldb.env;
 	DB_TXN *txn;
@@ -945,7 +1422,13 @@ int sess_load(struct htab *ss)
 		return -1;
 	}
 
-	if (sess_load_db(ss, txn) != 0) {
+	if (sess_load_db(txn) != 0) {
+		txn->abort(txn);
+		return -1;
+	}
+
+	/* rebuild the lock table from its journal */
+	if (lock_load(txn) != 0) {
 		txn->abort(txn);
 		return -1;
 	}
@@ -957,19 +1440,40 @@ int sess_load(struct htab *ss)
 	return 0;
 }
 
-static int sess_load_db(struct htab *ss, DB_TXN *txn)
+static gint sess_dormant_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct sess_dormant *x = *(struct sess_dormant * const *) a;
+	const struct sess_dormant *y = *(struct sess_dormant * const *) b;
+	uint64_t lx = le64_to_cpu(x->raw.last_contact);
+	uint64_t ly = le64_to_cpu(y->raw.last_contact);
+
+	return lx < ly ? -1 : lx > ly;
+}
+
+/*
+ * Recovered sessions stay as their raw records until a packet, an event
+ * or the reaper needs them; only the reaper's timer is armed here.
+ */
+static int sess_load_db(DB_TXN *txn)
 {
 	DB *db = cld_srv.cldb.sessions;
 	DBC *cur;
 	DBT key, val;
-	struct session *sess;
+	struct sess_dormant *sd;
 	struct raw_session raw_sess;
 	int rc;
 
+	sess_dormant = htab_new(sess_hash, sess_equal, NULL, NULL);
+	sess_reap_q = g_ptr_array_new();
+	if (!sess_dormant || !sess_reap_q) {
+		HAIL_ERR(&srv_log, "sess_load alloc");
+		goto err_out;
+	}
+
 	rc = db->cursor(db, txn, &cur, 0);
 	if (rc) {
 		db->err(db, rc, "sess_load cur");
-		return -1;
+		goto err_out;
 	}
 
 	memset(&key, 0, sizeof(key));
@@ -980,7 +1484,8 @@ static int sess_load_db(struct htab *ss, DB_TXN *txn)
 	val.flags = DB_DBT_USERMEM;
 
 	while (1) {
-		struct timeval tv;
+		/* records written before 'flags' existed are shorter */
+		memset(&raw_sess, 0, sizeof(raw_sess));
 
 		rc = cur->get(cur, &key, &val, DB_NEXT);
 		if (rc == DB_NOTFOUND)
@@ -988,36 +1493,51 @@ static int sess_load_db(struct htab *ss, DB_TXN *txn)
 		if (rc) {
 			db->err(db, rc, "sess_load get");
 			cur->close(cur);
-			return -1;
+			goto err_out;
 		}
 
-		sess = session_new();
-		if (!sess) {
-			db->err(db, rc, "sess_load alloc");
+		sd = calloc(1, sizeof(*sd));
+		if (!sd) {
+			HAIL_ERR(&srv_log, "sess_load alloc");
 			cur->close(cur);
-			return -1;
+			goto err_out;
 		}
-
-		session_decode(sess, &raw_sess);
+		sd->raw = raw_sess;
 
 		HAIL_DEBUG(&srv_log, " loaded sid " SIDFMT
 			   " next seqid %llu/%llu",
-			   SIDARG(sess->sid),
-			   (unsigned long long) le64_to_cpu(sess->next_seqid_out),
-			   (unsigned long long) le64_to_cpu(sess->next_seqid_in));
+			   SIDARG(sd->raw.sid),
+			   (unsigned long long)
+				le64_to_cpu(sd->raw.next_seqid_out),
+			   (unsigned long long)
+				le64_to_cpu(sd->raw.next_seqid_in));
+
+		htab_put(sess_dormant, sd->raw.sid, sd);
+		g_ptr_array_add(sess_reap_q, sd);
+	}
 
-		htab_put(ss, sess->sid, sess);
+	cur->close(cur);
 
-		/* begin session timer */
-		tv.tv_sec = CLD_SESS_TIMEOUT / 2;
-		tv.tv_usec = 0;
-		if (evtimer_add(&sess->timer, &tv) < 0) {
-			HAIL_ERR(&srv_log, "sess timer loop start failed");
-			break;
-		}
+	if (!sess_reap_q->len) {
+		sess_dormant_free();
+		return 0;
 	}
 
-	cur->close(cur);
+	HAIL_INFO(&srv_log, "recovered %u sessions", sess_reap_q->len);
+
+	g_ptr_array_sort(sess_reap_q, sess_dormant_cmp);
+	sess_reap_grace = time(NULL) + CLD_SESS_TIMEOUT / 2;
+	cld_timer_init(&sess_reap_timer, "sess-reap", sess_reap, NULL);
+	srv_timer_add(&sess_reap_timer, CLD_SESS_TIMEOUT / 2 * 1000);
 	return 0;
+
+err_out:
+	if (sess_reap_q)
+		sess_dormant_free();
+	else if (sess_dormant) {
+		htab_free(sess_dormant);
+		sess_dormant = NULL;
+	}
+	return -1;
 }
 
@@ -40,25 +40,40 @@ struct st_keylist {
 	GList		*contents;
 };
 
+struct stc_async;
+struct stc_pool_node;
+
 struct st_client {
 	char		*host;
+	int		port;
 	char		*user;
 	char		*key;
 	bool		verbose;
 
 	int		fd;
 
-	SSL_CTX		*ssl_ctx;
+	SSL_CTX		*ssl_ctx;	/* shared by all clients */
 	SSL		*ssl;
 
+	struct stc_async *async;	/* set by stc_new_async */
+	struct stc_pool_node *pool_node;	/* lender, if pooled */
+
 	char		req_buf[sizeof(struct chunksrv_req) + CHD_KEY_SZ +
 				sizeof(struct chunksrv_req_getpart)];
 };
 
+/* TLS handshakes made by this process's clients, all servers */
+struct stc_ssl_stats {
+	unsigned long	handshakes;
+	unsigned long	resumed;	/* of which, abbreviated */
+};
+
 extern void stc_free(struct st_client *stc);
 extern void stc_free_keylist(struct st_keylist *keylist);
 extern void stc_free_object(struct st_object *obj);
 extern void stc_init(void);
+extern void stc_exit(void);
+extern void stc_ssl_stats(struct stc_ssl_stats *out);
 
 extern struct st_client *stc_new(const char *service_host, int port,
 				 const char *user, const char *secret_key,
@@ -99,6 +114,21 @@ extern bool stc_put_sync(struct st_client *stc);
 extern bool stc_put_inline(struct st_client *stc, const void *key,
 			   size_t key_len, void *data, uint64_t len,
 			   uint32_t flags);
+extern bool stc_put_fd(struct st_client *stc, const void *key,
+		       size_t key_len, int fd, uint64_t len, uint32_t flags);
+extern bool stc_get_fd(struct st_client *stc, const void *key,
+		       size_t key_len, int fd, uint64_t *len);
+extern bool stc_put_fd_at(struct st_client *stc, const void *key,
+			  size_t key_len, int fd, uint64_t offset,
+			  uint64_t len, uint32_t flags);
+extern bool stc_get_fd_at(struct st_client *stc, const void *key,
+			  size_t key_len, int fd, uint64_t offset,
+			  uint64_t *len);
+extern bool stc_get_fd_len(struct st_client *stc, const void *key,
+			   size_t key_len, int fd, uint64_t len);
+extern bool stc_get_fd_len_at(struct st_client *stc, const void *key,
+			      size_t key_len, int fd, uint64_t offset,
+			      uint64_t len);
 extern bool stc_cp(struct st_client *stc,
 		   const void *dest_key, size_t dest_key_len,
 		   const void *src_key, size_t src_key_len);
@@ -112,6 +142,134 @@ extern bool stc_check_status(struct st_client *stc,
 
 extern struct st_keylist *stc_keys(struct st_client *stc);
 
+/*
+ * Asynchronous interface.  A client from stc_new_async only takes the
+ * stc_async_* calls.  Wait until stc_async_fd is ready for
+ * stc_async_events (e.g. with a libevent event, re-armed each time),
+ * then call stc_async_run; completions are delivered from inside it.
+ */
+enum {
+	STC_EV_READ		= (1 << 0),
+	STC_EV_WRITE		= (1 << 1),
+};
+
+struct stc_result {
+	bool			ok;
+	int			resp_code;	/* che_xxx, -1 if no reply */
+	uint64_t		size;		/* body bytes moved */
+	void			*data;		/* inline GET, CHECK_STATUS */
+	size_t			data_len;
+	struct st_keylist	*keylist;	/* LIST */
+};
+
+/*
+ * data and keylist are freed after the callback unless it NULLs them.
+ * A callback may stc_free its client; the free is put off until
+ * stc_async_run is done with it, which then returns false.
+ */
+typedef void (*stc_async_cb)(struct st_client *stc, struct stc_result *res,
+			     void *priv);
+
+extern struct st_client *stc_new_async(const char *service_host, int port,
+				       const char *user,
+				       const char *secret_key, bool encrypt);
+extern int stc_async_fd(struct st_client *stc);
+extern unsigned int stc_async_events(struct st_client *stc);
+extern unsigned int stc_async_pending(struct st_client *stc);
+extern bool stc_async_run(struct st_client *stc);
+
+extern bool stc_async_table_open(struct st_client *stc, const void *key,
+				 size_t key_len, uint32_t flags,
+				 stc_async_cb cb, void *priv);
+extern bool stc_async_get(struct st_client *stc, const void *key,
+			  size_t key_len,
+			  size_t (*write_cb)(void *, size_t, size_t, void *),
+			  void *user_data, stc_async_cb cb, void *priv);
+extern bool stc_async_get_part(struct st_client *stc, const void *key,
+			       size_t key_len, uint64_t offset,
+			       uint64_t max_len,
+			       size_t (*write_cb)(void *, size_t, size_t, void *),
+			       void *user_data, stc_async_cb cb, void *priv);
+extern bool stc_async_put(struct st_client *stc, const void *key,
+			  size_t key_len,
+			  size_t (*read_cb)(void *, size_t, size_t, void *),
+			  uint64_t len, void *user_data, uint32_t flags,
+			  stc_async_cb cb, void *priv);
+extern bool stc_async_put_inline(struct st_client *stc, const void *key,
+				 size_t key_len, void *data, uint64_t len,
+				 uint32_t flags, stc_async_cb cb, void *priv);
+extern bool stc_async_cp(struct st_client *stc,
+			 const void *dest_key, size_t dest_key_len,
+			 const void *src_key, size_t src_key_len,
+			 stc_async_cb cb, void *priv);
+extern bool stc_async_del(struct st_client *stc, const void *key,
+			  size_t key_len, stc_async_cb cb, void *priv);
+extern bool stc_async_ping(struct st_client *stc, stc_async_cb cb,
+			   void *priv);
+extern bool stc_async_keys(struct st_client *stc, stc_async_cb cb,
+			   void *priv);
+extern bool stc_async_check_start(struct st_client *stc, stc_async_cb cb,
+				  void *priv);
+extern bool stc_async_check_status(struct st_client *stc, stc_async_cb cb,
+				   void *priv);
+
+/*
+ * Connection pool (chunkdc-pool.c).  If threads share a pool, call
+ * g_thread_init before stc_pool_new.
+ */
+struct stc_pool_node {
+	char			*host;
+	int			port;
+	GList			*idle;		/* logged-in st_client's */
+	unsigned int		busy;		/* lent out now */
+};
+
+struct stc_pool {
+	char			*user;
+	char			*key;
+	char			*table;		/* opened on each connect */
+	uint32_t		table_flags;	/* CHF_TBL_xxx for that */
+	bool			encrypt;
+	bool			verbose;
+	unsigned int		max_per_node;
+
+	GList			*nodes;		/* stc_pool_node */
+	unsigned int		n_nodes;
+
+	GMutex			*lock;
+	GCond			*cond;		/* a connection came back */
+
+	struct {
+		unsigned long	connects;	/* new connections made */
+		unsigned long	reused;		/* idle connections lent */
+		unsigned long	dropped;	/* closed, dead or failed */
+	} stats;
+};
+
+extern struct stc_pool *stc_pool_new(const char *user,
+				     const char *secret_key,
+				     const char *table, bool encrypt,
+				     unsigned int max_per_node);
+extern int stc_pool_add(struct stc_pool *pool, const char *host, int port);
+extern struct st_client *stc_pool_get(struct stc_pool *pool, int node_idx);
+extern void stc_pool_put(struct stc_pool *pool, struct st_client *stc,
+			 bool reuse);
+extern void stc_pool_free(struct stc_pool *pool);
+
+/* Striped objects over a pool (chunkdc-stripe.c) */
+enum {
+	STC_STRIPE_PART_SZ	= 64 * 1024 * 1024,	/* default part size */
+};
+
+extern bool stc_stripe_put_fd(struct stc_pool *pool, const void *key,
+			      size_t key_len, int fd, uint64_t len,
+			      uint64_t part_sz, unsigned int parallel);
+extern bool stc_stripe_get_fd(struct stc_pool *pool, const void *key,
+			      size_t key_len, int fd, uint64_t *len,
+			      unsigned int parallel);
+extern bool stc_stripe_del(struct stc_pool *pool, const void *key,
+			   size_t key_len);
+
 static inline void *stc_get_inlinez(struct st_client *stc,
 				    const char *key,
 				    size_t *len)
@@ -172,4 +330,35 @@ static inline bool stc_cpz(struct st_client *stc,
 		      src_key, strlen(src_key) + 1);
 }
 
+static inline bool stc_async_getz(struct st_client *stc, const char *key,
+			size_t (*write_cb)(void *, size_t, size_t, void *),
+			void *user_data, stc_async_cb cb, void *priv)
+{
+	return stc_async_get(stc, key, strlen(key) + 1, write_cb, user_data,
+			     cb, priv);
+}
+
+static inline bool stc_async_put_inlinez(struct st_client *stc,
+					 const char *key, void *data,
+					 uint64_t len, uint32_t flags,
+					 stc_async_cb cb, void *priv)
+{
+	return stc_async_put_inline(stc, key, strlen(key) + 1, data, len,
+				    flags, cb, priv);
+}
+
+static inline bool stc_async_delz(struct st_client *stc, const char *key,
+				  stc_async_cb cb, void *priv)
+{
+	return stc_async_del(stc, key, strlen(key) + 1, cb, priv);
+}
+
+static inline bool stc_async_table_openz(struct st_client *stc,
+					 const char *key, uint32_t flags,
+					 stc_async_cb cb, void *priv)
+{
+	return stc_async_table_open(stc, key, strlen(key) + 1, flags,
+				    cb, priv);
+}
+
 #endif /* __STC_H__ */
@@ -26,13 +26,30 @@
 #include <time.h>
 #include <glib.h>
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
 #include <cld_msg_rpc.h>
 #include <hail_log.h>
 
 #define CLD_ALIGN8(n) ((8 - ((n) & 7)) & 7)
 
+/* where a cld with --unix-socket puts its AF_UNIX socket, cld-PORT.sock;
+ * clients on the same host connect there rather than over TCP
+ */
+#define CLD_UNIX_DIR	"/var/run/cld"
+
 enum {
 	CLD_RAW_MSG_SZ		= 4096,
+
+	/* largest UBBP frame of a CSF_LARGE_FRAMES session: a whole
+	 * message, plus packet header and footer
+	 */
+	CLD_MAX_FRAME_SZ	= CLD_MAX_MSG_SZ + CLD_RAW_MSG_SZ,
+};
+
+enum {
+	CLD_TIMER_BITS		= 6,
+	CLD_TIMER_SLOTS		= (1 << CLD_TIMER_BITS),
+	CLD_TIMER_LEVELS	= 6,	/* 2^36 msec: two years ahead */
 };
 
 struct cld_timer {
@@ -40,19 +57,35 @@ struct cld_timer {
 	bool			on_list;
 	void			(*cb)(struct cld_timer *);
 	void			*userdata;
-	time_t			expires;
+	uint64_t		expires;	/* msec since the epoch */
+	struct cld_timer	*next;		/* in wheel slot */
+	struct cld_timer	**pprev;
+	unsigned int		level;		/* wheel level holding us */
 	char			name[32];
 };
 
+/*
+ * Hierarchical timing wheel with millisecond ticks: level 0 holds the
+ * next CLD_TIMER_SLOTS msec one slot apiece, each level above covers
+ * CLD_TIMER_SLOTS times the span of the one below, and its timers are
+ * dropped a level as their slot comes up.  Add and delete are O(1).
+ * A zeroed list is ready for use.
+ */
 struct cld_timer_list {
-	GList *list;		/* of struct cld_timer */
-	time_t			runmark;
+	struct cld_timer	*wheel[CLD_TIMER_LEVELS][CLD_TIMER_SLOTS];
+	unsigned int		n_level[CLD_TIMER_LEVELS];
+	unsigned int		count;
+	uint64_t		tick;		/* next msec to run */
 };
 
+extern uint64_t cld_time_ms(void);
 extern void cld_timer_add(struct cld_timer_list *tlist, struct cld_timer *timer,
 			  time_t expires);
+extern void cld_timer_add_ms(struct cld_timer_list *tlist,
+			     struct cld_timer *timer, unsigned long msec);
 extern void cld_timer_del(struct cld_timer_list *tlist, struct cld_timer *timer);
 extern time_t cld_timers_run(struct cld_timer_list *tlist);
+extern unsigned long cld_timers_run_ms(struct cld_timer_list *tlist);
 
 static inline void cld_timer_init(struct cld_timer *timer, const char *name,
 	void (*cb)(struct cld_timer *), void *userdata)
@@ -64,11 +97,116 @@ static inline void cld_timer_init(struct cld_timer *timer, const char *name,
 	timer->name[sizeof(timer->name) - 1] = 0;
 }
 
+enum {
+	CLD_BUF_CLASSES		= 4,	/* 4K, 16K, 64K, CLD_MAX_FRAME_SZ */
+	CLD_BUF_KEEP		= 16,	/* idle buffers kept per class */
+};
+
+/*
+ * Size-classed pool of message and packet buffers, so that reassembly
+ * and encoding only hold memory while a message is in flight.  Idle buffers are
+ * threaded through their own first bytes.  A zeroed pool is ready for
+ * use; it does no locking of its own.
+ */
+struct cld_buf_pool {
+	void			*free_list[CLD_BUF_CLASSES];
+	unsigned int		n_free[CLD_BUF_CLASSES];
+	unsigned long		alloc;		/* buffers malloc'ed */
+	unsigned long		reuse;		/* served from a free list */
+	unsigned long		in_use;		/* handed out, not yet put */
+};
+
+/** Get a buffer of at least @size bytes from a pool.
+ *
+ * @param pool		The pool
+ * @param size		Bytes needed, at most CLD_MAX_FRAME_SZ
+ * @param cap		(out param) Capacity of the buffer returned
+ *
+ * @return		The buffer, or NULL if too large or out of memory
+ */
+extern void *cld_buf_get(struct cld_buf_pool *pool, size_t size, size_t *cap);
+
+/** Return a buffer to its pool.  NULL is ignored.
+ *
+ * @param pool		The pool
+ * @param buf		Buffer from cld_buf_get
+ * @param cap		Capacity cld_buf_get reported for it
+ */
+extern void cld_buf_put(struct cld_buf_pool *pool, void *buf, size_t cap);
+
+/** Make room for @need bytes in a pooled buffer, keeping the first @len.
+ * A NULL *bufp is allocated fresh.
+ *
+ * @param pool		The pool
+ * @param bufp		(in/out) The buffer
+ * @param capp		(in/out) Its capacity
+ * @param len		Bytes of *bufp to carry over to a larger buffer
+ * @param need		Bytes needed in total
+ *
+ * @return		0 on success; -ENOMEM or -EMSGSIZE otherwise
+ */
+extern int cld_buf_reserve(struct cld_buf_pool *pool, char **bufp,
+			   size_t *capp, size_t len, size_t need);
+
+/** Release all idle buffers held by a pool. */
+extern void cld_buf_pool_free(struct cld_buf_pool *pool);
+
 extern unsigned long long cld_sid2llu(const uint8_t *sid);
 extern void cld_rand64(void *p);
 extern const char *cld_errstr(enum cle_err_codes ecode);
 extern int cld_readport(const char *fname);	/* deprecated */
 extern int hail_readport(const char *fname);
+extern int cld_unix_path(char *buf, size_t len, const char *dir,
+			 unsigned int port);
+
+/*
+ * An HMAC-SHA1 key, scheduled once into an OpenSSL MAC context.  Each
+ * packet signed or checked runs on a copy of it, rather than redoing
+ * the key schedule.  Release with cld_auth_key_fini.
+ */
+struct cld_auth_key {
+	bool			valid;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX		*ctx;
+#else
+	HMAC_CTX		*ctx;
+#endif
+};
+
+/** Schedule an HMAC key.
+ *
+ * @param ak		(out param) The scheduled key
+ * @param key		The key, as a NULL-terminated string
+ *
+ * @return		0 on success; -EINVAL for a NULL or empty key,
+ *			-ENOMEM if OpenSSL could not set it up
+ */
+extern int cld_auth_key_init(struct cld_auth_key *ak, const char *key);
+
+/** Release a key set up by cld_auth_key_init; it is no longer valid. */
+extern void cld_auth_key_fini(struct cld_auth_key *ak);
+
+/** Sign a byte buffer with a scheduled key.
+ *
+ * @param ak		The scheduled key
+ * @param buf		The buffer
+ * @param buf_len	Length of the buffer
+ * @param sha		(out param) The signature, SHA_DIGEST_LENGTH bytes
+ *
+ * @return		0 on success; -EINVAL if the key is not valid,
+ *			-ENOMEM if OpenSSL could not copy it
+ */
+extern int cld_auth_key_sign(const struct cld_auth_key *ak,
+			     const void *buf, size_t buf_len, void *sha);
+
+/** Validate the signature of a byte buffer with a scheduled key.
+ *
+ * @return		0 on success; -EPERM on mismatch, -EINVAL if the
+ *			key is not valid
+ */
+extern int cld_auth_key_check(const struct cld_auth_key *ak,
+			      const void *buf, size_t buf_len,
+			      const void *sha);
 
 /*** Validate the HMAC signature of a byte buffer.
  *
@@ -101,6 +239,69 @@ extern int cld_authsign(struct hail_log *log, const char *key,
 /* Returns a constant string representing a message operation */
 extern const char *cld_opstr(enum cld_msg_op);
 
+/* Returns the message info of a packet beginning a message, else NULL */
+static inline const struct cld_pkt_msg_infos *
+cld_pkt_infos(const struct cld_pkt_hdr *pkt)
+{
+	if (!(pkt->mi.order & CLD_PKT_IS_FIRST))
+		return NULL;
+	if (pkt->mi.order & CLD_PKT_HAS_ACK)
+		return &pkt->mi.cld_pkt_msg_info_u.mia.mi;
+	return &pkt->mi.cld_pkt_msg_info_u.mi;
+}
+
+enum {
+	/* largest encoded packet header: magic, sid, user, order, xid,
+	 * op and a piggybacked ACK, rounded up
+	 */
+	CLD_PKT_HDR_MAX		= 128,
+};
+
+/** Encode a packet header into a buffer.
+ *
+ * @param pkt		The header
+ * @param buf		Buffer to write
+ * @param buf_len	Length of the buffer; CLD_PKT_HDR_MAX always suffices
+ *
+ * @return		Bytes written, or 0 on error
+ */
+extern size_t cld_pkt_hdr_encode(const struct cld_pkt_hdr *pkt, void *buf,
+				 size_t buf_len);
+
+/* Takes a finished packet, and the pooled buffer holding it; nonzero
+ * stops cld_msg_pack
+ */
+typedef int (*cld_pkt_emit_t)(void *priv, char *buf, size_t cap,
+			      char *pkt, size_t pkt_len);
+
+/** Encode a message into packets, in one pass over the message.
+ *
+ * The body is serialized once into a pooled buffer, behind room for a
+ * header.  A body of at most @max_chunk bytes gets its header written
+ * just in front of it and is emitted in place; a longer one is copied
+ * out in @max_chunk fragments, each to a pooled buffer of its own size
+ * class.  Packets come with a zeroed footer, for the caller to number
+ * and sign.
+ *
+ * @param pool		Pool for packet buffers
+ * @param first		Header of the first packet, order CLD_PKT_IS_FIRST
+ *			(with or without CLD_PKT_HAS_ACK); later packets
+ *			share its magic, sid and user
+ * @param xdrproc	XDR routine of the message
+ * @param xdrdata	The message
+ * @param max_chunk	Largest body fragment per packet
+ * @param emit		Called with each packet, in order; owns the buffer
+ *			from then on, even if it fails
+ * @param priv		Passed to @emit
+ *
+ * @return		0 on success; -ENOMEM, -EMSGSIZE, -EINVAL, or the
+ *			first nonzero return of @emit otherwise
+ */
+extern int cld_msg_pack(struct cld_buf_pool *pool,
+			const struct cld_pkt_hdr *first,
+			xdrproc_t xdrproc, const void *xdrdata,
+			size_t max_chunk, cld_pkt_emit_t emit, void *priv);
+
 /*
  * We use a unified format for sid so it can be searched in log files (* in vi).
  */
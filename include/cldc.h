@@ -37,6 +37,7 @@ struct cldc_call_opts {
 
 	/* private; lib-owned */
 	struct cld_msg_get_resp resp;
+	bool		eof;		/* READDIR: no names follow */
 };
 
 struct cldc_node_metadata {
@@ -54,8 +55,9 @@ struct cldc_pkt_info {
 	int		retries;
 	char		user[CLD_MAX_USERNAME];
 
-	/* must be at end of struct */
-	char		data[0];
+	char		*data;		/* the packet, within buf */
+	char		*buf;		/* pooled buffer holding it */
+	size_t		buf_cap;
 };
 
 /** an outgoing message, from client to server */
@@ -125,13 +127,21 @@ struct cldc_session {
 
 	char		user[CLD_MAX_USERNAME];
 	char		secret_key[CLD_MAX_SECRET_KEY];
+	struct cld_auth_key auth_key;		/* secret_key, scheduled */
 
 	bool		confirmed;
+	uint32_t	flags;			/* CSF_xxx granted by server */
+
+	unsigned int	ack_pending;		/* pkts rx'd, not yet ACK'd */
+	time_t		retry_time;		/* next retransmit pass */
 
 	enum cld_msg_op msg_buf_op;
 	unsigned int	msg_buf_len;
-	char		msg_buf[CLD_MAX_MSG_SZ];
-	char		payload[CLD_MAX_PAYLOAD_SZ];
+	size_t		msg_buf_cap;
+	char		*msg_buf;		/* pooled, while reassembling */
+
+	char		*payload;		/* pooled, after first GET */
+	size_t		payload_cap;
 	char		inode_name_temp[CLD_INODE_NAME_MAX];
 };
 
@@ -153,14 +163,13 @@ struct cldc_tcp {
 	struct ubbp_header ubbp;
 	unsigned int	ubbp_read;
 
+	char		*pkt;			/* raw_pkt or large_pkt */
+	char		*large_pkt;		/* CSF_LARGE_FRAMES frames */
 	char		raw_pkt[CLD_RAW_MSG_SZ];
 	unsigned int	raw_size;
 	unsigned int	raw_read;
 
-	struct cldc_session *sess;
-
-	int		(*cb)(struct cldc_session *, void *);
-	void		*cb_private;
+	GList		*sessions;		/* cldc_session sharing us */
 };
 
 struct cld_dirent_cur {
@@ -185,6 +194,28 @@ extern int cldc_receive_pkt(struct cldc_session *sess,
 		     const void *net_addr, size_t net_addrlen,
 		     const void *buf, size_t buflen);
 
+/**
+ * Find the session a received packet is for, by its sid
+ *
+ * @param sessions List of sessions sharing one transport connection
+ * @param buf Pointer to data buffer containing packet
+ * @param buflen Length of received packet
+ * @return The session, or NULL if the packet is for none of them
+ */
+extern struct cldc_session *cldc_pkt_sess(GList *sessions,
+					  const void *buf, size_t buflen);
+
+/**
+ * Count traffic on the session's connection as contact with the server
+ *
+ * The server probes one of the CSF_STREAM sessions sharing a connection
+ * on behalf of all.  Called by app for every session on a connection
+ * which delivered a good packet, to any of them.
+ *
+ * @param sess Session to keep from expiring
+ */
+extern void cldc_sess_renew(struct cldc_session *sess);
+
 extern void cldc_init(void);
 extern int cldc_new_sess(const struct cldc_ops *ops,
 		  const struct cldc_call_opts *copts,
@@ -193,6 +224,24 @@ extern int cldc_new_sess(const struct cldc_ops *ops,
 		  void *private,
 		  struct cldc_session **sess_out);
 extern void cldc_kill_sess(struct cldc_session *sess);
+
+/**
+ * Move a CSF_STREAM session onto a new transport connection
+ *
+ * Called by app after it connected to the server again, once the
+ * old connection failed.  A signed RECONNECT tells the server to
+ * move the session; then reads still awaiting a response are sent
+ * again, in their original order, under fresh sequence numbers.
+ * Other requests may already have been applied, so they complete
+ * with CLE_CONN_RESET instead.
+ *
+ * @param sess Session to move
+ * @param addr Opaque network address of the new connection
+ * @param addr_len Size of opaque network address
+ * @return Zero for success, negative errno on error
+ */
+extern int cldc_sess_reconnect(struct cldc_session *sess,
+			       const void *addr, size_t addr_len);
 extern int cldc_end_sess(struct cldc_session *sess,
 				const struct cldc_call_opts *copts);
 extern int cldc_nop(struct cldc_session *sess,
@@ -212,6 +261,96 @@ extern int cldc_put(struct cldc_fh *fh, const struct cldc_call_opts *copts,
 	     const void *data, size_t data_len);
 extern int cldc_get(struct cldc_fh *fh, const struct cldc_call_opts *copts,
 	     bool metadata_only);
+
+/**
+ * PUT, but only if the file is still at an expected version
+ *
+ * copts->resp.vers holds the version after the PUT, or on
+ * CLE_VERS_MISMATCH the version the file is actually at.
+ *
+ * @param fh Handle of a file opened with COM_WRITE
+ * @param copts Call options
+ * @param data Data to write
+ * @param data_len Length of data
+ * @param vers Version the file must be at
+ * @return Zero for success; -EOPNOTSUPP if the server predates PUT-IF;
+ *	   other negative errno on error
+ */
+extern int cldc_put_if(struct cldc_fh *fh, const struct cldc_call_opts *copts,
+		       const void *data, size_t data_len, uint64_t vers);
+
+/**
+ * OPEN, GET and CLOSE a file as one server transaction
+ *
+ * The reply is read as cldc_get's is; no handle is created.
+ *
+ * @param sess Session
+ * @param copts Call options
+ * @param pathname File to read
+ * @param open_mode COM_CREATE, COM_EXCL, COM_DIRECTORY; COM_READ is implied
+ * @return Zero for success; -EOPNOTSUPP if the server predates OPEN-GET;
+ *	   other negative errno on error
+ */
+extern int cldc_open_get(struct cldc_session *sess,
+			 const struct cldc_call_opts *copts,
+			 const char *pathname, uint32_t open_mode);
+
+/**
+ * OPEN, PUT and CLOSE a file as one server transaction
+ *
+ * copts->resp.vers is set as for cldc_put_if.
+ *
+ * @param sess Session
+ * @param copts Call options
+ * @param pathname File to write
+ * @param open_mode COM_CREATE, COM_EXCL; COM_WRITE is implied
+ * @param data Data to write
+ * @param data_len Length of data
+ * @param check_vers Write only if the file is at version vers
+ * @param vers Expected version, if check_vers
+ * @return Zero for success; -EOPNOTSUPP if the server predates OPEN-PUT;
+ *	   other negative errno on error
+ */
+extern int cldc_open_put(struct cldc_session *sess,
+			 const struct cldc_call_opts *copts,
+			 const char *pathname, uint32_t open_mode,
+			 const void *data, size_t data_len,
+			 bool check_vers, uint64_t vers);
+
+/**
+ * GET a file once its version exceeds one already seen
+ *
+ * Replaces polling: the server holds the request until a PUT (or, for
+ * a directory, a create or delete in it) takes the inode past 'vers',
+ * or until 'timeout' seconds pass, then answers as cldc_get would.
+ *
+ * @param fh Handle of a file opened with COM_READ
+ * @param copts Call options
+ * @param vers Version already seen
+ * @param timeout Most seconds to wait; the server caps it
+ * @return Zero for success; -EOPNOTSUPP if the server predates GET-WAIT;
+ *	   other negative errno on error
+ */
+extern int cldc_get_wait(struct cldc_fh *fh,
+			 const struct cldc_call_opts *copts,
+			 uint64_t vers, int timeout);
+
+/**
+ * List one page of a directory
+ *
+ * The names arrive in name order, packed as cldc_get returns them for
+ * a directory; read them with cldc_copts_get_data and the cldc_dirent
+ * cursor.  copts->eof is set on the last page.
+ *
+ * @param fh Handle of a directory opened with COM_DIRECTORY | COM_READ
+ * @param copts Call options
+ * @param after List names after this one, or NULL from the start
+ * @param max_ents Most names to return, or 0 for as many as fit
+ * @return Zero for success; -EOPNOTSUPP if the server predates READDIR;
+ *	   other negative errno on error
+ */
+extern int cldc_readdir(struct cldc_fh *fh, const struct cldc_call_opts *copts,
+			const char *after, int max_ents);
 extern int cldc_dirent_count(const void *data, size_t data_len);
 extern int cldc_dirent_first(struct cld_dirent_cur *dc);
 extern int cldc_dirent_next(struct cld_dirent_cur *dc);
@@ -227,10 +366,13 @@ extern void cldc_copts_get_metadata(const struct cldc_call_opts *copts,
 extern void cldc_tcp_free(struct cldc_tcp *tcp);
 extern int cldc_tcp_new(const char *hostname, int port,
 		 struct cldc_tcp **tcp_out);
+extern int cldc_tcp_reconnect(struct cldc_tcp *tcp, const char *hostname,
+			      int port);
 extern int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp);
 extern int cldc_tcp_pkt_send(void *private,
 			  const void *addr, size_t addrlen,
 			  const void *buf, size_t buflen);
+extern bool cldc_host_is_local(const char *hostname);
 
 /* cldc-dns */
 extern int cldc_getaddr(GList **host_list, const char *thishost,
@@ -29,22 +29,42 @@
 #include <glib.h>
 #include <cldc.h>
 
-struct ncld_sess {
+/*
+ * One connection to a CLD server, and the thread which polls it, shared
+ * by all the sessions a process opens to the same host and port.  The
+ * server renews every session on a live connection, so one PING keeps
+ * them all.  Session and handle events for all of them are delivered
+ * on the one thread, one at a time.
+ */
+struct ncld_conn {
 	char			*host;
 	unsigned short		port;
+	int			refcnt;		/* sessions, under conn list lock */
 	GMutex			*mutex;
 	GCond			*cond;
 	GThread			*thread;
+	int			to_thread[2];
+	struct cldc_tcp		*tcp;
+	struct cld_timer_list	tlist;
+	GList			*sessions;	/* ncld_sess */
+};
+
+struct ncld_sess {
+	struct ncld_conn	*conn;
+	struct cldc_session	*sess;
+	GMutex			*mutex;		/* conn->mutex */
+	GCond			*cond;		/* conn->cond */
 	bool			is_up;
 	bool			open_done;
 	int			errc;
 	GList			*handles;
-	int			to_thread[2];
-	struct cldc_tcp		*tcp;
-	struct cld_timer	tcp_timer;
-	struct cld_timer_list	tlist;
+	struct cld_timer	timer;
+	int			(*timer_cb)(struct cldc_session *, void *);
+	void			*timer_arg;
 	void			(*event)(void *, unsigned int);
 	void			*event_arg;
+	struct ncld_sess	*reader;	/* replica for read-only opens,
+						   see ncld_sess_replicas */
 };
 
 struct ncld_fh {
@@ -69,24 +89,80 @@ struct ncld_read {
 	/* GCond	*cond; -- abusing conditional of file handle for now */
 	bool		is_done;
 	int		errc;
+	bool		eof;	/* ncld_readdir: last page */
+};
+
+/*
+ * A namespace split over several CLD cells, by top-level directory.
+ * The shard map gives the cell of each listed top-level directory, and
+ * "*" lines give the cells over which all others are spread by hash:
+ *
+ *	# dir		host:port
+ *	/tabled		cld1.example.com:8081
+ *	*		cld2.example.com:8081
+ *	*		cld3.example.com:8081
+ *
+ * ncld_shard_sess names the session for a path; use it as usual.
+ */
+struct ncld_shard {
+	char			*host;
+	unsigned short		port;
+	struct ncld_sess	*nsess;
+};
+
+struct ncld_shard_route {
+	char			*dir;		/* top-level name, no slash */
+	struct ncld_shard	*shard;
+};
+
+struct ncld_shards {
+	GList			*shards;	/* ncld_shard, one per cell */
+	GList			*routes;	/* ncld_shard_route */
+	GPtrArray		*spread;	/* "*" cells */
 };
 
 extern struct ncld_sess *ncld_sess_open(const char *host, int port,
 	int *error, void (*event)(void *, unsigned int), void *ev_arg,
 	const char *cld_user, const char *cld_key, struct hail_log *log);
+extern struct ncld_sess *ncld_sess_open_flags(const char *host, int port,
+	int *error, void (*event)(void *, unsigned int), void *ev_arg,
+	const char *cld_user, const char *cld_key, struct hail_log *log,
+	uint32_t flags);
+extern int ncld_sess_replicas(struct ncld_sess *nsess, GList *replicas,
+	const char *cld_user, const char *cld_key, struct hail_log *log);
 extern struct ncld_fh *ncld_open(struct ncld_sess *s, const char *fname,
 	unsigned int mode, int *error, unsigned int events,
 	void (*event)(void *, unsigned int), void *ev_arg);
 extern int ncld_del(struct ncld_sess *nsess, const char *fname);
 extern struct ncld_read *ncld_get(struct ncld_fh *fh, int *error);
 extern struct ncld_read *ncld_get_meta(struct ncld_fh *fh, int *error);
+extern struct ncld_read *ncld_get_wait(struct ncld_fh *fh, uint64_t vers,
+	int timeout, int *error);
+extern struct ncld_read *ncld_readdir(struct ncld_fh *fh, const char *after,
+	int max_ents, int *error);
+extern struct ncld_read *ncld_open_get(struct ncld_sess *nsess,
+	const char *fname, unsigned int mode, int *error);
 extern void ncld_read_free(struct ncld_read *rp);
 extern int ncld_write(struct ncld_fh *, const void *data, long len);
+extern int ncld_write_if(struct ncld_fh *, const void *data, long len,
+	uint64_t *vers);
+extern int ncld_open_put(struct ncld_sess *nsess, const char *fname,
+	unsigned int mode, const void *data, long len, uint64_t *vers);
 extern int ncld_trylock(struct ncld_fh *);
 extern int ncld_qlock(struct ncld_fh *);
 extern int ncld_unlock(struct ncld_fh *);
 extern void ncld_close(struct ncld_fh *);
 extern void ncld_sess_close(struct ncld_sess *s);
+extern struct ncld_shards *ncld_shards_open(const char *map, int *error,
+	void (*event)(void *, unsigned int), void *ev_arg,
+	const char *cld_user, const char *cld_key, struct hail_log *log);
+extern struct ncld_shards *ncld_shards_open_cld(const char *host, int port,
+	const char *fname, int *error,
+	void (*event)(void *, unsigned int), void *ev_arg,
+	const char *cld_user, const char *cld_key, struct hail_log *log);
+extern struct ncld_sess *ncld_shard_sess(struct ncld_shards *sh,
+	const char *path);
+extern void ncld_shards_close(struct ncld_shards *sh);
 extern void ncld_init(void);
 
 #endif /* __NCLD_H__ */
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <cld_common.h>
+
+static const size_t buf_class_sz[CLD_BUF_CLASSES] = {
+	4096,
+	16384,
+	65536,
+	CLD_MAX_FRAME_SZ,
+};
+
+static int buf_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < CLD_BUF_CLASSES; i++)
+		if (size <= buf_class_sz[i])
+			return i;
+	return -1;
+}
+
+void *cld_buf_get(struct cld_buf_pool *pool, size_t size, size_t *cap)
+{
+	void *buf;
+	int cl;
+
+	cl = buf_class(size);
+	if (cl < 0)
+		return NULL;
+
+	buf = pool->free_list[cl];
+	if (buf) {
+		pool->free_list[cl] = *(void **)buf;
+		pool->n_free[cl]--;
+		pool->reuse++;
+	} else {
+		buf = malloc(buf_class_sz[cl]);
+		if (!buf)
+			return NULL;
+		pool->alloc++;
+	}
+
+	pool->in_use++;
+	*cap = buf_class_sz[cl];
+	return buf;
+}
+
+void cld_buf_put(struct cld_buf_pool *pool, void *buf, size_t cap)
+{
+	int cl;
+
+	if (!buf)
+		return;
+
+	pool->in_use--;
+
+	cl = buf_class(cap);
+	if (cl < 0 || buf_class_sz[cl] != cap ||
+	    pool->n_free[cl] >= CLD_BUF_KEEP) {
+		free(buf);
+		return;
+	}
+
+	*(void **)buf = pool->free_list[cl];
+	pool->free_list[cl] = buf;
+	pool->n_free[cl]++;
+}
+
+int cld_buf_reserve(struct cld_buf_pool *pool, char **bufp, size_t *capp,
+		    size_t len, size_t need)
+{
+	char *buf;
+	size_t cap;
+
+	if (*bufp && need <= *capp)
+		return 0;
+	if (need > CLD_MAX_MSG_SZ)
+		return -EMSGSIZE;
+
+	buf = cld_buf_get(pool, need, &cap);
+	if (!buf)
+		return -ENOMEM;
+
+	if (*bufp) {
+		memcpy(buf, *bufp, len);
+		cld_buf_put(pool, *bufp, *capp);
+	}
+
+	*bufp = buf;
+	*capp = cap;
+	return 0;
+}
+
+void cld_buf_pool_free(struct cld_buf_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < CLD_BUF_CLASSES; i++) {
+		while (pool->free_list[i]) {
+			void *buf = pool->free_list[i];
+
+			pool->free_list[i] = *(void **)buf;
+			free(buf);
+		}
+		pool->n_free[i] = 0;
+	}
+}
@@ -0,0 +1,265 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A pool of logged-in chunkd connections over one or more nodes.
+ * A caller borrows an st_client for a request or a run of them and
+ * gives it back; idle connections stay open for the next borrower.
+ * Each node lends out at most max_per_node connections at once, and
+ * borrowers past that wait for one to come back.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <chunkc.h>
+
+/*
+ * chunkd never speaks unasked, so an idle connection that has become
+ * readable was closed (or is confused) and is no use to anyone.
+ */
+static bool pool_conn_alive(struct st_client *stc)
+{
+	struct pollfd pfd;
+
+	if (stc->ssl && SSL_pending(stc->ssl))
+		return false;
+
+	pfd.fd = stc->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) != 0)
+		return false;
+
+	return true;
+}
+
+static struct st_client *pool_connect(struct stc_pool *pool,
+				      struct stc_pool_node *node)
+{
+	struct st_client *stc;
+
+	stc = stc_new(node->host, node->port, pool->user, pool->key,
+		      pool->encrypt);
+	if (!stc)
+		return NULL;
+
+	stc->verbose = pool->verbose;
+
+	if (pool->table &&
+	    !stc_table_openz(stc, pool->table, pool->table_flags)) {
+		stc_free(stc);
+		return NULL;
+	}
+
+	stc->pool_node = node;
+	return stc;
+}
+
+static struct stc_pool_node *pool_pick(struct stc_pool *pool, int node_idx)
+{
+	struct stc_pool_node *node, *best = NULL;
+	GList *tmp;
+
+	if (node_idx >= 0) {
+		node = g_list_nth_data(pool->nodes, node_idx);
+		if (node && node->busy < pool->max_per_node)
+			return node;
+		return NULL;
+	}
+
+	/* a warm connection first, else the least busy node */
+	for (tmp = pool->nodes; tmp; tmp = tmp->next) {
+		node = tmp->data;
+		if (node->busy >= pool->max_per_node)
+			continue;
+		if (node->idle)
+			return node;
+		if (!best || node->busy < best->busy)
+			best = node;
+	}
+
+	return best;
+}
+
+struct stc_pool *stc_pool_new(const char *user, const char *secret_key,
+			      const char *table, bool encrypt,
+			      unsigned int max_per_node)
+{
+	struct stc_pool *pool;
+
+	if (!user || !*user || !secret_key || !*secret_key)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->user = strdup(user);
+	pool->key = strdup(secret_key);
+	if (table)
+		pool->table = strdup(table);
+	pool->encrypt = encrypt;
+	pool->max_per_node = max_per_node ? max_per_node : 1;
+	pool->lock = g_mutex_new();
+	pool->cond = g_cond_new();
+
+	if (!pool->user || !pool->key || (table && !pool->table)) {
+		stc_pool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+ * Add a chunkd node.  Returns its index for stc_pool_get, or -1.
+ * Nodes should all be added before the pool is shared.
+ */
+int stc_pool_add(struct stc_pool *pool, const char *host, int port)
+{
+	struct stc_pool_node *node;
+
+	if (!host || !*host || port < 1 || port > 65535)
+		return -1;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return -1;
+
+	node->host = strdup(host);
+	if (!node->host) {
+		free(node);
+		return -1;
+	}
+	node->port = port;
+
+	pool->nodes = g_list_append(pool->nodes, node);
+	return pool->n_nodes++;
+}
+
+/*
+ * Borrow a connection to node node_idx, or to whichever node suits
+ * best if node_idx is -1.  Waits while the node is at its limit.
+ * Idle connections that went away are replaced by fresh ones.
+ */
+struct st_client *stc_pool_get(struct stc_pool *pool, int node_idx)
+{
+	struct stc_pool_node *node;
+	struct st_client *stc = NULL;
+
+	if (node_idx >= (int) pool->n_nodes || !pool->n_nodes)
+		return NULL;
+
+	g_mutex_lock(pool->lock);
+
+	while ((node = pool_pick(pool, node_idx)) == NULL)
+		g_cond_wait(pool->cond, pool->lock);
+
+	node->busy++;
+
+	while (node->idle) {
+		stc = node->idle->data;
+		node->idle = g_list_delete_link(node->idle, node->idle);
+		if (pool_conn_alive(stc)) {
+			pool->stats.reused++;
+			break;
+		}
+
+		pool->stats.dropped++;
+		stc_free(stc);
+		stc = NULL;
+	}
+
+	g_mutex_unlock(pool->lock);
+
+	if (stc)
+		return stc;
+
+	/* connect outside the lock; the busy slot is already ours */
+	stc = pool_connect(pool, node);
+
+	g_mutex_lock(pool->lock);
+	if (stc)
+		pool->stats.connects++;
+	else {
+		node->busy--;
+		g_cond_broadcast(pool->cond);
+	}
+	g_mutex_unlock(pool->lock);
+
+	return stc;
+}
+
+/*
+ * Return a borrowed connection.  Pass reuse false after a failed
+ * request: the connection may be out of step with the server, so it
+ * is closed rather than lent out again.
+ */
+void stc_pool_put(struct stc_pool *pool, struct st_client *stc, bool reuse)
+{
+	struct stc_pool_node *node = stc->pool_node;
+
+	g_mutex_lock(pool->lock);
+
+	node->busy--;
+	if (reuse)
+		node->idle = g_list_prepend(node->idle, stc);
+	else {
+		pool->stats.dropped++;
+		stc_free(stc);
+	}
+
+	/* waiters may want different nodes; let each look again */
+	g_cond_broadcast(pool->cond);
+	g_mutex_unlock(pool->lock);
+}
+
+/* All borrowed connections must have been returned. */
+void stc_pool_free(struct stc_pool *pool)
+{
+	GList *tmp, *conn;
+
+	if (!pool)
+		return;
+
+	for (tmp = pool->nodes; tmp; tmp = tmp->next) {
+		struct stc_pool_node *node = tmp->data;
+
+		for (conn = node->idle; conn; conn = conn->next)
+			stc_free(conn->data);
+		g_list_free(node->idle);
+		free(node->host);
+		free(node);
+	}
+	g_list_free(pool->nodes);
+
+	if (pool->cond)
+		g_cond_free(pool->cond);
+	if (pool->lock)
+		g_mutex_free(pool->lock);
+	free(pool->user);
+	free(pool->key);
+	free(pool->table);
+	free(pool);
+}
@@ -0,0 +1,536 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Striped objects.  A big object is cut into fixed-size parts, each a
+ * chunkd object of its own, and the parts move in parallel over
+ * connections borrowed from an stc_pool, dealt out round-robin over
+ * its nodes.  The object's own key then holds a small text manifest
+ * on the pool's first node, written last so a reader never sees a
+ * half-stored object:
+ *
+ *	chunkd-stripe 2
+ *	generation <16 hex digits>
+ *	size <bytes>
+ *	part-size <bytes>
+ *	parts <n>
+ *	part <index> <host> <port>
+ *	...
+ *
+ * Every store picks a new generation, which goes into its part keys,
+ * so overwriting an object never touches the parts the old manifest
+ * names; those go only once the new manifest is in.  A version 1
+ * manifest has no generation line, and its parts no generation.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <cld_common.h>
+#include <chunkc.h>
+
+#define STRIPE_MAGIC	"chunkd-stripe 2"
+#define STRIPE_MAGIC_V1	"chunkd-stripe 1"
+
+/* what one GET_PART returns; a manifest must fit, short of it */
+#define STRIPE_MANIFEST_MAX	(CHUNK_MAX_GETPART_SZ - 1)
+
+struct stripe_part {
+	uint64_t		off;
+	uint64_t		len;
+	int			node;		/* pool node index */
+};
+
+struct stripe_job {
+	struct stc_pool		*pool;
+	const void		*key;
+	size_t			key_len;
+	uint64_t		gen;		/* 0: version 1 part keys */
+
+	int			fd;
+	bool			positional;	/* fd is seekable */
+	bool			put;
+
+	struct stripe_part	*parts;
+	unsigned int		n_parts;
+
+	GMutex			*lock;		/* covers next, failed */
+	unsigned int		next;		/* next part to move */
+	bool			failed;
+};
+
+/*
+ * Part keys are the object key with ".GGGGGGGGGGGGGGGG-NNNNNNNN"
+ * (generation, index) appended, or ".part-NNNNNNNN" for generation 0;
+ * a trailing NUL, as the *z helpers send, is kept at the end.
+ */
+static bool stripe_part_key(char *buf, const void *key, size_t key_len,
+			    uint64_t gen, unsigned int idx, size_t *plen)
+{
+	bool nul = key_len && ((const char *) key)[key_len - 1] == '\0';
+	size_t base = nul ? key_len - 1 : key_len;
+	int n;
+
+	if (base + 28 > CHD_KEY_SZ)
+		return false;
+
+	memcpy(buf, key, base);
+	if (gen)
+		n = sprintf(buf + base, ".%016llx-%08x",
+			    (unsigned long long) gen, idx);
+	else
+		n = sprintf(buf + base, ".part-%08x", idx);
+	*plen = base + n + (nul ? 1 : 0);
+	return true;
+}
+
+static bool stripe_xfer(struct stripe_job *job, unsigned int idx)
+{
+	struct stripe_part *part = &job->parts[idx];
+	struct st_client *stc;
+	char pkey[CHD_KEY_SZ + 1];
+	size_t pkey_len;
+	bool rcb;
+
+	if (!stripe_part_key(pkey, job->key, job->key_len, job->gen, idx,
+			     &pkey_len))
+		return false;
+
+	stc = stc_pool_get(job->pool, part->node);
+	if (!stc)
+		return false;
+
+	if (job->put && job->positional)
+		rcb = stc_put_fd_at(stc, pkey, pkey_len, job->fd, part->off,
+				    part->len, 0);
+	else if (job->put)
+		rcb = stc_put_fd(stc, pkey, pkey_len, job->fd, part->len, 0);
+	else if (job->positional)
+		rcb = stc_get_fd_len_at(stc, pkey, pkey_len, job->fd,
+					part->off, part->len);
+	else
+		rcb = stc_get_fd_len(stc, pkey, pkey_len, job->fd, part->len);
+
+	/* a part of the wrong length is refused before it reaches fd */
+	stc_pool_put(job->pool, stc, rcb);
+	return rcb;
+}
+
+static gpointer stripe_worker(gpointer data)
+{
+	struct stripe_job *job = data;
+	unsigned int idx;
+
+	for (;;) {
+		g_mutex_lock(job->lock);
+		if (job->failed || job->next == job->n_parts) {
+			g_mutex_unlock(job->lock);
+			break;
+		}
+		idx = job->next++;
+		g_mutex_unlock(job->lock);
+
+		if (!stripe_xfer(job, idx)) {
+			g_mutex_lock(job->lock);
+			job->failed = true;
+			g_mutex_unlock(job->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Move every part, parallel at a time.  Parts go in order to a worker
+ * each; a descriptor that cannot seek is only ever used by one.
+ */
+static bool stripe_run(struct stripe_job *job, unsigned int parallel)
+{
+	GThread **threads = NULL;
+	unsigned int i, n_threads = 0;
+
+	if (!job->positional || parallel < 1)
+		parallel = 1;
+	if (parallel > job->n_parts)
+		parallel = job->n_parts;
+
+	job->lock = g_mutex_new();
+
+	if (parallel > 1) {
+		threads = calloc(parallel - 1, sizeof(*threads));
+		if (!threads)
+			job->failed = true;
+	}
+
+	for (i = 0; threads && i < parallel - 1; i++) {
+		threads[i] = g_thread_create(stripe_worker, job, TRUE, NULL);
+		if (!threads[i])
+			break;
+		n_threads++;
+	}
+
+	/* this thread is the last worker */
+	stripe_worker(job);
+
+	for (i = 0; i < n_threads; i++)
+		g_thread_join(threads[i]);
+
+	free(threads);
+	g_mutex_free(job->lock);
+	return !job->failed;
+}
+
+static void stripe_del_parts(struct stc_pool *pool, const void *key,
+			     size_t key_len, uint64_t gen,
+			     struct stripe_part *parts, unsigned int n_parts)
+{
+	struct st_client *stc;
+	char pkey[CHD_KEY_SZ + 1];
+	size_t pkey_len;
+	unsigned int i;
+	bool rcb;
+
+	for (i = 0; i < n_parts; i++) {
+		if (!stripe_part_key(pkey, key, key_len, gen, i, &pkey_len))
+			continue;
+		stc = stc_pool_get(pool, parts[i].node);
+		if (!stc)
+			continue;
+		rcb = stc_del(stc, pkey, pkey_len);
+		stc_pool_put(pool, stc, rcb);
+	}
+}
+
+static char *stripe_manifest(struct stc_pool *pool, uint64_t gen,
+			     uint64_t size, uint64_t part_sz,
+			     struct stripe_part *parts, unsigned int n_parts)
+{
+	struct stc_pool_node *node;
+	GString *str;
+	unsigned int i;
+
+	str = g_string_new(STRIPE_MAGIC "\n");
+	g_string_append_printf(str, "generation %016llx\n",
+			       (unsigned long long) gen);
+	g_string_append_printf(str, "size %llu\npart-size %llu\nparts %u\n",
+			       (unsigned long long) size,
+			       (unsigned long long) part_sz, n_parts);
+
+	for (i = 0; i < n_parts; i++) {
+		node = g_list_nth_data(pool->nodes, parts[i].node);
+		g_string_append_printf(str, "part %u %s %d\n", i,
+				       node->host, node->port);
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+static int stripe_node(struct stc_pool *pool, const char *host, int port)
+{
+	struct stc_pool_node *node;
+	GList *tmp;
+	int idx = 0;
+
+	for (tmp = pool->nodes; tmp; tmp = tmp->next, idx++) {
+		node = tmp->data;
+		if (node->port == port && !strcmp(node->host, host))
+			return idx;
+	}
+
+	/*
+	 * A part on a node this pool was not given.  Manifest text is no
+	 * reason to take our credentials elsewhere, nor to grow a pool
+	 * other threads are using; the object cannot be had here.
+	 */
+	return -1;
+}
+
+/*
+ * Fetch and parse the manifest for key.  Returns the parts, or NULL.
+ */
+static struct stripe_part *stripe_manifest_read(struct stc_pool *pool,
+						const void *key,
+						size_t key_len,
+						uint64_t *pgen,
+						uint64_t *psize,
+						unsigned int *pn_parts)
+{
+	struct stripe_part *parts = NULL;
+	struct st_client *stc;
+	unsigned long long size, part_sz, gen = 0;
+	unsigned int n_parts, i, idx;
+	char host[256];
+	char **lines = NULL, **l;
+	char *text, *tmp;
+	size_t len = 0;
+	bool magic_ok;
+	int port;
+
+	stc = stc_pool_get(pool, 0);
+	if (!stc)
+		return NULL;
+
+	/*
+	 * Any object may sit under key; look at its first line before
+	 * reading the rest, and never read more than a manifest can be.
+	 */
+	text = stc_get_part_inline(stc, key, key_len, 0,
+				   sizeof(STRIPE_MAGIC), &len);
+	if (!text) {
+		stc_pool_put(pool, stc, false);
+		return NULL;
+	}
+	magic_ok = len == sizeof(STRIPE_MAGIC) &&
+		   (!memcmp(text, STRIPE_MAGIC "\n", len) ||
+		    !memcmp(text, STRIPE_MAGIC_V1 "\n", len));
+	free(text);
+	if (!magic_ok) {
+		stc_pool_put(pool, stc, true);
+		return NULL;
+	}
+
+	text = stc_get_part_inline(stc, key, key_len, 0,
+				   STRIPE_MANIFEST_MAX + 1, &len);
+	stc_pool_put(pool, stc, text != NULL);
+	if (!text)
+		return NULL;
+	if (len > STRIPE_MANIFEST_MAX) {
+		free(text);
+		return NULL;
+	}
+
+	/* not NUL-terminated on the wire */
+	lines = g_strsplit(tmp = g_strndup(text, len), "\n", 0);
+	g_free(tmp);
+	free(text);
+
+	if (!lines[0])
+		goto err_out;
+	if (!strcmp(lines[0], STRIPE_MAGIC)) {
+		if (!lines[1] ||
+		    sscanf(lines[1], "generation %llx", &gen) != 1 || !gen)
+			goto err_out;
+		l = lines + 2;
+	} else if (!strcmp(lines[0], STRIPE_MAGIC_V1))
+		l = lines + 1;
+	else
+		goto err_out;
+
+	if (!l[0] || sscanf(l[0], "size %llu", &size) != 1 ||
+	    !l[1] || sscanf(l[1], "part-size %llu", &part_sz) != 1 ||
+	    !l[2] || sscanf(l[2], "parts %u", &n_parts) != 1 ||
+	    !part_sz || n_parts != (size + part_sz - 1) / part_sz)
+		goto err_out;
+
+	parts = calloc(n_parts ? n_parts : 1, sizeof(*parts));
+	if (!parts)
+		goto err_out;
+
+	for (i = 0; i < n_parts; i++) {
+		if (!l[3 + i] ||
+		    sscanf(l[3 + i], "part %u %255s %d",
+			   &idx, host, &port) != 3 || idx != i)
+			goto err_out;
+
+		parts[i].off = (uint64_t) i * part_sz;
+		parts[i].len = MIN(part_sz, size - parts[i].off);
+		parts[i].node = stripe_node(pool, host, port);
+		if (parts[i].node < 0)
+			goto err_out;
+	}
+
+	g_strfreev(lines);
+	*pgen = gen;
+	*psize = size;
+	*pn_parts = n_parts;
+	return parts;
+
+err_out:
+	free(parts);
+	g_strfreev(lines);
+	return NULL;
+}
+
+static bool fd_positional(int fd)
+{
+	struct stat st;
+
+	return !fstat(fd, &st) && S_ISREG(st.st_mode);
+}
+
+/*
+ * Store len bytes of fd as a striped object under key, in parts of
+ * part_sz bytes with up to parallel of them in flight.  A regular file
+ * is read at its own offsets from the start; anything else is read
+ * from where it is, one part after another.  The pool should lend at
+ * least parallel connections per node, and have had g_thread_init.
+ *
+ * An object already under key stays whole until the new manifest
+ * replaces it; its parts are deleted after that.
+ */
+bool stc_stripe_put_fd(struct stc_pool *pool, const void *key,
+		       size_t key_len, int fd, uint64_t len,
+		       uint64_t part_sz, unsigned int parallel)
+{
+	struct stripe_job job;
+	struct stripe_part *old_parts;
+	struct st_client *stc;
+	uint64_t old_gen = 0, old_size;
+	unsigned int old_n_parts = 0;
+	char *manifest;
+	unsigned int i;
+	bool rcb;
+
+	if (!pool->n_nodes || !key || key_len < 1 || key_len > CHD_KEY_SZ)
+		return false;
+	if (!part_sz)
+		part_sz = STC_STRIPE_PART_SZ;
+
+	memset(&job, 0, sizeof(job));
+	job.pool = pool;
+	job.key = key;
+	job.key_len = key_len;
+	job.fd = fd;
+	job.positional = fd_positional(fd);
+	job.put = true;
+	job.n_parts = (len + part_sz - 1) / part_sz;
+
+	job.parts = calloc(job.n_parts ? job.n_parts : 1, sizeof(*job.parts));
+	if (!job.parts)
+		return false;
+
+	/* what we replace, if anything; not a striped object is nothing */
+	old_parts = stripe_manifest_read(pool, key, key_len, &old_gen,
+					 &old_size, &old_n_parts);
+
+	do {
+		cld_rand64(&job.gen);
+	} while (!job.gen || (old_parts && job.gen == old_gen));
+
+	for (i = 0; i < job.n_parts; i++) {
+		job.parts[i].off = (uint64_t) i * part_sz;
+		job.parts[i].len = MIN(part_sz, len - job.parts[i].off);
+		job.parts[i].node = i % pool->n_nodes;
+	}
+
+	if (job.n_parts && !stripe_run(&job, parallel))
+		goto err_out;
+
+	manifest = stripe_manifest(pool, job.gen, len, part_sz, job.parts,
+				   job.n_parts);
+	if (strlen(manifest) > STRIPE_MANIFEST_MAX) {
+		g_free(manifest);
+		goto err_out;
+	}
+
+	stc = stc_pool_get(pool, 0);
+	rcb = stc && stc_put_inline(stc, key, key_len, manifest,
+				    strlen(manifest), 0);
+	if (stc)
+		stc_pool_put(pool, stc, rcb);
+	g_free(manifest);
+	if (!rcb)
+		goto err_out;
+
+	if (old_parts)
+		stripe_del_parts(pool, key, key_len, old_gen, old_parts,
+				 old_n_parts);
+	free(old_parts);
+	free(job.parts);
+	return true;
+
+err_out:
+	stripe_del_parts(pool, key, key_len, job.gen, job.parts, job.n_parts);
+	free(old_parts);
+	free(job.parts);
+	return false;
+}
+
+/*
+ * Fetch a striped object into fd.  A regular file is written at the
+ * parts' own offsets from the start, parallel parts at a time;
+ * anything else gets the parts in order, one at a time.  The object
+ * size is returned in *plen, if plen is not NULL.  Every part must be
+ * on a node the pool was given; the get fails otherwise.
+ */
+bool stc_stripe_get_fd(struct stc_pool *pool, const void *key,
+		       size_t key_len, int fd, uint64_t *plen,
+		       unsigned int parallel)
+{
+	struct stripe_job job;
+	uint64_t size;
+	bool rcb;
+
+	if (!pool->n_nodes || !key || key_len < 1 || key_len > CHD_KEY_SZ)
+		return false;
+
+	memset(&job, 0, sizeof(job));
+	job.parts = stripe_manifest_read(pool, key, key_len, &job.gen, &size,
+					 &job.n_parts);
+	if (!job.parts)
+		return false;
+
+	job.pool = pool;
+	job.key = key;
+	job.key_len = key_len;
+	job.fd = fd;
+	job.positional = fd_positional(fd);
+
+	rcb = !job.n_parts || stripe_run(&job, parallel);
+
+	free(job.parts);
+	if (rcb && plen)
+		*plen = size;
+	return rcb;
+}
+
+/* Delete a striped object: its parts, then its manifest. */
+bool stc_stripe_del(struct stc_pool *pool, const void *key, size_t key_len)
+{
+	struct stripe_part *parts;
+	struct st_client *stc;
+	unsigned int n_parts;
+	uint64_t gen, size;
+	bool rcb;
+
+	if (!pool->n_nodes)
+		return false;
+
+	parts = stripe_manifest_read(pool, key, key_len, &gen, &size,
+				     &n_parts);
+	if (!parts)
+		return false;
+
+	stripe_del_parts(pool, key, key_len, gen, parts, n_parts);
+	free(parts);
+
+	stc = stc_pool_get(pool, 0);
+	if (!stc)
+		return false;
+	rcb = stc_del(stc, key, key_len);
+	stc_pool_put(pool, stc, rcb);
+
+	return rcb;
+}
@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -42,6 +43,9 @@
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>
 #endif
+#if defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
 
 #if 0
 static int _strcasecmp(const unsigned char *a, const char *b)
@@ -137,6 +141,8 @@ static bool net_write(struct st_client *stc, const void *data, size_t datalen)
 	return true;
 }
 
+static bool async_free(struct st_client *stc);
+
 static bool resp_valid(const struct chunksrv_resp *resp)
 {
 	if (memcmp(resp->magic, CHUNKD_MAGIC, CHD_MAGIC_SZ))
@@ -155,11 +161,139 @@ static bool resp_read(struct st_client *stc, struct chunksrv_resp *resp)
 	return true;
 }
 
+/*
+ * One SSL context serves every connection in the process.  The last
+ * session each host:port gave us is kept, so the next connection
+ * there resumes it (by ticket or session ID) instead of doing a full
+ * handshake.
+ */
+G_LOCK_DEFINE_STATIC(stc_ssl);
+static SSL_CTX *stc_ssl_ctx;
+static GHashTable *stc_ssl_sessions;	/* "host:port" -> SSL_SESSION */
+static struct stc_ssl_stats stc_ssl_counts;
+
+static void stc_ssl_sess_free(gpointer data)
+{
+	SSL_SESSION_free(data);
+}
+
+/*
+ * A new session from the server: at the handshake up to TLS 1.2, in a
+ * ticket after it with TLS 1.3.  Keep it for the next connection to
+ * the same server; we take the caller's reference.
+ */
+static int stc_ssl_sess_new(SSL *ssl, SSL_SESSION *sess)
+{
+	struct st_client *stc = SSL_get_app_data(ssl);
+
+	G_LOCK(stc_ssl);
+	g_hash_table_replace(stc_ssl_sessions,
+			     g_strdup_printf("%s:%d", stc->host, stc->port),
+			     sess);
+	G_UNLOCK(stc_ssl);
+	return 1;
+}
+
+static bool stc_ssl_new(struct st_client *stc, long mode)
+{
+	SSL_SESSION *sess;
+	char *name;
+
+	G_LOCK(stc_ssl);
+	if (!stc_ssl_ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		stc_ssl_ctx = SSL_CTX_new(TLS_client_method());
+		if (!stc_ssl_ctx)
+			goto err_out;
+		if (!SSL_CTX_set_min_proto_version(stc_ssl_ctx,
+						   TLS1_2_VERSION)) {
+			SSL_CTX_free(stc_ssl_ctx);
+			stc_ssl_ctx = NULL;
+			goto err_out;
+		}
+#else
+		stc_ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+		if (!stc_ssl_ctx)
+			goto err_out;
+		SSL_CTX_set_options(stc_ssl_ctx, SSL_OP_NO_SSLv2 |
+				    SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 |
+				    SSL_OP_NO_TLSv1_1);
+#endif
+
+		/* we keep sessions ourselves, one per server */
+		SSL_CTX_set_session_cache_mode(stc_ssl_ctx,
+					SSL_SESS_CACHE_CLIENT |
+					SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(stc_ssl_ctx, stc_ssl_sess_new);
+
+		stc_ssl_sessions = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free, stc_ssl_sess_free);
+	}
+
+	stc->ssl_ctx = stc_ssl_ctx;
+
+	stc->ssl = SSL_new(stc_ssl_ctx);
+	if (!stc->ssl)
+		goto err_out;
+	SSL_set_app_data(stc->ssl, stc);
+
+	/* SSL_set_session takes its own reference */
+	name = g_strdup_printf("%s:%d", stc->host, stc->port);
+	sess = g_hash_table_lookup(stc_ssl_sessions, name);
+	if (sess)
+		SSL_set_session(stc->ssl, sess);
+	g_free(name);
+	G_UNLOCK(stc_ssl);
+
+	SSL_set_mode(stc->ssl, mode);
+
+	if (!SSL_set_fd(stc->ssl, stc->fd)) {
+		SSL_free(stc->ssl);
+		stc->ssl = NULL;
+		return false;
+	}
+
+	return true;
+
+err_out:
+	G_UNLOCK(stc_ssl);
+	return false;
+}
+
+/* handshake done: count it and keep the session for next time */
+/* sessions themselves are kept by stc_ssl_sess_new, as they arrive */
+static void stc_ssl_connected(struct st_client *stc)
+{
+	bool reused;
+
+	reused = SSL_session_reused(stc->ssl);
+
+	if (stc->verbose)
+		fprintf(stderr, "libstc: TLS %s\n",
+			reused ? "session resumed" : "full handshake");
+
+	G_LOCK(stc_ssl);
+	stc_ssl_counts.handshakes++;
+	if (reused)
+		stc_ssl_counts.resumed++;
+	G_UNLOCK(stc_ssl);
+}
+
+void stc_ssl_stats(struct stc_ssl_stats *out)
+{
+	G_LOCK(stc_ssl);
+	*out = stc_ssl_counts;
+	G_UNLOCK(stc_ssl);
+}
+
 void stc_free(struct st_client *stc)
 {
 	if (!stc)
 		return;
 
+	if (stc->async && !async_free(stc))
+		return;
+
 	free(stc->host);
 	free(stc->user);
 	free(stc->key);
@@ -167,8 +301,7 @@ void stc_free(struct st_client *stc)
 		SSL_shutdown(stc->ssl);
 		SSL_free(stc->ssl);
 	}
-	if (stc->ssl_ctx)
-		SSL_CTX_free(stc->ssl_ctx);
+	/* stc->ssl_ctx is the shared stc_ssl_ctx */
 	if (stc->fd >= 0)
 		close(stc->fd);
 	free(stc);
@@ -284,6 +417,7 @@ struct st_client *stc_new(const char *service_host, int port,
 		return NULL;
 
 	stc->fd = fd;
+	stc->port = port;
 	stc->host = strdup(service_host);
 	stc->user = strdup(user);
 	stc->key = strdup(secret_key);
@@ -295,22 +429,14 @@ struct st_client *stc_new(const char *service_host, int port,
 		if (!stc_start_tls_cmd(stc))
 			goto err_out;
 
-		stc->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
-		if (!stc->ssl_ctx)
+		if (!stc_ssl_new(stc, SSL_MODE_AUTO_RETRY))
 			goto err_out;
 
-		SSL_CTX_set_mode(stc->ssl_ctx, SSL_MODE_AUTO_RETRY);
-
-		stc->ssl = SSL_new(stc->ssl_ctx);
-		if (!stc->ssl)
-			goto err_out_ctx;
-
-		if (!SSL_set_fd(stc->ssl, stc->fd))
-			goto err_out_ssl;
-
 		rc = SSL_connect(stc->ssl);
 		if (rc <= 0)
 			goto err_out_ssl;
+
+		stc_ssl_connected(stc);
 	}
 
 	if (!stc_login(stc))
@@ -323,13 +449,9 @@ err_out_ssl:
 		SSL_free(stc->ssl);
 		stc->ssl = NULL;
 	}
-err_out_ctx:
-	if (stc->ssl_ctx) {
-		SSL_CTX_free(stc->ssl_ctx);
-		stc->ssl_ctx = NULL;
-	}
 err_out:
 	close(stc->fd);
+	stc->fd = -1;
 	stc_free(stc);
 	return NULL;
 }
@@ -899,6 +1021,335 @@ bool stc_put_inline(struct st_client *stc, const void *key, size_t key_len,
 	return stc_put(stc, key, key_len, read_inline_cb, len, &spi, flags);
 }
 
+/*
+ * File descriptor transfers.  On a plaintext connection the kernel
+ * moves the data: sendfile from a regular file, splice from a pipe,
+ * and splice through a pipe on the way in.  TLS needs the bytes in
+ * user space, so there (and for anything else) we copy in large
+ * buffers rather than the 4 KiB netbuf of stc_put and stc_get.
+ */
+enum {
+	STC_FD_BUF_SZ		= 256 * 1024,	/* user-space copies */
+	STC_SPLICE_SZ		= 64 * 1024,	/* default pipe capacity */
+};
+
+static bool fd_can_splice(int fd, bool out)
+{
+#if defined(HAVE_SPLICE)
+	struct stat st;
+	int flags;
+
+	if (fstat(fd, &st))
+		return false;
+	if (out) {
+		/* splice refuses appending writers */
+		flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || (flags & O_APPEND))
+			return false;
+		return S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode);
+	}
+	return S_ISFIFO(st.st_mode);
+#else
+	return false;
+#endif
+}
+
+/*
+ * In the helpers below a NULL off means the descriptor's own offset;
+ * otherwise *off is used and advanced, and the descriptor's is left be.
+ */
+static bool fd_send_copy(struct st_client *stc, int fd, off_t *off,
+			 uint64_t len)
+{
+	char *buf;
+	ssize_t rc;
+
+	buf = malloc(STC_FD_BUF_SZ);
+	if (!buf)
+		return false;
+
+	while (len) {
+		if (off)
+			rc = pread(fd, buf, MIN(len, STC_FD_BUF_SZ), *off);
+		else
+			rc = read(fd, buf, MIN(len, STC_FD_BUF_SZ));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			goto err_out;
+		if (off)
+			*off += rc;
+
+		if (!net_write(stc, buf, rc))
+			goto err_out;
+		len -= rc;
+	}
+
+	free(buf);
+	return true;
+
+err_out:
+	free(buf);
+	return false;
+}
+
+/* send exactly len bytes read from fd */
+static bool fd_send(struct st_client *stc, int fd, off_t *off, uint64_t len)
+{
+	ssize_t rc;
+
+	if (stc->ssl)
+		return fd_send_copy(stc, fd, off, len);
+
+#if defined(HAVE_SENDFILE) && defined(__linux__)
+	{
+		struct stat st;
+
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+			while (len) {
+				rc = sendfile(stc->fd, fd, off,
+					      MIN(len, STC_FD_BUF_SZ));
+				if (rc < 0 && errno == EINTR)
+					continue;
+				if (rc <= 0)
+					return false;
+				len -= rc;
+			}
+			return true;
+		}
+	}
+#endif
+
+#if defined(HAVE_SPLICE)
+	if (!off && fd_can_splice(fd, false)) {
+		while (len) {
+			/* MORE holds back a partial segment; not on the last */
+			rc = splice(fd, NULL, stc->fd, NULL,
+				    MIN(len, STC_SPLICE_SZ), SPLICE_F_MOVE |
+				    (len > STC_SPLICE_SZ ? SPLICE_F_MORE : 0));
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				return false;
+			len -= rc;
+		}
+		return true;
+	}
+#endif
+
+	return fd_send_copy(stc, fd, off, len);
+}
+
+static bool fd_write_all(int fd, off_t *off, const void *data, size_t len)
+{
+	ssize_t rc;
+
+	while (len) {
+		if (off)
+			rc = pwrite(fd, data, len, *off);
+		else
+			rc = write(fd, data, len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return false;
+		if (off)
+			*off += rc;
+		data += rc;
+		len -= rc;
+	}
+
+	return true;
+}
+
+static bool fd_recv_copy(struct st_client *stc, int fd, off_t *off,
+			 uint64_t len)
+{
+	char *buf;
+	size_t xfer_len;
+
+	buf = malloc(STC_FD_BUF_SZ);
+	if (!buf)
+		return false;
+
+	while (len) {
+		xfer_len = MIN(len, STC_FD_BUF_SZ);
+		if (!net_read(stc, buf, xfer_len) ||
+		    !fd_write_all(fd, off, buf, xfer_len))
+			goto err_out;
+		len -= xfer_len;
+	}
+
+	free(buf);
+	return true;
+
+err_out:
+	free(buf);
+	return false;
+}
+
+/* receive exactly len bytes, written to fd */
+static bool fd_recv(struct st_client *stc, int fd, off_t *off, uint64_t len)
+{
+#if defined(HAVE_SPLICE)
+	int pfd[2];
+	ssize_t rc, in_pipe;
+	loff_t loff;
+	bool rcb = false;
+
+	if (stc->ssl || !fd_can_splice(fd, true) || pipe(pfd))
+		return fd_recv_copy(stc, fd, off, len);
+
+	while (len) {
+		in_pipe = splice(stc->fd, NULL, pfd[1], NULL,
+				 MIN(len, STC_SPLICE_SZ), SPLICE_F_MOVE |
+				 (len > STC_SPLICE_SZ ? SPLICE_F_MORE : 0));
+		if (in_pipe < 0 && errno == EINTR)
+			continue;
+		if (in_pipe <= 0)
+			goto out;
+		len -= in_pipe;
+
+		while (in_pipe) {
+			if (off)
+				loff = *off;
+			rc = splice(pfd[0], NULL, fd, off ? &loff : NULL,
+				    in_pipe, SPLICE_F_MOVE |
+				    (len ? SPLICE_F_MORE : 0));
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				goto out;
+			if (off)
+				*off += rc;
+			in_pipe -= rc;
+		}
+	}
+
+	rcb = true;
+
+out:
+	close(pfd[0]);
+	close(pfd[1]);
+	return rcb;
+#else
+	return fd_recv_copy(stc, fd, off, len);
+#endif
+}
+
+static bool stc_put_fd_off(struct st_client *stc, const void *key,
+			   size_t key_len, int fd, off_t *off, uint64_t len,
+			   uint32_t flags)
+{
+	struct chunksrv_resp resp;
+	int sfd;
+
+	if (!stc_put_start(stc, key, key_len, len, &sfd, flags))
+		return false;
+
+	if (!fd_send(stc, fd, off, len))
+		return false;
+
+	/* read response header */
+	if (!resp_read(stc, &resp))
+		return false;
+
+	/* check response code */
+	if (resp.resp_code != che_Success) {
+		if (stc->verbose)
+			fprintf(stderr, "PUT resp code: %d\n", resp.resp_code);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Store len bytes from fd, starting at its current offset, as object
+ * key.  Meant for big files: no callback per 4 KiB, and no copying
+ * through user space on a plaintext connection.
+ */
+bool stc_put_fd(struct st_client *stc, const void *key, size_t key_len,
+		int fd, uint64_t len, uint32_t flags)
+{
+	return stc_put_fd_off(stc, key, key_len, fd, NULL, len, flags);
+}
+
+/* As stc_put_fd, but from offset in fd, which keeps its own offset. */
+bool stc_put_fd_at(struct st_client *stc, const void *key, size_t key_len,
+		   int fd, uint64_t offset, uint64_t len, uint32_t flags)
+{
+	off_t off = offset;
+
+	return stc_put_fd_off(stc, key, key_len, fd, &off, len, flags);
+}
+
+/*
+ * want, if not NULL, is the length the caller expects; anything else
+ * fails before a byte reaches fd, and leaves the body unread, so the
+ * connection is of no further use.
+ */
+static bool stc_get_fd_off(struct st_client *stc, const void *key,
+			   size_t key_len, int fd, off_t *off,
+			   const uint64_t *want, uint64_t *plen)
+{
+	uint64_t content_len;
+
+	if (!stc_get_req(stc, key, key_len, &content_len))
+		return false;
+
+	if (plen)
+		*plen = content_len;
+
+	if (want && content_len != *want) {
+		if (stc->verbose)
+			fprintf(stderr, "libstc: GET length %llu, want %llu\n",
+				(unsigned long long) content_len,
+				(unsigned long long) *want);
+		return false;
+	}
+
+	return fd_recv(stc, fd, off, content_len);
+}
+
+/*
+ * Fetch object key and write it to fd at its current offset.  The
+ * object's length is returned in *plen, if plen is not NULL.
+ */
+bool stc_get_fd(struct st_client *stc, const void *key, size_t key_len,
+		int fd, uint64_t *plen)
+{
+	return stc_get_fd_off(stc, key, key_len, fd, NULL, NULL, plen);
+}
+
+/* As stc_get_fd, but written at offset in fd. */
+bool stc_get_fd_at(struct st_client *stc, const void *key, size_t key_len,
+		   int fd, uint64_t offset, uint64_t *plen)
+{
+	off_t off = offset;
+
+	return stc_get_fd_off(stc, key, key_len, fd, &off, NULL, plen);
+}
+
+/*
+ * As stc_get_fd and stc_get_fd_at, but only for an object of exactly
+ * len bytes; one of any other length is refused before it is read.
+ * The connection is unusable after such a refusal.
+ */
+bool stc_get_fd_len(struct st_client *stc, const void *key, size_t key_len,
+		    int fd, uint64_t len)
+{
+	return stc_get_fd_off(stc, key, key_len, fd, NULL, &len, NULL);
+}
+
+bool stc_get_fd_len_at(struct st_client *stc, const void *key,
+		       size_t key_len, int fd, uint64_t offset, uint64_t len)
+{
+	off_t off = offset;
+
+	return stc_get_fd_off(stc, key, key_len, fd, &off, &len, NULL);
+}
+
 bool stc_del(struct st_client *stc, const void *key, size_t key_len)
 {
 	struct chunksrv_resp resp;
@@ -1019,40 +1470,89 @@ static void stc_parse_key(xmlDocPtr doc, xmlNode *node,
 		stc_free_object(obj);
 }
 
-struct st_keylist *stc_keys(struct st_client *stc)
+/*
+ * Parse the XML body of a LIST response.  Shared by stc_keys and
+ * the asynchronous LIST.
+ */
+static struct st_keylist *stc_parse_keylist(const void *data, size_t len)
 {
 	struct st_keylist *keylist;
 	xmlDocPtr doc;
 	xmlNode *node;
 	xmlChar *xs;
-	GByteArray *all_data;
-	char netbuf[4096];
-	struct chunksrv_resp resp;
-	uint64_t content_len;
-	struct chunksrv_req *req = (struct chunksrv_req *) stc->req_buf;
 
-	if (stc->verbose)
-		fprintf(stderr, "libstc: LIST-KEYS\n");
+	doc = xmlReadMemory(data, len, "foo.xml", NULL, 0);
+	if (!doc)
+		return NULL;
 
-	/* initialize request */
-	req_init(stc, req);
-	req->op = CHO_LIST;
+	node = xmlDocGetRootElement(doc);
+	if (!node)
+		goto err_out_doc;
 
-	/* sign request */
-	chreq_sign(req, stc->key, req->sig);
+	if (_strcmp(node->name, "ListVolumeResult"))
+		goto err_out_doc;
 
-	/* write request */
-	if (!net_write(stc, req, req_len(req)))
-		return false;
+	keylist = calloc(1, sizeof(*keylist));
+	if (!keylist)
+		goto err_out_doc;
 
-	/* read response header */
-	if (!resp_read(stc, &resp))
-		return false;
+	node = node->children;
+	while (node) {
+		if (node->type != XML_ELEMENT_NODE) {
+			node = node->next;
+			continue;
+		}
 
-	/* check response code */
-	if (resp.resp_code != che_Success) {
-		if (stc->verbose)
-			fprintf(stderr, "LIST resp code: %d\n", resp.resp_code);
+		if (!_strcmp(node->name, "Name")) {
+			xs = xmlNodeListGetString(doc, node->children, 1);
+			keylist->name = strdup((char *)xs);
+			xmlFree(xs);
+		}
+		else if (!_strcmp(node->name, "Contents"))
+			stc_parse_key(doc, node->children, keylist);
+
+		node = node->next;
+	}
+
+	xmlFreeDoc(doc);
+	return keylist;
+
+err_out_doc:
+	xmlFreeDoc(doc);
+	return NULL;
+}
+
+struct st_keylist *stc_keys(struct st_client *stc)
+{
+	struct st_keylist *keylist;
+	GByteArray *all_data;
+	char netbuf[4096];
+	struct chunksrv_resp resp;
+	uint64_t content_len;
+	struct chunksrv_req *req = (struct chunksrv_req *) stc->req_buf;
+
+	if (stc->verbose)
+		fprintf(stderr, "libstc: LIST-KEYS\n");
+
+	/* initialize request */
+	req_init(stc, req);
+	req->op = CHO_LIST;
+
+	/* sign request */
+	chreq_sign(req, stc->key, req->sig);
+
+	/* write request */
+	if (!net_write(stc, req, req_len(req)))
+		return false;
+
+	/* read response header */
+	if (!resp_read(stc, &resp))
+		return false;
+
+	/* check response code */
+	if (resp.resp_code != che_Success) {
+		if (stc->verbose)
+			fprintf(stderr, "LIST resp code: %d\n", resp.resp_code);
 		return false;
 	}
 
@@ -1074,51 +1574,13 @@ struct st_keylist *stc_keys(struct st_client *stc)
 		content_len -= xfer_len;
 	}
 
-	doc = xmlReadMemory((char *) all_data->data, all_data->len,
-			    "foo.xml", NULL, 0);
-	if (!doc)
-		goto err_out;
-
-	node = xmlDocGetRootElement(doc);
-	if (!node)
-		goto err_out_doc;
-
-	if (_strcmp(node->name, "ListVolumeResult"))
-		goto err_out_doc;
+	keylist = stc_parse_keylist(all_data->data, all_data->len);
 
-	keylist = calloc(1, sizeof(*keylist));
-	if (!keylist)
-		goto err_out_doc;
-
-	node = node->children;
-	while (node) {
-		if (node->type != XML_ELEMENT_NODE) {
-			node = node->next;
-			continue;
-		}
-
-		if (!_strcmp(node->name, "Name")) {
-			xs = xmlNodeListGetString(doc, node->children, 1);
-			keylist->name = strdup((char *)xs);
-			xmlFree(xs);
-		}
-		else if (!_strcmp(node->name, "Contents"))
-			stc_parse_key(doc, node->children, keylist);
-
-		node = node->next;
-	}
-
-	xmlFreeDoc(doc);
 	g_byte_array_free(all_data, TRUE);
-	all_data = NULL;
-
 	return keylist;
 
-err_out_doc:
-	xmlFreeDoc(doc);
 err_out:
 	g_byte_array_free(all_data, TRUE);
-	all_data = NULL;
 	return NULL;
 }
 
@@ -1293,6 +1755,903 @@ out:
 	return rcb;
 }
 
+/*
+ * Asynchronous interface.
+ *
+ * An st_client made by stc_new_async never blocks.  Its socket is
+ * non-blocking, and each queued operation is a small state machine
+ * that moves as far as the socket lets it and then records whether it
+ * is waiting to read or to write.  The application owns the event
+ * loop: it polls stc_async_fd for stc_async_events and calls
+ * stc_async_run when the descriptor is ready.  Completions arrive
+ * through the operation's callback, from inside stc_async_run.
+ *
+ * chunkd answers one request at a time per connection, so operations
+ * queued on one st_client go out in order, each after the previous
+ * one completed.  Open several clients for parallelism.
+ */
+
+enum stc_aop_state {
+	AOP_SEND_REQ,			/* request header and key(s) */
+	AOP_SEND_BODY,			/* PUT data */
+	AOP_HANDSHAKE,			/* TLS negotiation after START-TLS */
+	AOP_RECV_RESP,			/* response header */
+	AOP_RECV_EXTRA,			/* rest of a GET response header */
+	AOP_RECV_BODY,			/* response data */
+};
+
+struct stc_aop {
+	enum stc_aop_state	state;
+	struct chunksrv_req	*req;
+	size_t			req_len;
+	size_t			off;		/* progress within state */
+
+	/* PUT */
+	size_t			(*read_cb)(void *, size_t, size_t, void *);
+	void			*read_priv;
+	struct stc_put_info	spi;		/* put_inline source */
+	uint64_t		body_left;
+
+	/* GET, GET_PART; a NULL write_cb collects into data */
+	size_t			(*write_cb)(void *, size_t, size_t, void *);
+	void			*write_priv;
+	GByteArray		*data;
+	uint64_t		data_left;
+
+	struct chunksrv_resp_get resp;
+
+	char			buf[4096];
+	size_t			buf_len;
+
+	stc_async_cb		cb;		/* NULL for internal ops */
+	void			*cb_priv;
+	struct stc_result	res;
+};
+
+struct stc_async {
+	struct addrinfo		*ai_res;	/* addresses not yet tried */
+	struct addrinfo		*ai_next;
+	bool			connecting;
+	bool			dead;
+
+	unsigned int		want;		/* STC_EV_xxx last blocked on */
+
+	GList			*ops;		/* head is in progress */
+	unsigned int		n_ops;
+
+	unsigned int		in_run;		/* callbacks may be running */
+	bool			free_pending;	/* stc_free from one of them */
+};
+
+static void aop_free(struct stc_aop *aop)
+{
+	if (aop->data)
+		g_byte_array_free(aop->data, TRUE);
+	free(aop->req);
+	free(aop);
+}
+
+/*
+ * Deliver a result and drop the operation.  The callback may keep
+ * res->data or res->keylist by clearing the pointer.
+ */
+static void aop_complete(struct st_client *stc, struct stc_aop *aop)
+{
+	struct stc_async *as = stc->async;
+	struct stc_result *res = &aop->res;
+
+	as->ops = g_list_remove(as->ops, aop);
+	as->n_ops--;
+
+	if (aop->cb)
+		aop->cb(stc, res, aop->cb_priv);
+	else if (!res->ok) {
+		/* START-TLS or LOGIN failed; nothing after it can work */
+		if (stc->verbose)
+			fprintf(stderr, "libstc: async session setup failed\n");
+		as->dead = true;
+	}
+
+	free(res->data);
+	stc_free_keylist(res->keylist);
+	aop_free(aop);
+}
+
+static void as_fail_all(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+
+	as->dead = true;
+	while (as->ops) {
+		struct stc_aop *aop = as->ops->data;
+
+		aop->res.ok = false;
+		aop->res.resp_code = -1;
+		aop_complete(stc, aop);
+	}
+}
+
+/*
+ * Returns false if called from a completion callback: stc_async_run, or
+ * an outer async_free, still uses stc, and frees it when done.
+ */
+static bool async_free(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+
+	if (as->in_run) {
+		as->free_pending = true;
+		return false;
+	}
+
+	as->in_run++;
+	as_fail_all(stc);
+	if (as->ai_res)
+		freeaddrinfo(as->ai_res);
+	free(as);
+	stc->async = NULL;
+	return true;
+}
+
+/*
+ * Non-blocking I/O.  These return the byte count, zero if the caller
+ * must wait (with as->want saying for what), or a negative error.
+ */
+static ssize_t anet_read(struct st_client *stc, void *data, size_t len)
+{
+	struct stc_async *as = stc->async;
+	ssize_t rc;
+
+	if (stc->ssl) {
+		rc = SSL_read(stc->ssl, data, len);
+		if (rc > 0)
+			return rc;
+		switch (SSL_get_error(stc->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			as->want = STC_EV_READ;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			as->want = STC_EV_WRITE;
+			return 0;
+		case SSL_ERROR_ZERO_RETURN:
+			return -EPIPE;
+		default:
+			return -EIO;
+		}
+	}
+
+	do {
+		rc = read(stc->fd, data, len);
+	} while (rc < 0 && errno == EINTR);
+	if (rc > 0)
+		return rc;
+	if (rc == 0)
+		return -EPIPE;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		as->want = STC_EV_READ;
+		return 0;
+	}
+	return -errno;
+}
+
+static ssize_t anet_write(struct st_client *stc, const void *data, size_t len)
+{
+	struct stc_async *as = stc->async;
+	ssize_t rc;
+
+	if (stc->ssl) {
+		rc = SSL_write(stc->ssl, data, len);
+		if (rc > 0)
+			return rc;
+		switch (SSL_get_error(stc->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			as->want = STC_EV_READ;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			as->want = STC_EV_WRITE;
+			return 0;
+		case SSL_ERROR_ZERO_RETURN:
+			return -EPIPE;
+		default:
+			return -EIO;
+		}
+	}
+
+	do {
+		rc = write(stc->fd, data, len);
+	} while (rc < 0 && errno == EINTR);
+	if (rc >= 0)
+		return rc;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		as->want = STC_EV_WRITE;
+		return 0;
+	}
+	return -errno;
+}
+
+/*
+ * Start a non-blocking connect to the next untried address.
+ * Returns 1 when connected, 0 when in progress, <0 when out of addresses.
+ */
+static int aconn_start(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	struct addrinfo *rp;
+	int fd;
+
+	while ((rp = as->ai_next) != NULL) {
+		as->ai_next = rp->ai_next;
+
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+			close(fd);
+			continue;
+		}
+
+		stc->fd = fd;
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+			return 1;
+		if (errno == EINPROGRESS) {
+			as->connecting = true;
+			return 0;
+		}
+
+		close(fd);
+		stc->fd = -1;
+	}
+
+	return -ECONNREFUSED;
+}
+
+static int aconn_finish(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	struct addrinfo *rp;
+	int rc, on = 1;
+
+	/* the current address is the one before ai_next */
+	for (rp = as->ai_res; rp->ai_next != as->ai_next; rp = rp->ai_next)
+		;
+
+	/* a second connect reports how the first one went */
+	if (connect(stc->fd, rp->ai_addr, rp->ai_addrlen) < 0 &&
+	    errno != EISCONN) {
+		if (errno == EALREADY || errno == EINPROGRESS) {
+			as->want = STC_EV_WRITE;
+			return 0;
+		}
+
+		close(stc->fd);
+		stc->fd = -1;
+		as->connecting = false;
+
+		rc = aconn_start(stc);
+		if (rc <= 0) {
+			if (rc == 0)
+				as->want = STC_EV_WRITE;
+			return rc;
+		}
+	}
+
+	as->connecting = false;
+	freeaddrinfo(as->ai_res);
+	as->ai_res = as->ai_next = NULL;
+
+	/* disable delay of small output packets */
+	if (setsockopt(stc->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		perror("setsockopt(TCP_NODELAY)");
+
+	return 1;
+}
+
+static int aop_handshake(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	int rc;
+
+	if (!stc->ssl && !stc_ssl_new(stc, SSL_MODE_ENABLE_PARTIAL_WRITE))
+		return -ENOMEM;
+
+	rc = SSL_connect(stc->ssl);
+	if (rc == 1) {
+		stc_ssl_connected(stc);
+		return 1;
+	}
+
+	switch (SSL_get_error(stc->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		as->want = STC_EV_READ;
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		as->want = STC_EV_WRITE;
+		return 0;
+	default:
+		return -EIO;
+	}
+}
+
+static bool aop_has_mtime(const struct stc_aop *aop)
+{
+	return aop->req->op == CHO_GET || aop->req->op == CHO_GET_PART;
+}
+
+/* the response header is in; decide what follows it */
+static int aop_resp_done(struct st_client *stc, struct stc_aop *aop)
+{
+	struct chunksrv_resp *resp = &aop->resp.resp;
+
+	if (!resp_valid(resp))
+		return -EIO;
+
+	aop->res.resp_code = resp->resp_code;
+	if (resp->resp_code != che_Success) {
+		if (stc->verbose)
+			fprintf(stderr, "libstc: async op %u resp code: %d\n",
+				aop->req->op, resp->resp_code);
+		return 1;
+	}
+
+	aop->data_left = le64_to_cpu(resp->data_len);
+
+	if (aop->req->op == CHO_CHECK_STATUS &&
+	    aop->data_left != sizeof(struct chunk_check_status))
+		return -EIO;
+
+	if (aop_has_mtime(aop)) {
+		aop->state = AOP_RECV_EXTRA;
+		aop->off = 0;
+		return 0;
+	}
+
+	aop->state = AOP_RECV_BODY;
+	return 0;
+}
+
+static void aop_body_done(struct stc_aop *aop)
+{
+	struct stc_result *res = &aop->res;
+
+	res->ok = true;
+	if (!aop->data)
+		return;
+
+	if (aop->req->op == CHO_LIST) {
+		res->keylist = stc_parse_keylist(aop->data->data,
+						 aop->data->len);
+		if (!res->keylist)
+			res->ok = false;
+		return;
+	}
+
+	res->data_len = aop->data->len;
+	res->data = g_byte_array_free(aop->data, FALSE);
+	aop->data = NULL;
+}
+
+/*
+ * Move one operation along as far as the socket allows.
+ * Returns 1 when it completed, 0 when it must wait, <0 on a broken
+ * connection.
+ */
+static int aop_step(struct st_client *stc, struct stc_aop *aop)
+{
+	ssize_t rc;
+	size_t len;
+
+	for (;;) {
+		switch (aop->state) {
+		case AOP_SEND_REQ:
+			rc = anet_write(stc, (char *) aop->req + aop->off,
+					aop->req_len - aop->off);
+			if (rc <= 0)
+				return rc;
+			aop->off += rc;
+			if (aop->off < aop->req_len)
+				break;
+
+			aop->off = 0;
+			if (aop->req->op == CHO_START_TLS)
+				aop->state = AOP_HANDSHAKE;
+			else if (aop->req->op == CHO_PUT)
+				aop->state = AOP_SEND_BODY;
+			else
+				aop->state = AOP_RECV_RESP;
+			break;
+
+		case AOP_SEND_BODY:
+			if (aop->off == aop->buf_len) {
+				if (!aop->body_left) {
+					aop->state = AOP_RECV_RESP;
+					aop->off = 0;
+					break;
+				}
+
+				len = MIN(aop->body_left, sizeof(aop->buf));
+				len = aop->read_cb(aop->buf, len, 1,
+						   aop->read_priv);
+				if (len < 1)
+					return -EIO;
+				aop->body_left -= len;
+				aop->buf_len = len;
+				aop->off = 0;
+			}
+
+			rc = anet_write(stc, aop->buf + aop->off,
+					aop->buf_len - aop->off);
+			if (rc <= 0)
+				return rc;
+			aop->off += rc;
+			aop->res.size += rc;
+			break;
+
+		case AOP_HANDSHAKE:
+			rc = aop_handshake(stc);
+			if (rc <= 0)
+				return rc;
+
+			/* no response - SSL negotiation was the answer */
+			aop->res.ok = true;
+			return 1;
+
+		case AOP_RECV_RESP:
+			rc = anet_read(stc, (char *) &aop->resp.resp + aop->off,
+				       sizeof(aop->resp.resp) - aop->off);
+			if (rc <= 0)
+				return rc;
+			aop->off += rc;
+			if (aop->off < sizeof(aop->resp.resp))
+				break;
+
+			rc = aop_resp_done(stc, aop);
+			if (rc)
+				return rc;
+			break;
+
+		case AOP_RECV_EXTRA:
+			len = sizeof(aop->resp) - sizeof(aop->resp.resp);
+			rc = anet_read(stc, (char *) &aop->resp.mtime + aop->off,
+				       len - aop->off);
+			if (rc <= 0)
+				return rc;
+			aop->off += rc;
+			if (aop->off == len)
+				aop->state = AOP_RECV_BODY;
+			break;
+
+		case AOP_RECV_BODY:
+			if (!aop->data_left) {
+				aop_body_done(aop);
+				return 1;
+			}
+
+			len = MIN(aop->data_left, sizeof(aop->buf));
+			rc = anet_read(stc, aop->buf, len);
+			if (rc <= 0)
+				return rc;
+			aop->data_left -= rc;
+			aop->res.size += rc;
+
+			if (aop->write_cb)
+				aop->write_cb(aop->buf, rc, 1, aop->write_priv);
+			else
+				g_byte_array_append(aop->data,
+						    (unsigned char *) aop->buf,
+						    rc);
+			break;
+		}
+	}
+}
+
+int stc_async_fd(struct st_client *stc)
+{
+	return stc->fd;
+}
+
+unsigned int stc_async_events(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	struct stc_aop *aop;
+
+	if (!as || as->dead || !as->ops)
+		return 0;
+	if (as->connecting || as->want)
+		return as->connecting ? STC_EV_WRITE : as->want;
+
+	/* nothing tried yet; go by what the head operation does next */
+	aop = as->ops->data;
+	switch (aop->state) {
+	case AOP_SEND_REQ:
+	case AOP_SEND_BODY:
+	case AOP_HANDSHAKE:
+		return STC_EV_WRITE;
+	default:
+		return STC_EV_READ;
+	}
+}
+
+unsigned int stc_async_pending(struct st_client *stc)
+{
+	return stc->async ? stc->async->n_ops : 0;
+}
+
+static bool async_run(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	struct stc_aop *aop;
+	int rc;
+
+	if (as->connecting) {
+		rc = aconn_finish(stc);
+		if (rc == 0)
+			return true;
+		if (rc < 0)
+			goto err_out;
+	}
+
+	while (as->ops) {
+		aop = as->ops->data;
+		as->want = 0;
+
+		rc = aop_step(stc, aop);
+		if (rc == 0)
+			return true;
+		if (rc < 0)
+			goto err_out;
+
+		aop_complete(stc, aop);
+		if (as->dead)
+			goto err_out;
+		if (as->free_pending)
+			return false;
+	}
+
+	as->want = 0;
+	return true;
+
+err_out:
+	as_fail_all(stc);
+	return false;
+}
+
+bool stc_async_run(struct st_client *stc)
+{
+	struct stc_async *as = stc->async;
+	bool ok;
+
+	if (!as || as->dead)
+		return false;
+
+	as->in_run++;
+	ok = async_run(stc);
+	as->in_run--;
+
+	if (as->free_pending && !as->in_run) {
+		stc_free(stc);
+		return false;
+	}
+	return ok;
+}
+
+/*
+ * Build an operation: header, key, then extra_len bytes of extra.
+ * The caller fills in flags and data_len, then calls aop_submit.
+ */
+static struct stc_aop *aop_new(struct st_client *stc, uint8_t op,
+			       const void *key, size_t key_len,
+			       const void *extra, size_t extra_len,
+			       stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!stc->async || stc->async->dead)
+		return NULL;
+
+	aop = calloc(1, sizeof(*aop));
+	if (!aop)
+		return NULL;
+
+	aop->req_len = sizeof(struct chunksrv_req) + key_len + extra_len;
+	aop->req = malloc(aop->req_len);
+	if (!aop->req) {
+		free(aop);
+		return NULL;
+	}
+
+	req_init(stc, aop->req);
+	aop->req->op = op;
+	if (key_len)
+		req_set_key(aop->req, key, key_len);
+	if (extra_len)
+		memcpy((char *) (aop->req + 1) + key_len, extra, extra_len);
+
+	aop->state = AOP_SEND_REQ;
+	aop->cb = cb;
+	aop->cb_priv = priv;
+	aop->res.resp_code = -1;
+
+	return aop;
+}
+
+static bool aop_submit(struct st_client *stc, struct stc_aop *aop)
+{
+	struct stc_async *as = stc->async;
+
+	if (stc->verbose)
+		fprintf(stderr, "libstc: async op %u queued\n", aop->req->op);
+
+	/* sign request */
+	if (aop->req->op == CHO_START_TLS)
+		strcpy(aop->req->sig, "START-TLS");
+	else
+		chreq_sign(aop->req, stc->key, aop->req->sig);
+
+	as->ops = g_list_append(as->ops, aop);
+	as->n_ops++;
+	return true;
+}
+
+/*
+ * Open a connection without blocking on it.  Name resolution is still
+ * done here, synchronously; the connect, the TLS handshake and the
+ * login proceed as the application calls stc_async_run.  Operations
+ * may be queued at once; they go out after the login.
+ */
+struct st_client *stc_new_async(const char *service_host, int port,
+				const char *user, const char *secret_key,
+				bool use_ssl)
+{
+	struct st_client *stc;
+	struct stc_async *as;
+	struct stc_aop *aop;
+	struct addrinfo hints;
+	int rc;
+	char port_str[32];
+
+	if (!service_host || !*service_host ||
+	    port < 1 || port > 65535 ||
+	    !user || !*user ||
+	    !secret_key || !*secret_key)
+		return NULL;
+
+	stc = calloc(1, sizeof(struct st_client));
+	if (!stc)
+		return NULL;
+	stc->fd = -1;
+	stc->port = port;
+
+	stc->host = strdup(service_host);
+	stc->user = strdup(user);
+	stc->key = strdup(secret_key);
+	stc->async = as = calloc(1, sizeof(*as));
+
+	if (!stc->host || !stc->user || !stc->key || !as)
+		goto err_out;
+
+	sprintf(port_str, "%d", port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(service_host, port_str, &hints, &as->ai_res);
+	if (rc) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+		goto err_out;
+	}
+	as->ai_next = as->ai_res;
+
+	rc = aconn_start(stc);
+	if (rc < 0)
+		goto err_out;
+	if (rc > 0)
+		as->connecting = true;	/* let aconn_finish tidy up */
+
+	if (use_ssl) {
+		aop = aop_new(stc, CHO_START_TLS, NULL, 0, NULL, 0, NULL, NULL);
+		if (!aop)
+			goto err_out;
+		aop_submit(stc, aop);
+	}
+
+	/* username is sent as key/key_len */
+	aop = aop_new(stc, CHO_LOGIN, stc->user, strlen(stc->user) + 1,
+		      NULL, 0, NULL, NULL);
+	if (!aop)
+		goto err_out;
+	aop_submit(stc, aop);
+
+	return stc;
+
+err_out:
+	stc_free(stc);
+	return NULL;
+}
+
+bool stc_async_table_open(struct st_client *stc, const void *key,
+			  size_t key_len, uint32_t flags,
+			  stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!key_valid(key, key_len))
+		return false;
+
+	aop = aop_new(stc, CHO_TABLE_OPEN, key, key_len, NULL, 0, cb, priv);
+	if (!aop)
+		return false;
+	aop->req->flags = (flags & (CHF_TBL_CREAT | CHF_TBL_EXCL));
+
+	return aop_submit(stc, aop);
+}
+
+bool stc_async_get(struct st_client *stc, const void *key, size_t key_len,
+		   size_t (*write_cb)(void *, size_t, size_t, void *),
+		   void *user_data, stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!key_valid(key, key_len))
+		return false;
+
+	aop = aop_new(stc, CHO_GET, key, key_len, NULL, 0, cb, priv);
+	if (!aop)
+		return false;
+
+	aop->write_cb = write_cb;
+	aop->write_priv = user_data;
+	if (!write_cb)
+		aop->data = g_byte_array_new();
+
+	return aop_submit(stc, aop);
+}
+
+bool stc_async_get_part(struct st_client *stc, const void *key,
+			size_t key_len, uint64_t offset, uint64_t max_len,
+			size_t (*write_cb)(void *, size_t, size_t, void *),
+			void *user_data, stc_async_cb cb, void *priv)
+{
+	struct chunksrv_req_getpart gpr;
+	struct stc_aop *aop;
+
+	if (!key_valid(key, key_len))
+		return false;
+
+	gpr.offset = cpu_to_le64(offset);
+
+	aop = aop_new(stc, CHO_GET_PART, key, key_len, &gpr, sizeof(gpr),
+		      cb, priv);
+	if (!aop)
+		return false;
+	aop->req->data_len = cpu_to_le64(max_len);
+
+	aop->write_cb = write_cb;
+	aop->write_priv = user_data;
+	if (!write_cb)
+		aop->data = g_byte_array_new();
+
+	return aop_submit(stc, aop);
+}
+
+bool stc_async_put(struct st_client *stc, const void *key, size_t key_len,
+		   size_t (*read_cb)(void *, size_t, size_t, void *),
+		   uint64_t len, void *user_data, uint32_t flags,
+		   stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!key_valid(key, key_len))
+		return false;
+
+	aop = aop_new(stc, CHO_PUT, key, key_len, NULL, 0, cb, priv);
+	if (!aop)
+		return false;
+	aop->req->flags = (flags & CHF_SYNC);
+	aop->req->data_len = cpu_to_le64(len);
+
+	aop->read_cb = read_cb;
+	aop->read_priv = user_data;
+	aop->body_left = len;
+
+	return aop_submit(stc, aop);
+}
+
+/*
+ * The data is not copied; it must stay put until the callback runs.
+ */
+bool stc_async_put_inline(struct st_client *stc, const void *key,
+			  size_t key_len, void *data, uint64_t len,
+			  uint32_t flags, stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!key_valid(key, key_len))
+		return false;
+
+	aop = aop_new(stc, CHO_PUT, key, key_len, NULL, 0, cb, priv);
+	if (!aop)
+		return false;
+	aop->req->flags = (flags & CHF_SYNC);
+	aop->req->data_len = cpu_to_le64(len);
+
+	aop->spi.data = data;
+	aop->spi.len = len;
+	aop->read_cb = read_inline_cb;
+	aop->read_priv = &aop->spi;
+	aop->body_left = len;
+
+	return aop_submit(stc, aop);
+}
+
+bool stc_async_cp(struct st_client *stc,
+		  const void *dest_key, size_t dest_key_len,
+		  const void *src_key, size_t src_key_len,
+		  stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	if (!key_valid(dest_key, dest_key_len) ||
+	    !key_valid(src_key, src_key_len))
+		return false;
+
+	/* source (old) key rides in the data area, after the dest key */
+	aop = aop_new(stc, CHO_CP, dest_key, dest_key_len,
+		      src_key, src_key_len, cb, priv);
+	if (!aop)
+		return false;
+	aop->req->data_len = cpu_to_le64(src_key_len);
+
+	return aop_submit(stc, aop);
+}
+
+static bool stc_async_simple(struct st_client *stc, uint8_t op,
+			     const void *key, size_t key_len,
+			     stc_async_cb cb, void *priv)
+{
+	struct stc_aop *aop;
+
+	aop = aop_new(stc, op, key, key_len, NULL, 0, cb, priv);
+	if (!aop)
+		return false;
+
+	if (op == CHO_LIST || op == CHO_CHECK_STATUS)
+		aop->data = g_byte_array_new();
+
+	return aop_submit(stc, aop);
+}
+
+bool stc_async_del(struct st_client *stc, const void *key, size_t key_len,
+		   stc_async_cb cb, void *priv)
+{
+	if (!key_valid(key, key_len))
+		return false;
+
+	return stc_async_simple(stc, CHO_DEL, key, key_len, cb, priv);
+}
+
+bool stc_async_ping(struct st_client *stc, stc_async_cb cb, void *priv)
+{
+	return stc_async_simple(stc, CHO_NOP, NULL, 0, cb, priv);
+}
+
+bool stc_async_keys(struct st_client *stc, stc_async_cb cb, void *priv)
+{
+	return stc_async_simple(stc, CHO_LIST, NULL, 0, cb, priv);
+}
+
+bool stc_async_check_start(struct st_client *stc, stc_async_cb cb, void *priv)
+{
+	return stc_async_simple(stc, CHO_CHECK_START, NULL, 0, cb, priv);
+}
+
+bool stc_async_check_status(struct st_client *stc, stc_async_cb cb,
+			    void *priv)
+{
+	return stc_async_simple(stc, CHO_CHECK_STATUS, NULL, 0, cb, priv);
+}
+
 /*
  * For extra safety, call stc_init after g_thread_init, if present.
  * Currently we just call srand(), but since we use GLib, we may need
@@ -1303,3 +2662,21 @@ void stc_init(void)
 	srand(time(NULL) ^ getpid());	// for cld_rand64 et.al.
 }
 
+/*
+ * Drop the shared SSL context and the sessions kept for resumption.
+ * Call once every client is freed; a later stc_new starts afresh.
+ */
+void stc_exit(void)
+{
+	G_LOCK(stc_ssl);
+	if (stc_ssl_sessions) {
+		g_hash_table_destroy(stc_ssl_sessions);
+		stc_ssl_sessions = NULL;
+	}
+	if (stc_ssl_ctx) {
+		SSL_CTX_free(stc_ssl_ctx);
+		stc_ssl_ctx = NULL;
+	}
+	G_UNLOCK(stc_ssl);
+}
+
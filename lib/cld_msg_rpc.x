@@ -58,6 +58,14 @@ enum cld_msg_op {
 	CMO_EVENT		= 16,	/**< server->cli async event */
 	CMO_ACK_FRAG		= 17, 	/**< ack partial msg */
 
+	/* client -> server */
+	CMO_READDIR		= 18,	/**< list directory, a page at a time */
+	CMO_GET_WAIT		= 19,	/**< GET, once inode passes a version */
+	CMO_PUT_IF		= 20,	/**< PUT, if inode is at a version */
+	CMO_OPEN_GET		= 21,	/**< OPEN + GET + CLOSE, in one txn */
+	CMO_OPEN_PUT		= 22,	/**< OPEN + PUT + CLOSE, in one txn */
+	CMO_RECONNECT		= 23,	/**< move stream session to this conn */
+
 	CMO_AFTER_LAST
 };
 
@@ -81,7 +89,10 @@ enum cle_err_codes {
 	CLE_DIR_NOTEMPTY	= 15,	/**< dir not empty */
 	CLE_INTERNAL_ERR	= 16,	/**< nonspecific internal err */
 	CLE_TIMEOUT 		= 17,	/**< session timed out */
-	CLE_SIG_INVAL 		= 18	/**< HMAC sig bad / auth failed */
+	CLE_SIG_INVAL 		= 18,	/**< HMAC sig bad / auth failed */
+	CLE_VERS_MISMATCH	= 19,	/**< inode not at expected version */
+	CLE_READ_ONLY		= 20,	/**< write sent to a read-only replica */
+	CLE_CONN_RESET		= 21	/**< connection lost, outcome unknown */
 };
 
 /** availble OPEN mode flags */
@@ -101,7 +112,8 @@ enum cld_events {
 	CE_DELETED		= 0x02,	/**< inode deleted */
 	CE_LOCKED		= 0x04,	/**< lock acquired */
 	CE_MASTER_FAILOVER	= 0x08,	/**< master failover */
-	CE_SESS_FAILED		= 0x10
+	CE_SESS_FAILED		= 0x10,
+	CE_CHILD		= 0x20	/**< dir entry created or deleted */
 };
 
 enum cld_inode_flags {
@@ -113,15 +125,33 @@ enum cld_lock_flags {
 	CLF_SHARED		= 0x01	/**< a shared (read) lock */
 };
 
+/** NEW-SESS session feature flags */
+enum cld_sess_flags {
+	CSF_LARGE_FRAMES	= 0x01,	/**< send each msg as a single pkt */
+	CSF_STREAM		= 0x02,	/**< reliable transport; no retries
+					     or ACKs, client replays msgs
+					     after reconnecting */
+	CSF_READDIR		= 0x04,	/**< server implements READDIR */
+	CSF_WATCH		= 0x08,	/**< server implements GET-WAIT
+					     and CE_CHILD */
+	CSF_COMPOUND		= 0x10,	/**< server implements PUT-IF,
+					     OPEN-GET and OPEN-PUT */
+	CSF_CUM_ACK		= 0x20	/**< client ACKs are cumulative,
+					     and may ride on requests */
+};
+
 /** Describes whether a packet begins, continues, or ends a message. */
 enum cld_pkt_order_t {
 	CLD_PKT_ORD_MID = 0x0,
 	CLD_PKT_ORD_FIRST = 0x1,
 	CLD_PKT_ORD_LAST = 0x2,
-	CLD_PKT_ORD_FIRST_LAST = 0x3
+	CLD_PKT_ORD_FIRST_LAST = 0x3,
+	CLD_PKT_ORD_FIRST_ACK = 0x5,
+	CLD_PKT_ORD_FIRST_LAST_ACK = 0x7
 };
 const CLD_PKT_IS_FIRST = 0x1;
 const CLD_PKT_IS_LAST = 0x2;
+const CLD_PKT_HAS_ACK = 0x4;	/**< CSF_CUM_ACK sessions only */
 
 /** Information that appears only in the first packet */
 struct cld_pkt_msg_infos {
@@ -129,6 +159,12 @@ struct cld_pkt_msg_infos {
 	enum cld_msg_op		op;		/**< message operation */
 };
 
+/** First-packet information, plus a cumulative ACK riding along */
+struct cld_pkt_msg_infos_ack {
+	struct cld_pkt_msg_infos mi;
+	hyper			ack;		/**< all seqids up to here rx'd */
+};
+
 /** Information about the message contained in this packet */
 union cld_pkt_msg_info switch (enum cld_pkt_order_t order) {
 	case CLD_PKT_ORD_MID:
@@ -137,6 +173,9 @@ union cld_pkt_msg_info switch (enum cld_pkt_order_t order) {
 	case CLD_PKT_ORD_FIRST:
 	case CLD_PKT_ORD_FIRST_LAST:
 		struct cld_pkt_msg_infos mi;
+	case CLD_PKT_ORD_FIRST_ACK:
+	case CLD_PKT_ORD_FIRST_LAST_ACK:
+		struct cld_pkt_msg_infos_ack mia;
 };
 
 /** header for each packet */
@@ -153,6 +192,17 @@ struct cld_msg_generic_resp {
 	hyper			xid_in;		/**< C->S xid */
 };
 
+/** NEW-SESS message.  Optional; older clients send no body at all. */
+struct cld_msg_new_sess {
+	int			flags;		/**< features wanted, CSF_xxx */
+};
+
+/** NEW-SESS message response, sent only if the request had a body */
+struct cld_msg_new_sess_resp {
+	struct cld_msg_generic_resp msg;
+	int			flags;		/**< features granted, CSF_xxx */
+};
+
 /** ACK-FRAG message */
 struct cld_msg_ack_frag {
 	hyper			seqid;		/**< sequence id to ack */
@@ -188,12 +238,74 @@ struct cld_msg_get_resp {
 	opaque			data<CLD_MAX_PAYLOAD_SZ>;
 };
 
+/** GET-WAIT message; answered with a GET response */
+struct cld_msg_get_wait {
+	hyper			fh;		/**< open file handle */
+	hyper			vers;		/**< answer once the inode
+						     version is above this */
+	int			timeout;	/**< secs to wait at most;
+						     the inode as it stands
+						     is returned after */
+};
+
+/** READDIR message */
+struct cld_msg_readdir {
+	hyper			fh;		/**< open directory handle */
+	string			after<CLD_INODE_NAME_MAX>; /**< list names
+						     after this one; empty
+						     to start at the top */
+	int			max_ents;	/**< page size; 0 for as many
+						     as fit in one message */
+};
+
+/** READDIR message response */
+struct cld_msg_readdir_resp {
+	struct cld_msg_generic_resp msg;
+	hyper			vers;		/**< directory inode version */
+	bool			eof;		/**< no names follow this page */
+	opaque			data<CLD_MAX_PAYLOAD_SZ>; /**< names, in name
+						     order, packed as GET
+						     returns them */
+};
+
 /** PUT message */
 struct cld_msg_put {
 	hyper			fh;		/**< open file handle */
 	opaque			data<CLD_MAX_PAYLOAD_SZ>;
 };
 
+/** PUT-IF message */
+struct cld_msg_put_if {
+	hyper			fh;		/**< open file handle */
+	hyper			vers;		/**< expected inode version */
+	opaque			data<CLD_MAX_PAYLOAD_SZ>;
+};
+
+/** PUT-IF and OPEN-PUT response.  On CLE_VERS_MISMATCH, vers is the
+ * inode's current version; other errors get a generic response. */
+struct cld_msg_put_resp {
+	struct cld_msg_generic_resp msg;
+	hyper			vers;		/**< inode version after PUT */
+};
+
+/** OPEN-GET message; answered with a GET response */
+struct cld_msg_open_get {
+	int			mode;		/**< COM_CREATE, COM_EXCL,
+						     COM_DIRECTORY; COM_READ
+						     is implied */
+	string			inode_name<CLD_INODE_NAME_MAX>;
+};
+
+/** OPEN-PUT message */
+struct cld_msg_open_put {
+	int			mode;		/**< COM_CREATE, COM_EXCL;
+						     COM_WRITE is implied */
+	bool			check_vers;	/**< fail unless at vers */
+	hyper			vers;		/**< expected inode version */
+	string			inode_name<CLD_INODE_NAME_MAX>;
+	opaque			data<CLD_MAX_PAYLOAD_SZ>;
+};
+
 /** CLOSE message */
 struct cld_msg_close {
 	hyper			fh;		/**< open file handle */
@@ -0,0 +1,293 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A namespace split over several CLD cells by top-level directory.
+ * Each operation goes straight to the cell owning its path; there is
+ * no forwarding between cells.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ncld.h>
+#include <htab.h>
+
+static struct ncld_shard *shard_find(struct ncld_shards *sh,
+				     const char *host, unsigned short port)
+{
+	struct ncld_shard *shard;
+	GList *tmp;
+
+	for (tmp = sh->shards; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		if (shard->port == port && !strcmp(shard->host, host))
+			return shard;
+	}
+
+	shard = calloc(1, sizeof(*shard));
+	if (!shard)
+		return NULL;
+	shard->host = strdup(host);
+	if (!shard->host) {
+		free(shard);
+		return NULL;
+	}
+	shard->port = port;
+	sh->shards = g_list_append(sh->shards, shard);
+	return shard;
+}
+
+/*
+ * Parse one "dir host:port" line.  Returns 0, or an errno.
+ */
+static int shard_map_line(struct ncld_shards *sh, char *line)
+{
+	struct ncld_shard_route *route;
+	struct ncld_shard *shard;
+	char *dir, *host, *colon, *end, *save;
+	long port;
+
+	dir = strtok_r(line, " \t", &save);
+	if (!dir || *dir == '#')
+		return 0;		/* blank or comment */
+	host = strtok_r(NULL, " \t", &save);
+	if (!host || strtok_r(NULL, " \t", &save))
+		return EINVAL;
+
+	colon = strrchr(host, ':');
+	if (!colon)
+		return EINVAL;
+	*colon = 0;
+	port = strtol(colon + 1, &end, 10);
+	if (*end || port <= 0 || port >= 65536 || !*host)
+		return EINVAL;
+
+	shard = shard_find(sh, host, port);
+	if (!shard)
+		return ENOMEM;
+
+	if (!strcmp(dir, "*")) {
+		g_ptr_array_add(sh->spread, shard);
+		return 0;
+	}
+
+	/* a top-level directory: one component, under the root */
+	if (dir[0] != '/' || !dir[1] || strchr(dir + 1, '/'))
+		return EINVAL;
+
+	route = malloc(sizeof(*route));
+	if (!route)
+		return ENOMEM;
+	route->dir = strdup(dir + 1);
+	if (!route->dir) {
+		free(route);
+		return ENOMEM;
+	}
+	route->shard = shard;
+	sh->routes = g_list_append(sh->routes, route);
+	return 0;
+}
+
+static int shard_map_parse(struct ncld_shards *sh, const char *map)
+{
+	char *buf, *line, *save;
+	int err = 0;
+
+	buf = strdup(map);
+	if (!buf)
+		return ENOMEM;
+
+	for (line = strtok_r(buf, "\n", &save); line && !err;
+	     line = strtok_r(NULL, "\n", &save))
+		err = shard_map_line(sh, line);
+
+	free(buf);
+
+	/* every path must have an owner */
+	if (!err && !sh->spread->len)
+		err = EINVAL;
+	return err;
+}
+
+void ncld_shards_close(struct ncld_shards *sh)
+{
+	GList *tmp;
+
+	for (tmp = sh->routes; tmp; tmp = tmp->next) {
+		struct ncld_shard_route *route = tmp->data;
+
+		free(route->dir);
+		free(route);
+	}
+	g_list_free(sh->routes);
+
+	for (tmp = sh->shards; tmp; tmp = tmp->next) {
+		struct ncld_shard *shard = tmp->data;
+
+		if (shard->nsess)
+			ncld_sess_close(shard->nsess);
+		free(shard->host);
+		free(shard);
+	}
+	g_list_free(sh->shards);
+
+	g_ptr_array_free(sh->spread, TRUE);
+	free(sh);
+}
+
+/*
+ * Open a session to every cell in the map.
+ *
+ * On error, returns NULL and sets the error code, as ncld_sess_open does.
+ * A bad map is EINVAL.
+ *
+ * @param map The shard map, one "dir host:port" per line
+ * @param error Buffer for the error code
+ * @param ev_func Session event function for all cells (ok to be NULL)
+ * @param ev_arg User-supplied argument to the session event function
+ * @param cld_user The user identifier to be used to authentication
+ * @param cld_key The user key to be used to authentication
+ * @param log The application log descriptor (ok to be NULL)
+ */
+struct ncld_shards *ncld_shards_open(const char *map, int *error,
+				     void (*ev_func)(void *, unsigned int),
+				     void *ev_arg,
+				     const char *cld_user, const char *cld_key,
+				     struct hail_log *log)
+{
+	struct ncld_shards *sh;
+	GList *tmp;
+	int err;
+
+	sh = calloc(1, sizeof(*sh));
+	if (!sh) {
+		*error = ENOMEM;
+		return NULL;
+	}
+	sh->spread = g_ptr_array_new();
+
+	err = shard_map_parse(sh, map);
+	if (err)
+		goto err_out;
+
+	for (tmp = sh->shards; tmp; tmp = tmp->next) {
+		struct ncld_shard *shard = tmp->data;
+
+		shard->nsess = ncld_sess_open(shard->host, shard->port, &err,
+					      ev_func, ev_arg,
+					      cld_user, cld_key, log);
+		if (!shard->nsess)
+			goto err_out;
+	}
+
+	return sh;
+
+err_out:
+	ncld_shards_close(sh);
+	*error = err;
+	return NULL;
+}
+
+/*
+ * Open the cells named by a shard map kept in a file on a bootstrap
+ * cell, which may itself be one of them.
+ *
+ * @param host Bootstrap cell host name (NULL if resolving SRV records)
+ * @param port Bootstrap cell port
+ * @param fname The shard map file on the bootstrap cell
+ * Other parameters are as for ncld_shards_open.
+ */
+struct ncld_shards *ncld_shards_open_cld(const char *host, int port,
+					 const char *fname, int *error,
+					 void (*ev_func)(void *, unsigned int),
+					 void *ev_arg,
+					 const char *cld_user,
+					 const char *cld_key,
+					 struct hail_log *log)
+{
+	struct ncld_sess *nsess;
+	struct ncld_read *rp;
+	struct ncld_shards *sh;
+	char *map;
+
+	nsess = ncld_sess_open(host, port, error, NULL, NULL,
+			       cld_user, cld_key, log);
+	if (!nsess)
+		return NULL;
+
+	rp = ncld_open_get(nsess, fname, COM_READ, error);
+	if (!rp) {
+		ncld_sess_close(nsess);
+		return NULL;
+	}
+
+	map = g_strndup(rp->ptr, rp->length);
+	ncld_read_free(rp);
+
+	/* opened first, so a cell on the bootstrap host shares its
+	 * connection rather than reconnecting
+	 */
+	sh = ncld_shards_open(map, error, ev_func, ev_arg,
+			      cld_user, cld_key, log);
+	g_free(map);
+	ncld_sess_close(nsess);
+	return sh;
+}
+
+/*
+ * The session of the cell which owns path.  Listed top-level
+ * directories go to their cell, and the rest are spread over the "*"
+ * cells by hash of the top-level name.  The root itself is on the
+ * first "*" cell, so a readdir of "/" sees only that cell's entries.
+ */
+struct ncld_sess *ncld_shard_sess(struct ncld_shards *sh, const char *path)
+{
+	struct ncld_shard *shard;
+	const char *dir, *end;
+	size_t dir_len;
+	GList *tmp;
+
+	dir = path;
+	while (*dir == '/')
+		dir++;
+	end = strchrnul(dir, '/');
+	dir_len = end - dir;
+
+	if (!dir_len) {
+		shard = g_ptr_array_index(sh->spread, 0);
+		return shard->nsess;
+	}
+
+	for (tmp = sh->routes; tmp; tmp = tmp->next) {
+		struct ncld_shard_route *route = tmp->data;
+
+		if (strlen(route->dir) == dir_len &&
+		    !memcmp(route->dir, dir, dir_len))
+			return route->shard->nsess;
+	}
+
+	shard = g_ptr_array_index(sh->spread,
+				  htab_djb_hash(5381, dir, dir_len) %
+				  sh->spread->len);
+	return shard->nsess;
+}
@@ -22,6 +22,9 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,6 +33,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <cldc.h>
+#include <cld_common.h>
 
 void cldc_tcp_free(struct cldc_tcp *tcp)
 {
@@ -39,18 +43,108 @@ void cldc_tcp_free(struct cldc_tcp *tcp)
 	if (tcp->fd >= 0)
 		close(tcp->fd);
 
+	g_list_free(tcp->sessions);
+	free(tcp->large_pkt);
 	free(tcp);
 }
 
-int cldc_tcp_new(const char *hostname, int port,
-		 struct cldc_tcp **tcp_out)
+static bool sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return false;
+	if (a->sa_family == AF_INET)
+		return !memcmp(&((struct sockaddr_in *)a)->sin_addr,
+			       &((struct sockaddr_in *)b)->sin_addr,
+			       sizeof(struct in_addr));
+	if (a->sa_family == AF_INET6)
+		return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+			       &((struct sockaddr_in6 *)b)->sin6_addr,
+			       sizeof(struct in6_addr));
+	return false;
+}
+
+/*
+ * Does hostname name this machine: a loopback address, or one of ours?
+ */
+bool cldc_host_is_local(const char *hostname)
+{
+	struct addrinfo hints, *res, *rp;
+	struct ifaddrs *ifa_list, *ifa;
+	bool local = false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(hostname, NULL, &hints, &res))
+		return false;
+	if (getifaddrs(&ifa_list)) {
+		freeaddrinfo(res);
+		return false;
+	}
+
+	for (rp = res; rp && !local; rp = rp->ai_next) {
+		if (rp->ai_family == AF_INET &&
+		    (ntohl(((struct sockaddr_in *)rp->ai_addr)->sin_addr.s_addr)
+		     >> 24) == IN_LOOPBACKNET)
+			local = true;
+		else if (rp->ai_family == AF_INET6 &&
+			 IN6_IS_ADDR_LOOPBACK(
+			   &((struct sockaddr_in6 *)rp->ai_addr)->sin6_addr))
+			local = true;
+
+		for (ifa = ifa_list; ifa && !local; ifa = ifa->ifa_next)
+			if (ifa->ifa_addr &&
+			    sockaddr_equal(ifa->ifa_addr, rp->ai_addr))
+				local = true;
+	}
+
+	freeifaddrs(ifa_list);
+	freeaddrinfo(res);
+	return local;
+}
+
+/*
+ * A cld on this machine may also listen on a local socket, which is
+ * cheaper than TCP over loopback.  The framing is the same.
+ */
+static int cldc_unix_connect(struct cldc_tcp *tcp, int port)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (cld_unix_path(sun.sun_path, sizeof(sun.sun_path), NULL, port) < 0)
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -ENOENT;
+	}
+
+	/* the peer has no address to speak of; the family stands in */
+	memcpy(tcp->addr, &sun.sun_family, sizeof(sun.sun_family));
+	tcp->addr_len = sizeof(sun.sun_family);
+
+	tcp->fd = fd;
+
+	return 0;
+}
+
+static int cldc_tcp_connect(struct cldc_tcp *tcp, const char *hostname,
+			    int port)
 {
-	struct cldc_tcp *tcp;
 	struct addrinfo hints, *res, *rp;
 	char port_s[32];
 	int rc, fd = -1;
 
-	*tcp_out = NULL;
+	if (cldc_host_is_local(hostname) && !cldc_unix_connect(tcp, port))
+		return 0;
 
 	sprintf(port_s, "%d", port);
 
@@ -80,13 +174,6 @@ int cldc_tcp_new(const char *hostname, int port,
 		return -ENOENT;
 	}
 
-	tcp = calloc(1, sizeof(*tcp));
-	if (!tcp) {
-		freeaddrinfo(res);
-		close(fd);
-		return -ENOMEM;
-	}
-
 	memcpy(tcp->addr, rp->ai_addr, rp->ai_addrlen);
 	tcp->addr_len = rp->ai_addrlen;
 
@@ -94,15 +181,55 @@ int cldc_tcp_new(const char *hostname, int port,
 
 	freeaddrinfo(res);
 
+	return 0;
+}
+
+int cldc_tcp_new(const char *hostname, int port,
+		 struct cldc_tcp **tcp_out)
+{
+	struct cldc_tcp *tcp;
+	int rc;
+
+	*tcp_out = NULL;
+
+	tcp = calloc(1, sizeof(*tcp));
+	if (!tcp)
+		return -ENOMEM;
+
+	rc = cldc_tcp_connect(tcp, hostname, port);
+	if (rc) {
+		free(tcp);
+		return rc;
+	}
+
 	*tcp_out = tcp;
 
 	return 0;
 }
 
+/*
+ * Replace a failed connection, keeping the sessions attached to tcp.
+ * The caller moves each session over with cldc_sess_reconnect.
+ */
+int cldc_tcp_reconnect(struct cldc_tcp *tcp, const char *hostname, int port)
+{
+	if (tcp->fd >= 0) {
+		close(tcp->fd);
+		tcp->fd = -1;
+	}
+
+	tcp->ubbp_read = 0;
+	tcp->raw_size = 0;
+	tcp->raw_read = 0;
+
+	return cldc_tcp_connect(tcp, hostname, port);
+}
+
 int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp)
 {
-	static char buf[CLD_RAW_MSG_SZ];	/* BUG: static buf */
+	struct cldc_session *sess;
 	ssize_t rc, crc;
+	GList *tmp;
 	void *p;
 
 	if (tcp->ubbp_read < sizeof(tcp->ubbp)) {
@@ -114,6 +241,8 @@ int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp)
 				return -errno;
 			return 0;
 		}
+		if (rc == 0)
+			return -EPIPE;
 
 		tcp->ubbp_read += rc;
 		if (tcp->ubbp_read == sizeof(tcp->ubbp)) {
@@ -127,14 +256,32 @@ int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp)
 				return -EIO;
 			tcp->raw_read = 0;
 			tcp->raw_size = UBBP_SIZE(tcp->ubbp.op_size);
-			if (tcp->raw_size > CLD_RAW_MSG_SZ)
+			if (tcp->raw_size > CLD_MAX_FRAME_SZ)
 				return -EIO;
+
+			/* server only sends frames this large to sessions
+			 * which negotiated CSF_LARGE_FRAMES
+			 */
+			if (tcp->raw_size <= CLD_RAW_MSG_SZ)
+				tcp->pkt = tcp->raw_pkt;
+			else {
+				if (!tcp->large_pkt) {
+					tcp->large_pkt =
+						malloc(CLD_MAX_FRAME_SZ);
+					if (!tcp->large_pkt)
+						return -ENOMEM;
+				}
+				tcp->pkt = tcp->large_pkt;
+			}
 		}
 	}
-	if (!tcp->raw_size)
+	/* a large frame may arrive across many reads; wait for the
+	 * whole header before touching the payload
+	 */
+	if (tcp->ubbp_read < sizeof(tcp->ubbp) || !tcp->raw_size)
 		return 0;
 
-	p = buf;		/* BUG: uses temp buffer */
+	p = tcp->pkt;
 	p += tcp->raw_read;
 	rc = read(tcp->fd, p, tcp->raw_size - tcp->raw_read);
 	if (rc < 0) {
@@ -142,6 +289,8 @@ int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp)
 			return -errno;
 		return 0;
 	}
+	if (rc == 0)
+		return -EPIPE;
 
 	tcp->raw_read += rc;
 
@@ -150,11 +299,20 @@ int cldc_tcp_receive_pkt_data(struct cldc_tcp *tcp)
 
 	tcp->ubbp_read = 0;
 
-	crc = cldc_receive_pkt(tcp->sess, tcp->addr, tcp->addr_len, buf,
+	/* frames for a session already gone are dropped */
+	sess = cldc_pkt_sess(tcp->sessions, tcp->pkt, tcp->raw_size);
+	if (!sess)
+		return 0;
+
+	crc = cldc_receive_pkt(sess, tcp->addr, tcp->addr_len, tcp->pkt,
 				tcp->raw_size);
 	if (crc)
 		return crc;
 
+	/* the server pings one session for all sharing the connection */
+	for (tmp = tcp->sessions; tmp; tmp = tmp->next)
+		cldc_sess_renew(tmp->data);
+
 	return 0;
 }
 
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <stdarg.h>
 #include <syslog.h>
@@ -49,11 +50,60 @@ enum {
 	CLDC_MSG_RETRY		= 5,
 	CLDC_MSG_REMEMBER	= 25,
 	CLDC_SESS_EXPIRE	= 2 * 60,
+	CLDC_ACK_DELAY		= 1,		/* hold a lone ACK this long */
+	CLDC_ACK_MAX		= 16,		/* pkts received per ACK */
+
+	/* what NEW-SESS asks for by default: whole-message frames, and
+	 * reliability left to the TCP stream
+	 */
+	CLDC_SESS_FLAGS		= CSF_LARGE_FRAMES | CSF_STREAM | CSF_READDIR |
+				  CSF_WATCH | CSF_COMPOUND | CSF_CUM_ACK,
 };
 
-static const char *user_key(struct cldc_session *sess, const char *user);
+static const struct cld_auth_key *user_key(struct cldc_session *sess,
+					   const char *user);
 static int sess_send_pkt(struct cldc_session *sess,
 			const void *pkt, size_t pkt_len);
+static void cldc_msg_free_pkts(struct cldc_msg *msg);
+static int sess_timer(struct cldc_session *sess, void *priv);
+static ssize_t generic_end_cb(struct cldc_msg *msg, const void *resp_p,
+			      size_t resp_len, enum cle_err_codes resp_rc);
+
+/* reassembly, payload and packet buffers, shared by all sessions in the
+ * process
+ */
+static struct cld_buf_pool cldc_buf_pool;
+static GStaticMutex cldc_buf_lock = G_STATIC_MUTEX_INIT;
+
+static int cldc_buf_reserve(char **bufp, size_t *capp, size_t len,
+			    size_t need)
+{
+	int rc;
+
+	g_static_mutex_lock(&cldc_buf_lock);
+	rc = cld_buf_reserve(&cldc_buf_pool, bufp, capp, len, need);
+	g_static_mutex_unlock(&cldc_buf_lock);
+	return rc;
+}
+
+static void cldc_buf_put(char *buf, size_t cap)
+{
+	if (!buf)
+		return;
+
+	g_static_mutex_lock(&cldc_buf_lock);
+	cld_buf_put(&cldc_buf_pool, buf, cap);
+	g_static_mutex_unlock(&cldc_buf_lock);
+}
+
+static void cldc_pkt_free(struct cldc_pkt_info *pi)
+{
+	if (!pi)
+		return;
+
+	cldc_buf_put(pi->buf, pi->buf_cap);
+	free(pi);
+}
 
 #ifndef HAVE_STRNLEN
 static size_t strnlen(const char *s, size_t maxlen)
@@ -119,7 +169,7 @@ static int ack_seqid(struct cldc_session *sess, uint64_t seqid_le)
 	struct cld_pkt_ftr *foot;
 	int ret;
 	static const char * const magic = CLD_PKT_MAGIC;
-	const char *secret_key;
+	const struct cld_auth_key *auth_key;
 
 	/* Construct ACK packet */
 	memset(&pkt, 0, sizeof(struct cld_pkt_hdr));
@@ -149,9 +199,10 @@ static int ack_seqid(struct cldc_session *sess, uint64_t seqid_le)
 	foot->seqid = seqid_le;
 	xdr_destroy(&xdrs);
 
-	secret_key = user_key(sess, sess->user);
-	ret = cld_authsign(&sess->log, secret_key,
-			     buf, total_len - SHA_DIGEST_LENGTH, foot->sha);
+	auth_key = user_key(sess, sess->user);
+	ret = auth_key ? cld_auth_key_sign(auth_key, buf,
+					   total_len - SHA_DIGEST_LENGTH,
+					   foot->sha) : -EINVAL;
 	if (ret) {
 		HAIL_ERR(&sess->log, "%s: authsign failed: %d",
 			 __func__, ret);
@@ -161,16 +212,51 @@ static int ack_seqid(struct cldc_session *sess, uint64_t seqid_le)
 	return sess_send_pkt(sess, buf, total_len);
 }
 
+/* Acknowledge, in one CMO_ACK, everything received so far */
+static int ack_flush(struct cldc_session *sess)
+{
+	if (!sess->ack_pending)
+		return 0;
+
+	sess->ack_pending = 0;
+	return ack_seqid(sess, cpu_to_le64(sess->next_seqid_in - 1));
+}
+
+/** Acknowledge a received packet.  In a CSF_CUM_ACK session the ACK is
+ * held back: the next request we send carries it, or else the session
+ * timer sends one cumulative ACK after CLDC_ACK_DELAY.
+ *
+ * @param sess		The session
+ * @param seqid_le	Sequence ID of the packet, little endian
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int sess_ack(struct cldc_session *sess, uint64_t seqid_le)
+{
+	if (!(sess->flags & CSF_CUM_ACK))
+		return ack_seqid(sess, seqid_le);
+
+	if (!sess->ack_pending++)
+		sess->ops->timer_ctl(sess->private, true, sess_timer, sess,
+				     CLDC_ACK_DELAY);
+
+	if (sess->ack_pending >= CLDC_ACK_MAX)
+		return ack_flush(sess);
+	return 0;
+}
+
 static int rxmsg_generic(struct cldc_session *sess,
 			 const struct cld_pkt_hdr *pkt,
-			 const struct cld_pkt_ftr *foot)
+			 const struct cld_pkt_ftr *foot,
+			 const char *msg, size_t msg_len)
 {
 	XDR xdrs;
 	struct cld_msg_generic_resp resp;
 	struct cldc_msg *req = NULL;
 	GList *tmp;
+	bool stream = sess->flags & CSF_STREAM;
 
-	xdrmem_create(&xdrs, sess->msg_buf, sess->msg_buf_len, XDR_DECODE);
+	xdrmem_create(&xdrs, (void *)msg, msg_len, XDR_DECODE);
 	if (!xdr_cld_msg_generic_resp(&xdrs, &resp)) {
 		HAIL_DEBUG(&sess->log, "%s: failed to decode "
 			   "cld_msg_generic_resp", __func__);
@@ -207,26 +293,34 @@ static int rxmsg_generic(struct cldc_session *sess,
 
 		req->done = true;
 
+		/* never retransmitted, so the packets can go now */
+		if (stream)
+			cldc_msg_free_pkts(req);
+
 		if (req->cb) {
-			ssize_t rc = req->cb(req, sess->msg_buf,
-					     sess->msg_buf_len, resp.code);
+			ssize_t rc = req->cb(req, msg, msg_len, resp.code);
 			if (rc < 0)
 				return rc;
 		}
 	}
 
-	return ack_seqid(sess, foot->seqid);
+	/* the callback may have freed sess; do not look at it again */
+	if (stream)
+		return 0;
+
+	return sess_ack(sess, foot->seqid);
 }
 
 static int rxmsg_ack_frag(struct cldc_session *sess,
 			  const struct cld_pkt_hdr *pkt,
-			  const struct cld_pkt_ftr *foot)
+			  const struct cld_pkt_ftr *foot,
+			  const char *msg, size_t msg_len)
 {
 	XDR xdrs;
 	struct cld_msg_ack_frag ack_msg;
 	GList *tmp;
 
-	xdrmem_create(&xdrs, sess->msg_buf, sess->msg_buf_len, XDR_DECODE);
+	xdrmem_create(&xdrs, (void *)msg, msg_len, XDR_DECODE);
 	memset(&ack_msg, 0, sizeof(ack_msg));
 	if (!xdr_cld_msg_ack_frag(&xdrs, &ack_msg)) {
 		HAIL_INFO(&sess->log, "%s: failed to decode ack_msg",
@@ -267,7 +361,7 @@ static int rxmsg_ack_frag(struct cldc_session *sess,
 				     (unsigned long long) ack_msg.seqid);
 
 			req->pkt_info[i] = NULL;
-			free(pi);
+			cldc_pkt_free(pi);
 		}
 	}
 
@@ -276,14 +370,15 @@ static int rxmsg_ack_frag(struct cldc_session *sess,
 
 static int rxmsg_event(struct cldc_session *sess,
 		       const struct cld_pkt_hdr *pkt,
-		       const struct cld_pkt_ftr *foot)
+		       const struct cld_pkt_ftr *foot,
+		       const char *msg, size_t msg_len)
 {
 	XDR xdrs;
 	struct cld_msg_event ev;
 	struct cldc_fh *fh = NULL;
 	GList *tmp;
 
-	xdrmem_create(&xdrs, sess->msg_buf, sess->msg_buf_len, XDR_DECODE);
+	xdrmem_create(&xdrs, (void *)msg, msg_len, XDR_DECODE);
 	if (!xdr_cld_msg_event(&xdrs, &ev)) {
 		HAIL_DEBUG(&sess->log, "%s: failed to decode cld_msg_event",
 			   __func__);
@@ -308,16 +403,22 @@ static int rxmsg_event(struct cldc_session *sess,
 	return 0;
 }
 
-static void cldc_msg_free(struct cldc_msg *msg)
+static void cldc_msg_free_pkts(struct cldc_msg *msg)
 {
 	int i;
 
+	for (i = 0; i < msg->n_pkts; i++) {
+		cldc_pkt_free(msg->pkt_info[i]);
+		msg->pkt_info[i] = NULL;
+	}
+}
+
+static void cldc_msg_free(struct cldc_msg *msg)
+{
 	if (!msg)
 		return;
 
-	for (i = 0; i < msg->n_pkts; i++)
-		free(msg->pkt_info[i]);
-
+	cldc_msg_free_pkts(msg);
 	free(msg);
 }
 
@@ -342,7 +443,8 @@ static void sess_expire_outmsg(struct cldc_session *sess, time_t current_time)
 	sess->msg_scan_time = current_time + CLDC_MSG_SCAN;
 }
 
-static const char *user_key(struct cldc_session *sess, const char *user)
+static const struct cld_auth_key *user_key(struct cldc_session *sess,
+					   const char *user)
 {
 	if (!sess || !user || !*user ||
 	    (strnlen(user, CLD_MAX_USERNAME) >= CLD_MAX_USERNAME))
@@ -350,12 +452,13 @@ static const char *user_key(struct cldc_session *sess, const char *user)
 	if (strcmp(sess->user, user))
 		return NULL;
 
-	return sess->secret_key;
+	return &sess->auth_key;
 }
 
 static int rx_complete(struct cldc_session *sess,
 		       const struct cld_pkt_hdr *pkt,
-		       const struct cld_pkt_ftr *foot)
+		       const struct cld_pkt_ftr *foot,
+		       const char *msg, size_t msg_len)
 {
 	switch (sess->msg_buf_op) {
 	case CMO_ACK:
@@ -363,16 +466,16 @@ static int rx_complete(struct cldc_session *sess,
 		return -EBADRQC;
 	case CMO_PING:
 		/* send out an ACK */
-		return ack_seqid(sess, foot->seqid);
+		return sess_ack(sess, foot->seqid);
 	case CMO_NOT_MASTER:
 		HAIL_ERR(&sess->log, "FIXME: not-master message received");
 		return -1055;	/* FIXME */
 	case CMO_EVENT:
-		return rxmsg_event(sess, pkt, foot);
+		return rxmsg_event(sess, pkt, foot, msg, msg_len);
 	case CMO_ACK_FRAG:
-		return rxmsg_ack_frag(sess, pkt, foot);
+		return rxmsg_ack_frag(sess, pkt, foot, msg, msg_len);
 	default:
-		return rxmsg_generic(sess, pkt, foot);
+		return rxmsg_generic(sess, pkt, foot, msg, msg_len);
 	}
 }
 
@@ -426,11 +529,12 @@ int cldc_receive_pkt(struct cldc_session *sess,
 		     const void *net_addr, size_t net_addrlen,
 		     const void *pktbuf, size_t pkt_len)
 {
-	const char *secret_key;
+	const struct cld_auth_key *auth_key;
 	struct timeval tv;
 	time_t current_time;
 	struct cld_pkt_hdr pkt;
 	unsigned int hdr_len, msg_len;
+	const char *msg;
 	const struct cld_pkt_ftr *foot;
 	uint64_t seqid;
 	XDR xdrs;
@@ -464,9 +568,10 @@ int cldc_receive_pkt(struct cldc_session *sess,
 	/* check HMAC signature */
 	foot = (const struct cld_pkt_ftr *)
 		(((char *)pktbuf) + (pkt_len - CLD_PKT_FTR_LEN));
-	secret_key = user_key(sess, pkt.user);
-	ret = cld_authcheck(&sess->log, secret_key,
-			      pktbuf, pkt_len - SHA_DIGEST_LENGTH, foot->sha);
+	auth_key = user_key(sess, pkt.user);
+	ret = auth_key ? cld_auth_key_check(auth_key, pktbuf,
+					    pkt_len - SHA_DIGEST_LENGTH,
+					    foot->sha) : -EINVAL;
 	if (ret) {
 		HAIL_DEBUG(&sess->log, "%s: invalid auth (ret=%d)",
 			   __func__, ret);
@@ -487,7 +592,7 @@ int cldc_receive_pkt(struct cldc_session *sess,
 	if (pkt.mi.order & CLD_PKT_IS_FIRST) {
 		/* This packet begins a new message.
 		 * Determine the new message's op */
-		sess->msg_buf_op = pkt.mi.cld_pkt_msg_info_u.mi.op;
+		sess->msg_buf_op = cld_pkt_infos(&pkt)->op;
 	}
 
 	/* verify (or set, for new-sess) sequence id */
@@ -499,24 +604,104 @@ int cldc_receive_pkt(struct cldc_session *sess,
 		return ret;
 	}
 
-	if (pkt.mi.order & CLD_PKT_IS_FIRST)
+	/* a new message abandons any half-assembled one */
+	if (pkt.mi.order & CLD_PKT_IS_FIRST) {
+		cldc_buf_put(sess->msg_buf, sess->msg_buf_cap);
+		sess->msg_buf = NULL;
+		sess->msg_buf_cap = 0;
 		sess->msg_buf_len = 0;
+	}
+	msg = (const char *)pktbuf + hdr_len;
 	msg_len = pkt_len - hdr_len - CLD_PKT_FTR_LEN;
-	if ((sess->msg_buf_len + msg_len) > CLD_MAX_MSG_SZ) {
-		HAIL_DEBUG(&sess->log, "%s: message too long", __func__);
-		return -EPROTO;
+
+	/* a message in one packet is decoded where it lies; only
+	 * fragments are copied, into a buffer taken from the pool
+	 */
+	if ((pkt.mi.order & (CLD_PKT_IS_FIRST | CLD_PKT_IS_LAST)) !=
+	    (CLD_PKT_IS_FIRST | CLD_PKT_IS_LAST)) {
+		ret = cldc_buf_reserve(&sess->msg_buf, &sess->msg_buf_cap,
+				       sess->msg_buf_len,
+				       sess->msg_buf_len + msg_len);
+		if (ret == -EMSGSIZE) {
+			HAIL_DEBUG(&sess->log, "%s: message too long",
+				   __func__);
+			return -EPROTO;
+		}
+		if (ret)
+			return ret;
+
+		memcpy(sess->msg_buf + sess->msg_buf_len, msg, msg_len);
+		sess->msg_buf_len += msg_len;
 	}
-	memcpy(sess->msg_buf + sess->msg_buf_len, pktbuf + hdr_len, msg_len);
-	sess->msg_buf_len += msg_len;
 	sess->expire_time = current_time + CLDC_SESS_EXPIRE;
 
 	if (pkt.mi.order & CLD_PKT_IS_LAST) {
+		char *buf = sess->msg_buf;
+		size_t buf_cap = sess->msg_buf_cap;
+
 		HAIL_VERBOSE(&sess->log, "%s: receiving complete message of "
 			     "op %s", __func__, cld_opstr(sess->msg_buf_op));
-		return rx_complete(sess, &pkt, foot);
+
+		/* detach the buffer first; completions may free sess */
+		if (buf) {
+			msg = buf;
+			msg_len = sess->msg_buf_len;
+			sess->msg_buf = NULL;
+			sess->msg_buf_cap = 0;
+			sess->msg_buf_len = 0;
+		}
+
+		ret = rx_complete(sess, &pkt, foot, msg, msg_len);
+		cldc_buf_put(buf, buf_cap);
+		return ret;
+	} else if (sess->flags & CSF_STREAM) {
+		return 0;
 	} else {
-		return ack_seqid(sess, foot->seqid);
+		return sess_ack(sess, foot->seqid);
+	}
+}
+
+struct cldc_session *cldc_pkt_sess(GList *sessions,
+				   const void *pktbuf, size_t pkt_len)
+{
+	struct cldc_session *sess = NULL;
+	struct cld_pkt_hdr pkt;
+	XDR xdrs;
+	GList *tmp;
+
+	if (pkt_len < CLD_PKT_FTR_LEN)
+		return NULL;
+
+	xdrmem_create(&xdrs, (void *)pktbuf,
+		      pkt_len - CLD_PKT_FTR_LEN, XDR_DECODE);
+	memset(&pkt, 0, sizeof(pkt));
+	if (!xdr_cld_pkt_hdr(&xdrs, &pkt)) {
+		xdr_destroy(&xdrs);
+		return NULL;
+	}
+	xdr_destroy(&xdrs);
+
+	for (tmp = sessions; tmp; tmp = tmp->next) {
+		if (!memcmp(&pkt.sid, ((struct cldc_session *)tmp->data)->sid,
+			    CLD_SID_SZ)) {
+			sess = tmp->data;
+			break;
+		}
 	}
+
+	xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
+	return sess;
+}
+
+void cldc_sess_renew(struct cldc_session *sess)
+{
+	struct timeval tv;
+
+	if (!(sess->flags & CSF_STREAM) || sess->expired)
+		return;
+
+	gettimeofday(&tv, NULL);
+	sess->expire_time = tv.tv_sec + CLDC_SESS_EXPIRE;
 }
 
 static void sess_next_seqid(struct cldc_session *sess, uint64_t *seqid)
@@ -525,6 +710,51 @@ static void sess_next_seqid(struct cldc_session *sess, uint64_t *seqid)
 	*seqid = rc;
 }
 
+struct cldc_pack {
+	const char		*user;
+	unsigned int		n_pkts;
+	struct cldc_pkt_info	*pkts[CLD_MAX_MSG_SZ / CLD_MAX_PKT_MSG_SZ + 1];
+};
+
+/* cld_msg_pack callback; runs under cldc_buf_lock */
+static int cldc_pkt_emit(void *priv, char *buf, size_t cap,
+			 char *pkt, size_t pkt_len)
+{
+	struct cldc_pack *cp = priv;
+	struct cldc_pkt_info *pi;
+	char *small;
+	size_t small_cap;
+
+	pi = calloc(1, sizeof(*pi));
+	if (!pi || cp->n_pkts == G_N_ELEMENTS(cp->pkts)) {
+		free(pi);
+		cld_buf_put(&cldc_buf_pool, buf, cap);
+		return -ENOMEM;
+	}
+
+	/* packets are held until ACK'd, so move a small one out of the
+	 * large buffer it was encoded in
+	 */
+	if (pkt_len <= cap / 4) {
+		small = cld_buf_get(&cldc_buf_pool, pkt_len, &small_cap);
+		if (small) {
+			memcpy(small, pkt, pkt_len);
+			cld_buf_put(&cldc_buf_pool, buf, cap);
+			buf = pkt = small;
+			cap = small_cap;
+		}
+	}
+
+	pi->data = pkt;
+	pi->pkt_len = pkt_len;
+	pi->buf = buf;
+	pi->buf_cap = cap;
+	strncpy(pi->user, cp->user, CLD_MAX_USERNAME - 1);
+
+	cp->pkts[cp->n_pkts++] = pi;
+	return 0;
+}
+
 /**
  * creates a new cldc_msg
  *
@@ -542,41 +772,66 @@ static struct cldc_msg *cldc_new_msg(struct cldc_session *sess,
 				     xdrproc_t xdrproc, const void *data)
 {
 	struct cldc_msg *msg;
+	struct cldc_pack cp;
+	struct cld_pkt_hdr pkt;
 	struct timeval tv;
-	size_t i, body_len, n_pkts;
-	char *body;
-	XDR xbdy;
-
-	/* Encode the message body */
-	body_len = xdr_sizeof(xdrproc, (void *)data);
-	body = alloca(body_len);
-	xdrmem_create(&xbdy, body, body_len, XDR_ENCODE);
-	if (!xdrproc(&xbdy, (void *)data)) {
-		HAIL_DEBUG(&sess->log, "%s: failed to encode "
-			   "message", __func__);
-		xdr_destroy(&xbdy);
-		return NULL;
-	}
-	xdr_destroy(&xbdy);
+	size_t max_chunk_len;
+	uint64_t xid;
+	unsigned int i;
+	int rc;
+
+	/* Once the server agreed to take whole messages, a message
+	 * is always a single packet, with a single signature.
+	 */
+	if (sess->flags & CSF_LARGE_FRAMES)
+		max_chunk_len = CLD_MAX_MSG_SZ;
+	else
+		max_chunk_len = CLD_MAX_PKT_MSG_SZ;
 
-	if (body_len == 0)
-		/* Some packets (like ACKS) just have a header, and no message
-		 * body. */
-		n_pkts = 1;
-	else {
-		/* round up */
-		n_pkts = (body_len + CLD_MAX_PKT_MSG_SZ - 1) /
-			CLD_MAX_PKT_MSG_SZ;
+	/* Set up the first packet header */
+	cld_rand64(&xid);
+	memset(&pkt, 0, sizeof(pkt));
+	memcpy(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic));
+	memcpy(&pkt.sid, sess->sid, CLD_SID_SZ);
+	pkt.user = sess->user;
+	if (sess->flags & CSF_CUM_ACK) {
+		struct cld_pkt_msg_infos_ack *mia =
+			&pkt.mi.cld_pkt_msg_info_u.mia;
+
+		/* any ACK we are holding rides along */
+		pkt.mi.order = CLD_PKT_ORD_FIRST_ACK;
+		mia->mi.xid = xid;
+		mia->mi.op = op;
+		mia->ack = sess->next_seqid_in - 1;
+	} else {
+		pkt.mi.order = CLD_PKT_ORD_FIRST;
+		pkt.mi.cld_pkt_msg_info_u.mi.xid = xid;
+		pkt.mi.cld_pkt_msg_info_u.mi.op = op;
+	}
+
+	/* Encode header and body straight into pooled packet buffers */
+	cp.user = sess->user;
+	cp.n_pkts = 0;
+	g_static_mutex_lock(&cldc_buf_lock);
+	rc = cld_msg_pack(&cldc_buf_pool, &pkt, xdrproc, data,
+			  max_chunk_len, cldc_pkt_emit, &cp);
+	g_static_mutex_unlock(&cldc_buf_lock);
+	if (rc) {
+		HAIL_DEBUG(&sess->log, "%s: failed to encode "
+			   "message: %d", __func__, rc);
+		goto err_out;
 	}
 
 	/* Create cldc_msg */
 	msg = calloc(1, sizeof(*msg) +
-		        (n_pkts * sizeof(struct cldc_pkt_info *)));
+		        (cp.n_pkts * sizeof(struct cldc_pkt_info *)));
 	if (!msg)
-		return NULL;
+		goto err_out;
 
-	msg->n_pkts = n_pkts;
-	cld_rand64(&msg->xid);
+	msg->n_pkts = cp.n_pkts;
+	memcpy(msg->pkt_info, cp.pkts,
+	       cp.n_pkts * sizeof(struct cldc_pkt_info *));
+	msg->xid = xid;
 	msg->op = op;
 	msg->sess = sess;
 	if (copts)
@@ -584,60 +839,14 @@ static struct cldc_msg *cldc_new_msg(struct cldc_session *sess,
 	gettimeofday(&tv, NULL);
 	msg->expire_time = tv.tv_sec + CLDC_MSG_EXPIRE;
 
-	for (i = 0; i < msg->n_pkts; i++) {
-		XDR xhdr;
-		struct cld_pkt_hdr pkt;
-		struct cldc_pkt_info *pi;
-		int hdr_len, body_chunk_len, pkt_len;
-
-		/* Set up packet header */
-		memcpy(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic));
-		memcpy(&pkt.sid, sess->sid, CLD_SID_SZ);
-		pkt.user = sess->user;
-		if (i == 0) {
-			if (i == (msg->n_pkts - 1))
-				pkt.mi.order = CLD_PKT_ORD_FIRST_LAST;
-			else
-				pkt.mi.order = CLD_PKT_ORD_FIRST;
-			pkt.mi.cld_pkt_msg_info_u.mi.xid = msg->xid;
-			pkt.mi.cld_pkt_msg_info_u.mi.op = op;
-		} else {
-			if (i == (msg->n_pkts - 1))
-				pkt.mi.order = CLD_PKT_ORD_LAST;
-			else
-				pkt.mi.order = CLD_PKT_ORD_MID;
-		}
-
-		/* Allocate memory */
-		hdr_len = xdr_sizeof((xdrproc_t)xdr_cld_pkt_hdr, &pkt);
-		body_chunk_len = MIN(body_len, CLD_MAX_PKT_MSG_SZ);
-		pkt_len = hdr_len + body_chunk_len + CLD_PKT_FTR_LEN;
-		pi = calloc(1, sizeof(*pi) + pkt_len);
-		if (!pi)
-			goto err_out;
-		pi->pkt_len = pkt_len;
-		msg->pkt_info[i] = pi;
-		strncpy(pi->user, sess->user, CLD_MAX_USERNAME - 1);
-
-		/* Fill in the packet header */
-		xdrmem_create(&xhdr, (char *)pi->data, hdr_len, XDR_ENCODE);
-		if (!xdr_cld_pkt_hdr(&xhdr, &pkt)) {
-			HAIL_DEBUG(&sess->log, "%s: failed to encode header "
-				   "for packet %zu", __func__, i);
-			xdr_destroy(&xhdr);
-			goto err_out;
-		}
-
-		/* Fill in the body */
-		memcpy(pi->data + hdr_len, body, body_chunk_len);
-		body += body_chunk_len;
-		body_len -= body_chunk_len;
-	}
+	if (sess->flags & CSF_CUM_ACK)
+		sess->ack_pending = 0;
 
 	return msg;
 
 err_out:
-	cldc_msg_free(msg);
+	for (i = 0; i < cp.n_pkts; i++)
+		cldc_pkt_free(cp.pkts[i]);
 	return NULL;
 }
 
@@ -696,6 +905,21 @@ static int sess_timer(struct cldc_session *sess, void *priv)
 		return 0;
 	}
 
+	/* an ACK held for a request that never came is due now */
+	ack_flush(sess);
+
+	/* woken early for the ACK; retransmits keep their own pace */
+	if (tv.tv_sec < sess->retry_time) {
+		sess->ops->timer_ctl(sess->private, true, sess_timer, sess,
+				     sess->retry_time - tv.tv_sec);
+		return sess->retry_time - tv.tv_sec;
+	}
+	sess->retry_time = tv.tv_sec + CLDC_MSG_RETRY;
+
+	/* the transport retransmits for us */
+	if (sess->flags & CSF_STREAM)
+		tmp = NULL;
+
 	while (tmp) {
 		struct cldc_msg *msg;
 		int i;
@@ -722,35 +946,49 @@ static int sess_timer(struct cldc_session *sess, void *priv)
 	return CLDC_MSG_RETRY;
 }
 
+/* give a packet the next sequence number, and sign it */
+static int sess_sign_pkt(struct cldc_session *sess,
+			 const struct cld_auth_key *auth_key,
+			 struct cldc_pkt_info *pi)
+{
+	struct cld_pkt_ftr *foot;
+
+	/* Add the sequence number to the end of the packet */
+	foot = (struct cld_pkt_ftr *)
+		(pi->data + pi->pkt_len - CLD_PKT_FTR_LEN);
+	memset(foot, 0, CLD_PKT_FTR_LEN);
+	sess_next_seqid(sess, &foot->seqid);
+
+	/* Add the signature to the end of the packet */
+	return cld_auth_key_sign(auth_key, pi->data,
+				 pi->pkt_len - SHA_DIGEST_LENGTH, foot->sha);
+}
+
 static int sess_send(struct cldc_session *sess, struct cldc_msg *msg)
 {
 	int ret, i;
-	const char *secret_key;
+	const struct cld_auth_key *auth_key;
 
-	secret_key = user_key(sess, sess->user);
+	auth_key = user_key(sess, sess->user);
+	if (!auth_key)
+		return -EINVAL;
 
 	for (i = 0; i < msg->n_pkts; i++) {
 		struct cldc_pkt_info *pi;
-		struct cld_pkt_ftr *foot;
 
 		pi = msg->pkt_info[i];
 
-		/* Add the sequence number to the end of the packet */
-		foot = (struct cld_pkt_ftr *)
-			(pi->data + pi->pkt_len - CLD_PKT_FTR_LEN);
-		memset(foot, 0, CLD_PKT_FTR_LEN);
-		sess_next_seqid(sess, &foot->seqid);
-
-		/* Add the signature to the end of the packet */
-		ret = cld_authsign(&sess->log, secret_key,
-				     pi->data,
-				     pi->pkt_len - SHA_DIGEST_LENGTH,foot->sha);
+		ret = sess_sign_pkt(sess, auth_key, pi);
 		if (ret)
 			return ret;
 
 		/* attempt first send */
-		if (sess_send_pkt(sess, pi->data, pi->pkt_len) < 0)
+		if (sess_send_pkt(sess, pi->data, pi->pkt_len) < 0) {
+			/* keep it for cldc_sess_reconnect to replay */
+			if (sess->flags & CSF_STREAM)
+				break;
 			return -EIO;
+		}
 	}
 
 	/* add to list of outgoing packets, waiting to be ack'd */
@@ -759,6 +997,111 @@ static int sess_send(struct cldc_session *sess, struct cldc_msg *msg)
 	return 0;
 }
 
+/*
+ * Requests the server may run twice without changing the outcome.
+ * Anything else was possibly applied before the connection dropped,
+ * and the server keeps no reply cache for CSF_STREAM sessions.
+ */
+static bool op_replayable(enum cld_msg_op op)
+{
+	switch (op) {
+	case CMO_NOP:
+	case CMO_GET_META:
+	case CMO_GET:
+	case CMO_GET_WAIT:
+	case CMO_READDIR:
+	case CMO_END_SESS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int cldc_sess_reconnect(struct cldc_session *sess,
+			const void *addr, size_t addr_len)
+{
+	const struct cld_auth_key *auth_key;
+	struct cldc_call_opts copts;
+	struct cldc_msg *rmsg;
+	GList *tmp, *lost = NULL, *replay = NULL;
+	int i, rc;
+
+	if (!(sess->flags & CSF_STREAM))
+		return -EINVAL;
+	if (addr_len > sizeof(sess->addr))
+		return -EINVAL;
+	auth_key = user_key(sess, sess->user);
+	if (!auth_key)
+		return -EINVAL;
+
+	memcpy(sess->addr, addr, addr_len);
+	sess->addr_len = addr_len;
+
+	/* sort the unanswered requests, oldest first */
+	for (tmp = g_list_last(sess->out_msg); tmp; tmp = tmp->prev) {
+		struct cldc_msg *msg = tmp->data;
+
+		if (msg->done)
+			continue;
+
+		if (!op_replayable(msg->op)) {
+			msg->done = true;
+			cldc_msg_free_pkts(msg);
+			lost = g_list_prepend(lost, msg);
+			continue;
+		}
+
+		replay = g_list_prepend(replay, msg);
+	}
+
+	/* the server moves the session only on a RECONNECT, signed and
+	 * with a seqid it has not seen; so that goes first
+	 */
+	memset(&copts, 0, sizeof(copts));
+	rc = -ENOMEM;
+	rmsg = cldc_new_msg(sess, &copts, CMO_RECONNECT,
+			    (xdrproc_t)xdr_void, NULL);
+	if (!rmsg)
+		goto out;
+	rmsg->cb = generic_end_cb;
+	rc = sess_send(sess, rmsg);
+	if (rc)
+		goto out;
+
+	/* then the reads again; the server drops old seqids as replays */
+	for (tmp = g_list_last(replay); tmp; tmp = tmp->prev) {
+		struct cldc_msg *msg = tmp->data;
+
+		for (i = 0; i < msg->n_pkts; i++) {
+			struct cldc_pkt_info *pi = msg->pkt_info[i];
+
+			if (!pi)
+				continue;
+			pi->retries++;
+			rc = sess_sign_pkt(sess, auth_key, pi);
+			if (rc)
+				goto out;
+			rc = sess_send_pkt(sess, pi->data, pi->pkt_len);
+			if (rc < 0)
+				goto out;
+		}
+	}
+	rc = 0;
+
+out:
+	g_list_free(replay);
+	/* the rest may or may not have run; let the callers decide */
+	for (tmp = g_list_last(lost); tmp; tmp = tmp->prev) {
+		struct cldc_msg *msg = tmp->data;
+
+		if (msg->cb)
+			msg->cb(msg, NULL, 0, CLE_CONN_RESET);
+	}
+	g_list_free(lost);
+
+	return rc;
+}
+
 static void sess_free(struct cldc_session *sess)
 {
 	GList *tmp;
@@ -779,6 +1122,11 @@ static void sess_free(struct cldc_session *sess)
 	}
 	g_list_free(sess->out_msg);
 
+	cldc_buf_put(sess->msg_buf, sess->msg_buf_cap);
+	cldc_buf_put(sess->payload, sess->payload_cap);
+
+	cld_auth_key_fini(&sess->auth_key);
+
 	memset(sess, 0x55, sizeof(*sess));
 	free(sess);
 }
@@ -814,8 +1162,24 @@ int cldc_end_sess(struct cldc_session *sess, const struct cldc_call_opts *copts)
 static ssize_t new_sess_cb(struct cldc_msg *msg, const void *resp_p,
 			   size_t resp_len, enum cle_err_codes resp_rc)
 {
-	if (resp_rc == CLE_OK)
+	if (resp_rc == CLE_OK) {
+		XDR xdrs;
+		struct cld_msg_new_sess_resp resp;
+
+		/* servers predating session flags send a generic
+		 * response, which grants nothing
+		 */
+		xdrmem_create(&xdrs, (void *)resp_p, resp_len, XDR_DECODE);
+		memset(&resp, 0, sizeof(resp));
+		if (xdr_cld_msg_new_sess_resp(&xdrs, &resp))
+			msg->sess->flags = resp.flags &
+					   (CSF_LARGE_FRAMES | CSF_STREAM |
+					    CSF_READDIR | CSF_WATCH |
+					    CSF_COMPOUND | CSF_CUM_ACK);
+		xdr_destroy(&xdrs);
+
 		msg->sess->confirmed = true;
+	}
 
 	if (msg->copts.cb)
 		return msg->copts.cb(&msg->copts, resp_rc);
@@ -828,11 +1192,13 @@ static int cldc_new_sess_log(const struct cldc_ops *ops,
 			     const void *addr, size_t addr_len,
 			     const char *user, const char *secret_key,
 			     void *private, struct hail_log *log,
-			     struct cldc_session **sess_out)
+			     uint32_t flags, struct cldc_session **sess_out)
 {
 	struct cldc_session *sess;
 	struct cldc_msg *msg;
+	struct cld_msg_new_sess new_sess;
 	struct timeval tv;
+	int rc;
 
 	if (addr_len > sizeof(sess->addr))
 		return -EINVAL;
@@ -852,6 +1218,11 @@ static int cldc_new_sess_log(const struct cldc_ops *ops,
 	sess->log = *log;		/* save off caller's stack */
 	strcpy(sess->user, user);
 	strcpy(sess->secret_key, secret_key);
+	rc = cld_auth_key_init(&sess->auth_key, sess->secret_key);
+	if (rc) {
+		sess_free(sess);
+		return rc;
+	}
 
 	/* create random SID, next_seqid_out */
 	cld_rand64(sess->sid);
@@ -861,9 +1232,10 @@ static int cldc_new_sess_log(const struct cldc_ops *ops,
 	memcpy(sess->addr, addr, addr_len);
 	sess->addr_len = addr_len;
 
-	/* create NEW-SESS message */
+	/* create NEW-SESS message; the server grants a subset of flags */
+	new_sess.flags = flags;
 	msg = cldc_new_msg(sess, copts, CMO_NEW_SESS,
-			   (xdrproc_t)xdr_void, NULL);
+			   (xdrproc_t)xdr_cld_msg_new_sess, &new_sess);
 	if (!msg) {
 		sess_free(sess);
 		return -ENOMEM;
@@ -876,6 +1248,7 @@ static int cldc_new_sess_log(const struct cldc_ops *ops,
 
 	gettimeofday(&tv, NULL);
 	sess->expire_time = tv.tv_sec + CLDC_SESS_EXPIRE;
+	sess->retry_time = tv.tv_sec + CLDC_MSG_RETRY;
 
 	sess->ops->timer_ctl(sess->private, true, sess_timer, sess,
 			     CLDC_MSG_RETRY);
@@ -896,7 +1269,7 @@ int cldc_new_sess(const struct cldc_ops *ops,
 	log.verbose = false;
 	log.func = cldc_errlog;
 	return cldc_new_sess_log(ops, copts, addr, addr_len, user, secret_key,
-				 private, &log, sess_out);
+				 private, &log, CLDC_SESS_FLAGS, sess_out);
 }
 
 /*
@@ -1165,6 +1538,66 @@ int cldc_put(struct cldc_fh *fh, const struct cldc_call_opts *copts,
 	return 0;
 }
 
+static ssize_t put_end_cb(struct cldc_msg *msg, const void *resp_p,
+			  size_t resp_len, enum cle_err_codes resp_rc)
+{
+	/* the version is sent back on success or on a lost race */
+	if (resp_rc == CLE_OK || resp_rc == CLE_VERS_MISMATCH) {
+		XDR xin;
+		struct cld_msg_put_resp resp;
+
+		xdrmem_create(&xin, (void *)resp_p, resp_len, XDR_DECODE);
+		memset(&resp, 0, sizeof(resp));
+		if (!xdr_cld_msg_put_resp(&xin, &resp)) {
+			xdr_destroy(&xin);
+			return -1009;
+		}
+		xdr_destroy(&xin);
+
+		memset(&msg->copts.resp, 0, sizeof(struct cld_msg_get_resp));
+		msg->copts.resp.msg = resp.msg;
+		msg->copts.resp.vers = resp.vers;
+	}
+
+	if (msg->copts.cb)
+		return msg->copts.cb(&msg->copts, resp_rc);
+	return 0;
+}
+
+int cldc_put_if(struct cldc_fh *fh, const struct cldc_call_opts *copts,
+		const void *data, size_t data_len, uint64_t vers)
+{
+	struct cldc_session *sess;
+	struct cldc_msg *msg;
+	struct cld_msg_put_if put;
+
+	if (!data || !data_len || data_len > CLD_MAX_PAYLOAD_SZ)
+		return -EINVAL;
+
+	if (!fh->valid)
+		return -EINVAL;
+
+	sess = fh->sess;
+
+	/* older servers drop messages they do not know */
+	if (!(sess->flags & CSF_COMPOUND))
+		return -EOPNOTSUPP;
+
+	/* create PUT-IF message */
+	put.fh = fh->fh;
+	put.vers = vers;
+	put.data.data_len = data_len;
+	put.data.data_val = (char *)data;
+	msg = cldc_new_msg(sess, copts, CMO_PUT_IF,
+			   (xdrproc_t)xdr_cld_msg_put_if, &put);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->cb = put_end_cb;
+
+	return sess_send(sess, msg);
+}
+
 static ssize_t get_end_cb(struct cldc_msg *msg, const void *resp_p,
 			  size_t resp_len, enum cle_err_codes resp_rc)
 {
@@ -1175,6 +1608,12 @@ static ssize_t get_end_cb(struct cldc_msg *msg, const void *resp_p,
 		/* Parse GET response.
 		 * Avoid memory allocation in xdr_string by pointing
 		 * variable-length elements at static buffers. */
+		/* full size, so earlier results stay where they were */
+		if (cldc_buf_reserve(&msg->sess->payload,
+				     &msg->sess->payload_cap, 0,
+				     CLD_MAX_PAYLOAD_SZ))
+			return -ENOMEM;
+
 		xdrmem_create(&xin, (void *)resp_p, resp_len, XDR_DECODE);
 		memset(resp, 0, sizeof(struct cld_msg_get_resp));
 		resp->inode_name = msg->sess->inode_name_temp;
@@ -1216,13 +1655,188 @@ int cldc_get(struct cldc_fh *fh, const struct cldc_call_opts *copts,
 	return sess_send(sess, msg);
 }
 
-int cldc_dirent_count(const void *data, size_t data_len)
+int cldc_open_get(struct cldc_session *sess,
+		  const struct cldc_call_opts *copts,
+		  const char *pathname, uint32_t open_mode)
 {
-	const void *p = data;
-	size_t tmp_len = data_len;
-	size_t str_len, rec_len, pad, total_len;
-	const uint16_t *tmp16;
-	int count = 0;
+	struct cldc_msg *msg;
+	struct cld_msg_open_get og;
+
+	if (!sess->confirmed)
+		return -EINVAL;
+
+	/* first char must be slash */
+	if (*pathname != '/')
+		return -EINVAL;
+	if (strlen(pathname) > CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	if (!(sess->flags & CSF_COMPOUND))
+		return -EOPNOTSUPP;
+
+	/* create OPEN-GET message */
+	og.mode = open_mode;
+	og.inode_name = (char *)pathname;
+	msg = cldc_new_msg(sess, copts, CMO_OPEN_GET,
+			   (xdrproc_t)xdr_cld_msg_open_get, &og);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->cb = get_end_cb;
+
+	return sess_send(sess, msg);
+}
+
+int cldc_open_put(struct cldc_session *sess,
+		  const struct cldc_call_opts *copts,
+		  const char *pathname, uint32_t open_mode,
+		  const void *data, size_t data_len,
+		  bool check_vers, uint64_t vers)
+{
+	struct cldc_msg *msg;
+	struct cld_msg_open_put op;
+
+	if (!sess->confirmed)
+		return -EINVAL;
+
+	/* first char must be slash */
+	if (*pathname != '/')
+		return -EINVAL;
+	if (strlen(pathname) > CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	if (!data || !data_len || data_len > CLD_MAX_PAYLOAD_SZ)
+		return -EINVAL;
+
+	if (!(sess->flags & CSF_COMPOUND))
+		return -EOPNOTSUPP;
+
+	/* create OPEN-PUT message */
+	op.mode = open_mode;
+	op.check_vers = check_vers;
+	op.vers = vers;
+	op.inode_name = (char *)pathname;
+	op.data.data_len = data_len;
+	op.data.data_val = (char *)data;
+	msg = cldc_new_msg(sess, copts, CMO_OPEN_PUT,
+			   (xdrproc_t)xdr_cld_msg_open_put, &op);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->cb = put_end_cb;
+
+	return sess_send(sess, msg);
+}
+
+int cldc_get_wait(struct cldc_fh *fh, const struct cldc_call_opts *copts,
+		  uint64_t vers, int timeout)
+{
+	struct cldc_session *sess;
+	struct cldc_msg *msg;
+	struct cld_msg_get_wait gw;
+
+	if (!fh->valid || timeout < 0)
+		return -EINVAL;
+
+	sess = fh->sess;
+
+	/* older servers drop messages they do not know */
+	if (!(sess->flags & CSF_WATCH))
+		return -EOPNOTSUPP;
+
+	/* create GET-WAIT message */
+	gw.fh = fh->fh;
+	gw.vers = vers;
+	gw.timeout = timeout;
+	msg = cldc_new_msg(sess, copts, CMO_GET_WAIT,
+			   (xdrproc_t)xdr_cld_msg_get_wait, &gw);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->cb = get_end_cb;
+
+	return sess_send(sess, msg);
+}
+
+static ssize_t readdir_end_cb(struct cldc_msg *msg, const void *resp_p,
+			      size_t resp_len, enum cle_err_codes resp_rc)
+{
+	if (resp_rc == CLE_OK) {
+		XDR xin;
+		struct cld_msg_readdir_resp rd;
+		struct cld_msg_get_resp *resp = &msg->copts.resp;
+
+		/* Parse READDIR response into the GET response fields,
+		 * so the names are read back with cldc_copts_get_data. */
+		/* full size, so earlier results stay where they were */
+		if (cldc_buf_reserve(&msg->sess->payload,
+				     &msg->sess->payload_cap, 0,
+				     CLD_MAX_PAYLOAD_SZ))
+			return -ENOMEM;
+
+		xdrmem_create(&xin, (void *)resp_p, resp_len, XDR_DECODE);
+		memset(&rd, 0, sizeof(rd));
+		rd.data.data_val = msg->sess->payload;
+		rd.data.data_len = 0;
+		if (!xdr_cld_msg_readdir_resp(&xin, &rd)) {
+			xdr_destroy(&xin);
+			return -1009;
+		}
+		xdr_destroy(&xin);
+
+		memset(resp, 0, sizeof(struct cld_msg_get_resp));
+		resp->msg = rd.msg;
+		resp->vers = rd.vers;
+		resp->flags = CIFL_DIR;
+		resp->data.data_val = rd.data.data_val;
+		resp->data.data_len = rd.data.data_len;
+		msg->copts.eof = rd.eof;
+	}
+
+	if (msg->copts.cb)
+		return msg->copts.cb(&msg->copts, resp_rc);
+	return 0;
+}
+
+int cldc_readdir(struct cldc_fh *fh, const struct cldc_call_opts *copts,
+		 const char *after, int max_ents)
+{
+	struct cldc_session *sess;
+	struct cldc_msg *msg;
+	struct cld_msg_readdir rd;
+
+	if (!fh->valid || max_ents < 0)
+		return -EINVAL;
+	if (after && strlen(after) >= CLD_INODE_NAME_MAX)
+		return -EINVAL;
+
+	sess = fh->sess;
+
+	/* older servers drop messages they do not know */
+	if (!(sess->flags & CSF_READDIR))
+		return -EOPNOTSUPP;
+
+	/* create READDIR message */
+	rd.fh = fh->fh;
+	rd.after = (char *) (after ? after : "");
+	rd.max_ents = max_ents;
+	msg = cldc_new_msg(sess, copts, CMO_READDIR,
+			   (xdrproc_t)xdr_cld_msg_readdir, &rd);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->cb = readdir_end_cb;
+
+	return sess_send(sess, msg);
+}
+
+int cldc_dirent_count(const void *data, size_t data_len)
+{
+	const void *p = data;
+	size_t tmp_len = data_len;
+	size_t str_len, rec_len, pad, total_len;
+	const uint16_t *tmp16;
+	int count = 0;
 
 	while (tmp_len > 0) {
 		if (tmp_len < 2)
@@ -1375,33 +1989,111 @@ static int ncld_gethost(char **hostp, unsigned short *portp,
 	return 0;
 }
 
-static void ncld_tcp_timer_event(struct cld_timer *timer)
+static void ncld_sess_timer_event(struct cld_timer *timer)
 {
 	struct ncld_sess *nsess = timer->userdata;
-	struct cldc_tcp *tcp = nsess->tcp;
 
-	if (tcp->cb)
-		tcp->cb(tcp->sess, tcp->cb_private);
+	if (nsess->timer_cb)
+		nsess->timer_cb(nsess->sess, nsess->timer_arg);
 }
 
+/* open modes which only the master can serve */
+#define NCLD_WRITE_MODES \
+	(COM_WRITE | COM_LOCK | COM_ACL | COM_CREATE | COM_EXCL)
+
 enum {
 	NCLD_CMD_END = 0,
-	NCLD_CMD_SESEV		/* argument - 4 bytes in host order */
+	NCLD_CMD_SESEV,		/* arguments - session, 4 bytes events */
+	NCLD_CMD_FHEV,		/* arguments - session, 8 bytes fh, 4 bytes ev. */
+	NCLD_CMD_WAKE		/* no arguments; poll the socket and timers anew */
 };
 
+/*
+ * Connections, one per server host and port, shared by all sessions
+ * of the process.
+ */
+static GStaticMutex ncld_conn_lock = G_STATIC_MUTEX_INIT;
+static GList *ncld_conns;
+
+/*
+ * Hand a server event to the handle it is for, if still open and if
+ * the application asked for it.  Runs unlocked, like session events.
+ */
+static void ncld_fh_event(struct ncld_conn *conn, struct ncld_sess *nsess,
+			  uint64_t fhnum, uint32_t what)
+{
+	void (*func)(void *, unsigned int) = NULL;
+	void *arg = NULL;
+	GList *tmp;
+
+	g_mutex_lock(conn->mutex);
+	if (!g_list_find(conn->sessions, nsess))
+		tmp = NULL;		/* closed since the event came */
+	else
+		tmp = nsess->handles;
+	for (; tmp; tmp = tmp->next) {
+		struct ncld_fh *fh = tmp->data;
+
+		if (fh->is_open && fh->fh->fh == fhnum) {
+			what &= fh->event_mask | CE_DELETED;
+			func = fh->event_func;
+			arg = fh->event_arg;
+			break;
+		}
+	}
+	g_mutex_unlock(conn->mutex);
+
+	if (func && what)
+		func(arg, what);
+}
+
+/*
+ * Hand a server event to the session it is for, if still open.
+ * Runs unlocked, so the application may call back into ncld.
+ */
+static void ncld_sess_event(struct ncld_conn *conn, struct ncld_sess *nsess,
+			    uint32_t what)
+{
+	void (*func)(void *, unsigned int) = NULL;
+	void *arg = NULL;
+
+	g_mutex_lock(conn->mutex);
+	if (g_list_find(conn->sessions, nsess)) {
+		func = nsess->event;
+		arg = nsess->event_arg;
+	}
+	g_mutex_unlock(conn->mutex);
+
+	if (func)
+		func(arg, what);
+}
+
 /*
  * All the error printouts are likely to be lost for daemons, but it's
  * not a big deal. We abort instead in order to indicate that something
  * went wrong, so system features should report it (usualy as a core).
  * When debugging, strace or -F mode will capture the output.
  */
-static void ncld_thread_command(struct ncld_sess *nsess)
+static void ncld_thread_read(struct ncld_conn *conn, void *buf, size_t len)
+{
+	ssize_t rrc;
+
+	rrc = read(conn->to_thread[0], buf, len);
+	if (rrc < (ssize_t) len) {
+		fprintf(stderr, "bad read param\n");
+		g_thread_exit(NULL);
+	}
+}
+
+static void ncld_thread_command(struct ncld_conn *conn)
 {
 	ssize_t rrc;
 	unsigned char cmd;
+	struct ncld_sess *nsess;
 	uint32_t what;
+	uint64_t fhnum;
 
-	rrc = read(nsess->to_thread[0], &cmd, 1);
+	rrc = read(conn->to_thread[0], &cmd, 1);
 	if (rrc < 0) {
 		fprintf(stderr, "read error: %s\n", strerror(errno));
 		abort();
@@ -1417,13 +2109,17 @@ static void ncld_thread_command(struct ncld_sess *nsess)
 		g_thread_exit(NULL);
 		break;
 	case NCLD_CMD_SESEV:
-		rrc = read(nsess->to_thread[0], &what, sizeof(uint32_t));
-		if (rrc < sizeof(uint32_t)) {
-			fprintf(stderr, "bad read param\n");
-			g_thread_exit(NULL);
-		}
-		if (nsess->event)
-			nsess->event(nsess->event_arg, what);
+		ncld_thread_read(conn, &nsess, sizeof(nsess));
+		ncld_thread_read(conn, &what, sizeof(what));
+		ncld_sess_event(conn, nsess, what);
+		break;
+	case NCLD_CMD_FHEV:
+		ncld_thread_read(conn, &nsess, sizeof(nsess));
+		ncld_thread_read(conn, &fhnum, sizeof(fhnum));
+		ncld_thread_read(conn, &what, sizeof(what));
+		ncld_fh_event(conn, nsess, fhnum, what);
+		break;
+	case NCLD_CMD_WAKE:
 		break;
 	default:
 		fprintf(stderr, "bad command 0x%x\n", cmd);
@@ -1431,26 +2127,77 @@ static void ncld_thread_command(struct ncld_sess *nsess)
 	}
 }
 
-static gpointer ncld_sess_thr(gpointer data)
+/*
+ * The connection went away.  CSF_STREAM sessions survive that: connect
+ * again and replay what is outstanding.  If there are none, just stop
+ * polling the dead socket, and let the sessions expire.
+ *
+ * Called with conn->mutex held.
+ */
+static void ncld_reconnect(struct ncld_conn *conn)
 {
-	struct ncld_sess *nsess = data;
+	struct cldc_tcp *tcp = conn->tcp;
+	struct cldc_session *sess = NULL;
+	GList *tmp;
+
+	for (tmp = tcp->sessions; tmp; tmp = tmp->next) {
+		struct cldc_session *s = tmp->data;
+
+		if ((s->flags & CSF_STREAM) && !s->expired) {
+			sess = s;
+			break;
+		}
+	}
+
+	if (!sess) {
+		if (tcp->fd >= 0) {
+			close(tcp->fd);
+			tcp->fd = -1;
+		}
+		return;
+	}
+
+	if (cldc_tcp_reconnect(tcp, conn->host, conn->port))
+		return;		/* retried on next pass of the thread */
+
+	HAIL_INFO(&sess->log, "reconnected to %s:%u",
+		  conn->host, conn->port);
+
+	for (tmp = tcp->sessions; tmp; tmp = tmp->next) {
+		sess = tmp->data;
+		if (!(sess->flags & CSF_STREAM) || sess->expired)
+			continue;
+
+		if (cldc_sess_reconnect(sess, tcp->addr, tcp->addr_len)) {
+			close(tcp->fd);
+			tcp->fd = -1;
+			return;
+		}
+	}
+}
+
+static gpointer ncld_conn_thr(gpointer data)
+{
+	struct ncld_conn *conn = data;
 	struct pollfd pfd[2];
-	time_t tmo;
+	unsigned long tmo;
 	int i;
 	int rc;
 
 	for (;;) {
-		g_mutex_lock(nsess->mutex);
-		tmo = cld_timers_run(&nsess->tlist);
-		g_mutex_unlock(nsess->mutex);
+		g_mutex_lock(conn->mutex);
+		if (conn->tcp->fd < 0)
+			ncld_reconnect(conn);
+		tmo = cld_timers_run_ms(&conn->tlist);
+		g_mutex_unlock(conn->mutex);
 
 		memset(pfd, 0, sizeof(pfd));
-		pfd[0].fd = nsess->to_thread[0];
+		pfd[0].fd = conn->to_thread[0];
 		pfd[0].events = POLLIN;
-		pfd[1].fd = nsess->tcp->fd;
+		pfd[1].fd = conn->tcp->fd;
 		pfd[1].events = POLLIN;
 
-		rc = poll(pfd, 2, tmo ? tmo*1000 : -1);
+		rc = poll(pfd, 2, tmo ? (int) MIN(tmo, INT_MAX) : -1);
 		if (rc == 0)
 			continue;
 		if (rc < 0) {
@@ -1461,11 +2208,14 @@ static gpointer ncld_sess_thr(gpointer data)
 		for (i = 0; i < ARRAY_SIZE(pfd); i++) {
 			if (pfd[i].revents) {
 				if (i == 0) {
-					ncld_thread_command(nsess);
+					ncld_thread_command(conn);
 				} else {
-					g_mutex_lock(nsess->mutex);
-					cldc_tcp_receive_pkt_data(nsess->tcp);
-					g_mutex_unlock(nsess->mutex);
+					g_mutex_lock(conn->mutex);
+					rc = cldc_tcp_receive_pkt_data(conn->tcp);
+					if (rc == -EPIPE || rc == -ECONNRESET ||
+					    rc == -EIO)
+						ncld_reconnect(conn);
+					g_mutex_unlock(conn->mutex);
 				}
 			}
 		}
@@ -1477,13 +2227,25 @@ static gpointer ncld_sess_thr(gpointer data)
 /*
  * Ask the thread to exit and wait until it does.
  */
-static void ncld_thr_end(struct ncld_sess *nsess)
+static void ncld_thr_end(struct ncld_conn *conn)
 {
 	unsigned char cmd;
 
 	cmd = NCLD_CMD_END;
-	write(nsess->to_thread[1], &cmd, 1);
-	g_thread_join(nsess->thread);
+	write(conn->to_thread[1], &cmd, 1);
+	g_thread_join(conn->thread);
+}
+
+/*
+ * Have the thread look at its socket and timers again, after a session
+ * was added to the connection.
+ */
+static void ncld_thr_wake(struct ncld_conn *conn)
+{
+	unsigned char cmd;
+
+	cmd = NCLD_CMD_WAKE;
+	write(conn->to_thread[1], &cmd, 1);
 }
 
 static bool ncld_p_timer_ctl(void *priv, bool add,
@@ -1491,14 +2253,14 @@ static bool ncld_p_timer_ctl(void *priv, bool add,
 			     void *cb_priv, time_t secs)
 {
 	struct ncld_sess *nsess = priv;
-	struct cldc_tcp *tcp = nsess->tcp;
+	struct ncld_conn *conn = nsess->conn;
 
 	if (add) {
-		tcp->cb = cb;
-		tcp->cb_private = cb_priv;
-		cld_timer_add(&nsess->tlist, &nsess->tcp_timer, time(NULL) + secs);
+		nsess->timer_cb = cb;
+		nsess->timer_arg = cb_priv;
+		cld_timer_add_ms(&conn->tlist, &nsess->timer, secs * 1000);
 	} else {
-		cld_timer_del(&nsess->tlist, &nsess->tcp_timer);
+		cld_timer_del(&conn->tlist, &nsess->timer);
 	}
 	return true;
 }
@@ -1507,17 +2269,19 @@ static int ncld_p_pkt_send(void *priv, const void *addr, size_t addrlen,
 			       const void *buf, size_t buflen)
 {
 	struct ncld_sess *nsess = priv;
-	return cldc_tcp_pkt_send(nsess->tcp, addr, addrlen, buf, buflen);
+	return cldc_tcp_pkt_send(nsess->conn->tcp, addr, addrlen, buf, buflen);
 }
 
 static void ncld_p_event(void *priv, struct cldc_session *csp,
 			 struct cldc_fh *fh, uint32_t what)
 {
 	struct ncld_sess *nsess = priv;
-	unsigned char cmd;
+	unsigned char cmd[1 + sizeof(nsess) + sizeof(uint64_t) +
+			  sizeof(uint32_t)];
+	size_t len;
 
 	if (what == CE_SESS_FAILED) {
-		if (nsess->tcp->sess != csp)
+		if (nsess->sess != csp)
 			abort();
 		if (!nsess->is_up)
 			return;
@@ -1545,11 +2309,29 @@ static void ncld_p_event(void *priv, struct cldc_session *csp,
 		 * the call to cldc_tcp_receive_pkt_data(). But pipe also provides
 		 * a queue of events, just in case. It's not like these events
 		 * are super-performance critical.
+		 *
+		 * The session goes along, as sessions share the thread;
+		 * one write keeps the command whole.
 		 */
-		cmd = NCLD_CMD_SESEV;
-		write(nsess->to_thread[1], &cmd, 1);
-		write(nsess->to_thread[1], &what, sizeof(what));
+		cmd[0] = NCLD_CMD_SESEV;
+		memcpy(cmd + 1, &nsess, sizeof(nsess));
+		memcpy(cmd + 1 + sizeof(nsess), &what, sizeof(what));
+		len = 1 + sizeof(nsess) + sizeof(what);
+	} else if (fh) {
+		/* same trick, for events on a handle */
+		uint64_t fhnum = fh->fh;
+
+		cmd[0] = NCLD_CMD_FHEV;
+		memcpy(cmd + 1, &nsess, sizeof(nsess));
+		memcpy(cmd + 1 + sizeof(nsess), &fhnum, sizeof(fhnum));
+		memcpy(cmd + 1 + sizeof(nsess) + sizeof(fhnum), &what,
+		       sizeof(what));
+		len = sizeof(cmd);
+	} else {
+		return;
 	}
+
+	write(nsess->conn->to_thread[1], cmd, len);
 }
 
 static struct cldc_ops ncld_ops = {
@@ -1558,6 +2340,125 @@ static struct cldc_ops ncld_ops = {
 	.event		= ncld_p_event,
 };
 
+/*
+ * Find the connection to host:port, or open one, and take a reference.
+ * Takes over host, which the caller allocated.
+ *
+ * On error, returns NULL and sets the error code, like ncld_sess_open.
+ */
+static struct ncld_conn *ncld_conn_get(char *host, unsigned short port,
+				       int *error)
+{
+	struct ncld_conn *conn;
+	GList *tmp;
+	GError *gerr;
+	int err;
+
+	g_static_mutex_lock(&ncld_conn_lock);
+
+	for (tmp = ncld_conns; tmp; tmp = tmp->next) {
+		conn = tmp->data;
+		if (conn->port == port && !strcmp(conn->host, host)) {
+			conn->refcnt++;
+			g_static_mutex_unlock(&ncld_conn_lock);
+			free(host);
+			return conn;
+		}
+	}
+
+	err = ENOMEM;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		goto out_alloc;
+	conn->host = host;
+	conn->port = port;
+	conn->refcnt = 1;
+	conn->mutex = g_mutex_new();
+	if (!conn->mutex)
+		goto out_mutex;
+	conn->cond = g_cond_new();
+	if (!conn->cond)
+		goto out_cond;
+
+	if (pipe(conn->to_thread) < 0) {
+		err = errno;
+		goto out_pipe_to;
+	}
+
+	if (cldc_tcp_new(conn->host, conn->port, &conn->tcp)) {
+		err = 1023;
+		goto out_tcp;
+	}
+
+	conn->thread = g_thread_create(ncld_conn_thr, conn, TRUE, &gerr);
+	if (conn->thread == NULL) {
+		err = 1022;
+		goto out_thread;
+	}
+
+	ncld_conns = g_list_prepend(ncld_conns, conn);
+	g_static_mutex_unlock(&ncld_conn_lock);
+	return conn;
+
+out_thread:
+	cldc_tcp_free(conn->tcp);
+out_tcp:
+	close(conn->to_thread[0]);
+	close(conn->to_thread[1]);
+out_pipe_to:
+	g_cond_free(conn->cond);
+out_cond:
+	g_mutex_free(conn->mutex);
+out_mutex:
+	free(conn);
+out_alloc:
+	g_static_mutex_unlock(&ncld_conn_lock);
+	free(host);
+	*error = err;
+	return NULL;
+}
+
+/*
+ * Drop a reference; the last one closes the connection.
+ */
+static void ncld_conn_put(struct ncld_conn *conn)
+{
+	g_static_mutex_lock(&ncld_conn_lock);
+	if (--conn->refcnt) {
+		g_static_mutex_unlock(&ncld_conn_lock);
+		return;
+	}
+	ncld_conns = g_list_remove(ncld_conns, conn);
+	g_static_mutex_unlock(&ncld_conn_lock);
+
+	ncld_thr_end(conn);
+	cldc_tcp_free(conn->tcp);
+	close(conn->to_thread[0]);
+	close(conn->to_thread[1]);
+	g_cond_free(conn->cond);
+	g_mutex_free(conn->mutex);
+	free(conn->host);
+	free(conn);
+}
+
+/*
+ * Take a session off its connection and free its cldc state.
+ */
+static void ncld_sess_detach(struct ncld_sess *nsess)
+{
+	struct ncld_conn *conn = nsess->conn;
+
+	g_mutex_lock(conn->mutex);
+	conn->sessions = g_list_remove(conn->sessions, nsess);
+	if (nsess->sess) {
+		conn->tcp->sessions = g_list_remove(conn->tcp->sessions,
+						    nsess->sess);
+		cldc_kill_sess(nsess->sess);
+		nsess->sess = NULL;
+	}
+	g_mutex_unlock(conn->mutex);
+}
+
 static int ncld_new_sess(struct cldc_call_opts *copts, enum cle_err_codes errc)
 {
 	struct ncld_sess *nsess = copts->private;
@@ -1600,6 +2501,9 @@ static int ncld_wait_session(struct ncld_sess *nsess)
  * this function returns, with the session going down, for example.
  * This is kind of dirty, but oh well. Maybe we'll fix this later.
  *
+ * Sessions to the same host and port share one connection and thread,
+ * so an (*event)() which blocks holds up the events of the others.
+ *
  * @param host Host name (NULL if resolving SRV records)
  * @param port Port
  * @param error Buffer for the error code
@@ -1614,12 +2518,31 @@ struct ncld_sess *ncld_sess_open(const char *host, int port, int *error,
 				 void *ev_arg,
 				 const char *cld_user, const char *cld_key,
 				 struct hail_log *log)
+{
+	return ncld_sess_open_flags(host, port, error, ev_func, ev_arg,
+				    cld_user, cld_key, log, CLDC_SESS_FLAGS);
+}
+
+/*
+ * Like ncld_sess_open, but asking for the CSF_xxx session flags given
+ * rather than the default set.  The server may grant fewer; what it
+ * granted is in nsess->sess->flags.
+ */
+struct ncld_sess *ncld_sess_open_flags(const char *host, int port,
+				       int *error,
+				       void (*ev_func)(void *, unsigned int),
+				       void *ev_arg,
+				       const char *cld_user,
+				       const char *cld_key,
+				       struct hail_log *log, uint32_t flags)
 {
 	struct ncld_sess *nsess;
+	struct ncld_conn *conn;
 	struct hail_log nlog;
 	struct cldc_call_opts copts;
+	char *conn_host;
+	unsigned short conn_port;
 	int err;
-	GError *gerr;
 	int rc;
 
 	if (!log) {
@@ -1634,57 +2557,54 @@ struct ncld_sess *ncld_sess_open(const char *host, int port, int *error,
 	if (!nsess)
 		goto out_sesalloc;
 	memset(nsess, 0, sizeof(struct ncld_sess));
-	cld_timer_init(&nsess->tcp_timer, "nsess-tcp-timer",
-		       ncld_tcp_timer_event, nsess);
-	nsess->mutex = g_mutex_new();
-	if (!nsess->mutex)
-		goto out_mutex;
-	nsess->cond = g_cond_new();
-	if (!nsess->cond)
-		goto out_cond;
+	cld_timer_init(&nsess->timer, "nsess-timer",
+		       ncld_sess_timer_event, nsess);
 
 	if (!host) {
-		err = ncld_getsrv(&nsess->host, &nsess->port, log);
+		err = ncld_getsrv(&conn_host, &conn_port, log);
 		if (err)
 			goto out_srv;
 	} else {
-		err = ncld_gethost(&nsess->host, &nsess->port, host, port);
+		err = ncld_gethost(&conn_host, &conn_port, host, port);
 		if (err)
 			goto out_srv;
 	}
 
+	conn = ncld_conn_get(conn_host, conn_port, &err);
+	if (!conn)
+		goto out_srv;
+	nsess->conn = conn;
+	nsess->mutex = conn->mutex;
+	nsess->cond = conn->cond;
+
 	nsess->event = ev_func;
 	nsess->event_arg = ev_arg;
 
-	if (pipe(nsess->to_thread) < 0) {
-		err = errno;
-		goto out_pipe_to;
-	}
-
-	if (cldc_tcp_new(nsess->host, nsess->port, &nsess->tcp)) {
+	g_mutex_lock(conn->mutex);
+	/* a shared connection may be down, with no sessions to revive it */
+	if (conn->tcp->fd < 0 &&
+	    cldc_tcp_reconnect(conn->tcp, conn->host, conn->port)) {
+		g_mutex_unlock(conn->mutex);
 		err = 1023;
-		goto out_tcp;
-	}
-
-	nsess->thread = g_thread_create(ncld_sess_thr, nsess, TRUE, &gerr);
-	if (nsess->thread == NULL) {
-		err = 1022;
-		goto out_thread;
+		goto out_session;
 	}
-
-	g_mutex_lock(nsess->mutex);
 	memset(&copts, 0, sizeof(copts));
 	copts.cb = ncld_new_sess;
 	copts.private = nsess;
 	if (cldc_new_sess_log(&ncld_ops, &copts,
-			      nsess->tcp->addr, nsess->tcp->addr_len,
-			      cld_user, cld_key, nsess, log,
-			      &nsess->tcp->sess)) {
-		g_mutex_unlock(nsess->mutex);
+			      conn->tcp->addr, conn->tcp->addr_len,
+			      cld_user, cld_key, nsess, log, flags,
+			      &nsess->sess)) {
+		if (nsess->sess)
+			cldc_kill_sess(nsess->sess);
+		g_mutex_unlock(conn->mutex);
 		err = 1024;
 		goto out_session;
 	}
-	g_mutex_unlock(nsess->mutex);
+	conn->sessions = g_list_append(conn->sessions, nsess);
+	conn->tcp->sessions = g_list_append(conn->tcp->sessions, nsess->sess);
+	ncld_thr_wake(conn);
+	g_mutex_unlock(conn->mutex);
 
 	rc = ncld_wait_session(nsess);
 	if (rc) {
@@ -1695,27 +2615,73 @@ struct ncld_sess *ncld_sess_open(const char *host, int port, int *error,
 	return nsess;
 
 out_start:
-	cldc_kill_sess(nsess->tcp->sess);
+	ncld_sess_detach(nsess);
 out_session:
-	ncld_thr_end(nsess);
-out_thread:
-	cldc_tcp_free(nsess->tcp);
-out_tcp:
-	close(nsess->to_thread[0]);
-	close(nsess->to_thread[1]);
-out_pipe_to:
-	free(nsess->host);
+	ncld_conn_put(conn);
 out_srv:
-	g_cond_free(nsess->cond);
-out_cond:
-	g_mutex_free(nsess->mutex);
-out_mutex:
 	free(nsess);
 out_sesalloc:
 	*error = err;
 	return NULL;
 }
 
+/*
+ * Open a second session, on the nearest of a list of read-only replicas
+ * (struct cldc_host, as cldc_getaddr returns them), to which ncld_open
+ * and ncld_open_get then send the opens which cannot write.  Replicas
+ * on this host come first, then the others in list order.
+ *
+ * A replica may lag the master.  A reader which must see its own
+ * writes opens with COM_WRITE, which always goes to the master.
+ *
+ * @param nsess The session, to the master
+ * @param replicas List of struct cldc_host
+ * @param cld_user The user identifier to be used to authentication
+ * @param cld_key The user key to be used to authentication
+ * @param log The application log descriptor (ok to be NULL)
+ * A reader already set up is replaced, but only once every handle
+ * opened through it is closed: those belong to its session.
+ *
+ * @return 0, EBUSY if the current reader has handles open, or the error
+ *	of the last replica tried (ENOENT if none)
+ */
+int ncld_sess_replicas(struct ncld_sess *nsess, GList *replicas,
+		       const char *cld_user, const char *cld_key,
+		       struct hail_log *log)
+{
+	struct ncld_sess *reader = NULL;
+	GList *tmp;
+	int pass, err = ENOENT;
+	bool busy;
+
+	if (nsess->reader) {
+		g_mutex_lock(nsess->reader->mutex);
+		busy = nsess->reader->handles != NULL;
+		g_mutex_unlock(nsess->reader->mutex);
+		if (busy)
+			return EBUSY;
+	}
+
+	for (pass = 0; pass < 2 && !reader; pass++) {
+		for (tmp = replicas; tmp && !reader; tmp = tmp->next) {
+			struct cldc_host *hp = tmp->data;
+
+			if (cldc_host_is_local(hp->host) != (pass == 0))
+				continue;
+			reader = ncld_sess_open(hp->host, hp->port, &err,
+						nsess->event, nsess->event_arg,
+						cld_user, cld_key, log);
+		}
+	}
+	if (!reader)
+		return err;
+
+	if (nsess->reader)
+		ncld_sess_close(nsess->reader);
+	nsess->reader = reader;
+	return 0;
+}
+
 static int ncld_open_cb(struct cldc_call_opts *copts, enum cle_err_codes errc)
 {
 	struct ncld_fh *fh = copts->private;
@@ -1742,8 +2708,10 @@ static int ncld_wait_open(struct ncld_fh *fh)
  * leads to lost events. Unused arguments are not too onerous, so just
  * put zero into the events mask if you don't want notifications.
  *
- * FIXME It's a moot point for now anyway, since we don't have unlock-notify,
- * or a waiting lock anyway.
+ * Events arrive on the session's helper thread, without locks held.
+ *
+ * With a replica set up, opens which cannot write go there, and the
+ * handle belongs to the replica's session.
  *
  * On error, return NULL and set the error code (can be errno or our own code).
  */
@@ -1756,6 +2724,10 @@ struct ncld_fh *ncld_open(struct ncld_sess *nsess, const char *fname,
 	int err;
 	int rc;
 
+	if (nsess->reader && nsess->reader->is_up &&
+	    !(mode & NCLD_WRITE_MODES))
+		nsess = nsess->reader;
+
 	err = EBUSY;
 	if (!nsess->is_up)
 		goto out_session;
@@ -1774,7 +2746,7 @@ struct ncld_fh *ncld_open(struct ncld_sess *nsess, const char *fname,
 	memset(&copts, 0, sizeof(copts));
 	copts.cb = ncld_open_cb;
 	copts.private = fh;
-	rc = cldc_open(nsess->tcp->sess, &copts, fname, mode, events, &fh->fh);
+	rc = cldc_open(nsess->sess, &copts, fname, mode, events, &fh->fh);
 	if (rc) {
 		err = -rc;
 		g_mutex_unlock(nsess->mutex);
@@ -1788,7 +2760,9 @@ struct ncld_fh *ncld_open(struct ncld_sess *nsess, const char *fname,
 		goto out_start;
 	}
 
+	g_mutex_lock(nsess->mutex);
 	nsess->handles = g_list_prepend(nsess->handles, fh);
+	g_mutex_unlock(nsess->mutex);
 	return fh;
 
 out_start:
@@ -1806,64 +2780,221 @@ out_session:
 	return NULL;
 }
 
-struct ncld_delio {
-	struct ncld_sess *sess;
-	bool is_done;
-	int errc;
+struct ncld_delio {
+	struct ncld_sess *sess;
+	bool is_done;
+	int errc;
+};
+
+static int ncld_del_cb(struct cldc_call_opts *copts, enum cle_err_codes errc)
+{
+	struct ncld_delio *dp = copts->private;
+	struct ncld_sess *nsess = dp->sess;
+
+	dp->errc = errc;
+	dp->is_done = true;
+	g_cond_broadcast(nsess->cond);
+	return 0;
+}
+
+static int ncld_wait_del(struct ncld_delio *dp)
+{
+	struct ncld_sess *nsess = dp->sess;
+
+	g_mutex_lock(nsess->mutex);
+	while (!dp->is_done)
+		g_cond_wait(nsess->cond, nsess->mutex);
+	g_mutex_unlock(nsess->mutex);
+	return dp->errc;
+}
+
+int ncld_del(struct ncld_sess *nsess, const char *fname)
+{
+	struct cldc_call_opts copts;
+	struct ncld_delio dpb;
+	int rc;
+
+	if (!nsess->is_up)
+		return -EBUSY;
+
+	memset(&dpb, 0, sizeof(struct ncld_delio));
+	dpb.sess = nsess;
+
+	g_mutex_lock(nsess->mutex);
+	memset(&copts, 0, sizeof(copts));
+	copts.cb = ncld_del_cb;
+	copts.private = &dpb;
+	rc = cldc_del(nsess->sess, &copts, fname);
+	if (rc) {
+		g_mutex_unlock(nsess->mutex);
+		return -rc;
+	}
+	/* 
+	 * A delete operation is not accounted for end-session (e.g. nios).
+	 * This means: do not call ncld_del and ncld_close together.
+	 * The ncld_close can be invoked by ncld_sess_close, so don't
+	 * do that either.
+	 */
+	g_mutex_unlock(nsess->mutex);
+
+	rc = ncld_wait_del(&dpb);
+	if (rc)
+		return rc + 1100;
+
+	return 0;
+}
+
+struct ncld_sessio {
+	struct ncld_sess	*sess;
+	struct ncld_read	*rp;		/* ncld_open_get */
+	uint64_t		vers;		/* ncld_open_put */
+	bool			is_done;
+	int			errc;
 };
 
-static int ncld_del_cb(struct cldc_call_opts *copts, enum cle_err_codes errc)
+static int ncld_open_get_cb(struct cldc_call_opts *copts,
+			    enum cle_err_codes errc)
 {
-	struct ncld_delio *dp = copts->private;
-	struct ncld_sess *nsess = dp->sess;
+	struct ncld_sessio *sp = copts->private;
+	struct ncld_read *rp = sp->rp;
 
-	dp->errc = errc;
-	dp->is_done = true;
-	g_cond_broadcast(nsess->cond);
+	if (errc) {
+		sp->errc = errc;
+	} else {
+		char *p;
+		size_t l;
+		cldc_copts_get_data(copts, &p, &l);
+		cldc_copts_get_metadata(copts, &rp->meta);
+		rp->ptr = p;
+		rp->length = l;
+	}
+	sp->is_done = true;
+	g_cond_broadcast(sp->sess->cond);
 	return 0;
 }
 
-static int ncld_wait_del(struct ncld_delio *dp)
+static int ncld_open_put_cb(struct cldc_call_opts *copts,
+			    enum cle_err_codes errc)
 {
-	struct ncld_sess *nsess = dp->sess;
+	struct ncld_sessio *sp = copts->private;
+
+	sp->errc = errc;
+	sp->vers = copts->resp.vers;
+	sp->is_done = true;
+	g_cond_broadcast(sp->sess->cond);
+	return 0;
+}
+
+static int ncld_wait_sessio(struct ncld_sessio *sp)
+{
+	struct ncld_sess *nsess = sp->sess;
 
 	g_mutex_lock(nsess->mutex);
-	while (!dp->is_done)
+	while (!sp->is_done)
 		g_cond_wait(nsess->cond, nsess->mutex);
 	g_mutex_unlock(nsess->mutex);
-	return dp->errc;
+	return sp->errc;
 }
 
-int ncld_del(struct ncld_sess *nsess, const char *fname)
+/*
+ * Read a file by name in one round trip: open, get and close run as
+ * one server transaction, and no handle is left behind.  The result
+ * has no fh, so only ncld_read_free may be called on it.
+ *
+ * @mode COM_CREATE, COM_EXCL, COM_DIRECTORY; COM_READ is implied.
+ * @error Error code buffer.
+ * @return Pointer to struct ncld_read or NULL if error.
+ */
+struct ncld_read *ncld_open_get(struct ncld_sess *nsess, const char *fname,
+				unsigned int mode, int *error)
 {
 	struct cldc_call_opts copts;
-	struct ncld_delio dpb;
+	struct ncld_sessio spb;
+	struct ncld_read *rp;
+	int rc;
+
+	/* a replica serves it, unless it may create the file */
+	if (nsess->reader && nsess->reader->is_up &&
+	    !(mode & NCLD_WRITE_MODES))
+		nsess = nsess->reader;
+
+	if (!nsess->is_up) {
+		*error = EBUSY;
+		return NULL;
+	}
+
+	rp = malloc(sizeof(struct ncld_read));
+	if (!rp) {
+		*error = ENOMEM;
+		return NULL;
+	}
+	memset(rp, 0, sizeof(struct ncld_read));
+
+	memset(&spb, 0, sizeof(struct ncld_sessio));
+	spb.sess = nsess;
+	spb.rp = rp;
+
+	g_mutex_lock(nsess->mutex);
+	memset(&copts, 0, sizeof(copts));
+	copts.cb = ncld_open_get_cb;
+	copts.private = &spb;
+	rc = cldc_open_get(nsess->sess, &copts, fname, mode);
+	if (rc) {
+		g_mutex_unlock(nsess->mutex);
+		free(rp);
+		*error = -rc;
+		return NULL;
+	}
+	g_mutex_unlock(nsess->mutex);
+
+	rc = ncld_wait_sessio(&spb);
+	if (rc) {
+		free(rp);
+		*error = rc + 1100;
+		return NULL;
+	}
+
+	return rp;
+}
+
+/*
+ * Write a file by name in one round trip: open, put and close run as
+ * one server transaction.  With vers non-NULL the write happens only
+ * if the file is at version *vers; either way *vers, if given, is set
+ * to the version after the write, or the one that did not match.
+ *
+ * @mode COM_CREATE, COM_EXCL; COM_WRITE is implied.
+ * @return: Zero or error code.
+ */
+int ncld_open_put(struct ncld_sess *nsess, const char *fname,
+		  unsigned int mode, const void *data, long len,
+		  uint64_t *vers)
+{
+	struct cldc_call_opts copts;
+	struct ncld_sessio spb;
 	int rc;
 
 	if (!nsess->is_up)
 		return -EBUSY;
 
-	memset(&dpb, 0, sizeof(struct ncld_delio));
-	dpb.sess = nsess;
+	memset(&spb, 0, sizeof(struct ncld_sessio));
+	spb.sess = nsess;
 
 	g_mutex_lock(nsess->mutex);
 	memset(&copts, 0, sizeof(copts));
-	copts.cb = ncld_del_cb;
-	copts.private = &dpb;
-	rc = cldc_del(nsess->tcp->sess, &copts, fname);
+	copts.cb = ncld_open_put_cb;
+	copts.private = &spb;
+	rc = cldc_open_put(nsess->sess, &copts, fname, mode, data, len,
+			   vers != NULL, vers ? *vers : 0);
 	if (rc) {
 		g_mutex_unlock(nsess->mutex);
 		return -rc;
 	}
-	/* 
-	 * A delete operation is not accounted for end-session (e.g. nios).
-	 * This means: do not call ncld_del and ncld_close together.
-	 * The ncld_close can be invoked by ncld_sess_close, so don't
-	 * do that either.
-	 */
 	g_mutex_unlock(nsess->mutex);
 
-	rc = ncld_wait_del(&dpb);
+	rc = ncld_wait_sessio(&spb);
+	if (vers && (!rc || rc == CLE_VERS_MISMATCH))
+		*vers = spb.vers;
 	if (rc)
 		return rc + 1100;
 
@@ -2017,10 +3148,142 @@ struct ncld_read *ncld_get_meta(struct ncld_fh *fh, int *error)
 	return rp;
 }
 
+/*
+ * Read the file once its version is above 'vers', instead of polling
+ * it.  Returns whatever is there after 'timeout' seconds if nothing
+ * changed, so check rp->meta.version; the server caps the wait.
+ *
+ * @vers Version already seen.
+ * @timeout Most seconds to wait; 0 returns at once, like ncld_get.
+ * @error Error code buffer.
+ * @return Pointer to struct ncld_read or NULL if error.
+ */
+struct ncld_read *ncld_get_wait(struct ncld_fh *fh, uint64_t vers,
+				int timeout, int *error)
+{
+	struct ncld_sess *nsess = fh->sess;
+	struct ncld_read *rp;
+	struct cldc_call_opts copts;
+	int rc;
+
+	if (!fh->is_open) {
+		*error = EBUSY;
+		return NULL;
+	}
+
+	rp = malloc(sizeof(struct ncld_read));
+	if (!rp) {
+		*error = ENOMEM;
+		return NULL;
+	}
+	memset(rp, 0, sizeof(struct ncld_read));
+	rp->fh = fh;
+
+	g_mutex_lock(nsess->mutex);
+	memset(&copts, 0, sizeof(copts));
+	copts.cb = ncld_read_cb;
+	copts.private = rp;
+	rc = cldc_get_wait(fh->fh, &copts, vers, timeout);
+	if (rc) {
+		g_mutex_unlock(nsess->mutex);
+		free(rp);
+		*error = -rc;
+		return NULL;
+	}
+	fh->nios++;
+	g_mutex_unlock(nsess->mutex);
+
+	rc = ncld_wait_read(rp);
+	if (rc) {
+		free(rp);
+		*error = rc + 1100;
+		return NULL;
+	}
+
+	return rp;
+}
+
+static int ncld_readdir_cb(struct cldc_call_opts *copts,
+			   enum cle_err_codes errc)
+{
+	struct ncld_read *rp = copts->private;
+	struct ncld_fh *fh = rp->fh;
+
+	if (errc) {
+		rp->errc = errc;
+	} else {
+		char *p;
+		size_t l;
+		cldc_copts_get_data(copts, &p, &l);
+		cldc_copts_get_metadata(copts, &rp->meta);
+		rp->ptr = p;
+		rp->length = l;
+		rp->eof = copts->eof;
+	}
+	rp->is_done = true;
+	g_cond_broadcast(fh->sess->cond);
+	return 0;
+}
+
+/*
+ * List one page of a directory opened with COM_DIRECTORY.  Names come
+ * in name order, packed as ncld_get returns them; pass the last name
+ * of a page as 'after' to fetch the next one, until rp->eof is set.
+ *
+ * @after Name to list from (exclusive), or NULL for the first page.
+ * @max_ents Most names to return, or 0 for as many as fit.
+ * @error Error code buffer.
+ * @return Pointer to struct ncld_read or NULL if error.
+ */
+struct ncld_read *ncld_readdir(struct ncld_fh *fh, const char *after,
+			       int max_ents, int *error)
+{
+	struct ncld_sess *nsess = fh->sess;
+	struct ncld_read *rp;
+	struct cldc_call_opts copts;
+	int rc;
+
+	if (!fh->is_open) {
+		*error = EBUSY;
+		return NULL;
+	}
+
+	rp = malloc(sizeof(struct ncld_read));
+	if (!rp) {
+		*error = ENOMEM;
+		return NULL;
+	}
+	memset(rp, 0, sizeof(struct ncld_read));
+	rp->fh = fh;
+
+	g_mutex_lock(nsess->mutex);
+	memset(&copts, 0, sizeof(copts));
+	copts.cb = ncld_readdir_cb;
+	copts.private = rp;
+	rc = cldc_readdir(fh->fh, &copts, after, max_ents);
+	if (rc) {
+		g_mutex_unlock(nsess->mutex);
+		free(rp);
+		*error = -rc;
+		return NULL;
+	}
+	fh->nios++;
+	g_mutex_unlock(nsess->mutex);
+
+	rc = ncld_wait_read(rp);
+	if (rc) {
+		free(rp);
+		*error = rc + 1100;
+		return NULL;
+	}
+
+	return rp;
+}
+
 void ncld_read_free(struct ncld_read *rp)
 {
 	/*
-	 * FIXME: Actually the rp->ptr points to sess->msg_buf, so we
+	 * FIXME: Actually the rp->ptr points to sess->payload, so we
 	 * cannot issue 2 cldc_get independently.  Ditto for inode_name
 	 * in rp->meta.
 	 *
@@ -2036,6 +3299,7 @@ struct ncld_genio {
 	struct ncld_fh	*fh;
 	bool		is_done;
 	int		errc;
+	uint64_t	vers;		/* ncld_write_if */
 };
 
 static int ncld_genio_cb(struct cldc_call_opts *copts, enum cle_err_codes errc)
@@ -2097,6 +3361,57 @@ int ncld_write(struct ncld_fh *fh, const void *data, long len)
 	return 0;
 }
 
+static int ncld_put_if_cb(struct cldc_call_opts *copts,
+			  enum cle_err_codes errc)
+{
+	struct ncld_genio *ap = copts->private;
+
+	ap->vers = copts->resp.vers;
+	return ncld_genio_cb(copts, errc);
+}
+
+/*
+ * Write only if the file is still at version *vers, as last read.
+ * On success or on CLE_VERS_MISMATCH, *vers is updated to the file's
+ * version now, so a compare-and-swap loop can read and retry.
+ *
+ * @return: Zero or error code.
+ */
+int ncld_write_if(struct ncld_fh *fh, const void *data, long len,
+		  uint64_t *vers)
+{
+	struct ncld_sess *nsess = fh->sess;
+	struct cldc_call_opts copts;
+	struct ncld_genio apb;
+	int rc;
+
+	if (!fh->is_open)
+		return -EBUSY;
+
+	memset(&apb, 0, sizeof(struct ncld_genio));
+	apb.fh = fh;
+	apb.vers = *vers;
+
+	g_mutex_lock(nsess->mutex);
+	memset(&copts, 0, sizeof(copts));
+	copts.cb = ncld_put_if_cb;
+	copts.private = &apb;
+	rc = cldc_put_if(fh->fh, &copts, data, len, *vers);
+	if (rc) {
+		g_mutex_unlock(nsess->mutex);
+		return -rc;
+	}
+	fh->nios++;
+	g_mutex_unlock(nsess->mutex);
+
+	rc = ncld_wait_genio(&apb);
+	*vers = apb.vers;
+	if (rc)
+		return rc + 1100;
+
+	return 0;
+}
+
 int ncld_trylock(struct ncld_fh *fh)
 {
 	struct ncld_sess *nsess = fh->sess;
@@ -2252,28 +3567,50 @@ void ncld_close(struct ncld_fh *fh)
 	g_mutex_lock(nsess->mutex);
 	while (fh->nios)
 		g_cond_wait(nsess->cond, nsess->mutex);
+	/* under the lock, as the helper thread looks for event targets */
+	nsess->handles = g_list_remove_all(nsess->handles, fh);
 	g_mutex_unlock(nsess->mutex);
 
-	nsess->handles = g_list_remove_all(nsess->handles, fh);
 	free(fh);
 }
 
 void ncld_sess_close(struct ncld_sess *nsess)
 {
+	struct ncld_conn *conn = nsess->conn;
+	struct cldc_call_opts copts;
+	struct ncld_delio dpb;
 	gpointer p;
+	int rc;
+
+	if (nsess->reader)
+		ncld_sess_close(nsess->reader);
 
 	while ((p = g_list_nth_data(nsess->handles, 0)))
 		ncld_close(p);
 	g_list_free(nsess->handles);
 
-	cldc_kill_sess(nsess->tcp->sess);
-	ncld_thr_end(nsess);
-	cldc_tcp_free(nsess->tcp);
-	close(nsess->to_thread[0]);
-	close(nsess->to_thread[1]);
-	g_cond_free(nsess->cond);
-	g_mutex_free(nsess->mutex);
-	free(nsess->host);
+	/*
+	 * Other sessions may keep the connection up, and the server renews
+	 * every session on a live connection, so say goodbye properly
+	 * instead of leaving the session to time out.
+	 */
+	memset(&dpb, 0, sizeof(struct ncld_delio));
+	dpb.sess = nsess;
+
+	g_mutex_lock(nsess->mutex);
+	rc = -ENOTCONN;
+	if (nsess->is_up && conn->tcp->fd >= 0) {
+		memset(&copts, 0, sizeof(copts));
+		copts.cb = ncld_del_cb;
+		copts.private = &dpb;
+		rc = cldc_end_sess(nsess->sess, &copts);
+	}
+	g_mutex_unlock(nsess->mutex);
+	if (rc == 0)
+		ncld_wait_del(&dpb);	/* or until the session expires */
+
+	ncld_sess_detach(nsess);
+	ncld_conn_put(conn);
 	free(nsess);
 }
 
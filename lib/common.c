@@ -21,6 +21,7 @@
 #include "hail-config.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -68,6 +69,9 @@ static const char *cld_errlist[] =
 	[CLE_INTERNAL_ERR]	= "Internal error",
 	[CLE_TIMEOUT]		= "Session timed out",
 	[CLE_SIG_INVAL]		= "Bad HMAC signature",
+	[CLE_VERS_MISMATCH]	= "File version mismatch",
+	[CLE_READ_ONLY]		= "Read-only replica",
+	[CLE_CONN_RESET]	= "Connection lost, request may have run",
 };
 
 const char *cld_errstr(enum cle_err_codes ecode)
@@ -111,3 +115,22 @@ int cld_readport(const char *fname)
 	return hail_readport(fname);
 }
 
+/*
+ * Name the local socket of a cld listening on a TCP port.  The directory
+ * is dir if given, else $CLD_UNIX_DIR, else CLD_UNIX_DIR.  Returns the
+ * length of the path, or negative error if it does not fit.
+ */
+int cld_unix_path(char *buf, size_t len, const char *dir, unsigned int port)
+{
+	int rc;
+
+	if (!dir)
+		dir = getenv("CLD_UNIX_DIR");
+	if (!dir || !*dir)
+		dir = CLD_UNIX_DIR;
+
+	rc = snprintf(buf, len, "%s/cld-%u.sock", dir, port);
+	if (rc < 0 || rc >= len)
+		return -ENAMETOOLONG;
+	return rc;
+}
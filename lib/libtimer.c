@@ -1,4 +1,3 @@
-
 /*
  * Copyright 2009 Red Hat, Inc.
  *
@@ -20,46 +19,93 @@
 #define _GNU_SOURCE
 #include "hail-config.h"
 
+#include <sys/time.h>
 #include <glib.h>
 #include <cldc.h>
 #include <cld_common.h>
 
-static gint cld_timer_cmp(gconstpointer a_, gconstpointer b_)
+#define TW_MASK		((uint64_t) CLD_TIMER_SLOTS - 1)
+#define TW_SPAN		(1ULL << (CLD_TIMER_BITS * CLD_TIMER_LEVELS))
+
+uint64_t cld_time_ms(void)
 {
-	const struct cld_timer *a = a_;
-	const struct cld_timer *b = b_;
+	struct timeval tv;
 
-	if (a->expires > b->expires)
-		return 1;
-	if (a->expires == b->expires)
-		return 0;
-	return -1;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-void cld_timer_add(struct cld_timer_list *tlist, struct cld_timer *timer,
-		   time_t expires)
+static void tw_link(struct cld_timer **head, struct cld_timer *timer)
 {
-	GList *timer_list = tlist->list;
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
 
-	if (timer->on_list)
-		timer_list = g_list_remove(timer_list, timer);
-
-	/*
-	 * This additional resiliency is required by the invocations from
-	 * session_retry(). For some reason the computations in it result
-	 * in attempts to add timers in the past sometimes, and then we loop
-	 * when trying to run those. FIXME: maybe fix that one day.
-	 *
-	 * Even if we fix the callers, we probably should keep this.
-	 */
-	if (expires < tlist->runmark + 1)
-		expires = tlist->runmark + 1;
+static void tw_unlink(struct cld_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/*
+ * Put a timer in the lowest level whose span reaches its expiry.
+ */
+static void tw_place(struct cld_timer_list *tlist, struct cld_timer *timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	unsigned int level, slot;
+
+	/* past-due timers run on the next tick, not in the one running */
+	if (expires < tlist->tick)
+		expires = tlist->tick;
+	delta = expires - tlist->tick;
+	if (delta >= TW_SPAN)
+		expires = tlist->tick + TW_SPAN - 1;
+
+	for (level = 0; level < CLD_TIMER_LEVELS - 1; level++)
+		if (delta < (1ULL << (CLD_TIMER_BITS * (level + 1))))
+			break;
 
+	slot = (expires >> (CLD_TIMER_BITS * level)) & TW_MASK;
+	tw_link(&tlist->wheel[level][slot], timer);
+	tlist->n_level[level]++;
+	timer->level = level;
 	timer->on_list = true;
+}
+
+void cld_timer_add_ms(struct cld_timer_list *tlist, struct cld_timer *timer,
+		      unsigned long msec)
+{
+	uint64_t now = cld_time_ms();
+
+	if (timer->on_list)
+		cld_timer_del(tlist, timer);
+
+	/* an idle wheel restarts at the present */
+	if (!tlist->count)
+		tlist->tick = now;
+
 	timer->fired = false;
-	timer->expires = expires;
+	timer->expires = now + msec;
+
+	tw_place(tlist, timer);
+	tlist->count++;
+}
+
+void cld_timer_add(struct cld_timer_list *tlist, struct cld_timer *timer,
+		   time_t expires)
+{
+	time_t now = time(NULL);
 
-	tlist->list = g_list_insert_sorted(timer_list, timer, cld_timer_cmp);
+	cld_timer_add_ms(tlist, timer,
+			 expires > now ? (expires - now) * 1000 : 0);
 }
 
 void cld_timer_del(struct cld_timer_list *tlist, struct cld_timer *timer)
@@ -67,42 +113,118 @@ void cld_timer_del(struct cld_timer_list *tlist, struct cld_timer *timer)
 	if (!timer->on_list)
 		return;
 
-	tlist->list = g_list_remove(tlist->list, timer);
+	tlist->n_level[timer->level]--;
+	tw_unlink(timer);
+	tlist->count--;
 
 	timer->on_list = false;
 }
 
-time_t cld_timers_run(struct cld_timer_list *tlist)
+/*
+ * Level 'level - 1' just wrapped: drop the timers of the level's
+ * current slot down to where they now belong.
+ */
+static bool tw_cascade(struct cld_timer_list *tlist, unsigned int level)
 {
+	unsigned int slot;
 	struct cld_timer *timer;
-	time_t now = time(NULL);
-	time_t next_timeout = 0;
-	GList *cur;
 
-	tlist->runmark = now;
-	for (;;) {
-		cur = tlist->list;
-		if (!cur)
-			break;
-		timer = cur->data;
-		if (timer->expires > now)
-			break;
+	slot = (tlist->tick >> (CLD_TIMER_BITS * level)) & TW_MASK;
+	while ((timer = tlist->wheel[level][slot]) != NULL) {
+		tw_unlink(timer);
+		tlist->n_level[level]--;
+		tw_place(tlist, timer);
+	}
 
-		tlist->list = g_list_delete_link(tlist->list, cur);
-		timer->on_list = false;
+	return slot == 0;
+}
 
-		timer->fired = true;
-		timer->cb(timer);
+/*
+ * When the wheel next needs to run: the first busy level 0 slot, or
+ * else the earliest slot above due to cascade.  Zero if empty.
+ */
+static uint64_t tw_next(const struct cld_timer_list *tlist)
+{
+	uint64_t next = 0, base;
+	unsigned int level, i, first;
+
+	if (!tlist->count)
+		return 0;
+
+	for (i = 0; i < CLD_TIMER_SLOTS; i++)
+		if (tlist->wheel[0][(tlist->tick + i) & TW_MASK])
+			return tlist->tick + i;
+
+	for (level = 1; level < CLD_TIMER_LEVELS; level++) {
+		unsigned int shift = CLD_TIMER_BITS * level;
+
+		if (!tlist->n_level[level])
+			continue;
+
+		/* this level's current slot was emptied when entered,
+		 * unless the next tick is the one to enter it
+		 */
+		base = tlist->tick >> shift;
+		first = (tlist->tick & ((1ULL << shift) - 1)) ? 1 : 0;
+		for (i = first; i <= CLD_TIMER_SLOTS; i++)
+			if (tlist->wheel[level][(base + i) & TW_MASK])
+				break;
+		if (!next || ((base + i) << shift) < next)
+			next = (base + i) << shift;
 	}
 
-	if (tlist->list) {
-		timer = tlist->list->data;
-		if (timer->expires > now)
-			next_timeout = (timer->expires - now);
-		else
-			next_timeout = 1;
+	return next;
+}
+
+unsigned long cld_timers_run_ms(struct cld_timer_list *tlist)
+{
+	uint64_t now = cld_time_ms();
+	uint64_t next;
+	struct cld_timer *timer;
+	unsigned int level;
+	unsigned int slot;
+
+	while (tlist->count && tlist->tick <= now) {
+		slot = tlist->tick & TW_MASK;
+
+		if (!slot)
+			for (level = 1; level < CLD_TIMER_LEVELS; level++)
+				if (!tw_cascade(tlist, level))
+					break;
+
+		/* nothing below the next wrap: skip to it */
+		if (!tlist->n_level[0]) {
+			tlist->tick = MIN(now + 1, (tlist->tick | TW_MASK) + 1);
+			continue;
+		}
+
+		/* callbacks may add timers; those land from the next tick */
+		tlist->tick++;
+
+		while ((timer = tlist->wheel[0][slot]) != NULL) {
+			tw_unlink(timer);
+			tlist->n_level[0]--;
+			tlist->count--;
+			timer->on_list = false;
+
+			timer->fired = true;
+			timer->cb(timer);
+		}
 	}
 
-	return next_timeout;
+	if (!tlist->count) {
+		tlist->tick = now + 1;
+		return 0;
+	}
+
+	next = tw_next(tlist);
+	return next > now ? next - now : 1;
+}
+
+time_t cld_timers_run(struct cld_timer_list *tlist)
+{
+	unsigned long msec = cld_timers_run_ms(tlist);
+
+	return (msec + 999) / 1000;
 }
 
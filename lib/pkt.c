@@ -16,61 +16,204 @@
  * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <glib.h>
 #include <syslog.h>
 #include <openssl/sha.h>
+#include <openssl/crypto.h>
 #include <openssl/hmac.h>
 #include <cld-private.h>
 #include <cld_common.h>
 #include "cld_msg_rpc.h"
 #include <hail_log.h>
 
-int cld_authcheck(struct hail_log *log, const char *key,
-		    const void *buf, size_t buf_len, const void *sha)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+#include <openssl/core_names.h>
+
+int cld_auth_key_init(struct cld_auth_key *ak, const char *key)
 {
-	unsigned char md[SHA_DIGEST_LENGTH];
-	unsigned int md_len = 0;
+	OSSL_PARAM params[2];
+	EVP_MAC *mac;
 
+	ak->valid = false;
+	ak->ctx = NULL;
 	if (!key || !*key)
 		return -EINVAL;
 
-	HMAC(EVP_sha1(), key, strlen(key), buf, buf_len, md, &md_len);
+	mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (!mac)
+		return -ENOMEM;
+	ak->ctx = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac);
+	if (!ak->ctx)
+		return -ENOMEM;
 
-	if (md_len != SHA_DIGEST_LENGTH) {
-		HAIL_ERR(log, "%s BUG: md_len != SHA_DIGEST_LENGTH", __func__);
-		return -EBADMSG; /* BUG */
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						     "SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (!EVP_MAC_init(ak->ctx, (const unsigned char *)key, strlen(key),
+			  params)) {
+		cld_auth_key_fini(ak);
+		return -EINVAL;
 	}
 
-	if (memcmp(md, sha, SHA_DIGEST_LENGTH))
+	ak->valid = true;
+	return 0;
+}
+
+void cld_auth_key_fini(struct cld_auth_key *ak)
+{
+	EVP_MAC_CTX_free(ak->ctx);
+	ak->ctx = NULL;
+	ak->valid = false;
+}
+
+int cld_auth_key_sign(const struct cld_auth_key *ak,
+		      const void *buf, size_t buf_len, void *sha)
+{
+	EVP_MAC_CTX *ctx;
+	size_t md_len;
+	int rc = 0;
+
+	if (!ak->valid)
+		return -EINVAL;
+
+	ctx = EVP_MAC_CTX_dup(ak->ctx);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (!EVP_MAC_update(ctx, buf, buf_len) ||
+	    !EVP_MAC_final(ctx, sha, &md_len, SHA_DIGEST_LENGTH) ||
+	    md_len != SHA_DIGEST_LENGTH)
+		rc = -EINVAL;
+
+	EVP_MAC_CTX_free(ctx);
+	return rc;
+}
+
+#else /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static HMAC_CTX *HMAC_CTX_new(void)
+{
+	HMAC_CTX *ctx = malloc(sizeof(*ctx));
+
+	if (ctx)
+		HMAC_CTX_init(ctx);
+	return ctx;
+}
+
+static void HMAC_CTX_free(HMAC_CTX *ctx)
+{
+	if (!ctx)
+		return;
+	HMAC_CTX_cleanup(ctx);
+	free(ctx);
+}
+#endif
+
+int cld_auth_key_init(struct cld_auth_key *ak, const char *key)
+{
+	ak->valid = false;
+	ak->ctx = NULL;
+	if (!key || !*key)
+		return -EINVAL;
+
+	ak->ctx = HMAC_CTX_new();
+	if (!ak->ctx)
+		return -ENOMEM;
+
+	if (!HMAC_Init_ex(ak->ctx, key, strlen(key), EVP_sha1(), NULL)) {
+		cld_auth_key_fini(ak);
+		return -EINVAL;
+	}
+
+	ak->valid = true;
+	return 0;
+}
+
+void cld_auth_key_fini(struct cld_auth_key *ak)
+{
+	HMAC_CTX_free(ak->ctx);
+	ak->ctx = NULL;
+	ak->valid = false;
+}
+
+int cld_auth_key_sign(const struct cld_auth_key *ak,
+		      const void *buf, size_t buf_len, void *sha)
+{
+	HMAC_CTX *ctx;
+	unsigned int md_len;
+	int rc = 0;
+
+	if (!ak->valid)
+		return -EINVAL;
+
+	ctx = HMAC_CTX_new();
+	if (!ctx)
+		return -ENOMEM;
+
+	/* the copy only reads the scheduled key */
+	if (!HMAC_CTX_copy(ctx, (HMAC_CTX *)ak->ctx) ||
+	    !HMAC_Update(ctx, buf, buf_len) ||
+	    !HMAC_Final(ctx, sha, &md_len) ||
+	    md_len != SHA_DIGEST_LENGTH)
+		rc = -EINVAL;
+
+	HMAC_CTX_free(ctx);
+	return rc;
+}
+
+#endif /* OPENSSL_VERSION_NUMBER */
+
+int cld_auth_key_check(const struct cld_auth_key *ak,
+		       const void *buf, size_t buf_len, const void *sha)
+{
+	unsigned char md[SHA_DIGEST_LENGTH];
+	int rc;
+
+	rc = cld_auth_key_sign(ak, buf, buf_len, md);
+	if (rc)
+		return rc;
+
+	if (CRYPTO_memcmp(md, sha, SHA_DIGEST_LENGTH))
 		return -EPERM;
 
 	return 0;
 }
 
+int cld_authcheck(struct hail_log *log, const char *key,
+		    const void *buf, size_t buf_len, const void *sha)
+{
+	struct cld_auth_key ak;
+	int rc;
+
+	if (cld_auth_key_init(&ak, key))
+		return -EINVAL;
+
+	rc = cld_auth_key_check(&ak, buf, buf_len, sha);
+	cld_auth_key_fini(&ak);
+	return rc;
+}
+
 int cld_authsign(struct hail_log *log, const char *key,
 		   const void *buf, size_t buf_len, void *sha)
 {
-	unsigned char md[SHA_DIGEST_LENGTH];
-	unsigned int md_len = 0;
+	struct cld_auth_key ak;
+	int rc;
 
-	if (!key || !*key) {
+	if (cld_auth_key_init(&ak, key)) {
 		HAIL_DEBUG(log, "%s: invalid key\n", __func__);
 		return -EINVAL;
 	}
 
-	HMAC(EVP_sha1(), key, strlen(key), buf, buf_len, md, &md_len);
-
-	if (md_len != SHA_DIGEST_LENGTH) {
-		HAIL_ERR(log, "%s BUG: md_len != SHA_DIGEST_LENGTH", __func__);
-		return -EBADMSG;
-	}
-
-	memcpy(sha, md, SHA_DIGEST_LENGTH);
-
-	return 0;
+	rc = cld_auth_key_sign(&ak, buf, buf_len, sha);
+	cld_auth_key_fini(&ak);
+	return rc;
 }
 
 const char *cld_opstr(enum cld_msg_op op)
@@ -93,6 +236,12 @@ const char *cld_opstr(enum cld_msg_op op)
 	case CMO_NOT_MASTER:	return "CMO_NOT_MASTER";
 	case CMO_EVENT:		return "CMO_EVENT";
 	case CMO_ACK_FRAG:	return "CMO_ACK_FRAG";
+	case CMO_READDIR:	return "CMO_READDIR";
+	case CMO_GET_WAIT:	return "CMO_GET_WAIT";
+	case CMO_PUT_IF:	return "CMO_PUT_IF";
+	case CMO_OPEN_GET:	return "CMO_OPEN_GET";
+	case CMO_OPEN_PUT:	return "CMO_OPEN_PUT";
+	case CMO_RECONNECT:	return "CMO_RECONNECT";
 	default:		return "(unknown)";
 	}
 }
@@ -132,8 +281,7 @@ const char *cld_pkt_hdr_to_str(char *scratch,
 
 	bad_magic = !!(memcmp(&pkt.magic, CLD_PKT_MAGIC, sizeof(pkt.magic)));
 	if (pkt.mi.order & CLD_PKT_IS_FIRST) {
-		struct cld_pkt_msg_infos *infos =
-			&pkt.mi.cld_pkt_msg_info_u.mi;
+		const struct cld_pkt_msg_infos *infos = cld_pkt_infos(&pkt);
 		snprintf(temp, sizeof(temp), "[TYPE:%s, XID:%llx]",
 			 cld_opstr(infos->op),
 			 (unsigned long long) infos->xid);
@@ -158,6 +306,10 @@ const char *cld_pkt_hdr_to_str(char *scratch,
 		default:
 			break;
 		}
+		if (pkt.mi.order & CLD_PKT_HAS_ACK)
+			snprintf(temp2, sizeof(temp2), "{ack:%llx}",
+				 (unsigned long long)
+				 pkt.mi.cld_pkt_msg_info_u.mia.ack);
 	} else {
 		snprintf(temp, sizeof(temp), "[CONT]");
 	}
@@ -190,3 +342,98 @@ void __cld_dump_buf(const void *buf, size_t len)
 		printf("\n");
 	} while (len);
 }
+
+size_t cld_pkt_hdr_encode(const struct cld_pkt_hdr *pkt, void *buf,
+			  size_t buf_len)
+{
+	XDR xout;
+	size_t hdr_len = 0;
+
+	xdrmem_create(&xout, buf, buf_len, XDR_ENCODE);
+	if (xdr_cld_pkt_hdr(&xout, (struct cld_pkt_hdr *)pkt))
+		hdr_len = xdr_getpos(&xout);
+	xdr_destroy(&xout);
+
+	return hdr_len;
+}
+
+int cld_msg_pack(struct cld_buf_pool *pool, const struct cld_pkt_hdr *first,
+		 xdrproc_t xdrproc, const void *xdrdata, size_t max_chunk,
+		 cld_pkt_emit_t emit, void *priv)
+{
+	XDR xmsg;
+	struct cld_pkt_hdr pkt;
+	char hdr_buf[CLD_PKT_HDR_MAX];
+	char *buf, *body, *pbuf;
+	size_t cap, pcap, msg_len, hdr_len, chunk, off;
+	int rc = 0;
+
+	buf = cld_buf_get(pool, CLD_MAX_FRAME_SZ, &cap);
+	if (!buf)
+		return -ENOMEM;
+
+	/* encode the body once, straight into the buffer, leaving
+	 * room in front for the largest header
+	 */
+	body = buf + CLD_PKT_HDR_MAX;
+	xdrmem_create(&xmsg, body, CLD_MAX_MSG_SZ, XDR_ENCODE);
+	if (!xdrproc(&xmsg, (void *)xdrdata)) {
+		xdr_destroy(&xmsg);
+		cld_buf_put(pool, buf, cap);
+		return -EMSGSIZE;
+	}
+	msg_len = xdr_getpos(&xmsg);
+	xdr_destroy(&xmsg);
+
+	pkt = *first;
+
+	/* a message fitting one packet is framed where it lies */
+	if (msg_len <= max_chunk) {
+		pkt.mi.order |= CLD_PKT_IS_LAST;
+		hdr_len = cld_pkt_hdr_encode(&pkt, hdr_buf, sizeof(hdr_buf));
+		if (!hdr_len) {
+			cld_buf_put(pool, buf, cap);
+			return -EINVAL;
+		}
+		memcpy(body - hdr_len, hdr_buf, hdr_len);
+		memset(body + msg_len, 0, CLD_PKT_FTR_LEN);
+
+		return emit(priv, buf, cap, body - hdr_len,
+			    hdr_len + msg_len + CLD_PKT_FTR_LEN);
+	}
+
+	/* otherwise each fragment is copied out behind its own header */
+	for (off = 0; off < msg_len; off += chunk) {
+		chunk = MIN(max_chunk, msg_len - off);
+		if (off) {
+			if (off + chunk == msg_len)
+				pkt.mi.order = CLD_PKT_ORD_LAST;
+			else
+				pkt.mi.order = CLD_PKT_ORD_MID;
+		}
+
+		hdr_len = cld_pkt_hdr_encode(&pkt, hdr_buf, sizeof(hdr_buf));
+		if (!hdr_len) {
+			rc = -EINVAL;
+			break;
+		}
+
+		pbuf = cld_buf_get(pool, hdr_len + chunk + CLD_PKT_FTR_LEN,
+				   &pcap);
+		if (!pbuf) {
+			rc = -ENOMEM;
+			break;
+		}
+		memcpy(pbuf, hdr_buf, hdr_len);
+		memcpy(pbuf + hdr_len, body + off, chunk);
+		memset(pbuf + hdr_len + chunk, 0, CLD_PKT_FTR_LEN);
+
+		rc = emit(priv, pbuf, pcap, pbuf,
+			  hdr_len + chunk + CLD_PKT_FTR_LEN);
+		if (rc)
+			break;
+	}
+
+	cld_buf_put(pool, buf, cap);
+	return rc;
+}
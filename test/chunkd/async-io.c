@@ -0,0 +1,187 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Drive two asynchronous clients from one poll loop, each with its
+ * whole sequence of operations queued up front.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <cld_common.h>
+#include <chunkc.h>
+#include "test.h"
+
+enum {
+	N_CLIENTS		= 2,
+	OBJ_SZ			= 64 * 1024,
+};
+
+struct async_client {
+	struct st_client	*stc;
+	char			key[64];
+	void			*val;
+
+	int			n_done;
+	bool			failed;
+	void			*got;
+	size_t			got_len;
+	bool			listed;
+};
+
+static void done_cb(struct st_client *stc, struct stc_result *res, void *priv)
+{
+	struct async_client *ac = priv;
+
+	ac->n_done++;
+	if (!res->ok)
+		ac->failed = true;
+}
+
+static void get_cb(struct st_client *stc, struct stc_result *res, void *priv)
+{
+	struct async_client *ac = priv;
+
+	done_cb(stc, res, priv);
+
+	/* keep the buffer */
+	ac->got = res->data;
+	ac->got_len = res->data_len;
+	res->data = NULL;
+}
+
+static void keys_cb(struct st_client *stc, struct stc_result *res, void *priv)
+{
+	struct async_client *ac = priv;
+	GList *tmp;
+
+	done_cb(stc, res, priv);
+	if (!res->keylist)
+		return;
+
+	for (tmp = res->keylist->contents; tmp; tmp = tmp->next) {
+		struct st_object *obj = tmp->data;
+
+		if (!strcmp(obj->name, ac->key) && obj->size == OBJ_SZ)
+			ac->listed = true;
+	}
+}
+
+static void run_all(struct async_client *acv)
+{
+	struct pollfd pfd[N_CLIENTS];
+	unsigned int ev;
+	int i, n, rc;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < N_CLIENTS; i++) {
+			ev = stc_async_events(acv[i].stc);
+			if (!ev)
+				continue;
+			pfd[n].fd = stc_async_fd(acv[i].stc);
+			pfd[n].events = ((ev & STC_EV_READ) ? POLLIN : 0) |
+					((ev & STC_EV_WRITE) ? POLLOUT : 0);
+			pfd[n].revents = 0;
+			n++;
+		}
+		if (!n)
+			break;
+
+		rc = poll(pfd, n, 10 * 1000);
+		OK(rc > 0);
+
+		/* cheap to call when nothing is ready; it just returns */
+		for (i = 0; i < N_CLIENTS; i++)
+			OK(stc_async_run(acv[i].stc));
+	}
+}
+
+static void test(bool do_encrypt)
+{
+	struct async_client acv[N_CLIENTS];
+	struct async_client *ac;
+	int port, i;
+
+	port = hail_readport(TEST_PORTFILE);
+	OK(port > 0);
+
+	memset(acv, 0, sizeof(acv));
+	for (i = 0; i < N_CLIENTS; i++) {
+		ac = &acv[i];
+
+		ac->stc = stc_new_async(TEST_HOST, port, TEST_USER,
+					TEST_USER_KEY, do_encrypt);
+		OK(ac->stc);
+
+		sprintf(ac->key, "deadbeef async %d", i);
+		ac->val = randmem(OBJ_SZ);
+		OK(ac->val);
+
+		/* all queued before any of it goes out */
+		OK(stc_async_table_openz(ac->stc, TEST_TABLE, 0,
+					 done_cb, ac));
+		OK(stc_async_put_inlinez(ac->stc, ac->key, ac->val, OBJ_SZ, 0,
+					 done_cb, ac));
+		OK(stc_async_keys(ac->stc, keys_cb, ac));
+		OK(stc_async_getz(ac->stc, ac->key, NULL, NULL, get_cb, ac));
+		OK(stc_async_ping(ac->stc, done_cb, ac));
+		OK(stc_async_delz(ac->stc, ac->key, done_cb, ac));
+		OK(stc_async_pending(ac->stc) > 0);
+	}
+
+	run_all(acv);
+
+	for (i = 0; i < N_CLIENTS; i++) {
+		ac = &acv[i];
+
+		OK(ac->n_done == 6);
+		OK(!ac->failed);
+		OK(ac->listed);
+		OK(ac->got);
+		OK(ac->got_len == OBJ_SZ);
+		OK(!memcmp(ac->got, ac->val, OBJ_SZ));
+		OK(stc_async_pending(ac->stc) == 0);
+
+		free(ac->got);
+		free(ac->val);
+		stc_free(ac->stc);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	stc_init();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	test(false);
+	test(true);
+
+	return 0;
+}
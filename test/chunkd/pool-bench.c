@@ -0,0 +1,163 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * 4 KiB PUT and GET, first with a fresh connection per request as
+ * plain stc_new callers do, then borrowing from an stc_pool.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <cld_common.h>
+#include <chunkc.h>
+#include "test.h"
+
+enum {
+	N_TEST_OPS		= 1000,
+	OBJ_SZ			= 4 * 1024,
+};
+
+static void *val;
+static int port;
+
+static struct st_client *conn_new(bool do_encrypt)
+{
+	struct st_client *stc;
+
+	stc = stc_new(TEST_HOST, port, TEST_USER, TEST_USER_KEY, do_encrypt);
+	OK(stc);
+	OK(stc_table_openz(stc, TEST_TABLE, 0));
+
+	return stc;
+}
+
+static void one_op(struct st_client *stc, int i, int op)
+{
+	char key[64];
+	size_t len = 0;
+	void *mem;
+
+	sprintf(key, "%x pool-bench", i);
+
+	switch (op) {
+	case 0:
+		OK(stc_put_inlinez(stc, key, val, OBJ_SZ, 0));
+		break;
+	case 1:
+		mem = stc_get_inlinez(stc, key, &len);
+		OK(mem);
+		OK(len == OBJ_SZ);
+		OK(!memcmp(mem, val, OBJ_SZ));
+		free(mem);
+		break;
+	default:
+		OK(stc_delz(stc, key));
+		break;
+	}
+}
+
+static void test(int n_ops, bool do_encrypt)
+{
+	static const char *op_names[] = { "PUT", "GET", "DELETE" };
+	struct stc_pool *pool;
+	struct st_client *stc;
+	struct timeval ta, tb;
+	char pfx[64];
+	int i, op;
+
+	pool = stc_pool_new(TEST_USER, TEST_USER_KEY, TEST_TABLE,
+			    do_encrypt, 1);
+	OK(pool);
+	OK(stc_pool_add(pool, TEST_HOST, port) == 0);
+
+	for (op = 0; op < 3; op++) {
+		gettimeofday(&ta, NULL);
+
+		for (i = 0; i < n_ops; i++) {
+			stc = conn_new(do_encrypt);
+			one_op(stc, i, op);
+			stc_free(stc);
+		}
+
+		gettimeofday(&tb, NULL);
+
+		sprintf(pfx, "pool-bench %sunpooled %s",
+			do_encrypt ? "SSL " : "", op_names[op]);
+		printdiff(&ta, &tb, n_ops, pfx, "ops");
+	}
+
+	for (op = 0; op < 3; op++) {
+		gettimeofday(&ta, NULL);
+
+		for (i = 0; i < n_ops; i++) {
+			stc = stc_pool_get(pool, -1);
+			OK(stc);
+			one_op(stc, i, op);
+			stc_pool_put(pool, stc, true);
+		}
+
+		gettimeofday(&tb, NULL);
+
+		sprintf(pfx, "pool-bench %spooled %s",
+			do_encrypt ? "SSL " : "", op_names[op]);
+		printdiff(&ta, &tb, n_ops, pfx, "ops");
+	}
+
+	/* one warm connection served every request */
+	OK(pool->stats.connects == 1);
+	OK(pool->stats.reused == 3 * n_ops - 1);
+	OK(pool->stats.dropped == 0);
+
+	stc_pool_free(pool);
+}
+
+int main(int argc, char *argv[])
+{
+	int n_ops = N_TEST_OPS;
+
+	setlocale(LC_ALL, "C");
+
+	stc_init();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	if (argc == 2 && (atoi(argv[1]) > 0)) {
+		n_ops = atoi(argv[1]);
+		fprintf(stderr, "testing %d ops...\n", n_ops);
+	}
+
+	port = hail_readport(TEST_PORTFILE);
+	OK(port > 0);
+
+	val = randmem(OBJ_SZ);
+	OK(val);
+
+	test(n_ops, false);
+	test(n_ops, true);
+
+	free(val);
+	return 0;
+}
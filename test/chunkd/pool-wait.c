@@ -0,0 +1,156 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * More threads than the pool lends, over two nodes, some waiting for
+ * one node in particular and some for any.  A connection coming back
+ * to one node must not leave a borrower of the other asleep, and no
+ * node may ever lend more than max_per_node.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <glib.h>
+#include <cld_common.h>
+#include <chunkc.h>
+#include "test.h"
+
+enum {
+	N_THREADS		= 8,
+	N_ROUNDS		= 200,
+	MAX_PER_NODE		= 2,
+	OBJ_SZ			= 1024,
+
+	TEST_TIMEOUT		= 120,	/* secs; a lost wakeup hangs */
+};
+
+static struct stc_pool *pool;
+static void *val;
+
+static GMutex *lent_lock;
+static unsigned int lent[2];		/* per node, as we count them */
+
+static void lend(struct st_client *stc, int delta)
+{
+	unsigned int idx = stc->pool_node == g_list_nth_data(pool->nodes, 0) ?
+			   0 : 1;
+
+	g_mutex_lock(lent_lock);
+	lent[idx] += delta;
+	OK(lent[idx] <= MAX_PER_NODE);
+	g_mutex_unlock(lent_lock);
+}
+
+static gpointer borrower(gpointer data)
+{
+	long id = (long) data;
+	struct st_client *stc;
+	char key[64];
+	size_t len;
+	void *mem;
+	int i, node_idx;
+
+	for (i = 0; i < N_ROUNDS; i++) {
+		/* two threads in three pick a node, the rest take any */
+		node_idx = (id % 3 == 2) ? -1 : (int) (id % 2);
+
+		stc = stc_pool_get(pool, node_idx);
+		OK(stc);
+		if (node_idx >= 0)
+			OK(stc->pool_node ==
+			   g_list_nth_data(pool->nodes, node_idx));
+		lend(stc, 1);
+
+		sprintf(key, "%lx-%x pool-wait", id, i);
+		OK(stc_put_inlinez(stc, key, val, OBJ_SZ, 0));
+		mem = stc_get_inlinez(stc, key, &len);
+		OK(mem);
+		OK(len == OBJ_SZ);
+		OK(!memcmp(mem, val, OBJ_SZ));
+		free(mem);
+		OK(stc_delz(stc, key));
+
+		lend(stc, -1);
+		stc_pool_put(pool, stc, true);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	GThread *threads[N_THREADS];
+	GList *tmp;
+	long i;
+	int port;
+
+	setlocale(LC_ALL, "C");
+
+	g_thread_init(NULL);
+	stc_init();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	alarm(TEST_TIMEOUT);
+
+	port = hail_readport(TEST_PORTFILE);
+	OK(port > 0);
+
+	val = randmem(OBJ_SZ);
+	OK(val);
+
+	lent_lock = g_mutex_new();
+
+	/* one chunkd, added twice: the pool does not know */
+	pool = stc_pool_new(TEST_USER, TEST_USER_KEY, TEST_TABLE, false,
+			    MAX_PER_NODE);
+	OK(pool);
+	OK(stc_pool_add(pool, TEST_HOST, port) == 0);
+	OK(stc_pool_add(pool, TEST_HOST, port) == 1);
+
+	for (i = 0; i < N_THREADS; i++) {
+		threads[i] = g_thread_create(borrower, (gpointer) i, TRUE,
+					     NULL);
+		OK(threads[i]);
+	}
+	for (i = 0; i < N_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	/* everything came back, and nothing was lost on the way */
+	for (tmp = pool->nodes; tmp; tmp = tmp->next) {
+		struct stc_pool_node *node = tmp->data;
+
+		OK(node->busy == 0);
+		OK(g_list_length(node->idle) <= MAX_PER_NODE);
+	}
+	OK(pool->stats.dropped == 0);
+	OK(pool->stats.connects + pool->stats.reused ==
+	   N_THREADS * N_ROUNDS);
+
+	stc_pool_free(pool);
+	g_mutex_free(lent_lock);
+	free(val);
+	return 0;
+}
@@ -0,0 +1,94 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Only the first encrypted connection to a server should pay for a
+ * full handshake; the rest resume its session.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <cld_common.h>
+#include <chunkc.h>
+#include "test.h"
+
+enum {
+	N_CONNS			= 200,
+};
+
+static void test(void)
+{
+	struct stc_ssl_stats st;
+	struct st_client *stc;
+	struct timeval ta, tb;
+	int port, i;
+
+	port = hail_readport(TEST_PORTFILE);
+	OK(port > 0);
+
+	gettimeofday(&ta, NULL);
+
+	for (i = 0; i < N_CONNS; i++) {
+		stc = stc_new(TEST_HOST, port, TEST_USER, TEST_USER_KEY, true);
+		OK(stc);
+		OK(stc_ping(stc));
+		stc_free(stc);
+	}
+
+	gettimeofday(&tb, NULL);
+
+	printdiff(&ta, &tb, N_CONNS, "ssl-resume SSL connect", "conns");
+
+	stc_ssl_stats(&st);
+	OK(st.handshakes == N_CONNS);
+	OK(st.resumed == N_CONNS - 1);
+
+	/* stc_exit forgets the session, so the next one starts over */
+	stc_exit();
+
+	stc = stc_new(TEST_HOST, port, TEST_USER, TEST_USER_KEY, true);
+	OK(stc);
+	OK(stc_ping(stc));
+	stc_free(stc);
+
+	stc_ssl_stats(&st);
+	OK(st.handshakes == N_CONNS + 1);
+	OK(st.resumed == N_CONNS - 1);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	stc_init();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	test();
+
+	stc_exit();
+	return 0;
+}
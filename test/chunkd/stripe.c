@@ -0,0 +1,215 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Round trip of a striped object: a file of several parts plus a
+ * short tail goes up over parallel connections and comes back, then
+ * a shorter one replaces it without leaving the old parts behind.
+ * Objects that are not manifests are refused.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <locale.h>
+#include <cld_common.h>
+#include <chunkc.h>
+#include "test.h"
+
+enum {
+	PART_SZ			= 256 * 1024,
+	OBJ_SZ			= 7 * PART_SZ / 2,	/* 3 parts and a half */
+	OBJ2_SZ			= PART_SZ + 100,	/* its overwrite */
+	N_PARALLEL		= 3,
+};
+
+/* the generation in key's manifest */
+static uint64_t stripe_gen(struct stc_pool *pool, const char *key)
+{
+	struct st_client *stc;
+	unsigned long long gen;
+	size_t len = 0;
+	char *text, *str, *p;
+
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	text = stc_get_inlinez(stc, key, &len);
+	stc_pool_put(pool, stc, text != NULL);
+	OK(text);
+
+	str = g_strndup(text, len);
+	p = strstr(str, "\ngeneration ");
+	OK(p && sscanf(p, "\ngeneration %llx", &gen) == 1);
+	g_free(str);
+	free(text);
+
+	return gen;
+}
+
+static bool part_exists(struct stc_pool *pool, const char *key,
+			uint64_t gen, unsigned int idx)
+{
+	struct st_client *stc;
+	char pkey[128];
+	void *mem;
+
+	sprintf(pkey, "%s.%016llx-%08x", key, (unsigned long long) gen, idx);
+
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	mem = stc_get_inlinez(stc, pkey, NULL);
+	stc_pool_put(pool, stc, mem != NULL);
+	free(mem);
+
+	return mem != NULL;
+}
+
+static void test(bool do_encrypt)
+{
+	char in_fn[] = "stripe-in.XXXXXX";
+	char out_fn[] = "stripe-out.XXXXXX";
+	struct stc_pool *pool;
+	struct st_client *stc;
+	char key[64] = "deadbeef stripe";
+	struct timeval ta, tb;
+	uint64_t len = 0, gen, gen2;
+	void *val, *val2, *back;
+	int port, in_fd, out_fd;
+
+	port = hail_readport(TEST_PORTFILE);
+	OK(port > 0);
+
+	val = randmem(OBJ_SZ);
+	OK(val);
+
+	in_fd = mkstemp(in_fn);
+	OK(in_fd >= 0);
+	OK(write(in_fd, val, OBJ_SZ) == OBJ_SZ);
+	out_fd = mkstemp(out_fn);
+	OK(out_fd >= 0);
+
+	pool = stc_pool_new(TEST_USER, TEST_USER_KEY, TEST_TABLE, do_encrypt,
+			    N_PARALLEL);
+	OK(pool);
+	OK(stc_pool_add(pool, TEST_HOST, port) == 0);
+
+	gettimeofday(&ta, NULL);
+
+	OK(stc_stripe_put_fd(pool, key, strlen(key) + 1, in_fd, OBJ_SZ,
+			     PART_SZ, N_PARALLEL));
+	OK(stc_stripe_get_fd(pool, key, strlen(key) + 1, out_fd, &len,
+			     N_PARALLEL));
+
+	gettimeofday(&tb, NULL);
+
+	printdiff(&ta, &tb, 2 * OBJ_SZ,
+		  do_encrypt ? "stripe SSL PUT+GET" : "stripe PUT+GET", "B");
+
+	OK(len == OBJ_SZ);
+	back = malloc(OBJ_SZ);
+	OK(back);
+	OK(pread(out_fd, back, OBJ_SZ, 0) == OBJ_SZ);
+	OK(!memcmp(back, val, OBJ_SZ));
+
+	gen = stripe_gen(pool, key);
+	OK(part_exists(pool, key, gen, 3));
+
+	/* overwrite, shorter: new parts under a new generation, and the
+	 * old ones gone once the new manifest is in
+	 */
+	val2 = randmem(OBJ2_SZ);
+	OK(val2);
+	OK(pwrite(in_fd, val2, OBJ2_SZ, 0) == OBJ2_SZ);
+	OK(stc_stripe_put_fd(pool, key, strlen(key) + 1, in_fd, OBJ2_SZ,
+			     PART_SZ, N_PARALLEL));
+
+	gen2 = stripe_gen(pool, key);
+	OK(gen2 != gen);
+	OK(!part_exists(pool, key, gen, 0));
+	OK(!part_exists(pool, key, gen, 3));
+	OK(part_exists(pool, key, gen2, 1));
+
+	OK(!ftruncate(out_fd, 0));
+	OK(stc_stripe_get_fd(pool, key, strlen(key) + 1, out_fd, &len,
+			     N_PARALLEL));
+	OK(len == OBJ2_SZ);
+	OK(pread(out_fd, back, OBJ2_SZ, 0) == OBJ2_SZ);
+	OK(!memcmp(back, val2, OBJ2_SZ));
+
+	/* parts and manifest all go */
+	OK(stc_stripe_del(pool, key, strlen(key) + 1));
+
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	OK(!stc_get_inlinez(stc, key, NULL));
+	stc_pool_put(pool, stc, false);
+	OK(!part_exists(pool, key, gen2, 0));
+
+	/* a plain object is no manifest, nor is one past a manifest's size */
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	OK(stc_put_inline(stc, key, strlen(key) + 1, val, OBJ_SZ, 0));
+	stc_pool_put(pool, stc, true);
+	OK(!stc_stripe_get_fd(pool, key, strlen(key) + 1, out_fd, NULL,
+			      N_PARALLEL));
+
+	memcpy(val, "chunkd-stripe 2\n", 16);
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	OK(stc_put_inline(stc, key, strlen(key) + 1, val, OBJ_SZ, 0));
+	stc_pool_put(pool, stc, true);
+	OK(!stc_stripe_get_fd(pool, key, strlen(key) + 1, out_fd, NULL,
+			      N_PARALLEL));
+
+	stc = stc_pool_get(pool, 0);
+	OK(stc);
+	OK(stc_del(stc, key, strlen(key) + 1));
+	stc_pool_put(pool, stc, true);
+
+	stc_pool_free(pool);
+
+	close(in_fd);
+	close(out_fd);
+	unlink(in_fn);
+	unlink(out_fn);
+	free(back);
+	free(val2);
+	free(val);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_thread_init(NULL);
+	stc_init();
+	SSL_library_init();
+	SSL_load_error_strings();
+
+	test(false);
+	test(true);
+
+	return 0;
+}
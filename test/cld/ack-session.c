@@ -0,0 +1,140 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A session without CSF_STREAM: every reply is retransmitted until
+ * ACK'd, and the client ACKs in batches.  Enough round trips to fill
+ * several batches, and one message long enough to be fragmented.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+enum {
+	N_ROUNDS		= 50,
+	BIG_LEN			= 20000,	/* spans many packets */
+};
+
+static char big_buf[BIG_LEN];
+
+int main(int argc, char *argv[])
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	struct ncld_read *rp;
+	int error;
+	int port;
+	int i;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess = ncld_sess_open_flags(TEST_HOST, port, &error, NULL, NULL,
+				     TEST_USER, TEST_USER_KEY, NULL,
+				     CSF_CUM_ACK);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+	if (nsess->sess->flags & (CSF_STREAM | CSF_LARGE_FRAMES)) {
+		fprintf(stderr, "session got flags it did not ask for: 0x%x\n",
+			nsess->sess->flags);
+		exit(1);
+	}
+	if (!(nsess->sess->flags & CSF_CUM_ACK)) {
+		fprintf(stderr, "server did not grant CSF_CUM_ACK\n");
+		exit(1);
+	}
+
+	fh = ncld_open(nsess, TANAME, COM_READ | COM_WRITE | COM_CREATE,
+			&error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TANAME, error);
+		exit(1);
+	}
+
+	for (i = 0; i < N_ROUNDS; i++) {
+		error = ncld_write(fh, TESTSTR, TESTLEN);
+		if (error) {
+			fprintf(stderr, "ncld_write #%d failed: %d\n",
+				i, error);
+			exit(1);
+		}
+
+		rp = ncld_get(fh, &error);
+		if (!rp) {
+			fprintf(stderr, "ncld_get #%d failed: %d\n", i, error);
+			exit(1);
+		}
+		if (rp->length != TESTLEN || memcmp(rp->ptr, TESTSTR, TESTLEN)) {
+			fprintf(stderr, "Bad CLD file content, round %d\n", i);
+			exit(1);
+		}
+		ncld_read_free(rp);
+	}
+
+	for (i = 0; i < BIG_LEN; i++)
+		big_buf[i] = (i * 13) ^ (i >> 7);
+
+	error = ncld_write(fh, big_buf, BIG_LEN);
+	if (error) {
+		fprintf(stderr, "ncld_write (%d bytes) failed: %d\n",
+			BIG_LEN, error);
+		exit(1);
+	}
+
+	rp = ncld_get(fh, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get (%d bytes) failed: %d\n",
+			BIG_LEN, error);
+		exit(1);
+	}
+	if (rp->length != BIG_LEN || memcmp(rp->ptr, big_buf, BIG_LEN)) {
+		fprintf(stderr, "Bad CLD file content, %ld bytes\n",
+			rp->length);
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	ncld_close(fh);
+
+	error = ncld_del(nsess, TANAME);
+	if (error) {
+		fprintf(stderr, "ncld_del(%s) failed: %d\n", TANAME, error);
+		exit(1);
+	}
+
+	ncld_sess_close(nsess);
+	return 0;
+}
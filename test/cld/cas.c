@@ -0,0 +1,148 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Version-checked writes, and the single-message OPEN-GET and OPEN-PUT.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ncld.h>
+#include "test.h"
+
+static void sess_event(void *priv, unsigned int what)
+{
+	if (what == CE_SESS_FAILED) {
+		fprintf(stderr, "Session failed\n");
+		exit(1);
+	}
+	fprintf(stderr, "Unknown event %d\n", what);
+}
+
+static void check_data(struct ncld_sess *nsess, const char *want,
+		       uint64_t vers)
+{
+	struct ncld_read *rp;
+	int error;
+
+	rp = ncld_open_get(nsess, TCNAME, 0, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_open_get(%s) failed: %d\n",
+			TCNAME, error);
+		exit(1);
+	}
+	if (rp->length != strlen(want) || memcmp(rp->ptr, want, rp->length)) {
+		fprintf(stderr, "ncld_open_get: wrong data\n");
+		exit(1);
+	}
+	if (rp->meta.vers != vers) {
+		fprintf(stderr, "ncld_open_get: version %llu, want %llu\n",
+			(unsigned long long) rp->meta.vers,
+			(unsigned long long) vers);
+		exit(1);
+	}
+	ncld_read_free(rp);
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	uint64_t vers, stale;
+	int port;
+	int error;
+	int rc;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, sess_event, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+
+	/* create and write in one message */
+	vers = 0;
+	rc = ncld_open_put(nsess, TCNAME, COM_CREATE | COM_EXCL,
+			   "one", 3, NULL);
+	if (rc) {
+		fprintf(stderr, "ncld_open_put(%s) failed: %d\n", TCNAME, rc);
+		exit(1);
+	}
+
+	rc = ncld_open_put(nsess, TCNAME, 0, "two", 3, &vers);
+	if (rc != CLE_VERS_MISMATCH + 1100) {
+		fprintf(stderr, "ncld_open_put at version 0: %d\n", rc);
+		exit(1);
+	}
+	check_data(nsess, "one", vers);
+
+	/* a write at the current version goes in, and moves it on */
+	stale = vers;
+	rc = ncld_open_put(nsess, TCNAME, 0, "two", 3, &vers);
+	if (rc || vers <= stale) {
+		fprintf(stderr, "ncld_open_put failed: %d\n", rc);
+		exit(1);
+	}
+	check_data(nsess, "two", vers);
+
+	/* the same, through an open handle */
+	fh = ncld_open(nsess, TCNAME, COM_WRITE, &error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TCNAME, error);
+		exit(1);
+	}
+
+	rc = ncld_write_if(fh, "three", 5, &stale);
+	if (rc != CLE_VERS_MISMATCH + 1100 || stale != vers) {
+		fprintf(stderr, "ncld_write_if at stale version: %d\n", rc);
+		exit(1);
+	}
+
+	rc = ncld_write_if(fh, "three", 5, &vers);
+	if (rc) {
+		fprintf(stderr, "ncld_write_if failed: %d\n", rc);
+		exit(1);
+	}
+	check_data(nsess, "three", vers);
+
+	ncld_close(fh);
+
+	rc = ncld_del(nsess, TCNAME);
+	if (rc) {
+		fprintf(stderr, "ncld_del(%s) failed: %d\n", TCNAME, rc);
+		exit(1);
+	}
+
+	ncld_sess_close(nsess);
+	return 0;
+}
@@ -0,0 +1,154 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Write and read back a maximum-size file in CLD, so that the
+ * message spans well over one packet's worth of data.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ncld.h>
+#include "test.h"
+
+static char large_buf[CLD_MAX_PAYLOAD_SZ];
+
+static void fill_buf(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(large_buf); i++)
+		large_buf[i] = (i * 7) ^ (i >> 8);
+}
+
+static int test_write(int port)
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	int error;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, NULL, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+
+	if (!(nsess->sess->flags & CSF_LARGE_FRAMES)) {
+		fprintf(stderr, "server did not grant CSF_LARGE_FRAMES\n");
+		exit(1);
+	}
+
+	fh = ncld_open(nsess, TBNAME, COM_WRITE | COM_CREATE,
+			&error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TBNAME, error);
+		exit(1);
+	}
+
+	error = ncld_write(fh, large_buf, sizeof(large_buf));
+	if (error) {
+		fprintf(stderr, "ncld_write failed: %d\n", error);
+		exit(1);
+	}
+
+	ncld_close(fh);
+	ncld_sess_close(nsess);
+	return 0;
+}
+
+static int test_read(int port)
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	struct ncld_read *rp;
+	int error;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, NULL, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+
+	if (!(nsess->sess->flags & CSF_LARGE_FRAMES)) {
+		fprintf(stderr, "server did not grant CSF_LARGE_FRAMES\n");
+		exit(1);
+	}
+
+	fh = ncld_open(nsess, TBNAME, COM_READ, &error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TBNAME, error);
+		exit(1);
+	}
+
+	rp = ncld_get(fh, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get failed: %d\n", error);
+		exit(1);
+	}
+
+	if (rp->length != sizeof(large_buf)) {
+		fprintf(stderr, "Bad CLD file length %ld\n", rp->length);
+		exit(1);
+	}
+
+	if (memcmp(rp->ptr, large_buf, sizeof(large_buf))) {
+		fprintf(stderr, "Bad CLD file content\n");
+		exit(1);
+	}
+
+	ncld_read_free(rp);
+
+	ncld_close(fh);
+	ncld_sess_close(nsess);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int port;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return 1;
+	if (port == 0)
+		return 1;
+
+	fill_buf();
+
+	if (test_write(port))
+		return 1;
+	if (test_read(port))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A client on the server's host connects over the server's local
+ * socket, and locks and reads through it as over TCP.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	struct ncld_read *rp;
+	sa_family_t family;
+	int error;
+	int port;
+	int rc;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	/* start-daemon put the socket here */
+	setenv("CLD_UNIX_DIR", ".", 1);
+
+	nsess = test_sess_open(port);
+
+	memcpy(&family, nsess->conn->tcp->addr, sizeof(family));
+	if (family != AF_UNIX) {
+		fprintf(stderr, "connected over TCP, not the local socket\n");
+		exit(1);
+	}
+
+	fh = ncld_open(nsess, TLNAME, COM_READ | COM_WRITE | COM_LOCK |
+		       COM_CREATE, &error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TLNAME, error);
+		exit(1);
+	}
+
+	rc = ncld_write(fh, LOCKSTR, LOCKLEN);
+	if (rc) {
+		fprintf(stderr, "ncld_write failed: %d\n", rc);
+		exit(1);
+	}
+
+	rc = ncld_trylock(fh);
+	if (rc) {
+		fprintf(stderr, "ncld_trylock failed: %d\n", rc);
+		exit(1);
+	}
+
+	rp = ncld_get(fh, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get failed: %d\n", error);
+		exit(1);
+	}
+	if (rp->length != LOCKLEN || memcmp(rp->ptr, LOCKSTR, LOCKLEN)) {
+		fprintf(stderr, "ncld_get returned bad data\n");
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	rc = ncld_unlock(fh);
+	if (rc) {
+		fprintf(stderr, "ncld_unlock failed: %d\n", rc);
+		exit(1);
+	}
+
+	ncld_close(fh);
+	ncld_sess_close(nsess);
+	return 0;
+}
@@ -0,0 +1,137 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Queue a lock behind another session's, and check that it is granted
+ * in turn when the holder lets go.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+static void sess_event(void *priv, unsigned int what)
+{
+	if (what == CE_SESS_FAILED) {
+		fprintf(stderr, "Session failed\n");
+		exit(1);
+	}
+	fprintf(stderr, "Unknown event %d\n", what);
+}
+
+static struct ncld_sess *sess_open(int port)
+{
+	struct ncld_sess *nsess;
+	int error;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, sess_event, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+	return nsess;
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess_a, *nsess_b;
+	struct ncld_fh *fh_a, *fh_b;
+	int port;
+	int error;
+	int rc;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess_a = sess_open(port);
+	nsess_b = sess_open(port);
+
+	fh_a = ncld_open(nsess_a, TWNAME, COM_WRITE | COM_LOCK | COM_CREATE,
+			&error, 0, NULL, NULL);
+	if (!fh_a) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TWNAME, error);
+		exit(1);
+	}
+
+	fh_b = ncld_open(nsess_b, TWNAME, COM_READ | COM_LOCK,
+			&error, 0, NULL, NULL);
+	if (!fh_b) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TWNAME, error);
+		exit(1);
+	}
+
+	rc = ncld_trylock(fh_a);
+	if (rc) {
+		fprintf(stderr, "ncld_trylock failed: %d\n", rc);
+		exit(1);
+	}
+
+	/* held by A, so B must queue */
+	rc = ncld_qlock(fh_b);
+	if (rc != 1) {
+		fprintf(stderr, "ncld_qlock did not queue: %d\n", rc);
+		exit(1);
+	}
+
+	/* releasing A's lock hands it to B */
+	rc = ncld_unlock(fh_a);
+	if (rc) {
+		fprintf(stderr, "ncld_unlock failed: %d\n", rc);
+		exit(1);
+	}
+
+	rc = ncld_trylock(fh_a);
+	if (rc != CLE_LOCK_CONFLICT + 1100) {
+		fprintf(stderr, "ncld_trylock after handoff: %d\n", rc);
+		exit(1);
+	}
+
+	/* closing B's handle drops its lock */
+	ncld_close(fh_b);
+
+	rc = ncld_trylock(fh_a);
+	if (rc) {
+		fprintf(stderr, "ncld_trylock after close failed: %d\n", rc);
+		exit(1);
+	}
+
+	rc = ncld_unlock(fh_a);
+	if (rc) {
+		fprintf(stderr, "ncld_unlock failed: %d\n", rc);
+		exit(1);
+	}
+
+	ncld_close(fh_a);
+	ncld_sess_close(nsess_b);
+	ncld_sess_close(nsess_a);
+	return 0;
+}
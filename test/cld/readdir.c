@@ -0,0 +1,175 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Fill a directory, then list it a page at a time with READDIR and
+ * whole with GET, and check that both agree.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ncld.h>
+#include "test.h"
+
+#define N_FILES		300
+#define PAGE_SIZE	64
+
+static void sess_event(void *priv, unsigned int what)
+{
+	if (what == CE_SESS_FAILED) {
+		fprintf(stderr, "Session failed\n");
+		exit(1);
+	}
+	fprintf(stderr, "Unknown event %d\n", what);
+}
+
+/* count the names in a listing, checking they come in name order */
+static int count_names(const void *data, size_t data_len, char *last)
+{
+	struct cld_dirent_cur dc;
+	int i, n;
+
+	n = cldc_dirent_count(data, data_len);
+	if (n < 0)
+		return n;
+
+	cldc_dirent_cur_init(&dc, data, data_len);
+	for (i = 0; i < n; i++) {
+		char *s;
+
+		if ((i == 0 ? cldc_dirent_first(&dc) :
+			      cldc_dirent_next(&dc)) < 0)
+			return -1;
+
+		s = cldc_dirent_name(&dc);
+		if (last[0] && strcmp(last, s) >= 0) {
+			fprintf(stderr, "%s listed after %s\n", s, last);
+			exit(1);
+		}
+		strcpy(last, s);
+		free(s);
+	}
+	cldc_dirent_cur_fini(&dc);
+
+	return n;
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *dir, *fh;
+	struct ncld_read *rp;
+	char path[CLD_INODE_NAME_MAX];
+	char last[CLD_INODE_NAME_MAX];
+	int port;
+	int error;
+	int i, n, total;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, sess_event, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+
+	dir = ncld_open(nsess, TDNAME,
+			COM_READ | COM_DIRECTORY | COM_CREATE | COM_EXCL,
+			&error, 0, NULL, NULL);
+	if (!dir) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TDNAME, error);
+		exit(1);
+	}
+
+	for (i = 0; i < N_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%04d", TDNAME, i);
+		fh = ncld_open(nsess, path, COM_WRITE | COM_CREATE | COM_EXCL,
+				&error, 0, NULL, NULL);
+		if (!fh) {
+			fprintf(stderr, "ncld_open(%s) failed: %d\n",
+				path, error);
+			exit(1);
+		}
+		ncld_close(fh);
+	}
+
+	/* page through */
+	total = 0;
+	last[0] = 0;
+	do {
+		rp = ncld_readdir(dir, last, PAGE_SIZE, &error);
+		if (!rp) {
+			fprintf(stderr, "ncld_readdir failed: %d\n", error);
+			exit(1);
+		}
+
+		n = count_names(rp->ptr, rp->length, last);
+		if (n < 0 || n > PAGE_SIZE) {
+			fprintf(stderr, "bad READDIR page: %d names\n", n);
+			exit(1);
+		}
+		total += n;
+
+		if (rp->eof) {
+			ncld_read_free(rp);
+			break;
+		}
+		ncld_read_free(rp);
+	} while (n);
+
+	if (total != N_FILES) {
+		fprintf(stderr, "READDIR listed %d names, wanted %d\n",
+			total, N_FILES);
+		exit(1);
+	}
+
+	/* the whole directory, in the format GET always returned */
+	rp = ncld_get(dir, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get(%s) failed: %d\n", TDNAME, error);
+		exit(1);
+	}
+
+	last[0] = 0;
+	n = count_names(rp->ptr, rp->length, last);
+	if (n != N_FILES) {
+		fprintf(stderr, "GET listed %d names, wanted %d\n",
+			n, N_FILES);
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	ncld_close(dir);
+	ncld_sess_close(nsess);
+	return 0;
+}
@@ -0,0 +1,166 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * The second cell's replica: it refuses writes, catches up with the
+ * master's, serves reads routed to it by ncld_sess_replicas, and tells
+ * watchers of changes made on the master.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+enum {
+	REPLICA_WAIT		= 40,	/* secs for replica to start */
+	REPLICA_LAG		= 10,	/* secs for a write to arrive */
+};
+
+static volatile unsigned int update_events;
+
+static void file_event(void *priv, unsigned int what)
+{
+	if (what & CE_UPDATED)
+		update_events++;
+}
+
+static void file_put(struct ncld_sess *nsess, const char *data)
+{
+	int rc;
+
+	rc = ncld_open_put(nsess, TRNAME, COM_CREATE, data, strlen(data),
+			   NULL);
+	if (rc) {
+		fprintf(stderr, "ncld_open_put(%s) failed: %d\n", TRNAME, rc);
+		exit(1);
+	}
+}
+
+/* read through nsess, and so its replica, until the data shows up */
+static void file_wait(struct ncld_sess *nsess, const char *data)
+{
+	struct ncld_read *rp;
+	int i, error;
+
+	for (i = 0; i < REPLICA_LAG * 10; i++) {
+		rp = ncld_open_get(nsess, TRNAME, 0, &error);
+		if (rp) {
+			bool match = rp->length == strlen(data) &&
+				     !memcmp(rp->ptr, data, rp->length);
+
+			ncld_read_free(rp);
+			if (match)
+				return;
+		}
+		usleep(100000);
+	}
+
+	fprintf(stderr, "replica never had \"%s\"\n", data);
+	exit(1);
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *master, *replica;
+	struct cldc_host hp;
+	struct ncld_fh *fh;
+	GList *replicas;
+	int port2, port3;
+	int i, error;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port2 = hail_readport(TEST_PORTFILE_CLD2);
+	if (port2 <= 0)
+		return -1;
+
+	/* the replica writes its port file only once it is in sync */
+	for (i = 0; i < REPLICA_WAIT; i++) {
+		port3 = hail_readport(TEST_PORTFILE_CLD3);
+		if (port3 > 0)
+			break;
+		sleep(1);
+	}
+	if (port3 <= 0) {
+		fprintf(stderr, "replica did not start\n");
+		return -1;
+	}
+
+	master = test_sess_open(port2);
+	file_put(master, "first\n");
+
+	/* writes, and opens which could write, are refused */
+	replica = test_sess_open(port3);
+	fh = ncld_open(replica, TRNAME, COM_READ | COM_WRITE, &error,
+		       0, NULL, NULL);
+	if (fh || error != 1100 + CLE_READ_ONLY) {
+		fprintf(stderr, "write open on replica: %d, want %d\n",
+			fh ? 0 : error, 1100 + CLE_READ_ONLY);
+		exit(1);
+	}
+	ncld_sess_close(replica);
+
+	memset(&hp, 0, sizeof(hp));
+	hp.host = TEST_HOST;
+	hp.port = port3;
+	replicas = g_list_append(NULL, &hp);
+	error = ncld_sess_replicas(master, replicas, TEST_USER, TEST_USER_KEY,
+				   NULL);
+	g_list_free(replicas);
+	if (error) {
+		fprintf(stderr, "ncld_sess_replicas failed: %d\n", error);
+		exit(1);
+	}
+
+	file_wait(master, "first\n");
+
+	/* a read-only open lands on the replica, and hears of updates */
+	fh = ncld_open(master, TRNAME, COM_READ, &error, CE_UPDATED,
+		       file_event, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TRNAME, error);
+		exit(1);
+	}
+	if (fh->sess != master->reader) {
+		fprintf(stderr, "read-only open not sent to the replica\n");
+		exit(1);
+	}
+
+	file_put(master, "second\n");
+	file_wait(master, "second\n");
+
+	for (i = 0; i < REPLICA_LAG * 10 && !update_events; i++)
+		usleep(100000);
+	if (!update_events) {
+		fprintf(stderr, "no update event from the replica\n");
+		exit(1);
+	}
+
+	ncld_close(fh);
+	ncld_sess_close(master);
+	return 0;
+}
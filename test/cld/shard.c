@@ -0,0 +1,141 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Split the namespace over the two test cells, with the shard map kept
+ * on the first: TSNAME on the first cell, all else on the second.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+static void file_write(struct ncld_sess *nsess, const char *fname,
+		       unsigned int mode, const void *data, long len)
+{
+	struct ncld_fh *fh;
+	int error;
+	int rc;
+
+	fh = ncld_open(nsess, fname, mode | COM_WRITE | COM_CREATE,
+		       &error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", fname, error);
+		exit(1);
+	}
+
+	if (len) {
+		rc = ncld_write(fh, data, len);
+		if (rc) {
+			fprintf(stderr, "ncld_write(%s) failed: %d\n",
+				fname, rc);
+			exit(1);
+		}
+	}
+
+	ncld_close(fh);
+}
+
+static bool file_exists(struct ncld_sess *nsess, const char *fname)
+{
+	struct ncld_fh *fh;
+	int error;
+
+	fh = ncld_open(nsess, fname, COM_READ, &error, 0, NULL, NULL);
+	if (!fh)
+		return false;
+	ncld_close(fh);
+	return true;
+}
+
+static void check_cell(struct ncld_shards *sh, const char *path, int port)
+{
+	if (ncld_shard_sess(sh, path)->conn->port != port) {
+		fprintf(stderr, "%s not routed to the cell on port %d\n",
+			path, port);
+		exit(1);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess1, *nsess2;
+	struct ncld_shards *sh;
+	char map[256];
+	int port1, port2;
+	int error;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port1 = hail_readport(TEST_PORTFILE_CLD);
+	if (port1 <= 0)
+		return -1;
+	port2 = hail_readport(TEST_PORTFILE_CLD2);
+	if (port2 <= 0)
+		return -1;
+
+	/* keep the map on the first cell, which bootstraps the rest */
+	nsess1 = test_sess_open(port1);
+	snprintf(map, sizeof(map),
+		 "# test cells\n"
+		 "%s\t%s:%d\n"
+		 "*\t%s:%d\n",
+		 TSNAME, TEST_HOST, port1, TEST_HOST, port2);
+	file_write(nsess1, TSMAP, 0, map, strlen(map));
+
+	sh = ncld_shards_open_cld(TEST_HOST, port1, TSMAP, &error, NULL, NULL,
+				  TEST_USER, TEST_USER_KEY, NULL);
+	if (!sh) {
+		fprintf(stderr, "ncld_shards_open_cld failed: %d\n", error);
+		exit(1);
+	}
+
+	check_cell(sh, TSNAME, port1);
+	check_cell(sh, TSNAME "/file", port1);
+	check_cell(sh, TSNAME "-not", port2);
+	check_cell(sh, TFNAME, port2);
+
+	file_write(ncld_shard_sess(sh, TSNAME), TSNAME, COM_DIRECTORY, NULL, 0);
+	file_write(ncld_shard_sess(sh, TSNAME "/file"), TSNAME "/file", 0,
+		   TESTSTR, TESTLEN);
+
+	/* the file lives on its own cell, and nowhere else */
+	nsess2 = test_sess_open(port2);
+	if (!file_exists(nsess1, TSNAME "/file")) {
+		fprintf(stderr, "%s/file missing from its cell\n", TSNAME);
+		exit(1);
+	}
+	if (file_exists(nsess2, TSNAME)) {
+		fprintf(stderr, "%s found on the wrong cell\n", TSNAME);
+		exit(1);
+	}
+
+	ncld_shards_close(sh);
+	ncld_sess_close(nsess2);
+	ncld_sess_close(nsess1);
+	return 0;
+}
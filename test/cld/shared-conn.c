@@ -0,0 +1,82 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Two sessions to one server share a connection; either stays usable
+ * after the other closes.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess_a, *nsess_b;
+	struct ncld_fh *fh;
+	int error;
+	int port;
+	int rc;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess_a = test_sess_open(port);
+	nsess_b = test_sess_open(port);
+	if (nsess_a->conn != nsess_b->conn) {
+		fprintf(stderr, "sessions to one server on two connections\n");
+		exit(1);
+	}
+	if (!memcmp(nsess_a->sess->sid, nsess_b->sess->sid, CLD_SID_SZ)) {
+		fprintf(stderr, "sessions share a sid\n");
+		exit(1);
+	}
+
+	ncld_sess_close(nsess_a);
+
+	fh = ncld_open(nsess_b, TFNAME, COM_READ | COM_WRITE | COM_CREATE,
+			&error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TFNAME, error);
+		exit(1);
+	}
+
+	rc = ncld_write(fh, TESTSTR, TESTLEN);
+	if (rc) {
+		fprintf(stderr, "ncld_write failed: %d\n", rc);
+		exit(1);
+	}
+
+	ncld_close(fh);
+	ncld_sess_close(nsess_b);
+	return 0;
+}
@@ -0,0 +1,229 @@
+
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * A signed packet seen on the wire, sent again from another
+ * connection, must not take a CSF_STREAM session over: the server
+ * drops it as a replay, and replies keep going to the session's own
+ * connection.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ncld.h>
+#include "test.h"
+
+enum {
+	TEST_TIMEOUT		= 60,	/* secs; a hijacked session hangs */
+	REPLY_WAIT_MS		= 5000,
+};
+
+/* a RECONNECT, as the session's own client would have signed it */
+static size_t build_pkt(char *buf, size_t cap, struct cldc_session *sess,
+			uint64_t seqid)
+{
+	static const char * const magic = CLD_PKT_MAGIC;
+	struct cld_pkt_hdr pkt;
+	struct cld_pkt_ftr *foot;
+	size_t hdr_len;
+	XDR xdrs;
+
+	memset(&pkt, 0, sizeof(pkt));
+	memcpy(&pkt.magic, magic, sizeof(pkt.magic));
+	memcpy(&pkt.sid, sess->sid, CLD_SID_SZ);
+	pkt.user = TEST_USER;
+	pkt.mi.order = CLD_PKT_ORD_FIRST_LAST;
+	pkt.mi.cld_pkt_msg_info_u.mi.xid = 1;
+	pkt.mi.cld_pkt_msg_info_u.mi.op = CMO_RECONNECT;
+
+	xdrmem_create(&xdrs, buf, cap - CLD_PKT_FTR_LEN, XDR_ENCODE);
+	if (!xdr_cld_pkt_hdr(&xdrs, &pkt)) {
+		fprintf(stderr, "cannot encode packet header\n");
+		exit(1);
+	}
+	hdr_len = xdr_getpos(&xdrs);
+	xdr_destroy(&xdrs);
+
+	foot = (struct cld_pkt_ftr *) (buf + hdr_len);
+	memset(foot, 0, CLD_PKT_FTR_LEN);
+	foot->seqid = GUINT64_TO_LE(seqid);
+	if (cld_authsign(NULL, TEST_USER_KEY, buf,
+			 hdr_len + CLD_PKT_FTR_LEN - SHA_DIGEST_LENGTH,
+			 foot->sha)) {
+		fprintf(stderr, "cannot sign packet\n");
+		exit(1);
+	}
+
+	return hdr_len + CLD_PKT_FTR_LEN;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t rc;
+
+	while (len) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, REPLY_WAIT_MS) != 1)
+			return false;
+		rc = read(fd, buf, len);
+		if (rc <= 0)
+			return false;
+		buf += rc;
+		len -= rc;
+	}
+	return true;
+}
+
+/* the server's answer to the replay, on the replaying connection */
+static enum cle_err_codes read_reply(int fd)
+{
+	struct ubbp_header ubbp;
+	struct cld_pkt_hdr pkt;
+	struct cld_msg_generic_resp resp;
+	char buf[CLD_RAW_MSG_SZ];
+	uint32_t size;
+	XDR xdrs;
+
+	if (!read_all(fd, &ubbp, sizeof(ubbp))) {
+		fprintf(stderr, "no reply to the replay\n");
+		exit(1);
+	}
+	size = UBBP_SIZE(GUINT32_FROM_LE(ubbp.op_size));
+	if (size <= CLD_PKT_FTR_LEN || size > sizeof(buf) ||
+	    !read_all(fd, buf, size)) {
+		fprintf(stderr, "bad reply to the replay\n");
+		exit(1);
+	}
+
+	memset(&pkt, 0, sizeof(pkt));
+	memset(&resp, 0, sizeof(resp));
+	xdrmem_create(&xdrs, buf, size - CLD_PKT_FTR_LEN, XDR_DECODE);
+	if (!xdr_cld_pkt_hdr(&xdrs, &pkt) ||
+	    !xdr_cld_msg_generic_resp(&xdrs, &resp)) {
+		fprintf(stderr, "cannot decode reply to the replay\n");
+		exit(1);
+	}
+	xdr_destroy(&xdrs);
+	xdr_free((xdrproc_t)xdr_cld_pkt_hdr, (char *)&pkt);
+
+	return resp.code;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ncld_sess *nsess;
+	struct ncld_fh *fh;
+	struct ncld_read *rp;
+	struct cldc_tcp *tcp;
+	char buf[CLD_RAW_MSG_SZ];
+	uint64_t seqid;
+	size_t len;
+	int error;
+	int port;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	alarm(TEST_TIMEOUT);
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess = test_sess_open(port);
+	if (!(nsess->sess->flags & CSF_STREAM)) {
+		fprintf(stderr, "server did not grant CSF_STREAM\n");
+		exit(1);
+	}
+
+	fh = ncld_open(nsess, TPNAME, COM_READ | COM_WRITE | COM_CREATE,
+			&error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TPNAME, error);
+		exit(1);
+	}
+	error = ncld_write(fh, TESTSTR, TESTLEN);
+	if (error) {
+		fprintf(stderr, "ncld_write failed: %d\n", error);
+		exit(1);
+	}
+
+	/* the last seqid the session used, and one long before it */
+	g_mutex_lock(nsess->mutex);
+	seqid = nsess->sess->next_seqid_out - 1;
+	g_mutex_unlock(nsess->mutex);
+
+	error = cldc_tcp_new(TEST_HOST, port, &tcp);
+	if (error) {
+		fprintf(stderr, "cldc_tcp_new failed: %d\n", error);
+		exit(1);
+	}
+
+	len = build_pkt(buf, sizeof(buf), nsess->sess, seqid);
+	if (cldc_tcp_pkt_send(tcp, NULL, 0, buf, len) ||
+	    read_reply(tcp->fd) != CLE_SESS_INVAL) {
+		fprintf(stderr, "replay of seqid %llu was not refused\n",
+			(unsigned long long) seqid);
+		exit(1);
+	}
+
+	len = build_pkt(buf, sizeof(buf), nsess->sess, seqid - 2);
+	if (cldc_tcp_pkt_send(tcp, NULL, 0, buf, len) ||
+	    read_reply(tcp->fd) != CLE_SESS_INVAL) {
+		fprintf(stderr, "replay of seqid %llu was not refused\n",
+			(unsigned long long) seqid - 2);
+		exit(1);
+	}
+
+	/* the session still answers on its own connection */
+	rp = ncld_get(fh, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get after replay failed: %d\n", error);
+		exit(1);
+	}
+	if (rp->length != TESTLEN || memcmp(rp->ptr, TESTSTR, TESTLEN)) {
+		fprintf(stderr, "Bad CLD file content after replay\n");
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	cldc_tcp_free(tcp);
+
+	ncld_close(fh);
+
+	error = ncld_del(nsess, TPNAME);
+	if (error) {
+		fprintf(stderr, "ncld_del(%s) failed: %d\n", TPNAME, error);
+		exit(1);
+	}
+
+	ncld_sess_close(nsess);
+	return 0;
+}
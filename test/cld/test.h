@@ -9,6 +9,16 @@
 
 #define TFNAME     "/cld-test-inst"
 #define TLNAME     "/cld-lock-inst"
+#define TBNAME     "/cld-large-inst"
+#define TWNAME     "/cld-lockw-inst"
+#define TDNAME     "/cld-dir-inst"
+#define TGNAME     "/cld-watch-inst"
+#define TCNAME     "/cld-cas-inst"
+#define TSNAME     "/cld-shard-inst"
+#define TSMAP      "/cld-shard-map"
+#define TRNAME     "/cld-replica-inst"
+#define TANAME     "/cld-ack-inst"
+#define TPNAME     "/cld-replay-inst"
 
 #define TEST_HOST "localhost"
 
@@ -16,5 +26,11 @@
 #define TEST_USER_KEY "testuser"
 
 #define TEST_PORTFILE_CLD	"cld.port"
+#define TEST_PORTFILE_CLD2	"cld2.port"	/* second cell */
+#define TEST_PORTFILE_CLD3	"cld3.port"	/* its replica */
+
+struct ncld_sess;
+
+extern struct ncld_sess *test_sess_open(int port);
 
 #endif
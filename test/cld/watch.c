@@ -0,0 +1,192 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Watch a directory for children coming and going, and wait on its
+ * version with GET-WAIT instead of polling it.
+ */
+
+#define _GNU_SOURCE
+#include "hail-config.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <ncld.h>
+#include "test.h"
+
+static volatile unsigned int child_events;
+
+static void sess_event(void *priv, unsigned int what)
+{
+	if (what == CE_SESS_FAILED) {
+		fprintf(stderr, "Session failed\n");
+		exit(1);
+	}
+	fprintf(stderr, "Unknown event %d\n", what);
+}
+
+static void dir_event(void *priv, unsigned int what)
+{
+	if (what & CE_CHILD)
+		child_events++;
+}
+
+static struct ncld_sess *sess_open(int port)
+{
+	struct ncld_sess *nsess;
+	int error;
+
+	nsess = ncld_sess_open(TEST_HOST, port, &error, sess_event, NULL,
+			     TEST_USER, TEST_USER_KEY, NULL);
+	if (!nsess) {
+		fprintf(stderr, "ncld_sess_open(host %s port %u) failed: %d\n",
+			TEST_HOST, port, error);
+		exit(1);
+	}
+	return nsess;
+}
+
+static uint64_t dir_vers(struct ncld_fh *fh)
+{
+	struct ncld_read *rp;
+	uint64_t vers;
+	int error;
+
+	rp = ncld_get_meta(fh, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get_meta failed: %d\n", error);
+		exit(1);
+	}
+	vers = rp->meta.vers;
+	ncld_read_free(rp);
+	return vers;
+}
+
+int main (int argc, char *argv[])
+{
+	struct ncld_sess *nsess_a, *nsess_b;
+	struct ncld_fh *dir_fh, *fh;
+	struct ncld_read *rp;
+	uint64_t vers;
+	time_t start;
+	int port;
+	int error;
+	int rc, i;
+
+	g_thread_init(NULL);
+	ncld_init();
+
+	port = hail_readport(TEST_PORTFILE_CLD);
+	if (port < 0)
+		return port;
+	if (port == 0)
+		return -1;
+
+	nsess_a = sess_open(port);
+	nsess_b = sess_open(port);
+
+	dir_fh = ncld_open(nsess_a, TGNAME,
+			   COM_READ | COM_CREATE | COM_DIRECTORY,
+			   &error, CE_CHILD, dir_event, NULL);
+	if (!dir_fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n", TGNAME, error);
+		exit(1);
+	}
+
+	vers = dir_vers(dir_fh);
+
+	/* nothing changed: the wait runs out, and the same version returns */
+	start = time(NULL);
+	rp = ncld_get_wait(dir_fh, vers, 1, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get_wait failed: %d\n", error);
+		exit(1);
+	}
+	if (rp->meta.vers != vers || time(NULL) - start < 1) {
+		fprintf(stderr, "ncld_get_wait returned early, vers %llu\n",
+			(unsigned long long) rp->meta.vers);
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	/* a version already passed is answered at once */
+	rp = ncld_get_wait(dir_fh, vers - 1, 30, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get_wait failed: %d\n", error);
+		exit(1);
+	}
+	ncld_read_free(rp);
+
+	/* another session adds a child */
+	fh = ncld_open(nsess_b, TGNAME "/child", COM_WRITE | COM_CREATE,
+		       &error, 0, NULL, NULL);
+	if (!fh) {
+		fprintf(stderr, "ncld_open(%s) failed: %d\n",
+			TGNAME "/child", error);
+		exit(1);
+	}
+	ncld_close(fh);
+
+	rp = ncld_get_wait(dir_fh, vers, 30, &error);
+	if (!rp) {
+		fprintf(stderr, "ncld_get_wait failed: %d\n", error);
+		exit(1);
+	}
+	if (rp->meta.vers <= vers) {
+		fprintf(stderr, "ncld_get_wait: stale version %llu\n",
+			(unsigned long long) rp->meta.vers);
+		exit(1);
+	}
+	vers = rp->meta.vers;
+	ncld_read_free(rp);
+
+	rc = ncld_del(nsess_b, TGNAME "/child");
+	if (rc) {
+		fprintf(stderr, "ncld_del(%s) failed: %d\n",
+			TGNAME "/child", rc);
+		exit(1);
+	}
+
+	if (dir_vers(dir_fh) <= vers) {
+		fprintf(stderr, "directory version unchanged by delete\n");
+		exit(1);
+	}
+
+	/* events trail the replies they were committed with */
+	for (i = 0; i < 10 && child_events < 2; i++)
+		sleep(1);
+	if (child_events < 1) {
+		fprintf(stderr, "no CE_CHILD event delivered\n");
+		exit(1);
+	}
+
+	ncld_close(dir_fh);
+
+	rc = ncld_del(nsess_a, TGNAME);
+	if (rc) {
+		fprintf(stderr, "ncld_del(%s) failed: %d\n", TGNAME, rc);
+		exit(1);
+	}
+
+	ncld_sess_close(nsess_b);
+	ncld_sess_close(nsess_a);
+	return 0;
+}
@@ -71,6 +71,8 @@ static struct argp_option options[] = {
 	  "List supported commands" },
 	{ "create", 1002, NULL, 0,
 	  "Create new table (if table does not exist)" },
+	{ "parallel", 1003, "N", 0,
+	  "Stripe get/put/del over all hosts, N connections each" },
 
 	{ }
 };
@@ -122,6 +124,7 @@ static bool table_create;
 static char *password_env = "CHCLI_PASSWORD";
 static bool chcli_verbose;
 static bool use_ssl;
+static unsigned int parallel;
 static enum chcli_cmd cmd_mode = CHC_NONE;
 static char **cmd_args;
 static int n_cmd_args;
@@ -324,6 +327,13 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 1002:			/* --create */
 		table_create = true;
 		break;
+	case 1003:			/* --parallel */
+		if (atoi(arg) < 1) {
+			fprintf(stderr, "invalid parallel count: '%s'\n", arg);
+			argp_usage(state);
+		}
+		parallel = atoi(arg);
+		break;
 
 	case ARGP_KEY_ARG:
 		if (cmd_mode != CHC_NONE)
@@ -388,6 +398,36 @@ static struct st_client *chcli_stc_new(void)
 	return stc;
 }
 
+/* every -h host becomes a node of the pool */
+static struct stc_pool *chcli_pool_new(void)
+{
+	struct stc_pool *pool;
+	struct chcli_host *h;
+	GList *tmp;
+
+	pool = stc_pool_new(username, password, table_name, use_ssl,
+			    parallel);
+	if (!pool) {
+		fprintf(stderr, "failed to set up connection pool\n");
+		return NULL;
+	}
+
+	pool->verbose = chcli_verbose;
+	pool->table_flags = table_create ? CHF_TBL_CREAT : 0;
+
+	for (tmp = host_list; tmp; tmp = tmp->next) {
+		h = tmp->data;
+		if (stc_pool_add(pool, h->name, h->port) < 0) {
+			fprintf(stderr, "%s:%u: invalid host\n",
+				h->name, h->port);
+			stc_pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
 static int cmd_ping(void)
 {
 	struct st_client *stc;
@@ -489,6 +529,22 @@ static int cmd_del(void)
 		return 1;
 	}
 
+	if (parallel) {
+		struct stc_pool *pool;
+		bool rcb;
+
+		pool = chcli_pool_new();
+		if (!pool)
+			return 1;
+		rcb = stc_stripe_del(pool, key_data, key_data_len);
+		stc_pool_free(pool);
+		if (!rcb) {
+			fprintf(stderr, "DEL failed\n");
+			return 1;
+		}
+		return 0;
+	}
+
 	stc = chcli_stc_new();
 	if (!stc)
 		return 1;
@@ -504,21 +560,12 @@ static int cmd_del(void)
 	return 0;
 }
 
-static size_t read_file_cb(void *ptr, size_t size, size_t nmemb,
-			void *user_data)
-{
-	int *fdp = user_data;
-
-	return read(*fdp, ptr, size * nmemb);
-}
-
 static bool stc_put_file(struct st_client *stc, const void *key, size_t key_len,
 			const char *filename, uint32_t flags)
 {
 	bool rcb;
 	int fd;
 	struct stat st;
-	uint64_t content_len;
 	int rc;
 
 	fd = open(filename, O_RDONLY);
@@ -530,13 +577,40 @@ static bool stc_put_file(struct st_client *stc, const void *key, size_t key_len,
 		close(fd);
 		return false;
 	}
-	content_len = st.st_size;
-	rcb = stc_put(stc, key, key_len, read_file_cb, content_len, &fd, flags);
+	rcb = stc_put_fd(stc, key, key_len, fd, st.st_size, flags);
 	close(fd);
 
 	return rcb;
 }
 
+static bool stc_stripe_put_file(const void *key, size_t key_len,
+				const char *filename)
+{
+	struct stc_pool *pool;
+	struct stat st;
+	bool rcb = false;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st))
+		goto out;
+
+	pool = chcli_pool_new();
+	if (!pool)
+		goto out;
+
+	rcb = stc_stripe_put_fd(pool, key, key_len, fd, st.st_size, 0,
+				parallel);
+	stc_pool_free(pool);
+
+out:
+	close(fd);
+	return rcb;
+}
+
 static int cmd_put(void)
 {
 	struct st_client *stc;
@@ -580,6 +654,18 @@ static int cmd_put(void)
 		return 1;
 	}
 
+	if (parallel) {
+		if (!value_in_file) {
+			fprintf(stderr, "PUT --parallel requires -i FILE\n");
+			return 1;
+		}
+		if (!stc_stripe_put_file(key_data, key_data_len, input_fn)) {
+			fprintf(stderr, "PUT failed\n");
+			return 1;
+		}
+		return 0;
+	}
+
 	stc = chcli_stc_new();
 	if (!stc)
 		return 1;
@@ -640,8 +726,10 @@ static bool recv_buf(struct st_client *stc, int rfd, void *buf, size_t buf_len)
 
 static int cmd_get(void)
 {
-	struct st_client *stc;
-	int rfd = -1, wfd;
+	struct st_client *stc = NULL;
+	struct stc_pool *pool = NULL;
+	bool rcb;
+	int wfd;
 
 	/* if key data not supplied via file, absorb first cmd arg */
 	if (!key_data) {
@@ -663,14 +751,14 @@ static int cmd_get(void)
 		return 1;
 	}
 
-	stc = chcli_stc_new();
-	if (!stc)
-		return 1;
-
-	if (!stc_get_start(stc, key_data, key_data_len, &rfd, &get_len)) {
-		fprintf(stderr, "GET initiation failed\n");
-		stc_free(stc);
-		return 1;
+	if (parallel) {
+		pool = chcli_pool_new();
+		if (!pool)
+			return 1;
+	} else {
+		stc = chcli_stc_new();
+		if (!stc)
+			return 1;
 	}
 
 	if (!output_fn || !strcmp(output_fn, "-"))
@@ -682,38 +770,33 @@ static int cmd_get(void)
 				output_fn,
 				strerror(errno));
 			stc_free(stc);
+			stc_pool_free(pool);
 			return 1;
 		}
 	}
 
-	while (get_len > 0) {
-		size_t need_len;
-		ssize_t rc;
-
-		need_len = MIN(GET_BUFSZ, get_len);
-
-		if (!recv_buf(stc, rfd, get_buf, need_len)) {
-			fprintf(stderr, "GET buffer failed\n");
-			stc_free(stc);
-			return 1;
-		}
+	if (pool)
+		rcb = stc_stripe_get_fd(pool, key_data, key_data_len, wfd,
+					NULL, parallel);
+	else
+		rcb = stc_get_fd(stc, key_data, key_data_len, wfd, NULL);
 
-		rc = write(wfd, get_buf, need_len);
-		if (rc < 0) {
-			fprintf(stderr, "GET write to output failed: %s\n",
-				strerror(errno));
+	if (!rcb) {
+		fprintf(stderr, "GET failed\n");
+		if (wfd != STDOUT_FILENO) {
+			close(wfd);
 			unlink(output_fn);
-			stc_free(stc);
-			return 1;
 		}
-
-		get_len -= rc;
+		stc_free(stc);
+		stc_pool_free(pool);
+		return 1;
 	}
 
 	if (wfd != STDOUT_FILENO)
 		close(wfd);
 
 	stc_free(stc);
+	stc_pool_free(pool);
 
 	return 0;
 }
@@ -921,6 +1004,10 @@ int main (int argc, char *argv[])
 		return 1;
 	}
 
+	/* striping runs a thread per connection */
+	if (parallel)
+		g_thread_init(NULL);
+
 	stc_init();
 
 	host = host_list->data;
@@ -163,64 +163,24 @@ static void cmd_cd(const char *arg)
 	strcpy(clicwd, creq.path);
 }
 
-static void cmd_ls(const char *arg)
+/*
+ * Print the names in one packed directory listing; leaves the last
+ * name printed in 'last', for the next READDIR page to start after.
+ */
+static int ls_print(const char *path, const void *data, size_t data_len,
+		    char *last, size_t last_size)
 {
-	struct creq creq = { 0, };
-	struct ncld_fh *fh;
-	struct ncld_read *rp;
-	const char *data;
-	size_t data_len;
 	unsigned int n_records;
 	struct cld_dirent_cur dc;
 	bool first;
-	int error;
 	int i;
 	int rc;
 
-	if (!*arg)
-		arg = clicwd;
-
-	if (!make_abs_path(creq.path, sizeof(creq.path), arg)) {
-		fprintf(stderr, TAG ": %s: path too long\n", arg);
-		return;
-	}
-
-	fh = ncld_open(nsess, creq.path, COM_DIRECTORY | COM_READ, &error,
-			0, NULL, NULL);
-	if (!fh) {
-		if (error < 1000) {
-			fprintf(stderr, TAG ": cannot open path `%s': %s\n",
-				creq.path, strerror(error));
-		} else {
-			fprintf(stderr, TAG ": cannot open path `%s': %d\n",
-				creq.path, error);
-		}
-		return;
-	}
-
-	rp = ncld_get(fh, &error);
-	if (!rp) {
-		if (error < 1000) {
-			fprintf(stderr, TAG ": cannot get on path `%s': %s\n",
-				creq.path, strerror(error));
-		} else {
-			fprintf(stderr, TAG ": cannot get on path `%s': %d\n",
-				creq.path, error);
-		}
-		ncld_close(fh);
-		return;
-	}
-
-	data = rp->ptr;
-	data_len = rp->length;
-
 	rc = cldc_dirent_count(data, data_len);
 	if (rc < 0) {
 		fprintf(stderr, TAG ": cldc_dirent_count failed on path `%s'\n",
-				creq.path);
-		ncld_read_free(rp);
-		ncld_close(fh);
-		return;
+				path);
+		return rc;
 	}
 	n_records = rc;
 
@@ -242,12 +202,72 @@ static void cmd_ls(const char *arg)
 
 		s = cldc_dirent_name(&dc);
 		printf("%s\n", s);
+		snprintf(last, last_size, "%s", s);
 		free(s);
 	}
 
 	cldc_dirent_cur_fini(&dc);
+	return 0;
+}
+
+static void cmd_ls(const char *arg)
+{
+	struct creq creq = { 0, };
+	struct ncld_fh *fh;
+	struct ncld_read *rp;
+	char last[CLD_INODE_NAME_MAX];
+	bool eof;
+	int error;
+
+	if (!*arg)
+		arg = clicwd;
+
+	if (!make_abs_path(creq.path, sizeof(creq.path), arg)) {
+		fprintf(stderr, TAG ": %s: path too long\n", arg);
+		return;
+	}
+
+	fh = ncld_open(nsess, creq.path, COM_DIRECTORY | COM_READ, &error,
+			0, NULL, NULL);
+	if (!fh) {
+		if (error < 1000) {
+			fprintf(stderr, TAG ": cannot open path `%s': %s\n",
+				creq.path, strerror(error));
+		} else {
+			fprintf(stderr, TAG ": cannot open path `%s': %d\n",
+				creq.path, error);
+		}
+		return;
+	}
+
+	/* list a page at a time; older servers only offer a whole GET */
+	last[0] = 0;
+	do {
+		eof = false;
+		rp = ncld_readdir(fh, last, 0, &error);
+		if (!rp && error == EOPNOTSUPP) {
+			rp = ncld_get(fh, &error);
+			eof = true;
+		}
+		if (!rp) {
+			if (error < 1000) {
+				fprintf(stderr, TAG ": cannot list path `%s': %s\n",
+					creq.path, strerror(error));
+			} else {
+				fprintf(stderr, TAG ": cannot list path `%s': %d\n",
+					creq.path, error);
+			}
+			break;
+		}
+
+		eof = eof || rp->eof || !rp->length;
+		if (ls_print(creq.path, rp->ptr, rp->length,
+			     last, sizeof(last)) < 0)
+			eof = true;
+
+		ncld_read_free(rp);
+	} while (!eof);
 
-	ncld_read_free(rp);
 	ncld_close(fh);
 }
 